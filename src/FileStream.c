@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <sys/syscall.h>
 #include "StormCommon.h"
 #include "FileStream.h"
 
@@ -28,11 +29,15 @@
 #define INVALID_HANDLE_VALUE ((HANDLE)-1)
 #endif
 
+#define STREAM_COPY_BUFFER_SIZE 0x100000    /* Size of the buffer used by FileStream_Copy */
+
 /*-----------------------------------------------------------------------------
  * Local functions - platform-specific functions
  */
 
-static int nLastError = ERROR_SUCCESS;
+/* Each thread has its own last error value, like errno. The workers */
+/* of SFileVerifyAllFiles and SFileCompactArchive rely on that */
+static __thread int nLastError = ERROR_SUCCESS;
 
 int GetLastError()
 {
@@ -256,6 +261,34 @@ static int BaseFile_Replace(TFileStream_t * pStream, TFileStream_t * pNewStream)
     return 1;
 }
 
+#ifdef __NR_copy_file_range
+/* Lets the kernel copy the data between two disk files, starting */
+/* at the current file positions. Returns number of bytes copied, */
+/* which is less than required if the kernel can't copy the data */
+static uint64_t BaseFile_Copy(TFileStream_t * pTrgStream, TFileStream_t * pSrcStream, uint64_t ByteCount)
+{
+    uint64_t BytesCopied = 0;
+    ssize_t bytes_copied;
+
+    while(BytesCopied < ByteCount)
+    {
+        bytes_copied = syscall(__NR_copy_file_range, pSrcStream->Base.File.hFile, NULL, pTrgStream->Base.File.hFile, NULL, (size_t)STORMLIB_MIN(ByteCount - BytesCopied, 0x40000000), 0);
+        if(bytes_copied <= 0)
+            break;
+
+        /* Both file positions moved by the number of bytes copied */
+        pSrcStream->Base.File.FilePos += bytes_copied;
+        pTrgStream->Base.File.FilePos += bytes_copied;
+        BytesCopied += bytes_copied;
+    }
+
+    /* Also modify the file size, if needed */
+    if(pTrgStream->Base.File.FilePos > pTrgStream->Base.File.FileSize)
+        pTrgStream->Base.File.FileSize = pTrgStream->Base.File.FilePos;
+    return BytesCopied;
+}
+#endif
+
 static void BaseFile_Close(TFileStream_t * pStream)
 {
     if(pStream->Base.File.hFile != -1)
@@ -298,6 +331,8 @@ static int BaseMap_Open(TFileStream_t * pStream, const char * szFileName, uint32
         if(fstat(handle, &fileinfo) != -1)
         {
             pStream->Base.Map.pbFile = (unsigned char *)mmap(NULL, (size_t)fileinfo.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+            if(pStream->Base.Map.pbFile == (unsigned char *)MAP_FAILED)
+                pStream->Base.Map.pbFile = NULL;
             if(pStream->Base.Map.pbFile != NULL)
             {
                 /* time_t is number of seconds since 1.1.1970, UTC. */
@@ -2334,6 +2369,92 @@ int FileStream_Write(TFileStream_t * pStream, uint64_t * pByteOffset, const void
     return pStream->StreamWrite(pStream, pByteOffset, pvBuffer, dwBytesToWrite);
 }
 
+/**
+ * This function copies data from one stream to another
+ *
+ * - Returns 1 if all bytes have been copied
+ * - Returns 0 if either read or write failed
+ * - Data between two plain disk files are copied by the kernel, if possible.
+ *   Otherwise, they are copied through a large buffer.
+ *
+ * \a pTrgStream Pointer to the target stream
+ * \a pTrgOffset Pointer to target byte offset. If NULL, it writes to the current position
+ * \a pSrcStream Pointer to the source stream
+ * \a pSrcOffset Pointer to source byte offset. If NULL, it reads from the current position
+ * \a ByteCount Number of bytes to copy
+ */
+int FileStream_Copy(TFileStream_t * pTrgStream, uint64_t * pTrgOffset, TFileStream_t * pSrcStream, uint64_t * pSrcOffset, uint64_t ByteCount)
+{
+    unsigned char * pbBuffer;
+    uint64_t TrgOffset;
+    uint64_t SrcOffset;
+    uint32_t dwToCopy;
+    int bResult = 1;
+
+    if(pTrgStream->dwFlags & STREAM_FLAG_READ_ONLY)
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return 0;
+    }
+
+    /* Resolve the starting positions */
+    if(pTrgOffset != NULL)
+        TrgOffset = *pTrgOffset;
+    else
+        FileStream_GetPos(pTrgStream, &TrgOffset);
+    if(pSrcOffset != NULL)
+        SrcOffset = *pSrcOffset;
+    else
+        FileStream_GetPos(pSrcStream, &SrcOffset);
+
+#ifdef __NR_copy_file_range
+    /* If both streams are plain disk files, let the kernel copy the data */
+    if(ByteCount != 0 && pSrcStream->StreamRead == BaseFile_Read && pTrgStream->StreamWrite == BaseFile_Write)
+    {
+        uint64_t BytesCopied;
+
+        /* Move both files to the starting positions */
+        if(!BaseFile_Read(pSrcStream, &SrcOffset, NULL, 0) || !BaseFile_Write(pTrgStream, &TrgOffset, NULL, 0))
+            return 0;
+
+        BytesCopied = BaseFile_Copy(pTrgStream, pSrcStream, ByteCount);
+        TrgOffset += BytesCopied;
+        SrcOffset += BytesCopied;
+        ByteCount -= BytesCopied;
+    }
+#endif
+
+    /* Copy the rest of the data through a buffer */
+    if(ByteCount != 0)
+    {
+        pbBuffer = STORM_ALLOC(uint8_t, STORMLIB_MIN(ByteCount, STREAM_COPY_BUFFER_SIZE));
+        if(pbBuffer == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return 0;
+        }
+
+        while(ByteCount != 0)
+        {
+            dwToCopy = (uint32_t)STORMLIB_MIN(ByteCount, STREAM_COPY_BUFFER_SIZE);
+
+            bResult = FileStream_Read(pSrcStream, &SrcOffset, pbBuffer, dwToCopy);
+            if(bResult)
+                bResult = FileStream_Write(pTrgStream, &TrgOffset, pbBuffer, dwToCopy);
+            if(!bResult)
+                break;
+
+            TrgOffset += dwToCopy;
+            SrcOffset += dwToCopy;
+            ByteCount -= dwToCopy;
+        }
+
+        STORM_FREE(pbBuffer);
+    }
+
+    return bResult;
+}
+
 /**
  * Returns the size of a file
  *
@@ -2400,6 +2521,26 @@ int FileStream_GetFlags(TFileStream_t * pStream, uint32_t * pdwStreamFlags)
     return 1;
 }
 
+/**
+ * Returns pointer to the memory-mapped content of the stream, or NULL
+ * if the stream is not a plain stream opened with BASE_PROVIDER_MAP.
+ * The view is valid until the stream is closed.
+ *
+ * \a pStream Pointer to an open stream
+ * \a pFileSize Pointer where to store the size of the view
+ */
+const void * FileStream_GetMappedView(TFileStream_t * pStream, uint64_t * pFileSize)
+{
+    /* Streams with a bitmap or with a master stream have their own read functions */
+    if(pStream->BaseRead != BaseMap_Read || pStream->StreamRead != BaseMap_Read)
+        return NULL;
+    if(pStream->Base.Map.pbFile == NULL)
+        return NULL;
+
+    *pFileSize = pStream->Base.Map.FileSize;
+    return pStream->Base.Map.pbFile;
+}
+
 /**
  * Switches a stream with another. Used for final phase of archive compacting.
  * Performs these steps:
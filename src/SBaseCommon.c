@@ -13,6 +13,7 @@
 
 #include "thunderStorm.h"
 #include "StormCommon.h"
+#include <pthread.h>
 
 /*-----------------------------------------------------------------------------
  * Local variables
@@ -100,6 +101,7 @@ unsigned char AsciiToUpperTable_Slash[256] =
 #define HASH_INDEX_MASK(ha) (ha->pHeader->dwHashTableSize ? (ha->pHeader->dwHashTableSize - 1) : 0)
 
 static uint32_t StormBuffer[STORM_BUFFER_SIZE];    /* Buffer for the decryption engine */
+static unsigned char AsciiIdentityTable[256];      /* Leaves the characters as they are (case-sensitive names) */
 static int  bMpqCryptographyInitialized = 0;
 
 void InitializeMpqCryptography()
@@ -115,6 +117,8 @@ void InitializeMpqCryptography()
     {
         for(index1 = 0; index1 < 0x100; index1++)
         {
+            AsciiIdentityTable[index1] = (unsigned char)index1;
+
             for(index2 = index1, i = 0; i < 5; i++, index2 += 0x100)
             {
                 uint32_t temp1, temp2;
@@ -306,6 +310,109 @@ uint64_t HashStringJenkinsCS(const char * szFileName)
     return (uint64_t)primary_hash * (uint64_t)0x100000000ULL + (uint64_t)secondary_hash;
 }
 
+/*-----------------------------------------------------------------------------
+ * Calculates all hashes of a file name by a single pass over the name:
+ * MPQ_HASH_TABLE_INDEX, MPQ_HASH_NAME_A, MPQ_HASH_NAME_B (normalized like
+ * ha->pfnHashString does) and the Jenkins hash for the HET table
+ * (normalized like HashStringJenkins or HashStringJenkinsCS does).
+ */
+
+/* Returns the conversion table used by the hashing function of the archive */
+static unsigned char * GetHashConversionTable(TMPQArchive * ha)
+{
+    if(ha->pfnHashString == HashString)
+        return AsciiToUpperTable;
+    if(ha->pfnHashString == HashStringCS)
+        return AsciiIdentityTable;
+    if(ha->pfnHashString == HashStringSlash)
+        return AsciiToUpperTable_Slash;
+    if(ha->pfnHashString == HashStringLower)
+        return AsciiToLowerTable;
+    return NULL;
+}
+
+void HashFileName(TMPQArchive * ha, const char * szFileName, uint32_t dwHashFlags, TMPQNameHash * pNameHash)
+{
+    unsigned char * pbKey = (unsigned char *)szFileName;
+    unsigned char * pbStormTable = NULL;
+    unsigned char * pbJenkinsTable = NULL;
+    char szLocFileName[0x108];
+    size_t nLength = 0;
+    uint32_t dwIndexSeed1 = 0x7FED7FED;
+    uint32_t dwIndexSeed2 = 0xEEEEEEEE;
+    uint32_t dwNameASeed1 = 0x7FED7FED;
+    uint32_t dwNameASeed2 = 0xEEEEEEEE;
+    uint32_t dwNameBSeed1 = 0x7FED7FED;
+    uint32_t dwNameBSeed2 = 0xEEEEEEEE;
+    uint32_t ch;
+    unsigned int primary_hash = 1;
+    unsigned int secondary_hash = 2;
+
+    /* The Jenkins hash is only needed if there is a HET table */
+    if(ha->pHetTable == NULL)
+        dwHashFlags &= ~MPQ_NAME_HASH_HET;
+    memset(pNameHash, 0, sizeof(TMPQNameHash));
+
+    /* Get the conversion table for the Storm hashes. */
+    /* If the archive uses an unknown hash function, let that one do the work */
+    if(dwHashFlags & MPQ_NAME_HASH_STORM)
+    {
+        pbStormTable = GetHashConversionTable(ha);
+        if(pbStormTable == NULL)
+        {
+            pNameHash->dwHashIndex = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
+            pNameHash->dwName1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
+            pNameHash->dwName2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+        }
+    }
+
+    /* Jenkins hash is calculated from lowercase name, unless the names are case-sensitive */
+    if(dwHashFlags & MPQ_NAME_HASH_HET)
+        pbJenkinsTable = (ha->dwFlags & MPQ_FLAG_FILENAME_UNIX) ? AsciiIdentityTable : AsciiToLowerTable;
+
+    /* Walk the name once, feeding all the hashes */
+    while(*pbKey != 0)
+    {
+        if(pbStormTable != NULL)
+        {
+            ch = pbStormTable[*pbKey];
+
+            dwIndexSeed1 = StormBuffer[MPQ_HASH_TABLE_INDEX + ch] ^ (dwIndexSeed1 + dwIndexSeed2);
+            dwIndexSeed2 = ch + dwIndexSeed1 + dwIndexSeed2 + (dwIndexSeed2 << 5) + 3;
+
+            dwNameASeed1 = StormBuffer[MPQ_HASH_NAME_A + ch] ^ (dwNameASeed1 + dwNameASeed2);
+            dwNameASeed2 = ch + dwNameASeed1 + dwNameASeed2 + (dwNameASeed2 << 5) + 3;
+
+            dwNameBSeed1 = StormBuffer[MPQ_HASH_NAME_B + ch] ^ (dwNameBSeed1 + dwNameBSeed2);
+            dwNameBSeed2 = ch + dwNameBSeed1 + dwNameBSeed2 + (dwNameBSeed2 << 5) + 3;
+        }
+
+        if(pbJenkinsTable != NULL && nLength < sizeof(szLocFileName))
+            szLocFileName[nLength] = (char)pbJenkinsTable[*pbKey];
+        nLength++;
+        pbKey++;
+    }
+
+    if(pbStormTable != NULL)
+    {
+        pNameHash->dwHashIndex = dwIndexSeed1;
+        pNameHash->dwName1 = dwNameASeed1;
+        pNameHash->dwName2 = dwNameBSeed1;
+    }
+
+    if(pbJenkinsTable != NULL)
+    {
+        /* Names that don't fit into the local buffer are converted while hashing */
+        if(nLength > sizeof(szLocFileName))
+            hashlittle2_table(szFileName, nLength, pbJenkinsTable, &secondary_hash, &primary_hash);
+        else
+            hashlittle2(szLocFileName, nLength, &secondary_hash, &primary_hash);
+
+        pNameHash->FileNameHash = ((uint64_t)primary_hash * (uint64_t)0x100000000ULL + (uint64_t)secondary_hash);
+        pNameHash->FileNameHash = (pNameHash->FileNameHash & ha->pHetTable->AndMask64) | ha->pHetTable->OrMask64;
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * Default flags for (attributes) and (listfile)
  */
@@ -735,15 +842,24 @@ TMPQHash * FindFreeHashEntry(TMPQArchive * ha, uint32_t dwStartIndex, uint32_t d
 /* Retrieves the first hash entry for the given file. */
 /* Every locale version of a file has its own hash entry */
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName)
+{
+    TMPQNameHash NameHash;
+
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_STORM, &NameHash);
+    return GetFirstHashEntry2(ha, &NameHash);
+}
+
+/* Same like GetFirstHashEntry, but with already calculated name hashes */
+TMPQHash * GetFirstHashEntry2(TMPQArchive * ha, TMPQNameHash * pNameHash)
 {
     uint32_t dwHashIndexMask = HASH_INDEX_MASK(ha);
-    uint32_t dwStartIndex = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
-    uint32_t dwName1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
-    uint32_t dwName2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+    uint32_t dwName1 = pNameHash->dwName1;
+    uint32_t dwName2 = pNameHash->dwName2;
+    uint32_t dwStartIndex;
     uint32_t dwIndex;
 
     /* Set the initial index */
-    dwStartIndex = dwIndex = (dwStartIndex & dwHashIndexMask);
+    dwStartIndex = dwIndex = (pNameHash->dwHashIndex & dwHashIndexMask);
 
     /* Search the hash table */
     for(;;)
@@ -796,23 +912,30 @@ TMPQHash * GetNextHashEntry(TMPQArchive * ha, TMPQHash * pFirstHash, TMPQHash *
 }
 
 /* Allocates an entry in the hash table */
+/* If the caller has the name hashes already, it can pass them in pNameHash */
 TMPQHash * AllocateHashEntry(
     TMPQArchive * ha,
-    TFileEntry * pFileEntry,
+    TMPQFileEntry * pFileEntry,
+    TMPQNameHash * pNameHash,
     uint32_t lcLocale)
 {
+    TMPQNameHash NameHash;
     TMPQHash * pHash;
-    uint32_t dwStartIndex = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_TABLE_INDEX);
-    uint32_t dwName1 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_A);
-    uint32_t dwName2 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_B);
+
+    /* Calculate the name hashes, if not given */
+    if(pNameHash == NULL)
+    {
+        HashFileName(ha, pFileEntry->szFileName, MPQ_NAME_HASH_STORM, &NameHash);
+        pNameHash = &NameHash;
+    }
 
     /* Attempt to find a free hash entry */
-    pHash = FindFreeHashEntry(ha, dwStartIndex, dwName1, dwName2, lcLocale);
+    pHash = FindFreeHashEntry(ha, pNameHash->dwHashIndex, pNameHash->dwName1, pNameHash->dwName2, lcLocale);
     if(pHash != NULL)
     {
         /* Fill the free hash entry */
-        pHash->dwName1      = dwName1;
-        pHash->dwName2      = dwName2;
+        pHash->dwName1      = pNameHash->dwName1;
+        pHash->dwName2      = pNameHash->dwName2;
         pHash->lcLocale     = (uint16_t)lcLocale;
         pHash->wPlatform    = 0;
         pHash->dwBlockIndex = (uint32_t)(pFileEntry - ha->pFileTable);
@@ -826,14 +949,29 @@ TMPQHash * AllocateHashEntry(
  * position in the MPQ. (listfile), (attributes) and (signature) are ignored,
  * unless the MPQ is being flushed.
  */
-uint64_t FindFreeMpqSpace(TMPQArchive * ha)
+/* Returns the end of the file data, including the MD5 chunks (if any) */
+static uint64_t GetFileDataEnd(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
 {
     TMPQHeader * pHeader = ha->pHeader;
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
-    uint64_t FreeSpacePos = ha->pHeader->dwHeaderSize;
+    uint64_t FileDataEnd = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
     uint32_t dwChunkCount;
 
+    /* Add the MD5 chunks, if present */
+    if(pHeader->dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
+    {
+        dwChunkCount = ((pFileEntry->dwCmpSize - 1) / pHeader->dwRawChunkSize) + 1;
+        FileDataEnd += dwChunkCount * MD5_DIGEST_SIZE;
+    }
+
+    return FileDataEnd;
+}
+
+static uint64_t ScanFreeMpqSpace(TMPQArchive * ha)
+{
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
+    uint64_t FreeSpacePos = ha->pHeader->dwHeaderSize;
+
     /* Parse the entire block table */
     for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
     {
@@ -846,17 +984,7 @@ uint64_t FindFreeMpqSpace(TMPQArchive * ha)
 
             /* If the end of the file is bigger than current MPQ table pos, update it */
             if((pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > FreeSpacePos)
-            {
-                /* Get the end of the file data */
-                FreeSpacePos = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
-
-                /* Add the MD5 chunks, if present */
-                if(pHeader->dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
-                {
-                    dwChunkCount = ((pFileEntry->dwCmpSize - 1) / pHeader->dwRawChunkSize) + 1;
-                    FreeSpacePos += dwChunkCount * MD5_DIGEST_SIZE;
-                }
-            }
+                FreeSpacePos = GetFileDataEnd(ha, pFileEntry);
         }
     }
 
@@ -864,11 +992,41 @@ uint64_t FindFreeMpqSpace(TMPQArchive * ha)
     return FreeSpacePos;
 }
 
+uint64_t FindFreeMpqSpace(TMPQArchive * ha)
+{
+    /* When saving MPQ tables, the internal files count too. */
+    /* This only happens a few times per flush, so don't bother with caching */
+    if(ha->dwFlags & MPQ_FLAG_SAVING_TABLES)
+        return ScanFreeMpqSpace(ha);
+
+    /* Only scan the file table if the position is not known yet. It is kept */
+    /* up to date by UpdateFreeMpqSpace and reset to zero when a file is deleted, */
+    /* renamed or moved */
+    if(ha->FreeSpacePos == 0)
+        ha->FreeSpacePos = ScanFreeMpqSpace(ha);
+    return ha->FreeSpacePos;
+}
+
+/* Called after a file has been written to the MPQ */
+void UpdateFreeMpqSpace(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    /* Nothing to do if the free space position is not known yet */
+    if(ha->FreeSpacePos == 0)
+        return;
+
+    /* Same rules like in ScanFreeMpqSpace */
+    if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwCmpSize != 0) && !IsInternalMpqFileName(pFileEntry->szFileName))
+    {
+        if((pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > ha->FreeSpacePos)
+            ha->FreeSpacePos = GetFileDataEnd(ha, pFileEntry);
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * Common functions - MPQ File
  */
 
-TMPQFile * CreateFileHandle(TMPQArchive * ha, TFileEntry * pFileEntry)
+TMPQFile * CreateFileHandle(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
 {
     TMPQFile * hf;
 
@@ -1119,9 +1277,10 @@ __AllocateAndLoadPatchInfo:
 int AllocateSectorOffsets(TMPQFile * hf, int bLoadFromFile)
 {
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint32_t dwSectorOffsLen;
     int bSectorOffsetTableCorrupt = 0;
+    int nError;
 
     /* Caller of AllocateSectorOffsets must ensure these */
     assert(hf->SectorOffsets == NULL);
@@ -1182,6 +1341,15 @@ int AllocateSectorOffsets(TMPQFile * hf, int bLoadFromFile)
                 return GetLastError();
             }
 
+            /* Check the raw data of the table, if required */
+            nError = VerifyRawDataChunks(hf, RawFilePos, dwSectorOffsLen);
+            if(nError != ERROR_SUCCESS)
+            {
+                STORM_FREE(hf->SectorOffsets);
+                hf->SectorOffsets = NULL;
+                return nError;
+            }
+
             /* Swap the sector positions */
             BSWAP_ARRAY32_UNSIGNED(hf->SectorOffsets, dwSectorOffsLen);
 
@@ -1276,7 +1444,7 @@ int AllocateSectorOffsets(TMPQFile * hf, int bLoadFromFile)
 int AllocateSectorChecksums(TMPQFile * hf, int bLoadFromFile)
 {
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint64_t RawFilePos;
     uint32_t dwCompressedSize = 0;
     uint32_t dwExpectedSize;
@@ -1370,7 +1538,7 @@ int WritePatchInfo(TMPQFile * hf)
 int WriteSectorOffsets(TMPQFile * hf)
 {
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint64_t RawFilePos = hf->RawFilePos;
     uint32_t dwSectorOffsLen;
 
@@ -1404,7 +1572,7 @@ int WriteSectorChecksums(TMPQFile * hf)
 {
     TMPQArchive * ha = hf->ha;
     uint64_t RawFilePos;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     unsigned char * pbCompressed;
     uint32_t dwCompressedSize = 0;
     uint32_t dwCrcSize;
@@ -1458,6 +1626,8 @@ int WriteSectorChecksums(TMPQFile * hf)
     return nError;
 }
 
+#define RAW_CHUNKS_PER_READ     0x40    /* Number of raw data chunks read and hashed at once */
+
 int WriteMemDataMD5(
     TFileStream * pStream,
     uint64_t RawDataOffs,
@@ -1467,31 +1637,16 @@ int WriteMemDataMD5(
     uint32_t * pcbTotalSize)
 {
     unsigned char * md5_array;
-    unsigned char * md5;
-    unsigned char * pbRawData = (unsigned char *)pvRawData;
-    uint32_t dwBytesRemaining = dwRawDataSize;
     uint32_t dwMd5ArraySize = 0;
     int nError = ERROR_SUCCESS;
 
     /* Allocate buffer for array of MD5 */
-    md5_array = md5 = AllocateMd5Buffer(dwRawDataSize, dwChunkSize, &dwMd5ArraySize);
+    md5_array = AllocateMd5Buffer(dwRawDataSize, dwChunkSize, &dwMd5ArraySize);
     if(md5_array == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
-    /* For every file chunk, calculate MD5 */
-    while(dwBytesRemaining != 0)
-    {
-        /* Get the remaining number of bytes to read */
-        dwChunkSize = STORMLIB_MIN(dwBytesRemaining, dwChunkSize);
-
-        /* Calculate MD5 */
-        CalculateDataBlockHash(pbRawData, dwChunkSize, md5);
-        md5 += MD5_DIGEST_SIZE;
-
-        /* Move offset and size */
-        dwBytesRemaining -= dwChunkSize;
-        pbRawData += dwChunkSize;
-    }
+    /* Calculate MD5 of every file chunk */
+    MD5_HashChunks(pvRawData, dwRawDataSize, dwChunkSize, md5_array);
 
     /* Write the array od MD5's to the file */
     RawDataOffs += dwRawDataSize;
@@ -1517,8 +1672,9 @@ int WriteMpqDataMD5(
 {
     unsigned char * md5_array;
     unsigned char * md5;
-    unsigned char * pbFileChunk;
+    unsigned char * pbFileChunks;
     uint32_t dwMd5ArraySize = 0;
+    uint32_t dwChunksPerRead;
     uint32_t dwToRead = dwRawDataSize;
     int nError = ERROR_SUCCESS;
 
@@ -1527,9 +1683,10 @@ int WriteMpqDataMD5(
     if(md5_array == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
-    /* Allocate space for file chunk */
-    pbFileChunk = STORM_ALLOC(uint8_t, dwChunkSize);
-    if(pbFileChunk == NULL)
+    /* Allocate space for several file chunks, so that they are hashed together */
+    dwChunksPerRead = STORMLIB_MIN(dwMd5ArraySize / MD5_DIGEST_SIZE, RAW_CHUNKS_PER_READ);
+    pbFileChunks = STORM_ALLOC(uint8_t, dwChunksPerRead * dwChunkSize);
+    if(pbFileChunks == NULL)
     {
         STORM_FREE(md5_array);
         return ERROR_NOT_ENOUGH_MEMORY;
@@ -1539,18 +1696,18 @@ int WriteMpqDataMD5(
     while(dwRawDataSize != 0)
     {
         /* Get the remaining number of bytes to read */
-        dwToRead = STORMLIB_MIN(dwRawDataSize, dwChunkSize);
+        dwToRead = STORMLIB_MIN(dwRawDataSize, dwChunksPerRead * dwChunkSize);
 
-        /* Read the chunk */
-        if(!FileStream_Read(pStream, &RawDataOffs, pbFileChunk, dwToRead))
+        /* Read the chunks */
+        if(!FileStream_Read(pStream, &RawDataOffs, pbFileChunks, dwToRead))
         {
             nError = GetLastError();
             break;
         }
 
-        /* Calculate MD5 */
-        CalculateDataBlockHash(pbFileChunk, dwToRead, md5);
-        md5 += MD5_DIGEST_SIZE;
+        /* Calculate MD5 of each chunk */
+        MD5_HashChunks(pbFileChunks, dwToRead, dwChunkSize, md5);
+        md5 += ((dwToRead - 1) / dwChunkSize + 1) * MD5_DIGEST_SIZE;
 
         /* Move offset and size */
         RawDataOffs += dwToRead;
@@ -1565,11 +1722,179 @@ int WriteMpqDataMD5(
     }
 
     /* Free buffers and exit */
-    STORM_FREE(pbFileChunk);
+    STORM_FREE(pbFileChunks);
     STORM_FREE(md5_array);
     return nError;
 }
 
+/* Builds the bitmap of verified raw chunks. Each file entry gets */
+/* a range of bits, one for each raw chunk of the file data */
+static TMPQChunkBitmap * BuildChunkBitmap(TMPQArchive * ha)
+{
+    TMPQChunkBitmap * pChunkBitmap;
+    uint32_t dwChunkSize = ha->pHeader->dwRawChunkSize;
+    uint32_t dwChunkCount = 0;
+    uint32_t dwBitmapSize;
+    uint32_t i;
+
+    pChunkBitmap = STORM_ALLOC(TMPQChunkBitmap, 1);
+    if(pChunkBitmap != NULL)
+    {
+        pChunkBitmap->dwFileCount = ha->dwFileTableSize;
+        pChunkBitmap->Verified = NULL;
+        pChunkBitmap->FirstChunk = STORM_ALLOC(uint32_t, ha->dwFileTableSize + 1);
+        if(pChunkBitmap->FirstChunk != NULL)
+        {
+            for(i = 0; i < ha->dwFileTableSize; i++)
+            {
+                pChunkBitmap->FirstChunk[i] = dwChunkCount;
+                if(ha->pFileTable[i].dwCmpSize != 0)
+                    dwChunkCount += ((ha->pFileTable[i].dwCmpSize - 1) / dwChunkSize) + 1;
+            }
+            pChunkBitmap->FirstChunk[i] = dwChunkCount;
+
+            /* Nothing has been verified yet */
+            dwBitmapSize = (dwChunkCount / 8) + 1;
+            pChunkBitmap->Verified = STORM_ALLOC(uint8_t, dwBitmapSize);
+            if(pChunkBitmap->Verified != NULL)
+            {
+                memset(pChunkBitmap->Verified, 0, dwBitmapSize);
+                return pChunkBitmap;
+            }
+
+            STORM_FREE(pChunkBitmap->FirstChunk);
+        }
+
+        STORM_FREE(pChunkBitmap);
+    }
+
+    return NULL;
+}
+
+/*
+ * Verifies the raw data of a file against the MD5s of the raw chunks (MPQs v4).
+ * Only does something if the archive has been open with MPQ_OPEN_CHECK_RAW_MD5.
+ * Every chunk overlapping the given range is verified once, then it is marked
+ * in the chunk bitmap, so reading the same data again costs no hashing.
+ * The bitmap is freed when the archive changes, see InvalidateInternalFiles.
+ */
+int VerifyRawDataChunks(TMPQFile * hf, uint64_t RawFilePos, uint32_t dwRawDataSize)
+{
+    TMPQArchive * ha = hf->ha;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQChunkBitmap * pChunkBitmap;
+    unsigned char md5_array[MD5_DIGEST_SIZE * RAW_CHUNKS_PER_READ];
+    unsigned char md5_calc[MD5_DIGEST_SIZE * RAW_CHUNKS_PER_READ];
+    unsigned char * pbRawData;
+    uint64_t DataOffset;
+    uint64_t ChunkOffset;
+    uint64_t RawDataEnd;
+    uint32_t dwChunkSize = ha->pHeader->dwRawChunkSize;
+    uint32_t dwFileIndex;
+    uint32_t dwChunkIndex;
+    uint32_t dwChunkEnd;
+    uint32_t dwChunkCount;
+    uint32_t dwBytesToRead;
+    uint32_t dwBit;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Only if the caller wants it and the archive has the MD5s */
+    if((ha->dwFlags & MPQ_FLAG_CHECK_RAW_MD5) == 0 || dwChunkSize == 0 || pFileEntry == NULL || hf->pStream != NULL)
+        return ERROR_SUCCESS;
+
+    /* Only the data within the file are covered by the MD5s. Sector offset */
+    /* tables placed before the file data by MPQ protectors aren't. */
+    if(RawFilePos < hf->RawFilePos || dwRawDataSize == 0)
+        return ERROR_SUCCESS;
+    RawDataEnd = STORMLIB_MIN(RawFilePos + dwRawDataSize, hf->RawFilePos + pFileEntry->dwCmpSize);
+    if(RawFilePos >= RawDataEnd)
+        return ERROR_SUCCESS;
+
+    /* Build the chunk bitmap on first use, or rebuild it if the file table grew */
+    dwFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
+    if(ha->pChunkBitmap != NULL && dwFileIndex >= ha->pChunkBitmap->dwFileCount)
+        FreeChunkBitmap(ha);
+    if(ha->pChunkBitmap == NULL)
+    {
+        ha->pChunkBitmap = BuildChunkBitmap(ha);
+        if(ha->pChunkBitmap == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    pChunkBitmap = ha->pChunkBitmap;
+
+    /* Get the range of chunks of the file */
+    dwChunkIndex = (uint32_t)((RawFilePos - hf->RawFilePos) / dwChunkSize);
+    dwChunkEnd = (uint32_t)((RawDataEnd - hf->RawFilePos - 1) / dwChunkSize) + 1;
+
+    while(nError == ERROR_SUCCESS && dwChunkIndex < dwChunkEnd)
+    {
+        /* Skip the chunks that have been verified before */
+        dwBit = pChunkBitmap->FirstChunk[dwFileIndex] + dwChunkIndex;
+        if(pChunkBitmap->Verified[dwBit / 8] & (1 << (dwBit & 0x07)))
+        {
+            dwChunkIndex++;
+            continue;
+        }
+
+        /* Take all following chunks that haven't been verified yet */
+        for(dwChunkCount = 1; dwChunkIndex + dwChunkCount < dwChunkEnd && dwChunkCount < RAW_CHUNKS_PER_READ; dwChunkCount++)
+        {
+            dwBit = pChunkBitmap->FirstChunk[dwFileIndex] + dwChunkIndex + dwChunkCount;
+            if(pChunkBitmap->Verified[dwBit / 8] & (1 << (dwBit & 0x07)))
+                break;
+        }
+
+        /* The last chunk of the file may be shorter */
+        ChunkOffset = (uint64_t)dwChunkIndex * dwChunkSize;
+        dwBytesToRead = (uint32_t)STORMLIB_MIN((uint64_t)dwChunkCount * dwChunkSize, pFileEntry->dwCmpSize - ChunkOffset);
+        pbRawData = STORM_ALLOC(uint8_t, dwBytesToRead);
+        if(pbRawData == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+
+        /* Read the raw data of the chunks and their MD5s, which follow the file data */
+        DataOffset = hf->RawFilePos + ChunkOffset;
+        if(!FileStream_Read(ha->pStream, &DataOffset, pbRawData, dwBytesToRead))
+            nError = ERROR_FILE_CORRUPT;
+        DataOffset = hf->RawFilePos + pFileEntry->dwCmpSize + (uint64_t)dwChunkIndex * MD5_DIGEST_SIZE;
+        if(nError == ERROR_SUCCESS && !FileStream_Read(ha->pStream, &DataOffset, md5_array, dwChunkCount * MD5_DIGEST_SIZE))
+            nError = ERROR_FILE_CORRUPT;
+
+        /* Hash all chunks at once */
+        if(nError == ERROR_SUCCESS)
+            MD5_HashChunks(pbRawData, dwBytesToRead, dwChunkSize, md5_calc);
+
+        /* Check each chunk and remember the ones that match */
+        for(i = 0; nError == ERROR_SUCCESS && i < dwChunkCount; i++)
+        {
+            if(memcmp(md5_calc + i * MD5_DIGEST_SIZE, md5_array + i * MD5_DIGEST_SIZE, MD5_DIGEST_SIZE))
+            {
+                nError = ERROR_FILE_CORRUPT;
+                break;
+            }
+
+            dwBit = pChunkBitmap->FirstChunk[dwFileIndex] + dwChunkIndex + i;
+            pChunkBitmap->Verified[dwBit / 8] |= (uint8_t)(1 << (dwBit & 0x07));
+        }
+
+        STORM_FREE(pbRawData);
+        dwChunkIndex += dwChunkCount;
+    }
+
+    return nError;
+}
+
+void FreeChunkBitmap(TMPQArchive * ha)
+{
+    if(ha->pChunkBitmap != NULL)
+    {
+        STORM_FREE(ha->pChunkBitmap->Verified);
+        STORM_FREE(ha->pChunkBitmap->FirstChunk);
+        STORM_FREE(ha->pChunkBitmap);
+        ha->pChunkBitmap = NULL;
+    }
+}
+
 /* Frees the structure for MPQ file */
 void FreeFileHandle(TMPQFile ** hf)
 {
@@ -1610,30 +1935,30 @@ void FreeArchiveHandle(TMPQArchive ** ha)
         if((*ha)->pPatchPrefix != NULL)
             STORM_FREE((*ha)->pPatchPrefix);
 
+        /* Save the verification cache while the archive name is still known */
+        FreeVerifyCache(*ha);
+
         /* Close the file stream */
         FileStream_Close((*ha)->pStream);
         (*ha)->pStream = NULL;
 
-        /* Free the file names from the file table */
+        /* Free the file names and the file table */
+        FreeNameIndex(*ha);
+        FreeDataIndex(*ha);
+        FreeChunkBitmap(*ha);
+        FreeFileNames(*ha);
+        FreeFileAttributes(*ha);
         if((*ha)->pFileTable != NULL)
-        {
-            uint32_t i;
-            
-            for(i = 0; i < (*ha)->dwFileTableSize; i++)
-            {
-                if((*ha)->pFileTable[i].szFileName != NULL)
-                    STORM_FREE((*ha)->pFileTable[i].szFileName);
-                (*ha)->pFileTable[i].szFileName = NULL;
-            }
-
-            /* Then free all buffers allocated in the archive structure */
             STORM_FREE((*ha)->pFileTable);
-        }
 
         if((*ha)->pHashTable != NULL)
             STORM_FREE((*ha)->pHashTable);
         if((*ha)->pHetTable != NULL)
             FreeHetTable((*ha)->pHetTable);
+        if((*ha)->pBetTable != NULL)
+            FreeBetTable((*ha)->pBetTable);
+        if((*ha)->pbBetDecoded != NULL)
+            STORM_FREE((*ha)->pbBetDecoded);
         if((*ha)->keyRSA.N != NULL)
             rsa_free(&((*ha)->keyRSA));
         STORM_FREE(*ha);
@@ -1690,13 +2015,82 @@ int IsPseudoFileName(const char * szFileName, uint32_t * pdwFileIndex)
     return 0;
 }
 
+/*-----------------------------------------------------------------------------
+ * Running work on multiple threads
+ */
+
+#define MAX_PARALLEL_WORKERS    16      /* Upper limit for the number of worker threads */
+
+struct TParallelWorker
+{
+    PARALLEL_WORKER pfnWorker;          /* Function doing the work */
+    void * pvContext;                   /* Context of this worker */
+};
+
+static void * ParallelWorkerThread(void * pvParam)
+{
+    struct TParallelWorker * pWorker = (struct TParallelWorker *)pvParam;
+
+    pWorker->pfnWorker(pWorker->pvContext);
+    return NULL;
+}
+
+/* Returns the number of workers worth running for the given amount of work, */
+/* so that each worker gets at least cbMinWorkload bytes to process */
+uint32_t GetParallelWorkerCount(uint64_t cbWorkload, uint32_t cbMinWorkload)
+{
+    uint64_t dwWorkers = cbWorkload / cbMinWorkload;
+    long nProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nProcessors > MAX_PARALLEL_WORKERS)
+        nProcessors = MAX_PARALLEL_WORKERS;
+    if(dwWorkers > (uint64_t)nProcessors)
+        dwWorkers = (uint64_t)nProcessors;
+    return (dwWorkers > 1) ? (uint32_t)dwWorkers : 1;
+}
+
+/* Calls pfnWorker for each of dwWorkers contexts, which are cbContext bytes each. */
+/* The first context is processed by the calling thread. If a thread can't be */
+/* started, its context is processed by the calling thread as well. */
+void RunParallelWorkers(PARALLEL_WORKER pfnWorker, void * pvContexts, size_t cbContext, uint32_t dwWorkers)
+{
+    struct TParallelWorker Workers[MAX_PARALLEL_WORKERS];
+    pthread_t Threads[MAX_PARALLEL_WORKERS];
+    int bStarted[MAX_PARALLEL_WORKERS];
+    uint32_t i;
+
+    /* Sanity check */
+    assert(dwWorkers <= MAX_PARALLEL_WORKERS);
+
+    /* Start the worker threads */
+    for(i = 1; i < dwWorkers; i++)
+    {
+        Workers[i].pfnWorker = pfnWorker;
+        Workers[i].pvContext = (uint8_t *)pvContexts + (i * cbContext);
+        bStarted[i] = (pthread_create(&Threads[i], NULL, ParallelWorkerThread, &Workers[i]) == 0);
+    }
+
+    /* Do our part of the work */
+    if(dwWorkers > 0)
+        pfnWorker(pvContexts);
+
+    /* Wait for the threads to finish */
+    for(i = 1; i < dwWorkers; i++)
+    {
+        if(bStarted[i])
+            pthread_join(Threads[i], NULL);
+        else
+            pfnWorker(Workers[i].pvContext);
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * Functions calculating and verifying the MD5 signature
  */
 
-int IsValidMD5(unsigned char * pbMd5)
+int IsValidMD5(const unsigned char * pbMd5)
 {
-    uint32_t * Md5 = (uint32_t *)pbMd5;
+    const uint32_t * Md5 = (const uint32_t *)pbMd5;
 
     return (Md5[0] | Md5[1] | Md5[2] | Md5[3]) ? 1 : 0;
 }
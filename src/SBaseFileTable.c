@@ -17,6 +17,7 @@
 
 #define INVALID_FLAG_VALUE 0xCCCCCCCC
 #define MAX_FLAG_INDEX     512
+#define NAME_BLOCK_SIZE    0x10000      /* Size of one block of the file name arena */
 
 /*-----------------------------------------------------------------------------
  * Support for calculating bit sizes
@@ -84,6 +85,90 @@ static TBitArray * CreateBitArray(
     return pBitArray;
 }
 
+/* Loads up to 8 bytes from the bit array as little-endian 64-bit value. */
+/* Near the end of the array, only the remaining bytes are loaded */
+static uint64_t LoadBitArrayQword(TBitArray * pArray, unsigned int nBytePosition)
+{
+    uint64_t Value = 0;
+    unsigned int nBytesLeft;
+    unsigned int i;
+
+    if(nBytePosition < pArray->NumberOfBytes)
+    {
+        nBytesLeft = pArray->NumberOfBytes - nBytePosition;
+        if(nBytesLeft >= sizeof(uint64_t))
+        {
+            memcpy(&Value, pArray->Elements + nBytePosition, sizeof(uint64_t));
+            return BSWAP_INT64_UNSIGNED(Value);
+        }
+
+        for(i = 0; i < nBytesLeft; i++)
+            Value |= (uint64_t)pArray->Elements[nBytePosition + i] << (i * 8);
+    }
+
+    return Value;
+}
+
+/* Stores a value to the caller's buffer of 1, 2, 4 or 8 bytes */
+static int StoreBitsValue(void * pvBuffer, int nResultByteSize, uint64_t Value)
+{
+    uint32_t Value32;
+    uint16_t Value16;
+
+    switch(nResultByteSize)
+    {
+        case 1:
+            *(uint8_t *)pvBuffer = (uint8_t)Value;
+            return 1;
+
+        case 2:
+            Value16 = (uint16_t)Value;
+            memcpy(pvBuffer, &Value16, sizeof(uint16_t));
+            return 1;
+
+        case 4:
+            Value32 = (uint32_t)Value;
+            memcpy(pvBuffer, &Value32, sizeof(uint32_t));
+            return 1;
+
+        case 8:
+            memcpy(pvBuffer, &Value, sizeof(uint64_t));
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Loads a value from the caller's buffer of 1, 2, 4 or 8 bytes */
+static int LoadBitsValue(void * pvBuffer, int nResultByteSize, uint64_t * PtrValue)
+{
+    uint32_t Value32;
+    uint16_t Value16;
+
+    switch(nResultByteSize)
+    {
+        case 1:
+            PtrValue[0] = *(uint8_t *)pvBuffer;
+            return 1;
+
+        case 2:
+            memcpy(&Value16, pvBuffer, sizeof(uint16_t));
+            PtrValue[0] = Value16;
+            return 1;
+
+        case 4:
+            memcpy(&Value32, pvBuffer, sizeof(uint32_t));
+            PtrValue[0] = Value32;
+            return 1;
+
+        case 8:
+            memcpy(PtrValue, pvBuffer, sizeof(uint64_t));
+            return 1;
+    }
+
+    return 0;
+}
+
 void GetBits(
     TBitArray * pArray,
     unsigned int nBitPosition,
@@ -97,9 +182,7 @@ void GetBits(
     unsigned int nByteLength = (nBitLength / 8);
     unsigned int nBitOffset = (nBitPosition & 0x07);
     unsigned char BitBuffer;
-
-    /* Keep compiler happy for platforms where nResultByteSize is not used */
-    nResultByteSize = nResultByteSize;
+    uint64_t Value;
 
 #ifdef _DEBUG
     /* Check if the target is properly zeroed */
@@ -107,6 +190,18 @@ void GetBits(
         assert(pbBuffer[i] == 0);
 #endif
 
+    /* Fast path: If the value fits into one 64-bit load, */
+    /* get it by a single load, shift and mask */
+    if((nBitOffset + nBitLength) <= 64)
+    {
+        Value = LoadBitArrayQword(pArray, nBytePosition0) >> nBitOffset;
+        if(nBitLength < 64)
+            Value &= ((uint64_t)1 << nBitLength) - 1;
+
+        if(StoreBitsValue(pvBuffer, nResultByteSize, Value))
+            return;
+    }
+
 #ifndef PLATFORM_LITTLE_ENDIAN
     /* Adjust the buffer pointer for big endian platforms */
     pbBuffer += (nResultByteSize - 1);
@@ -163,9 +258,22 @@ void SetBits(
     unsigned short BitBuffer = 0;
     unsigned short AndMask = 0;
     unsigned short OneByte = 0;
+    uint64_t Value64;
+    uint64_t Mask64;
 
-    /* Keep compiler happy for platforms where nResultByteSize is not used */
-    nResultByteSize = nResultByteSize;
+    /* Fast path: If the value fits into one 64-bit word that is completely */
+    /* inside the array, update it by a single load, merge and store */
+    if((nBitOffset + nBitLength) <= 64 && (nBytePosition + sizeof(uint64_t)) <= pArray->NumberOfBytes)
+    {
+        if(LoadBitsValue(pvBuffer, nResultByteSize, &Value64))
+        {
+            Mask64 = (nBitLength < 64) ? ((uint64_t)1 << nBitLength) - 1 : (uint64_t)-1;
+            Value64 = ((Value64 & Mask64) << nBitOffset) | (LoadBitArrayQword(pArray, nBytePosition) & ~(Mask64 << nBitOffset));
+            Value64 = BSWAP_INT64_UNSIGNED(Value64);
+            memcpy(pArray->Elements + nBytePosition, &Value64, sizeof(uint64_t));
+            return;
+        }
+    }
 
 #ifndef PLATFORM_LITTLE_ENDIAN
     /* Adjust the buffer pointer for big endian platforms */
@@ -542,6 +650,16 @@ int ConvertMpqHeaderToFormat4(
             if(!VerifyDataBlockHash(pHeader, MPQ_HEADER_SIZE_V4 - MD5_DIGEST_SIZE, pHeader->MD5_MpqHeader))
                 nError = ERROR_FILE_CORRUPT;
 
+            /* The raw chunk size, if any, must be a power of two within sane limits. */
+            /* The sizes of the chunks and of their MD5 array are calculated from it */
+            if(pHeader->dwRawChunkSize != 0)
+            {
+                if((pHeader->dwRawChunkSize & (pHeader->dwRawChunkSize - 1)) ||
+                   (pHeader->dwRawChunkSize < MPQ_RAW_CHUNK_SIZE_MIN)         ||
+                   (pHeader->dwRawChunkSize > MPQ_RAW_CHUNK_SIZE_MAX))
+                    nError = ERROR_BAD_FORMAT;
+            }
+
             /* Calculate the block table position */
             BlockTablePos64 = MpqOffset + MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos);
             break;
@@ -570,6 +688,80 @@ int ConvertMpqHeaderToFormat4(
     return nError;
 }
 
+/*-----------------------------------------------------------------------------
+ * Identity of the archive file
+ */
+
+/* Adds the raw bytes of a MPQ table to the MD5. Tables */
+/* that go beyond the end of the file are hashed up to the end */
+static int HashRawTable(TMPQArchive * ha, hash_state * pMd5State, unsigned char * pbBuffer, uint64_t ByteOffset, uint64_t TableSize)
+{
+    uint32_t dwBytesToRead;
+
+    if(ByteOffset >= ha->FileSize)
+        return ERROR_SUCCESS;
+    if(TableSize > ha->FileSize - ByteOffset)
+        TableSize = ha->FileSize - ByteOffset;
+
+    while(TableSize != 0)
+    {
+        dwBytesToRead = (TableSize > 0x10000) ? 0x10000 : (uint32_t)TableSize;
+        if(!FileStream_Read(ha->pStream, &ByteOffset, pbBuffer, dwBytesToRead))
+            return GetLastError();
+
+        md5_process(pMd5State, pbBuffer, dwBytesToRead);
+        ByteOffset += dwBytesToRead;
+        TableSize -= dwBytesToRead;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+/* Calculates the identity of the archive file. Must be called after the MPQ */
+/* header has been converted to format 4, and before any table is loaded. */
+/* The tables are hashed as they are stored, so nothing needs to be decoded */
+int CalculateArchiveId(TMPQArchive * ha, TMPQArchiveId * pArchiveId)
+{
+    TMPQHeader * pHeader = ha->pHeader;
+    hash_state md5_state;
+    unsigned char * pbBuffer;
+    int nError = ERROR_SUCCESS;
+
+    pbBuffer = STORM_ALLOC(uint8_t, 0x10000);
+    if(pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    memset(pArchiveId, 0, sizeof(TMPQArchiveId));
+    pArchiveId->ArchiveSize = ha->FileSize;
+    FileStream_GetTime(ha->pStream, &pArchiveId->ArchiveTime);
+    pArchiveId->MpqPos = ha->MpqPos;
+
+    md5_init(&md5_state);
+    md5_process(&md5_state, (unsigned char *)ha->HeaderData, sizeof(ha->HeaderData));
+    if(nError == ERROR_SUCCESS && pHeader->HetTablePos64 != 0)
+        nError = HashRawTable(ha, &md5_state, pbBuffer, ha->MpqPos + pHeader->HetTablePos64, pHeader->HetTableSize64);
+    if(nError == ERROR_SUCCESS && pHeader->BetTablePos64 != 0)
+        nError = HashRawTable(ha, &md5_state, pbBuffer, ha->MpqPos + pHeader->BetTablePos64, pHeader->BetTableSize64);
+    if(nError == ERROR_SUCCESS && (pHeader->wHashTablePosHi || pHeader->dwHashTablePos))
+        nError = HashRawTable(ha, &md5_state, pbBuffer, FileOffsetFromMpqOffset(ha, MAKE_OFFSET64(pHeader->wHashTablePosHi, pHeader->dwHashTablePos)), pHeader->HashTableSize64);
+    if(nError == ERROR_SUCCESS && (pHeader->wBlockTablePosHi || pHeader->dwBlockTablePos))
+        nError = HashRawTable(ha, &md5_state, pbBuffer, FileOffsetFromMpqOffset(ha, MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos)), pHeader->BlockTableSize64);
+    if(nError == ERROR_SUCCESS && pHeader->HiBlockTablePos64 != 0)
+        nError = HashRawTable(ha, &md5_state, pbBuffer, ha->MpqPos + pHeader->HiBlockTablePos64, pHeader->HiBlockTableSize64);
+    md5_done(&md5_state, pArchiveId->TablesMd5);
+
+    STORM_FREE(pbBuffer);
+    return nError;
+}
+
+int IsSameArchiveId(TMPQArchiveId * pArchiveId1, TMPQArchiveId * pArchiveId2)
+{
+    return (pArchiveId1->ArchiveSize == pArchiveId2->ArchiveSize &&
+            pArchiveId1->ArchiveTime == pArchiveId2->ArchiveTime &&
+            pArchiveId1->MpqPos      == pArchiveId2->MpqPos &&
+            memcmp(pArchiveId1->TablesMd5, pArchiveId2->TablesMd5, MD5_DIGEST_SIZE) == 0);
+}
+
 /*-----------------------------------------------------------------------------
  * Support for hash table
  */
@@ -601,7 +793,7 @@ static int IsValidHashEntry1(TMPQArchive * ha, TMPQHash * pHash, TMPQBlock * pBl
 /* Hash entry verification when the file table does not exist yet */
 static int IsValidHashEntry2(TMPQArchive * ha, TMPQHash * pHash)
 {
-    TFileEntry * pFileEntry = ha->pFileTable + pHash->dwBlockIndex;
+    TMPQFileEntry * pFileEntry = ha->pFileTable + pHash->dwBlockIndex;
     return ((pHash->dwBlockIndex < ha->dwFileTableSize) && (pFileEntry->dwFlags & MPQ_FILE_EXISTS)) ? 1 : 0;
 }
 
@@ -609,10 +801,10 @@ static int IsValidHashEntry2(TMPQArchive * ha, TMPQHash * pHash)
 /* 1) A hash table entry with the preferred locale */
 /* 2) A hash table entry with the neutral locale */
 /* 3) NULL */
-static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale)
+static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, TMPQNameHash * pNameHash, uint32_t lcLocale)
 {
     TMPQHash * pHashNeutral = NULL;
-    TMPQHash * pFirstHash = GetFirstHashEntry(ha, szFileName);
+    TMPQHash * pFirstHash = GetFirstHashEntry2(ha, pNameHash);
     TMPQHash * pHash = pFirstHash;
 
     /* Parse the found hashes */
@@ -637,9 +829,9 @@ static TMPQHash * GetHashEntryLocale(TMPQArchive * ha, const char * szFileName,
 /* Returns a hash table entry in the following order: */
 /* 1) A hash table entry with the preferred locale */
 /* 2) NULL */
-static TMPQHash * GetHashEntryExact(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale)
+static TMPQHash * GetHashEntryExact(TMPQArchive * ha, TMPQNameHash * pNameHash, uint32_t lcLocale)
 {
-    TMPQHash * pFirstHash = GetFirstHashEntry(ha, szFileName);
+    TMPQHash * pFirstHash = GetFirstHashEntry2(ha, pNameHash);
     TMPQHash * pHash = pFirstHash;
 
     /* Parse the found hashes */
@@ -720,7 +912,7 @@ static int BuildFileTableFromBlockTable(
     TMPQArchive * ha,
     TMPQBlock * pBlockTable)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQHeader * pHeader = ha->pHeader;
     TMPQBlock * pBlock;
     TMPQHash * pHashTableEnd;
@@ -817,7 +1009,7 @@ static int BuildFileTableFromBlockTable(
         /* free some memory by shrinking the file table */
         if(ha->dwFileTableSize > ha->dwMaxFileCount)
         {
-            ha->pFileTable = STORM_REALLOC(TFileEntry, ha->pFileTable, ha->dwMaxFileCount);
+            ha->pFileTable = STORM_REALLOC(TMPQFileEntry, ha->pFileTable, ha->dwMaxFileCount);
             ha->pHeader->dwBlockTableSize = ha->dwMaxFileCount;
             ha->dwFileTableSize = ha->dwMaxFileCount;
         }
@@ -860,7 +1052,7 @@ TMPQBlock * TranslateBlockTable(
     uint64_t * pcbTableSize,
     int * pbNeedHiBlockTable)
 {
-    TFileEntry * pFileEntry = ha->pFileTable;
+    TMPQFileEntry * pFileEntry = ha->pFileTable;
     TMPQBlock * pBlockTable;
     TMPQBlock * pBlock;
     size_t NeedHiBlockTable = 0;
@@ -899,7 +1091,7 @@ static uint16_t * TranslateHiBlockTable(
     TMPQArchive * ha,
     uint64_t * pcbTableSize)
 {
-    TFileEntry * pFileEntry = ha->pFileTable;
+    TMPQFileEntry * pFileEntry = ha->pFileTable;
     uint16_t * pHiBlockTable;
     uint16_t * pHiBlock;
     size_t dwBlockTableSize = ha->pHeader->dwBlockTableSize;
@@ -1178,6 +1370,7 @@ static void CreateHetHeader(
 TMPQHetTable * CreateHetTable(uint32_t dwEntryCount, uint32_t dwTotalCount, uint32_t dwNameHashBitSize, unsigned char * pbSrcData)
 {
     TMPQHetTable * pHetTable;
+    uint32_t i;
 
     pHetTable = STORM_ALLOC(TMPQHetTable, 1);
     if(pHetTable != NULL)
@@ -1223,6 +1416,13 @@ TMPQHetTable * CreateHetTable(uint32_t dwEntryCount, uint32_t dwTotalCount, uint
 
                     /* Copy the file indexes */
                     memcpy(pHetTable->pBetIndexes->Elements, pbSrcData + dwTotalCount, pHetTable->pBetIndexes->NumberOfBytes);
+
+                    /* Count the used entries */
+                    for(i = 0; i < dwTotalCount; i++)
+                    {
+                        if(pHetTable->pNameHashes[i] != HET_ENTRY_FREE)
+                            pHetTable->dwUsedCount++;
+                    }
                 }
                 
                 /* Return the result HET table */
@@ -1258,6 +1458,7 @@ static int InsertHetEntry(TMPQHetTable * pHetTable, uint64_t FileNameHash, uint3
         {
             /* Set the entry in the name hash table */
             pHetTable->pNameHashes[Index] = NameHash1;
+            pHetTable->dwUsedCount++;
 
             /* Set the entry in the file index table */
             SetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * Index,
@@ -1364,10 +1565,30 @@ static TMPQExtHeader * TranslateHetTable2(TMPQHetTable * pHetTable, uint64_t * p
     return &pHetHeader->ExtHdr;
 }
 
-static uint32_t GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
+/* Returns the name hash of a file entry. If the BET table is decoded on demand, */
+/* the name hash is taken from the BET table and stored in the file entry */
+static uint64_t GetFileNameHash_Het(TMPQArchive * ha, uint32_t dwFileIndex, uint8_t NameHash1)
+{
+    TMPQBetTable * pBetTable = ha->pBetTable;
+    TMPQFileEntry * pFileEntry = ha->pFileTable + dwFileIndex;
+    uint64_t NameHash2 = 0;
+
+    if(pBetTable != NULL && dwFileIndex < pBetTable->dwEntryCount && pFileEntry->FileNameHash == 0)
+    {
+        GetBits(pBetTable->pNameHashes, pBetTable->dwBitTotal_NameHash2 * dwFileIndex,
+                                        pBetTable->dwBitCount_NameHash2,
+                                       &NameHash2,
+                                        8);
+        pFileEntry->FileNameHash = ((uint64_t)NameHash1 << pBetTable->dwBitCount_NameHash2) | NameHash2;
+    }
+
+    return pFileEntry->FileNameHash;
+}
+
+static uint32_t GetFileIndex_Het(TMPQArchive * ha, TMPQNameHash * pNameHash)
 {
     TMPQHetTable * pHetTable = ha->pHetTable;
-    uint64_t FileNameHash;
+    uint64_t FileNameHash = pNameHash->FileNameHash;
     uint32_t StartIndex;
     uint32_t Index;
     uint8_t NameHash1;                 /* Upper 8 bits of the masked file name hash */
@@ -1379,12 +1600,6 @@ static uint32_t GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
     /* Do nothing if the MPQ has no HET table */
     assert(ha->pHetTable != NULL);
 
-    /* Calculate 64-bit hash of the file name */
-    if (ha->dwFlags & MPQ_FLAG_FILENAME_UNIX)
-        FileNameHash = (HashStringJenkinsCS(szFileName) & pHetTable->AndMask64) | pHetTable->OrMask64;
-    else
-        FileNameHash = (HashStringJenkins(szFileName) & pHetTable->AndMask64) | pHetTable->OrMask64;
-
     /* Split the file name hash into two parts:
      * NameHash1: The highest 8 bits of the name hash
      * NameHash2: File name hash limited to hash size
@@ -1410,8 +1625,9 @@ static uint32_t GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
                                             4);
 
             /* Verify the FileNameHash against the entry in the table of name hashes */
-            if(dwFileIndex <= ha->dwFileTableSize && ha->pFileTable[dwFileIndex].FileNameHash == FileNameHash)
+            if(dwFileIndex < ha->dwFileTableSize && GetFileNameHash_Het(ha, dwFileIndex, NameHash1) == FileNameHash)
             {
+                DecodeFileEntry(ha, dwFileIndex);
                 return dwFileIndex;
             }
         }
@@ -1448,8 +1664,8 @@ static void CreateBetHeader(
     TMPQArchive * ha,
     TMPQBetHeader * pBetHeader)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     uint64_t MaxByteOffset = 0;
     uint32_t FlagArray[MAX_FLAG_INDEX];
     uint32_t dwMaxFlagIndex = 0;
@@ -1647,8 +1863,8 @@ TMPQExtHeader * TranslateBetTable2(
 {
     TMPQBetHeader * pBetHeader = NULL;
     TMPQBetHeader BetHeader;
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     TBitArray * pBitArray = NULL;
     unsigned char * pbLinearTable = NULL;
     unsigned char * pbTrgData;
@@ -1779,7 +1995,18 @@ void FreeBetTable(TMPQBetTable * pBetTable)
  * Support for file table
  */
 
-TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
+TMPQFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
+{
+    TMPQNameHash NameHash;
+
+    /* Calculate all hashes of the name at once */
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &NameHash);
+    return GetFileEntryByHash(ha, &NameHash, lcLocale, PtrHashIndex);
+}
+
+/* Same like GetFileEntryLocale2, but with already calculated name hashes */
+/* (MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET) */
+TMPQFileEntry * GetFileEntryByHash(TMPQArchive * ha, TMPQNameHash * pNameHash, uint32_t lcLocale, uint32_t *PtrHashIndex)
 {
     TMPQHash * pHash;
     uint32_t dwFileIndex;
@@ -1789,7 +2016,7 @@ TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint
     /* we will need the pointer to hash table entry */
     if(ha->pHashTable != NULL)
     {
-        pHash = GetHashEntryLocale(ha, szFileName, lcLocale);
+        pHash = GetHashEntryLocale(ha, pNameHash, lcLocale);
         if(pHash != NULL && pHash->dwBlockIndex < ha->dwFileTableSize)
         {
             if(PtrHashIndex != NULL)
@@ -1801,7 +2028,7 @@ TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint
     /* If we have HET table in the MPQ, try to find the file in HET table */
     if(ha->pHetTable != NULL)
     {
-        dwFileIndex = GetFileIndex_Het(ha, szFileName);
+        dwFileIndex = GetFileIndex_Het(ha, pNameHash);
         if(dwFileIndex != HASH_ENTRY_FREE)
             return ha->pFileTable + dwFileIndex;
     }
@@ -1810,20 +2037,24 @@ TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint
     return NULL;
 }
 
-TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale)
+TMPQFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale)
 {
     return GetFileEntryLocale2(ha, szFileName, lcLocale, NULL);
 }
 
-TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
+TMPQFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
 {
+    TMPQNameHash NameHash;
     TMPQHash * pHash;
     uint32_t dwFileIndex;
 
+    /* Calculate all hashes of the name at once */
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &NameHash);
+
     /* If the hash table is present, find the entry from hash table */
     if(ha->pHashTable != NULL)
     {
-        pHash = GetHashEntryExact(ha, szFileName, lcLocale);
+        pHash = GetHashEntryExact(ha, &NameHash, lcLocale);
         if(pHash != NULL && pHash->dwBlockIndex < ha->dwFileTableSize)
         {
             if(PtrHashIndex != NULL)
@@ -1835,7 +2066,7 @@ TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32
     /* If we have HET table in the MPQ, try to find the file in HET table */
     if(ha->pHetTable != NULL)
     {
-        dwFileIndex = GetFileIndex_Het(ha, szFileName);
+        dwFileIndex = GetFileIndex_Het(ha, &NameHash);
         if(dwFileIndex != HASH_ENTRY_FREE)
         {
             if(PtrHashIndex != NULL)
@@ -1848,45 +2079,467 @@ TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32
     return NULL;
 }
 
-void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * szFileName)
+/* Copies the file name to the name arena of the archive. */
+/* The names are only freed when the archive is closed */
+static char * StoreFileName(TMPQArchive * ha, const char * szFileName)
+{
+    TMPQNameBlock * pBlock = ha->pNameBlocks;
+    size_t cbFileName = strlen(szFileName) + 1;
+    size_t cbBlockSize = NAME_BLOCK_SIZE;
+    char * szStoredName;
+
+    /* Allocate new block if the name doesn't fit into the current one */
+    if(pBlock == NULL || (pBlock->cbUsed + cbFileName) > pBlock->cbBlockSize)
+    {
+        /* Very long names get a block of their own */
+        if(cbFileName > cbBlockSize)
+            cbBlockSize = cbFileName;
+
+        pBlock = (TMPQNameBlock *)STORM_ALLOC(uint8_t, sizeof(TMPQNameBlock) + cbBlockSize);
+        if(pBlock == NULL)
+            return NULL;
+
+        pBlock->pNext = ha->pNameBlocks;
+        pBlock->cbBlockSize = cbBlockSize;
+        pBlock->cbUsed = 0;
+        ha->pNameBlocks = pBlock;
+    }
+
+    /* Append the name to the block */
+    szStoredName = pBlock->szNames + pBlock->cbUsed;
+    memcpy(szStoredName, szFileName, cbFileName);
+    pBlock->cbUsed += cbFileName;
+    return szStoredName;
+}
+
+void FreeFileNames(TMPQArchive * ha)
+{
+    TMPQNameBlock * pBlock;
+
+    while((pBlock = ha->pNameBlocks) != NULL)
+    {
+        ha->pNameBlocks = pBlock->pNext;
+        STORM_FREE(pBlock);
+    }
+}
+
+/* Drops the sorted name index. Must be called whenever a file entry */
+/* gets a new name or file entries are moved in the file table */
+void FreeNameIndex(TMPQArchive * ha)
+{
+    if(ha->pNameIndex != NULL)
+        STORM_FREE(ha->pNameIndex);
+    ha->pNameIndex = NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Support for CRC32, file time and MD5 of the file entries
+ *
+ * These values are only needed when (attributes) are loaded or saved,
+ * or when a file is verified. They are kept in arrays parallel
+ * to the file table, and each array is only allocated when needed.
+ */
+
+static const unsigned char ZeroMd5[MD5_DIGEST_SIZE] = {0};
+
+static void * AllocateAttributeArray(void * pvArray, size_t cbItem, uint32_t dwOldCount, uint32_t dwNewCount)
+{
+    uint8_t * pbArray;
+
+    pbArray = STORM_REALLOC(uint8_t, pvArray, dwNewCount * cbItem);
+    if(pbArray != NULL && dwNewCount > dwOldCount)
+        memset(pbArray + dwOldCount * cbItem, 0, (dwNewCount - dwOldCount) * cbItem);
+    return pbArray;
+}
+
+/* Changes the size of all existing attribute arrays. */
+/* Must be called before ha->dwFileTableSize is updated */
+static int ResizeFileAttributes(TMPQArchive * ha, uint32_t dwNewSize)
+{
+    void * pvArray;
+
+    if(ha->pFileCrc32 != NULL)
+    {
+        pvArray = AllocateAttributeArray(ha->pFileCrc32, sizeof(uint32_t), ha->dwFileTableSize, dwNewSize);
+        if(pvArray == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        ha->pFileCrc32 = (uint32_t *)pvArray;
+    }
+
+    if(ha->pFileTime != NULL)
+    {
+        pvArray = AllocateAttributeArray(ha->pFileTime, sizeof(uint64_t), ha->dwFileTableSize, dwNewSize);
+        if(pvArray == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        ha->pFileTime = (uint64_t *)pvArray;
+    }
+
+    if(ha->pFileMd5 != NULL)
+    {
+        pvArray = AllocateAttributeArray(ha->pFileMd5, MD5_DIGEST_SIZE, ha->dwFileTableSize, dwNewSize);
+        if(pvArray == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        ha->pFileMd5 = (unsigned char *)pvArray;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static void MoveFileAttributes(TMPQArchive * ha, uint32_t dwTrgIndex, uint32_t dwSrcIndex)
+{
+    if(ha->pFileCrc32 != NULL)
+        ha->pFileCrc32[dwTrgIndex] = ha->pFileCrc32[dwSrcIndex];
+    if(ha->pFileTime != NULL)
+        ha->pFileTime[dwTrgIndex] = ha->pFileTime[dwSrcIndex];
+    if(ha->pFileMd5 != NULL)
+        memcpy(ha->pFileMd5 + dwTrgIndex * MD5_DIGEST_SIZE, ha->pFileMd5 + dwSrcIndex * MD5_DIGEST_SIZE, MD5_DIGEST_SIZE);
+}
+
+static void ClearFileAttributes(TMPQArchive * ha, uint32_t dwIndex, uint32_t dwCount)
+{
+    if(ha->pFileCrc32 != NULL)
+        memset(ha->pFileCrc32 + dwIndex, 0, dwCount * sizeof(uint32_t));
+    if(ha->pFileTime != NULL)
+        memset(ha->pFileTime + dwIndex, 0, dwCount * sizeof(uint64_t));
+    if(ha->pFileMd5 != NULL)
+        memset(ha->pFileMd5 + dwIndex * MD5_DIGEST_SIZE, 0, dwCount * MD5_DIGEST_SIZE);
+}
+
+/* Allocates the arrays for the given MPQ_ATTRIBUTE_XXX flags, if not allocated yet */
+int AllocateFileAttributes(TMPQArchive * ha, uint32_t dwAttrFlags)
+{
+    if((dwAttrFlags & MPQ_ATTRIBUTE_CRC32) && ha->pFileCrc32 == NULL)
+    {
+        ha->pFileCrc32 = (uint32_t *)AllocateAttributeArray(NULL, sizeof(uint32_t), 0, ha->dwFileTableSize);
+        if(ha->pFileCrc32 == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if((dwAttrFlags & MPQ_ATTRIBUTE_FILETIME) && ha->pFileTime == NULL)
+    {
+        ha->pFileTime = (uint64_t *)AllocateAttributeArray(NULL, sizeof(uint64_t), 0, ha->dwFileTableSize);
+        if(ha->pFileTime == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if((dwAttrFlags & MPQ_ATTRIBUTE_MD5) && ha->pFileMd5 == NULL)
+    {
+        ha->pFileMd5 = (unsigned char *)AllocateAttributeArray(NULL, MD5_DIGEST_SIZE, 0, ha->dwFileTableSize);
+        if(ha->pFileMd5 == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void FreeFileAttributes(TMPQArchive * ha)
+{
+    if(ha->pFileCrc32 != NULL)
+        STORM_FREE(ha->pFileCrc32);
+    if(ha->pFileTime != NULL)
+        STORM_FREE(ha->pFileTime);
+    if(ha->pFileMd5 != NULL)
+        STORM_FREE(ha->pFileMd5);
+
+    ha->pFileCrc32 = NULL;
+    ha->pFileTime = NULL;
+    ha->pFileMd5 = NULL;
+}
+
+uint32_t GetFileEntryCrc32(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    SAttrLoadLazy(ha);
+    return (ha->pFileCrc32 != NULL) ? ha->pFileCrc32[pFileEntry - ha->pFileTable] : 0;
+}
+
+uint64_t GetFileEntryTime(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    SAttrLoadLazy(ha);
+    return (ha->pFileTime != NULL) ? ha->pFileTime[pFileEntry - ha->pFileTable] : 0;
+}
+
+/* Never returns NULL. If there is no MD5, returns all zeros */
+const unsigned char * GetFileEntryMd5(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    SAttrLoadLazy(ha);
+    return (ha->pFileMd5 != NULL) ? ha->pFileMd5 + (pFileEntry - ha->pFileTable) * MD5_DIGEST_SIZE : ZeroMd5;
+}
+
+int SetFileEntryCrc32(TMPQArchive * ha, TMPQFileEntry * pFileEntry, uint32_t dwCrc32)
+{
+    /* Deferred (attributes) would overwrite the new value */
+    SAttrLoadLazy(ha);
+
+    /* Zero value is the same as not present */
+    if(ha->pFileCrc32 == NULL)
+    {
+        if(dwCrc32 == 0)
+            return ERROR_SUCCESS;
+        if(AllocateFileAttributes(ha, MPQ_ATTRIBUTE_CRC32) != ERROR_SUCCESS)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    ha->pFileCrc32[pFileEntry - ha->pFileTable] = dwCrc32;
+    return ERROR_SUCCESS;
+}
+
+int SetFileEntryTime(TMPQArchive * ha, TMPQFileEntry * pFileEntry, uint64_t FileTime)
+{
+    /* Deferred (attributes) would overwrite the new value */
+    SAttrLoadLazy(ha);
+
+    /* Zero value is the same as not present */
+    if(ha->pFileTime == NULL)
+    {
+        if(FileTime == 0)
+            return ERROR_SUCCESS;
+        if(AllocateFileAttributes(ha, MPQ_ATTRIBUTE_FILETIME) != ERROR_SUCCESS)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    ha->pFileTime[pFileEntry - ha->pFileTable] = FileTime;
+    return ERROR_SUCCESS;
+}
+
+int SetFileEntryMd5(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const unsigned char * md5)
+{
+    /* Deferred (attributes) would overwrite the new value */
+    SAttrLoadLazy(ha);
+
+    /* Zero value is the same as not present */
+    if(ha->pFileMd5 == NULL)
+    {
+        if(!memcmp(md5, ZeroMd5, MD5_DIGEST_SIZE))
+            return ERROR_SUCCESS;
+        if(AllocateFileAttributes(ha, MPQ_ATTRIBUTE_MD5) != ERROR_SUCCESS)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    memcpy(ha->pFileMd5 + (pFileEntry - ha->pFileTable) * MD5_DIGEST_SIZE, md5, MD5_DIGEST_SIZE);
+    return ERROR_SUCCESS;
+}
+
+/*-----------------------------------------------------------------------------
+ * Support for deduplication of file data
+ *
+ * Files with the same data may share them in the MPQ. The data index finds
+ * files by the MD5 of their content. The index is not updated when files
+ * are deleted or replaced, so each entry is verified when looked up.
+ */
+
+#define DATA_COMPARE_BUFFER_SIZE 0x10000
+
+/* Returns nonzero if the file data may be shared with another file. */
+/* Encrypted data can't be shared, because the key depends on the file name. */
+/* Patch files are excluded, as their compressed size may not include the patch header. */
+int CanShareFileData(TMPQFileEntry * pFileEntry)
+{
+    if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0 || pFileEntry->dwCmpSize == 0)
+        return 0;
+    if(pFileEntry->dwFlags & (MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE))
+        return 0;
+    return (pFileEntry->szFileName == NULL || !IsInternalMpqFileName(pFileEntry->szFileName));
+}
+
+/* Returns nonzero if both files have the same data stored the same way */
+int IsSameFileData(TMPQArchive * ha, TMPQFileEntry * pFileEntry1, TMPQFileEntry * pFileEntry2)
+{
+    uint64_t RawFilePos1;
+    uint64_t RawFilePos2;
+    uint32_t dwBytesLeft = pFileEntry1->dwCmpSize;
+    uint32_t dwToRead;
+    uint8_t * pbBuffer;
+    int bIsSame = 1;
+
+    /* Both files must have the same flags and sizes */
+    if(!CanShareFileData(pFileEntry1) || !CanShareFileData(pFileEntry2))
+        return 0;
+    if(pFileEntry1->dwFlags != pFileEntry2->dwFlags || pFileEntry1->dwFileSize != pFileEntry2->dwFileSize || pFileEntry1->dwCmpSize != pFileEntry2->dwCmpSize)
+        return 0;
+
+    /* Files that already share the data are the same */
+    if(pFileEntry1->ByteOffset == pFileEntry2->ByteOffset)
+        return 1;
+
+    /* Compare the stored data */
+    pbBuffer = STORM_ALLOC(uint8_t, DATA_COMPARE_BUFFER_SIZE * 2);
+    if(pbBuffer == NULL)
+        return 0;
+
+    RawFilePos1 = FileOffsetFromMpqOffset(ha, pFileEntry1->ByteOffset);
+    RawFilePos2 = FileOffsetFromMpqOffset(ha, pFileEntry2->ByteOffset);
+    while(bIsSame && dwBytesLeft != 0)
+    {
+        dwToRead = STORMLIB_MIN(dwBytesLeft, DATA_COMPARE_BUFFER_SIZE);
+        if(!FileStream_Read(ha->pStream, &RawFilePos1, pbBuffer, dwToRead) ||
+           !FileStream_Read(ha->pStream, &RawFilePos2, pbBuffer + DATA_COMPARE_BUFFER_SIZE, dwToRead) ||
+           memcmp(pbBuffer, pbBuffer + DATA_COMPARE_BUFFER_SIZE, dwToRead))
+            bIsSame = 0;
+
+        RawFilePos1 += dwToRead;
+        RawFilePos2 += dwToRead;
+        dwBytesLeft -= dwToRead;
+    }
+
+    STORM_FREE(pbBuffer);
+    return bIsSame;
+}
+
+static uint32_t GetDataIndexHash(const unsigned char * md5)
+{
+    return (uint32_t)md5[0] | ((uint32_t)md5[1] << 8) | ((uint32_t)md5[2] << 16) | ((uint32_t)md5[3] << 24);
+}
+
+/* Adds the file entry to the data index. Returns zero if the index is full. */
+static int AddDataIndexEntry(TMPQArchive * ha, TMPQDataIndex * pDataIndex, TMPQFileEntry * pFileEntry)
+{
+    uint32_t dwFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
+    uint32_t dwIndexMask = pDataIndex->dwHashTableSize - 1;
+    uint32_t dwSlot;
+
+    /* Keep at least half of the slots free */
+    if((pDataIndex->dwEntries + 1) * 2 > pDataIndex->dwHashTableSize)
+        return 0;
+
+    /* Find a free slot. Don't insert the same entry twice */
+    dwSlot = GetDataIndexHash(GetFileEntryMd5(ha, pFileEntry)) & dwIndexMask;
+    while(pDataIndex->FileIndexes[dwSlot] != 0)
+    {
+        if(pDataIndex->FileIndexes[dwSlot] == dwFileIndex + 1)
+            return 1;
+        dwSlot = (dwSlot + 1) & dwIndexMask;
+    }
+
+    pDataIndex->FileIndexes[dwSlot] = dwFileIndex + 1;
+    pDataIndex->dwEntries++;
+    return 1;
+}
+
+/* Builds the data index from all files that have MD5 */
+static TMPQDataIndex * BuildDataIndex(TMPQArchive * ha, uint32_t dwMinEntries)
+{
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
+    TMPQDataIndex * pDataIndex;
+    uint32_t dwHashTableSize = 0x100;
+
+    while(dwHashTableSize < (STORMLIB_MAX(dwMinEntries, ha->dwFileTableSize) * 2))
+        dwHashTableSize <<= 1;
+
+    pDataIndex = (TMPQDataIndex *)STORM_ALLOC(uint8_t, sizeof(TMPQDataIndex) + dwHashTableSize * sizeof(uint32_t));
+    if(pDataIndex != NULL)
+    {
+        memset(pDataIndex->FileIndexes, 0, dwHashTableSize * sizeof(uint32_t));
+        pDataIndex->dwHashTableSize = dwHashTableSize;
+        pDataIndex->dwEntries = 0;
+
+        for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+        {
+            if(CanShareFileData(pFileEntry) && memcmp(GetFileEntryMd5(ha, pFileEntry), ZeroMd5, MD5_DIGEST_SIZE))
+                AddDataIndexEntry(ha, pDataIndex, pFileEntry);
+        }
+    }
+
+    return pDataIndex;
+}
+
+/* Finds another file with the same data. Returns NULL if there is none */
+TMPQFileEntry * FindSameFileData(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    const unsigned char * md5 = GetFileEntryMd5(ha, pFileEntry);
+    TMPQDataIndex * pDataIndex;
+    TMPQFileEntry * pCandidate;
+    uint32_t dwIndexMask;
+    uint32_t dwSlot;
+
+    /* Files without MD5 can't be looked up */
+    if(!CanShareFileData(pFileEntry) || !memcmp(md5, ZeroMd5, MD5_DIGEST_SIZE))
+        return NULL;
+
+    /* Build the index, if not done yet */
+    if(ha->pDataIndex == NULL)
+        ha->pDataIndex = BuildDataIndex(ha, 0);
+    if((pDataIndex = ha->pDataIndex) == NULL)
+        return NULL;
+
+    /* Check all entries with the same hash */
+    dwIndexMask = pDataIndex->dwHashTableSize - 1;
+    dwSlot = GetDataIndexHash(md5) & dwIndexMask;
+    while(pDataIndex->FileIndexes[dwSlot] != 0)
+    {
+        if(pDataIndex->FileIndexes[dwSlot] <= ha->dwFileTableSize)
+        {
+            pCandidate = ha->pFileTable + pDataIndex->FileIndexes[dwSlot] - 1;
+            if(pCandidate != pFileEntry && !memcmp(GetFileEntryMd5(ha, pCandidate), md5, MD5_DIGEST_SIZE) && IsSameFileData(ha, pFileEntry, pCandidate))
+                return pCandidate;
+        }
+        dwSlot = (dwSlot + 1) & dwIndexMask;
+    }
+
+    return NULL;
+}
+
+/* Adds the file to the data index, so that next files can share its data */
+void InsertDataIndexEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    TMPQDataIndex * pDataIndex;
+
+    if(ha->pDataIndex != NULL && CanShareFileData(pFileEntry))
+    {
+        if(!AddDataIndexEntry(ha, ha->pDataIndex, pFileEntry))
+        {
+            /* The index is full, so build a larger one */
+            pDataIndex = BuildDataIndex(ha, ha->pDataIndex->dwEntries * 2);
+            FreeDataIndex(ha);
+            ha->pDataIndex = pDataIndex;
+        }
+    }
+}
+
+/* Drops the data index. Must be called when file entries are moved in the file table */
+void FreeDataIndex(TMPQArchive * ha)
+{
+    if(ha->pDataIndex != NULL)
+        STORM_FREE(ha->pDataIndex);
+    ha->pDataIndex = NULL;
+}
+
+/* Sets the file name to the file entry. The name hashes must be calculated by the caller */
+void AllocateFileName2(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const char * szFileName, TMPQNameHash * pNameHash)
 {
     /* Sanity check */
     assert(pFileEntry != NULL);
 
-    /* If the file name is pseudo file name, free it at this point */
+    /* If the file name is pseudo file name, drop it at this point */
     if(IsPseudoFileName(pFileEntry->szFileName, NULL))
-    {
-        if(pFileEntry->szFileName != NULL)
-            STORM_FREE(pFileEntry->szFileName);
         pFileEntry->szFileName = NULL;
-    }
 
     /* Only allocate new file name if it's not there yet */
     if(pFileEntry->szFileName == NULL)
     {
-        pFileEntry->szFileName = STORM_ALLOC(char, strlen(szFileName) + 1);
-        if(pFileEntry->szFileName != NULL)
-            strcpy(pFileEntry->szFileName, szFileName);
+        pFileEntry->szFileName = StoreFileName(ha, szFileName);
+        FreeNameIndex(ha);
     }
 
-    /* We also need to create the file name hash */
+    /* We also need to set the file name hash */
     if(ha->pHetTable != NULL)
-    {
-        uint64_t AndMask64 = ha->pHetTable->AndMask64;
-        uint64_t OrMask64 = ha->pHetTable->OrMask64;
+        pFileEntry->FileNameHash = pNameHash->FileNameHash;
+}
 
-        if (ha->dwFlags & MPQ_FLAG_FILENAME_UNIX)
-            pFileEntry->FileNameHash = (HashStringJenkinsCS(szFileName) & AndMask64) | OrMask64;
-        else
-            pFileEntry->FileNameHash = (HashStringJenkins(szFileName) & AndMask64) | OrMask64;
-    }
+void AllocateFileName(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const char * szFileName)
+{
+    TMPQNameHash NameHash;
+
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_HET, &NameHash);
+    AllocateFileName2(ha, pFileEntry, szFileName, &NameHash);
 }
 
-TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
+TMPQFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t *PtrHashIndex)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFreeEntry = NULL;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFreeEntry = NULL;
+    TMPQFileEntry * pFileEntry;
+    TMPQNameHash NameHash;
     TMPQHash * pHash = NULL;
     uint32_t dwReservedFiles = ha->dwReservedFiles;
     uint32_t dwFreeCount = 0;
@@ -1894,10 +2547,13 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32
     /* If we are saving MPQ tables, we don't tale number of reserved files into account */
     dwReservedFiles = (ha->dwFlags & MPQ_FLAG_SAVING_TABLES) ? 0 : ha->dwReservedFiles;
 
+    /* The attributes are stored per file index. Load them before any entry changes */
+    SAttrLoadLazy(ha);
+
     /* Now find a free entry in the file table. */
     /* Note that in the case when free entries are in the middle, */
-    /* we need to use these */
-    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    /* we need to use these. There are no free entries below dwFreeFileIndex */
+    for(pFileEntry = ha->pFileTable + ha->dwFreeFileIndex; pFileEntry < pFileTableEnd; pFileEntry++)
     {
         if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
         {
@@ -1918,18 +2574,26 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32
     if(pFreeEntry == NULL || dwFreeCount <= dwReservedFiles)
         return NULL;
 
+    /* The entry gets MPQ_FILE_EXISTS from the caller. Until then, */
+    /* it still counts as free, so the next search starts here */
+    ha->dwFreeFileIndex = (uint32_t)(pFreeEntry - ha->pFileTable);
+
+    /* Calculate all hashes of the name at once */
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &NameHash);
+
     /* Initialize the file entry and set its file name */
-    memset(pFreeEntry, 0, sizeof(TFileEntry));
-    AllocateFileName(ha, pFreeEntry, szFileName);
+    memset(pFreeEntry, 0, sizeof(TMPQFileEntry));
+    ClearFileAttributes(ha, (uint32_t)(pFreeEntry - ha->pFileTable), 1);
+    AllocateFileName2(ha, pFreeEntry, szFileName, &NameHash);
 
     /* If the archive has a hash table, we need to first free entry there */
     if(ha->pHashTable != NULL)
     {
         /* Make sure that the entry is not there yet */
-        assert(GetHashEntryExact(ha, szFileName, lcLocale) == NULL);
+        assert(GetHashEntryExact(ha, &NameHash, lcLocale) == NULL);
 
         /* Find a free hash table entry for the name */
-        pHash = AllocateHashEntry(ha, pFreeEntry, lcLocale);
+        pHash = AllocateHashEntry(ha, pFreeEntry, &NameHash, lcLocale);
         if(pHash == NULL)
             return NULL;
 
@@ -1939,10 +2603,11 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32
     }
 
     /* If the archive has a HET table, just do some checks */
-    /* Note: Don't bother modifying the HET table. It will be rebuilt from scratch after, anyway */
+    /* Note: Don't bother modifying the HET table. The file is inserted there */
+    /* by InsertHetTableEntry after it has been written */
     if(ha->pHetTable != NULL)
     {
-        assert(GetFileIndex_Het(ha, szFileName) == HASH_ENTRY_FREE);
+        assert(GetFileIndex_Het(ha, &NameHash) == HASH_ENTRY_FREE);
     }
 
     /* Return the free table entry */
@@ -1954,8 +2619,9 @@ int RenameFileEntry(
     TMPQFile * hf,
     const char * szNewFileName)
 {
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     TMPQHash * pHashEntry = hf->pHashEntry;
+    TMPQNameHash NameHash;
     uint32_t lcLocale = 0;
 
     /* If the archive hash hash table, we need to free the hash table entry */
@@ -1977,28 +2643,37 @@ int RenameFileEntry(
         pHashEntry->dwBlockIndex = HASH_ENTRY_DELETED;
     }
 
-    /* Free the old file name */
-    if(pFileEntry->szFileName != NULL)
-        STORM_FREE(pFileEntry->szFileName);
+    /* Remove the old name from the HET table */
+    if(ha->pHetTable != NULL)
+        DeleteHetTableEntry(ha, pFileEntry);
+
+    /* Forget the old file name. It stays in the name arena until the archive is closed */
     pFileEntry->szFileName = NULL;
 
+    /* Renaming from or to an internal file name changes the end of the file data */
+    ha->FreeSpacePos = 0;
+
     /* Allocate new file name */
-    AllocateFileName(ha, pFileEntry, szNewFileName);
+    HashFileName(ha, szNewFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &NameHash);
+    AllocateFileName2(ha, pFileEntry, szNewFileName, &NameHash);
 
     /* Allocate new hash entry */
     if(ha->pHashTable != NULL)
     {
         /* Since we freed one hash entry before, this must succeed */
-        hf->pHashEntry = AllocateHashEntry(ha, pFileEntry, lcLocale);
+        hf->pHashEntry = AllocateHashEntry(ha, pFileEntry, &NameHash, lcLocale);
         assert(hf->pHashEntry != NULL);
     }
 
+    /* Insert the new name to the HET table */
+    if(ha->pHetTable != NULL)
+        return InsertHetTableEntry(ha, pFileEntry);
     return ERROR_SUCCESS;
 }
 
 int DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
 {
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     TMPQHash * pHashEntry = hf->pHashEntry;
 
     /* If the archive hash hash table, we need to free the hash table entry */
@@ -2017,13 +2692,14 @@ int DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
         pHashEntry->dwBlockIndex = HASH_ENTRY_DELETED;
     }
 
-    /* Free the file name, and set the file entry as deleted */
-    if(pFileEntry->szFileName != NULL)
-        STORM_FREE(pFileEntry->szFileName);
+    /* Remove the file from the HET table */
+    if(ha->pHetTable != NULL)
+        DeleteHetTableEntry(ha, pFileEntry);
+
+    /* Forget the file name, and set the file entry as deleted */
     pFileEntry->szFileName = NULL;
 
     /*
-     * Don't modify the HET table, because it gets recreated by the caller
      * Don't decrement the number of entries in the file table
      * Keep Byte Offset, file size, compressed size, CRC32 and MD5
      * Clear the file name hash and the MPQ_FILE_EXISTS bit
@@ -2031,6 +2707,13 @@ int DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
 
     pFileEntry->dwFlags &= ~MPQ_FILE_EXISTS;
     pFileEntry->FileNameHash = 0;
+
+    /* The end of the file data needs to be found again */
+    ha->FreeSpacePos = 0;
+
+    /* The entry can be reused by the next AllocateFileEntry */
+    if((uint32_t)(pFileEntry - ha->pFileTable) < ha->dwFreeFileIndex)
+        ha->dwFreeFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
     return ERROR_SUCCESS;
 }
 
@@ -2065,9 +2748,17 @@ uint32_t InvalidateInternalFile(TMPQArchive * ha, const char * szFileName, uint3
 
 void InvalidateInternalFiles(TMPQArchive * ha)
 {
+    /* File data are about to change, so the verified raw chunks are no longer valid */
+    FreeChunkBitmap(ha);
+
     /* Do nothing if we are in the middle of saving internal files */
     if(!(ha->dwFlags & MPQ_FLAG_SAVING_TABLES))
     {
+        /* The (listfile) and (attributes) will be saved again, */
+        /* so they must be loaded if they have been deferred */
+        SListFileLoadLazy(ha);
+        SAttrLoadLazy(ha);
+
         /*
          * We clear the file entries for (listfile), (attributes) and (signature)
          * For each internal file cleared, we increment the number 
@@ -2176,11 +2867,11 @@ static TMPQHash * LoadHashTable(TMPQArchive * ha)
 
 int CreateFileTable(TMPQArchive * ha, uint32_t dwFileTableSize)
 {
-    ha->pFileTable = STORM_ALLOC(TFileEntry, dwFileTableSize);
+    ha->pFileTable = STORM_ALLOC(TMPQFileEntry, dwFileTableSize);
     if(ha->pFileTable == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
-    memset(ha->pFileTable, 0x00, sizeof(TFileEntry) * dwFileTableSize);
+    memset(ha->pFileTable, 0x00, sizeof(TMPQFileEntry) * dwFileTableSize);
     ha->dwFileTableSize = dwFileTableSize;
     return ERROR_SUCCESS;
 }
@@ -2354,7 +3045,7 @@ static int BuildFileTable_Classic(TMPQArchive * ha)
             /* Now merge the hi-block table to the file table */
             if(nError == ERROR_SUCCESS)
             {
-                TFileEntry * pFileEntry = ha->pFileTable;
+                TMPQFileEntry * pFileEntry = ha->pFileTable;
 
                 /* Swap the hi-block table */
                 BSWAP_ARRAY16_UNSIGNED(pHiBlockTable, dwTableSize);
@@ -2377,13 +3068,90 @@ static int BuildFileTable_Classic(TMPQArchive * ha)
     return nError;
 }
 
+/* Fills the name hashes of all file entries from the HET and BET table */
+static void BuildFileNameHashes_HetBet(TMPQArchive * ha, TMPQBetTable * pBetTable)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    TMPQFileEntry * pFileEntry;
+    uint32_t i;
+
+    for(i = 0; i < pHetTable->dwTotalCount; i++)
+    {
+        uint32_t dwFileIndex = 0;
+
+        /* Is the entry in the HET table occupied? */
+        if(pHetTable->pNameHashes[i] != HET_ENTRY_FREE)
+        {
+            /* Load the index to the BET table */
+            GetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * i,
+                                            pHetTable->dwIndexSize,
+                                           &dwFileIndex,
+                                            4);
+            /* Overflow test */
+            if(dwFileIndex < pBetTable->dwEntryCount)
+            {
+                uint64_t NameHash1 = pHetTable->pNameHashes[i];
+                uint64_t NameHash2 = 0;
+
+                /* Load the BET hash */
+                GetBits(pBetTable->pNameHashes, pBetTable->dwBitTotal_NameHash2 * dwFileIndex,
+                                                pBetTable->dwBitCount_NameHash2,
+                                               &NameHash2,
+                                                8);
+
+                /* Combine both part of the name hash and put it to the file table */
+                pFileEntry = ha->pFileTable + dwFileIndex;
+                pFileEntry->FileNameHash = (NameHash1 << pBetTable->dwBitCount_NameHash2) | NameHash2;
+            }
+        }
+    }
+}
+
+/* Decodes one entry of the BET table to the file entry */
+static void DecodeBetEntry(TMPQBetTable * pBetTable, TMPQFileEntry * pFileEntry, uint32_t dwFileIndex)
+{
+    TBitArray * pBitArray = pBetTable->pFileTable;
+    uint32_t dwBitPosition = pBetTable->dwTableEntrySize * dwFileIndex;
+    uint32_t dwFlagIndex = 0;
+
+    /* Read the file position */
+    GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FilePos,
+                       pBetTable->dwBitCount_FilePos,
+                      &pFileEntry->ByteOffset,
+                       8);
+
+    /* Read the file size */
+    GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FileSize,
+                       pBetTable->dwBitCount_FileSize,
+                      &pFileEntry->dwFileSize,
+                       4);
+
+    /* Read the compressed size */
+    GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_CmpSize,
+                       pBetTable->dwBitCount_CmpSize,
+                      &pFileEntry->dwCmpSize,
+                       4);
+
+    /* Read the flag index. Keep the patch bit that */
+    /* might have been loaded from (attributes) already */
+    if(pBetTable->dwFlagCount != 0)
+    {
+        GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FlagIndex,
+                           pBetTable->dwBitCount_FlagIndex,
+                          &dwFlagIndex,
+                           4);
+        pFileEntry->dwFlags |= pBetTable->pFileFlags[dwFlagIndex];
+    }
+
+    /*
+     * TODO: Locale (?)
+     */
+}
+
 static int BuildFileTable_HetBet(TMPQArchive * ha)
 {
     TMPQHetTable * pHetTable = ha->pHetTable;
     TMPQBetTable * pBetTable;
-    TFileEntry * pFileEntry = ha->pFileTable;
-    TBitArray * pBitArray;
-    uint32_t dwBitPosition = 0;
     uint32_t i;
     int nError = ERROR_FILE_CORRUPT;
 
@@ -2394,85 +3162,33 @@ static int BuildFileTable_HetBet(TMPQArchive * ha)
         /* Verify the size of NameHash2 in the BET table. */
         /* It has to be 8 bits less than the information in HET table */
         if((pBetTable->dwBitCount_NameHash2 + 8) != pHetTable->dwNameHashBitSize)
-            return ERROR_FILE_CORRUPT;
-        
-        /* Step one: Fill the name indexes */
-        for(i = 0; i < pHetTable->dwTotalCount; i++)
         {
-            uint32_t dwFileIndex = 0;
-
-            /* Is the entry in the HET table occupied? */
-            if(pHetTable->pNameHashes[i] != HET_ENTRY_FREE)
-            {
-                /* Load the index to the BET table */
-                GetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * i,
-                                                pHetTable->dwIndexSize,
-                                               &dwFileIndex,
-                                                4);
-                /* Overflow test */
-                if(dwFileIndex < pBetTable->dwEntryCount)
-                {
-                    uint64_t NameHash1 = pHetTable->pNameHashes[i];
-                    uint64_t NameHash2 = 0;
-
-                    /* Load the BET hash */
-                    GetBits(pBetTable->pNameHashes, pBetTable->dwBitTotal_NameHash2 * dwFileIndex,
-                                                    pBetTable->dwBitCount_NameHash2,
-                                                   &NameHash2,
-                                                    8);
-
-                    /* Combine both part of the name hash and put it to the file table */
-                    pFileEntry = ha->pFileTable + dwFileIndex;
-                    pFileEntry->FileNameHash = (NameHash1 << pBetTable->dwBitCount_NameHash2) | NameHash2;
-                }
-            }
+            FreeBetTable(pBetTable);
+            return ERROR_FILE_CORRUPT;
         }
 
-        /* Go through the entire BET table and convert it to the file table. */
-        pFileEntry = ha->pFileTable;
-        pBitArray = pBetTable->pFileTable; 
-        for(i = 0; i < pBetTable->dwEntryCount; i++)
+        /* If the BET table shall be decoded on demand, just keep it */
+        if(ha->dwFlags & MPQ_FLAG_LAZY_BET)
         {
-            uint32_t dwFlagIndex = 0;
-
-            /* Read the file position */
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FilePos,
-                               pBetTable->dwBitCount_FilePos,
-                              &pFileEntry->ByteOffset,
-                               8);
-
-            /* Read the file size */
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FileSize,
-                               pBetTable->dwBitCount_FileSize,
-                              &pFileEntry->dwFileSize,
-                               4);
-
-            /* Read the compressed size */
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_CmpSize,
-                               pBetTable->dwBitCount_CmpSize,
-                              &pFileEntry->dwCmpSize,
-                               4);
-
-
-            /* Read the flag index */
-            if(pBetTable->dwFlagCount != 0)
+            ha->pbBetDecoded = STORM_ALLOC(uint8_t, (pBetTable->dwEntryCount + 7) / 8);
+            if(ha->pbBetDecoded == NULL)
             {
-                GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FlagIndex,
-                                   pBetTable->dwBitCount_FlagIndex,
-                                  &dwFlagIndex,
-                                   4);
-                pFileEntry->dwFlags = pBetTable->pFileFlags[dwFlagIndex];
+                FreeBetTable(pBetTable);
+                return ERROR_NOT_ENOUGH_MEMORY;
             }
 
-            /*
-             * TODO: Locale (?)
-             */
-
-            /* Move the current bit position */
-            dwBitPosition += pBetTable->dwTableEntrySize;
-            pFileEntry++;
+            memset(ha->pbBetDecoded, 0, (pBetTable->dwEntryCount + 7) / 8);
+            ha->pBetTable = pBetTable;
+            return ERROR_SUCCESS;
         }
 
+        /* Step one: Fill the name indexes */
+        BuildFileNameHashes_HetBet(ha, pBetTable);
+
+        /* Go through the entire BET table and convert it to the file table. */
+        for(i = 0; i < pBetTable->dwEntryCount; i++)
+            DecodeBetEntry(pBetTable, ha->pFileTable + i, i);
+
         /* Set the current size of the file table */
         FreeBetTable(pBetTable);
         nError = ERROR_SUCCESS;
@@ -2485,6 +3201,44 @@ static int BuildFileTable_HetBet(TMPQArchive * ha)
     return nError;
 }
 
+void DecodeFileEntry(TMPQArchive * ha, uint32_t dwFileIndex)
+{
+    TMPQBetTable * pBetTable = ha->pBetTable;
+    uint8_t BitMask = (uint8_t)(1 << (dwFileIndex & 0x07));
+
+    /* Only if the BET table is decoded on demand and the entry hasn't been decoded yet */
+    if(pBetTable != NULL && dwFileIndex < pBetTable->dwEntryCount)
+    {
+        if((ha->pbBetDecoded[dwFileIndex / 8] & BitMask) == 0)
+        {
+            DecodeBetEntry(pBetTable, ha->pFileTable + dwFileIndex, dwFileIndex);
+            ha->pbBetDecoded[dwFileIndex / 8] |= BitMask;
+        }
+    }
+}
+
+/* Decodes all remaining BET entries and frees the BET table. */
+/* Used by operations that need to walk the entire file table */
+void DecodeAllFileEntries(TMPQArchive * ha)
+{
+    uint32_t i;
+
+    if(ha->pBetTable != NULL)
+    {
+        /* Decode all entries and fill all name hashes */
+        for(i = 0; i < ha->pBetTable->dwEntryCount; i++)
+            DecodeFileEntry(ha, i);
+        BuildFileNameHashes_HetBet(ha, ha->pBetTable);
+
+        /* From now on, the archive behaves like if it was decoded at once */
+        FreeBetTable(ha->pBetTable);
+        STORM_FREE(ha->pbBetDecoded);
+        ha->pBetTable = NULL;
+        ha->pbBetDecoded = NULL;
+        ha->dwFlags &= ~MPQ_FLAG_LAZY_BET;
+    }
+}
+
 int BuildFileTable(TMPQArchive * ha)
 {
     uint32_t dwFileTableSize;
@@ -2499,12 +3253,12 @@ int BuildFileTable(TMPQArchive * ha)
     dwFileTableSize = STORMLIB_MAX(ha->pHeader->dwBlockTableSize, ha->dwMaxFileCount);
 
     /* Allocate the file table with size determined before */
-    ha->pFileTable = STORM_ALLOC(TFileEntry, dwFileTableSize);
+    ha->pFileTable = STORM_ALLOC(TMPQFileEntry, dwFileTableSize);
     if(ha->pFileTable == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
     /* Fill the table with zeros */
-    memset(ha->pFileTable, 0, dwFileTableSize * sizeof(TFileEntry));
+    memset(ha->pFileTable, 0, dwFileTableSize * sizeof(TMPQFileEntry));
     ha->dwFileTableSize = dwFileTableSize;
 
     /* If we have HET table, we load file table from the BET table */
@@ -2522,9 +3276,17 @@ int BuildFileTable(TMPQArchive * ha)
     if(ha->pHashTable != NULL)
     {
         if(BuildFileTable_Classic(ha) != ERROR_SUCCESS)
+        {
             ha->dwFlags |= MPQ_FLAG_READ_ONLY;
+        }
         else
+        {
+            /* The block table has filled all file entries. If the BET table is kept, */
+            /* it is only used for verifying name hashes in the HET table */
+            if(ha->pbBetDecoded != NULL)
+                memset(ha->pbBetDecoded, 0xFF, (ha->pBetTable->dwEntryCount + 7) / 8);
             bFileTableCreated = 1;
+        }
     }
 
     // Return result
@@ -2534,8 +3296,8 @@ int BuildFileTable(TMPQArchive * ha)
 /*
 void UpdateBlockTableSize(TMPQArchive * ha)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     uint32_t dwBlockTableSize = 0;
 
     // Calculate the number of files
@@ -2554,14 +3316,19 @@ void UpdateBlockTableSize(TMPQArchive * ha)
 /* Defragment the file table so it does not contain any gaps */
 int DefragmentFileTable(TMPQArchive * ha)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pSource = ha->pFileTable;
-    TFileEntry * pTarget = ha->pFileTable;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pSource = ha->pFileTable;
+    TMPQFileEntry * pTarget = ha->pFileTable;
     uint32_t * DefragmentTable;
     uint32_t dwBlockTableSize = 0;
     uint32_t dwSrcIndex;
     uint32_t dwTrgIndex;
 
+    /* The attributes are moved together with the file entries */
+    SAttrLoadLazy(ha);
+    FreeNameIndex(ha);
+    FreeDataIndex(ha);
+
     /* Allocate brand new file table */
     DefragmentTable = STORM_ALLOC(uint32_t, ha->dwFileTableSize);
     if(DefragmentTable != NULL)
@@ -2582,7 +3349,10 @@ int DefragmentFileTable(TMPQArchive * ha)
 
                 /* Move the entry, if needed */
                 if(pTarget != pSource)
+                {
                     pTarget[0] = pSource[0];
+                    MoveFileAttributes(ha, dwTrgIndex, dwSrcIndex);
+                }
                 pTarget++;
 
                 /* Update the block table size */
@@ -2593,8 +3363,10 @@ int DefragmentFileTable(TMPQArchive * ha)
         /* Did we defragment something? */
         if(pTarget < pFileTableEnd)
         {
-            /* Clear the remaining file entries */
-            memset(pTarget, 0, (pFileTableEnd - pTarget) * sizeof(TFileEntry));
+            /* Clear the remaining file entries. All free entries are now at the end */
+            memset(pTarget, 0, (pFileTableEnd - pTarget) * sizeof(TMPQFileEntry));
+            ha->dwFreeFileIndex = (uint32_t)(pTarget - ha->pFileTable);
+            ClearFileAttributes(ha, (uint32_t)(pTarget - ha->pFileTable), (uint32_t)(pFileTableEnd - pTarget));
             
             /* Go through the hash table and relocate the block indexes */
             if(ha->pHashTable != NULL)
@@ -2628,8 +3400,8 @@ int DefragmentFileTable(TMPQArchive * ha)
 int RebuildHetTable(TMPQArchive * ha)
 {
     TMPQHetTable * pOldHetTable = ha->pHetTable;
-    TFileEntry * pFileTableEnd;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd;
+    TMPQFileEntry * pFileEntry;
     uint32_t dwBlockTableSize = ha->dwFileTableSize;
     int nError = ERROR_SUCCESS;
 
@@ -2665,11 +3437,117 @@ int RebuildHetTable(TMPQArchive * ha)
     return nError;
 }
 
+/* Looks for the HET table entry of the given file table entry. */
+/* Returns the HET index of the entry, or HASH_ENTRY_FREE if not found. */
+/* If PtrFreeIndex is not NULL, it receives the index of the free entry */
+/* that ended the search (HASH_ENTRY_FREE if the table is full) */
+static uint32_t FindHetTableEntry(TMPQHetTable * pHetTable, uint64_t FileNameHash, uint32_t dwFileIndex, uint32_t * PtrFreeIndex)
+{
+    uint32_t dwHetIndex;
+    uint32_t StartIndex;
+    uint32_t Index;
+    uint8_t NameHash1;
+
+    /* Get the start index and the high 8 bits of the name hash */
+    StartIndex = Index = (uint32_t)(FileNameHash % pHetTable->dwTotalCount);
+    NameHash1 = (uint8_t)(FileNameHash >> (pHetTable->dwNameHashBitSize - 8));
+
+    /* Go through HET table until we find a terminator */
+    while(pHetTable->pNameHashes[Index] != HET_ENTRY_FREE)
+    {
+        if(pHetTable->pNameHashes[Index] == NameHash1)
+        {
+            dwHetIndex = 0;
+            GetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * Index,
+                                            pHetTable->dwIndexSize,
+                                           &dwHetIndex,
+                                            4);
+            if(dwHetIndex == dwFileIndex)
+                return Index;
+        }
+
+        /* Move to the next entry in the HET table */
+        /* If we came to the start index again, the table is full */
+        Index = (Index + 1) % pHetTable->dwTotalCount;
+        if(Index == StartIndex)
+        {
+            Index = HASH_ENTRY_FREE;
+            break;
+        }
+    }
+
+    /* Give the free entry to the caller */
+    if(PtrFreeIndex != NULL)
+        PtrFreeIndex[0] = Index;
+    return HASH_ENTRY_FREE;
+}
+
+/* Inserts a newly added or renamed file to the existing HET table. */
+/* The HET table is only rebuilt from scratch if the file index doesn't fit */
+/* into it, or if more than 3/4 of the table is used (including deleted entries) */
+int InsertHetTableEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    uint32_t dwFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
+    uint32_t dwFreeIndex = HASH_ENTRY_FREE;
+    uint8_t NameHash1;
+
+    /* The HET table was created for a given number of files. */
+    /* The file index must be lower than that, otherwise it may not fit */
+    if(pHetTable != NULL && dwFileIndex < pHetTable->dwEntryCount && pHetTable->dwTotalCount != 0)
+    {
+        /* A replaced file is already in the HET table */
+        if(FindHetTableEntry(pHetTable, pFileEntry->FileNameHash, dwFileIndex, &dwFreeIndex) != HASH_ENTRY_FREE)
+            return ERROR_SUCCESS;
+
+        /* Use the free entry, unless the table is getting too full */
+        if(dwFreeIndex != HASH_ENTRY_FREE && ((uint64_t)pHetTable->dwUsedCount + 1) * 4 <= (uint64_t)pHetTable->dwTotalCount * 3)
+        {
+            NameHash1 = (uint8_t)(pFileEntry->FileNameHash >> (pHetTable->dwNameHashBitSize - 8));
+            pHetTable->pNameHashes[dwFreeIndex] = NameHash1;
+            pHetTable->dwUsedCount++;
+
+            SetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * dwFreeIndex,
+                                            pHetTable->dwIndexSize,
+                                           &dwFileIndex,
+                                            4);
+            return ERROR_SUCCESS;
+        }
+    }
+
+    /* Create new HET table. This also removes the deleted entries */
+    return RebuildHetTable(ha);
+}
+
+/* Marks the HET table entry of a deleted or renamed file as deleted. */
+/* Must be called while the file entry still has the old name hash */
+void DeleteHetTableEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    uint32_t dwInvalidIndex = 0xFFFFFFFF;
+    uint32_t Index;
+
+    if(pHetTable != NULL && pHetTable->dwTotalCount != 0)
+    {
+        Index = FindHetTableEntry(pHetTable, pFileEntry->FileNameHash, (uint32_t)(pFileEntry - ha->pFileTable), NULL);
+        if(Index != HASH_ENTRY_FREE)
+        {
+            /* The entry stays used, because it can be part of a collision chain. */
+            /* The file index is set to an invalid value, so it never matches */
+            pHetTable->pNameHashes[Index] = HET_ENTRY_DELETED;
+            SetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * Index,
+                                            pHetTable->dwIndexSize,
+                                           &dwInvalidIndex,
+                                            4);
+        }
+    }
+}
+
 /* Rebuilds the file table, removing all deleted file entries. */
 /* Used when compacting the archive */
 int RebuildFileTable(TMPQArchive * ha, uint32_t dwNewHashTableSize)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQHash * pHashTableEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
     TMPQHash * pOldHashTable = ha->pHashTable;
     TMPQHash * pHashTable = NULL;
@@ -2680,16 +3558,24 @@ int RebuildFileTable(TMPQArchive * ha, uint32_t dwNewHashTableSize)
     assert(dwNewHashTableSize >= ha->pHeader->dwHashTableSize);
     assert(dwNewHashTableSize >= ha->dwMaxFileCount);
     assert((dwNewHashTableSize & (dwNewHashTableSize - 1)) == 0);
+
+    /* The attribute arrays are resized together with the file table */
+    SAttrLoadLazy(ha);
+
     assert(ha->pHashTable != NULL);
 
     /* Reallocate the new file table, if needed */
     if(dwNewHashTableSize > ha->dwFileTableSize)
     {
-        ha->pFileTable = STORM_REALLOC(TFileEntry, ha->pFileTable, dwNewHashTableSize);
+        ha->pFileTable = STORM_REALLOC(TMPQFileEntry, ha->pFileTable, dwNewHashTableSize);
         if(ha->pFileTable == NULL)
             return ERROR_NOT_ENOUGH_MEMORY;
 
-        memset(ha->pFileTable + ha->dwFileTableSize, 0, (dwNewHashTableSize - ha->dwFileTableSize) * sizeof(TFileEntry));
+        memset(ha->pFileTable + ha->dwFileTableSize, 0, (dwNewHashTableSize - ha->dwFileTableSize) * sizeof(TMPQFileEntry));
+
+        /* The attribute arrays must grow together with the file table */
+        if(ResizeFileAttributes(ha, dwNewHashTableSize) != ERROR_SUCCESS)
+            return ERROR_NOT_ENOUGH_MEMORY;
     }
 
     /* Allocate new hash table */
@@ -2716,7 +3602,7 @@ int RebuildFileTable(TMPQArchive * ha, uint32_t dwNewHashTableSize)
             if(IsValidHashEntry2(ha, pHash))
             {
                 pFileEntry = ha->pFileTable + pHash->dwBlockIndex;
-                AllocateHashEntry(ha, pFileEntry, pHash->lcLocale);
+                AllocateHashEntry(ha, pFileEntry, NULL, pHash->lcLocale);
             }
         }
 
@@ -0,0 +1,680 @@
+/*****************************************************************************/
+/* SBaseIndexFile.c                                 Copyright (c) Ayron 2026 */
+/*---------------------------------------------------------------------------*/
+/* Index file stored next to the MPQ. Holds the decoded file table, file     */
+/* names and attributes, so the archive can be open without decoding the     */
+/* MPQ tables, (listfile) and (attributes) again.                            */
+/*---------------------------------------------------------------------------*/
+/*   Date    Ver   Who  Comment                                              */
+/* --------  ----  ---  -------                                              */
+/* 18.10.26  1.00  Ayr  Created                                              */
+/*****************************************************************************/
+
+#include "thunderStorm.h"
+#include "StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MPQ_INDEX_SIGNATURE     0x58444954      /* 'TIDX' */
+#define MPQ_INDEX_VERSION       2
+#define MPQ_INDEX_EXTENSION     ".idx"
+#define MPQ_INDEX_TEMP_SUFFIX   ".tmp"
+#define MPQ_INDEX_NO_NAME       0xFFFFFFFF      /* dwNameOffset of a file entry without name */
+
+/* Open flags that change the content of the loaded tables */
+#define MPQ_INDEX_OPEN_FLAGS    (MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES | MPQ_OPEN_FORCE_MPQ_V1 | MPQ_OPEN_UNIX)
+
+/* Archive flags that can be set while loading the tables */
+#define MPQ_INDEX_LOAD_FLAGS    (MPQ_FLAG_READ_ONLY | MPQ_FLAG_MALFORMED | MPQ_FLAG_HASH_TABLE_CUT | MPQ_FLAG_BLOCK_TABLE_CUT)
+
+/* File attributes that can be stored in the index */
+#define MPQ_INDEX_ATTR_ARRAYS   (MPQ_ATTRIBUTE_FILETIME | MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5)
+
+/* All sections of the index file are aligned to 8 bytes, */
+/* so the 64-bit items are aligned when the index data are loaded */
+#define ALIGN_INDEX_SECTION(x)  (((x) + 7) & ~(uint64_t)7)
+
+/*
+ * Layout of the index file:
+ *
+ *   TMPQIndexHeader
+ *   TMPQIndexEntry [dwFileTableSize]
+ *   TMPQHash       [dwHashTableSize]            (decrypted hash table)
+ *   uint64_t       [dwFileTableSize]            (if MPQ_ATTRIBUTE_FILETIME)
+ *   uint32_t       [dwFileTableSize]            (if MPQ_ATTRIBUTE_CRC32)
+ *   MD5            [dwFileTableSize]            (if MPQ_ATTRIBUTE_MD5)
+ *   uint8_t        [dwHetTotalCount]            (HET name hashes)
+ *   TBitArray data [HET index table size]       (HET file indexes)
+ *   char           [cbNames]                    (zero-terminated file names)
+ *
+ * The index file is in native byte order. An index file created
+ * on the other byte order has wrong signature and is simply rebuilt.
+ * The index file belongs to the archive with the same TMPQArchiveId,
+ * and IndexMd5 protects the index file itself against damage.
+ * Nothing loaded from the index file is trusted until it has been checked.
+ */
+
+typedef struct _TMPQIndexHeader
+{
+    uint32_t dwSignature;                       /* MPQ_INDEX_SIGNATURE */
+    uint32_t dwVersion;                         /* MPQ_INDEX_VERSION */
+    uint32_t dwHeaderSize;                      /* sizeof(TMPQIndexHeader) */
+    uint32_t dwEntrySize;                       /* sizeof(TMPQIndexEntry) */
+    uint64_t IndexSize;                         /* Size of the entire index file, in bytes */
+    unsigned char IndexMd5[MD5_DIGEST_SIZE];    /* MD5 of the entire index file, calculated with this member zeroed */
+
+    /* Validation of the archive */
+    TMPQArchiveId ArchiveId;                    /* Identity of the archive */
+    uint32_t dwOpenFlags;                       /* MPQ_OPEN_XXX flags that affect the content */
+    uint32_t dwLoadFlags;                       /* MPQ_FLAG_XXX flags set when the tables were loaded */
+
+    /* State of the archive after loading the tables */
+    uint32_t dwMaxFileCount;
+    uint32_t dwFileTableSize;
+    uint32_t dwFileFlags1;
+    uint32_t dwFileFlags2;
+    uint32_t dwFileFlags3;
+    uint32_t dwAttrFlags;
+    uint32_t dwAttrArrays;                      /* MPQ_ATTRIBUTE_XXX of the arrays present in the index */
+    uint32_t dwHashTableSize;                   /* Number of entries in the hash table (0 if none) */
+    uint32_t dwHetEntryCount;                   /* HET table parameters (dwHetTotalCount is 0 if none) */
+    uint32_t dwHetTotalCount;
+    uint32_t dwHetNameHashBitSize;
+    uint32_t dwHetIndexSizeTotal;
+    uint32_t dwHetIndexSizeExtra;
+    uint32_t dwHetIndexSize;
+    uint32_t cbNames;                           /* Size of the file name section, in bytes */
+    uint32_t dwReserved;
+
+    uint32_t LoadedHeader[MPQ_HEADER_WORDS];    /* MPQ header after the tables were loaded */
+} TMPQIndexHeader;
+
+typedef struct _TMPQIndexEntry
+{
+    uint64_t FileNameHash;
+    uint64_t ByteOffset;
+    uint32_t dwNameOffset;                      /* Offset of the name in the name section, or MPQ_INDEX_NO_NAME */
+    uint32_t dwFileSize;
+    uint32_t dwCmpSize;
+    uint32_t dwFlags;
+} TMPQIndexEntry;
+
+/* Offsets of the sections, relative to the end of the index header */
+typedef struct _TMPQIndexLayout
+{
+    uint64_t EntriesOffs;
+    uint64_t HashTableOffs;
+    uint64_t FileTimeOffs;
+    uint64_t Crc32Offs;
+    uint64_t Md5Offs;
+    uint64_t HetOffs;
+    uint64_t HetIndexBytes;
+    uint64_t NamesOffs;
+    uint64_t DataSize;
+} TMPQIndexLayout;
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static char * CreateIndexFileName(TMPQArchive * ha, const char * szSuffix)
+{
+    const char * szMpqName = FileStream_GetFileName(ha->pStream);
+    size_t nLength = strlen(szMpqName);
+    char * szIndexName;
+
+    szIndexName = STORM_ALLOC(char, nLength + strlen(MPQ_INDEX_EXTENSION) + strlen(szSuffix) + 1);
+    if(szIndexName != NULL)
+    {
+        memcpy(szIndexName, szMpqName, nLength);
+        strcpy(szIndexName + nLength, MPQ_INDEX_EXTENSION);
+        strcat(szIndexName, szSuffix);
+    }
+
+    return szIndexName;
+}
+
+static void GetIndexLayout(TMPQIndexHeader * pIndexHeader, TMPQIndexLayout * pLayout)
+{
+    uint64_t FileCount = pIndexHeader->dwFileTableSize;
+    uint64_t DataSize = 0;
+
+    pLayout->EntriesOffs = DataSize;
+    DataSize = ALIGN_INDEX_SECTION(DataSize + FileCount * sizeof(TMPQIndexEntry));
+
+    pLayout->HashTableOffs = DataSize;
+    DataSize = ALIGN_INDEX_SECTION(DataSize + (uint64_t)pIndexHeader->dwHashTableSize * sizeof(TMPQHash));
+
+    pLayout->FileTimeOffs = DataSize;
+    if(pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_FILETIME)
+        DataSize = ALIGN_INDEX_SECTION(DataSize + FileCount * sizeof(uint64_t));
+
+    pLayout->Crc32Offs = DataSize;
+    if(pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_CRC32)
+        DataSize = ALIGN_INDEX_SECTION(DataSize + FileCount * sizeof(uint32_t));
+
+    pLayout->Md5Offs = DataSize;
+    if(pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_MD5)
+        DataSize = ALIGN_INDEX_SECTION(DataSize + FileCount * MD5_DIGEST_SIZE);
+
+    pLayout->HetOffs = DataSize;
+    pLayout->HetIndexBytes = ((uint64_t)pIndexHeader->dwHetTotalCount * pIndexHeader->dwHetIndexSizeTotal + 7) / 8;
+    DataSize = ALIGN_INDEX_SECTION(DataSize + pIndexHeader->dwHetTotalCount + pLayout->HetIndexBytes);
+
+    pLayout->NamesOffs = DataSize;
+    DataSize = ALIGN_INDEX_SECTION(DataSize + pIndexHeader->cbNames);
+
+    pLayout->DataSize = DataSize;
+}
+
+/* Calculates MD5 of the index file. The header is hashed with IndexMd5 zeroed */
+static void CalculateIndexMd5(TMPQIndexHeader * pIndexHeader, unsigned char * pbIndexData, size_t cbIndexData, unsigned char * md5)
+{
+    TMPQIndexHeader IndexHeader;
+    hash_state md5_state;
+
+    memcpy(&IndexHeader, pIndexHeader, sizeof(TMPQIndexHeader));
+    memset(IndexHeader.IndexMd5, 0, MD5_DIGEST_SIZE);
+
+    md5_init(&md5_state);
+    md5_process(&md5_state, (unsigned char *)&IndexHeader, sizeof(TMPQIndexHeader));
+    md5_process(&md5_state, pbIndexData, (unsigned long)cbIndexData);
+    md5_done(&md5_state, md5);
+}
+
+/* Checks whether the index file belongs to the archive in its current state, */
+/* and whether all values in the index header are valid */
+static int VerifyIndexHeader(TMPQArchive * ha, TMPQArchiveId * pArchiveId, TMPQIndexHeader * pIndexHeader, uint64_t IndexSize, uint32_t dwFlags)
+{
+    TMPQHeader * pLoadedHeader = (TMPQHeader *)pIndexHeader->LoadedHeader;
+    TMPQIndexLayout Layout;
+
+    /* Verify the index file itself */
+    if(pIndexHeader->dwSignature != MPQ_INDEX_SIGNATURE || pIndexHeader->dwVersion != MPQ_INDEX_VERSION)
+        return ERROR_BAD_FORMAT;
+    if(pIndexHeader->dwHeaderSize != sizeof(TMPQIndexHeader) || pIndexHeader->dwEntrySize != sizeof(TMPQIndexEntry))
+        return ERROR_BAD_FORMAT;
+    if(pIndexHeader->IndexSize != IndexSize)
+        return ERROR_FILE_CORRUPT;
+
+    /* Verify that the index belongs to the archive */
+    if(!IsSameArchiveId(&pIndexHeader->ArchiveId, pArchiveId) || pIndexHeader->dwOpenFlags != (dwFlags & MPQ_INDEX_OPEN_FLAGS))
+        return ERROR_FILE_CORRUPT;
+
+    /* The loaded MPQ header must describe the same archive */
+    if(pLoadedHeader->dwID != ha->pHeader->dwID || pLoadedHeader->dwHeaderSize != ha->pHeader->dwHeaderSize)
+        return ERROR_FILE_CORRUPT;
+    if(pLoadedHeader->wFormatVersion != ha->pHeader->wFormatVersion || pLoadedHeader->wSectorSize != ha->pHeader->wSectorSize)
+        return ERROR_FILE_CORRUPT;
+
+    /* Verify the flags */
+    if(pIndexHeader->dwLoadFlags & ~MPQ_INDEX_LOAD_FLAGS)
+        return ERROR_FILE_CORRUPT;
+    if((pIndexHeader->dwAttrFlags & ~MPQ_ATTRIBUTE_ALL) || (pIndexHeader->dwAttrArrays & ~MPQ_INDEX_ATTR_ARRAYS))
+        return ERROR_FILE_CORRUPT;
+    if((pIndexHeader->dwFileFlags1 | pIndexHeader->dwFileFlags2 | pIndexHeader->dwFileFlags3) & ~MPQ_FILE_VALID_FLAGS)
+        return ERROR_FILE_CORRUPT;
+
+    /* Verify the sizes of the tables. The hash table is indexed */
+    /* by the size in the MPQ header, so they must be the same */
+    if(pIndexHeader->dwFileTableSize == 0 || pIndexHeader->dwFileTableSize > pIndexHeader->dwMaxFileCount)
+        return ERROR_FILE_CORRUPT;
+    if(pIndexHeader->dwHashTableSize == 0 && pIndexHeader->dwHetTotalCount == 0)
+        return ERROR_FILE_CORRUPT;
+    if(pIndexHeader->dwHashTableSize != 0 && pIndexHeader->dwHashTableSize != pLoadedHeader->dwHashTableSize)
+        return ERROR_FILE_CORRUPT;
+
+    /* Verify the HET table parameters. The name hash must hold */
+    /* at least the 8 bits in the HET table, and a file index */
+    /* is read as 32-bit value */
+    if(pIndexHeader->dwHetTotalCount != 0)
+    {
+        if(pIndexHeader->dwHetNameHashBitSize < 8 || pIndexHeader->dwHetNameHashBitSize > 0x40)
+            return ERROR_FILE_CORRUPT;
+        if(pIndexHeader->dwHetEntryCount > pIndexHeader->dwHetTotalCount)
+            return ERROR_FILE_CORRUPT;
+        if(pIndexHeader->dwHetIndexSizeTotal > 32 || pIndexHeader->dwHetIndexSize > pIndexHeader->dwHetIndexSizeTotal)
+            return ERROR_FILE_CORRUPT;
+        if(pIndexHeader->dwHetIndexSizeExtra > pIndexHeader->dwHetIndexSizeTotal)
+            return ERROR_FILE_CORRUPT;
+    }
+
+    /* Verify the size of the index data */
+    GetIndexLayout(pIndexHeader, &Layout);
+    if((sizeof(TMPQIndexHeader) + Layout.DataSize) != IndexSize)
+        return ERROR_FILE_CORRUPT;
+    return ERROR_SUCCESS;
+}
+
+/* Creates the tables from the index data. The archive handle */
+/* is only changed if all tables have been created successfully */
+static int ApplyIndexData(TMPQArchive * ha, TMPQIndexHeader * pIndexHeader, unsigned char * pbIndexData)
+{
+    TMPQIndexLayout Layout;
+    TMPQIndexEntry * pIndexEntry;
+    TMPQNameBlock * pNameBlock = NULL;
+    TMPQHetTable * pHetTable = NULL;
+    TMPQFileEntry * pFileTable = NULL;
+    TMPQHash * pHashTable = NULL;
+    uint32_t * pFileCrc32 = NULL;
+    uint64_t * pFileTime = NULL;
+    unsigned char * pFileMd5 = NULL;
+    uint32_t dwFileTableSize = pIndexHeader->dwFileTableSize;
+    uint32_t cbNames = pIndexHeader->cbNames;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    GetIndexLayout(pIndexHeader, &Layout);
+
+    /* Copy the file names. The name section must end with zero terminator */
+    if(cbNames != 0)
+    {
+        if(pbIndexData[Layout.NamesOffs + cbNames - 1] != 0)
+            return ERROR_FILE_CORRUPT;
+
+        pNameBlock = (TMPQNameBlock *)STORM_ALLOC(uint8_t, sizeof(TMPQNameBlock) + cbNames);
+        if(pNameBlock == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+
+        memcpy(pNameBlock->szNames, pbIndexData + Layout.NamesOffs, cbNames);
+        pNameBlock->pNext = NULL;
+        pNameBlock->cbBlockSize = cbNames;
+        pNameBlock->cbUsed = cbNames;
+    }
+
+    /* Create the file table */
+    pFileTable = STORM_ALLOC(TMPQFileEntry, dwFileTableSize);
+    if(pFileTable != NULL)
+    {
+        pIndexEntry = (TMPQIndexEntry *)(pbIndexData + Layout.EntriesOffs);
+        for(i = 0; i < dwFileTableSize; i++, pIndexEntry++)
+        {
+            pFileTable[i].FileNameHash = pIndexEntry->FileNameHash;
+            pFileTable[i].ByteOffset   = pIndexEntry->ByteOffset;
+            pFileTable[i].szFileName   = NULL;
+            pFileTable[i].dwFileSize   = pIndexEntry->dwFileSize;
+            pFileTable[i].dwCmpSize    = pIndexEntry->dwCmpSize;
+            pFileTable[i].dwFlags      = pIndexEntry->dwFlags;
+
+            /* The name must begin in the name section, right after another name */
+            if(pIndexEntry->dwNameOffset != MPQ_INDEX_NO_NAME)
+            {
+                if(pIndexEntry->dwNameOffset >= cbNames || (pIndexEntry->dwNameOffset != 0 && pNameBlock->szNames[pIndexEntry->dwNameOffset - 1] != 0))
+                {
+                    nError = ERROR_FILE_CORRUPT;
+                    break;
+                }
+
+                pFileTable[i].szFileName = pNameBlock->szNames + pIndexEntry->dwNameOffset;
+            }
+        }
+    }
+    else
+    {
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* Copy the hash table */
+    if(nError == ERROR_SUCCESS && pIndexHeader->dwHashTableSize != 0)
+    {
+        pHashTable = STORM_ALLOC(TMPQHash, pIndexHeader->dwHashTableSize);
+        if(pHashTable != NULL)
+            memcpy(pHashTable, pbIndexData + Layout.HashTableOffs, pIndexHeader->dwHashTableSize * sizeof(TMPQHash));
+        else
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* Create the HET table */
+    if(nError == ERROR_SUCCESS && pIndexHeader->dwHetTotalCount != 0)
+    {
+        pHetTable = CreateHetTable(pIndexHeader->dwHetEntryCount,
+                                   pIndexHeader->dwHetTotalCount,
+                                   pIndexHeader->dwHetNameHashBitSize,
+                                   pbIndexData + Layout.HetOffs);
+        if(pHetTable != NULL)
+        {
+            if(pHetTable->dwIndexSizeTotal == pIndexHeader->dwHetIndexSizeTotal)
+            {
+                pHetTable->dwIndexSizeExtra = pIndexHeader->dwHetIndexSizeExtra;
+                pHetTable->dwIndexSize      = pIndexHeader->dwHetIndexSize;
+            }
+            else
+            {
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+        else
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    /* Copy the file attributes */
+    if(nError == ERROR_SUCCESS && (pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_FILETIME))
+    {
+        if((pFileTime = STORM_ALLOC(uint64_t, dwFileTableSize)) != NULL)
+            memcpy(pFileTime, pbIndexData + Layout.FileTimeOffs, dwFileTableSize * sizeof(uint64_t));
+        else
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS && (pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_CRC32))
+    {
+        if((pFileCrc32 = STORM_ALLOC(uint32_t, dwFileTableSize)) != NULL)
+            memcpy(pFileCrc32, pbIndexData + Layout.Crc32Offs, dwFileTableSize * sizeof(uint32_t));
+        else
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS && (pIndexHeader->dwAttrArrays & MPQ_ATTRIBUTE_MD5))
+    {
+        if((pFileMd5 = STORM_ALLOC(uint8_t, dwFileTableSize * MD5_DIGEST_SIZE)) != NULL)
+            memcpy(pFileMd5, pbIndexData + Layout.Md5Offs, dwFileTableSize * MD5_DIGEST_SIZE);
+        else
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* If everything succeeded, give the tables to the archive */
+    if(nError == ERROR_SUCCESS)
+    {
+        memcpy(ha->HeaderData, pIndexHeader->LoadedHeader, sizeof(ha->HeaderData));
+        ha->pHashTable = pHashTable;
+        ha->pHetTable = pHetTable;
+        ha->pFileTable = pFileTable;
+        ha->pFileCrc32 = pFileCrc32;
+        ha->pFileTime = pFileTime;
+        ha->pFileMd5 = pFileMd5;
+        ha->pNameBlocks = pNameBlock;
+        ha->dwMaxFileCount = pIndexHeader->dwMaxFileCount;
+        ha->dwFileTableSize = dwFileTableSize;
+        ha->dwFileFlags1 = pIndexHeader->dwFileFlags1;
+        ha->dwFileFlags2 = pIndexHeader->dwFileFlags2;
+        ha->dwFileFlags3 = pIndexHeader->dwFileFlags3;
+        ha->dwAttrFlags = pIndexHeader->dwAttrFlags;
+        ha->dwFlags |= pIndexHeader->dwLoadFlags;
+        return ERROR_SUCCESS;
+    }
+
+    /* Free everything that has been allocated */
+    if(pFileMd5 != NULL)
+        STORM_FREE(pFileMd5);
+    if(pFileTime != NULL)
+        STORM_FREE(pFileTime);
+    if(pFileCrc32 != NULL)
+        STORM_FREE(pFileCrc32);
+    if(pHetTable != NULL)
+        FreeHetTable(pHetTable);
+    if(pHashTable != NULL)
+        STORM_FREE(pHashTable);
+    if(pFileTable != NULL)
+        STORM_FREE(pFileTable);
+    if(pNameBlock != NULL)
+        STORM_FREE(pNameBlock);
+    return nError;
+}
+
+/*-----------------------------------------------------------------------------
+ * Public functions (StormLib internals)
+ */
+
+/* Loads the tables from the index file. Must be called after */
+/* the MPQ header has been loaded, and before any table is loaded. */
+/* If the function fails, the archive handle is not changed */
+int LoadArchiveIndex(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags)
+{
+    TMPQIndexHeader IndexHeader;
+    TFileStream * pStream;
+    unsigned char md5[MD5_DIGEST_SIZE];
+    unsigned char * pbIndexData = NULL;
+    uint64_t ByteOffset = 0;
+    uint64_t IndexSize = 0;
+    char * szIndexName;
+    int nError = ERROR_SUCCESS;
+
+    /* Sanity checks */
+    assert(ha->pHashTable == NULL && ha->pHetTable == NULL);
+    assert(ha->pFileTable == NULL);
+
+    /* Open the index file */
+    if((szIndexName = CreateIndexFileName(ha, "")) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pStream = FileStream_OpenFile(szIndexName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+    STORM_FREE(szIndexName);
+    if(pStream == NULL)
+        return ERROR_FILE_NOT_FOUND;
+
+    /* Load and verify the index header */
+    FileStream_GetSize(pStream, &IndexSize);
+    if(IndexSize < sizeof(TMPQIndexHeader) || !FileStream_Read(pStream, &ByteOffset, &IndexHeader, sizeof(TMPQIndexHeader)))
+        nError = ERROR_BAD_FORMAT;
+    if(nError == ERROR_SUCCESS)
+        nError = VerifyIndexHeader(ha, pArchiveId, &IndexHeader, IndexSize, dwFlags);
+
+    /* Load the rest of the index file */
+    if(nError == ERROR_SUCCESS)
+    {
+        pbIndexData = STORM_ALLOC(uint8_t, (size_t)(IndexSize - sizeof(TMPQIndexHeader)));
+        if(pbIndexData != NULL)
+        {
+            ByteOffset = sizeof(TMPQIndexHeader);
+            if(!FileStream_Read(pStream, &ByteOffset, pbIndexData, (uint32_t)(IndexSize - sizeof(TMPQIndexHeader))))
+                nError = ERROR_FILE_CORRUPT;
+        }
+        else
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    /* Only use the index file if it is intact */
+    if(nError == ERROR_SUCCESS)
+    {
+        CalculateIndexMd5(&IndexHeader, pbIndexData, (size_t)(IndexSize - sizeof(TMPQIndexHeader)), md5);
+        if(memcmp(md5, IndexHeader.IndexMd5, MD5_DIGEST_SIZE))
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    /* Create the tables */
+    if(nError == ERROR_SUCCESS)
+        nError = ApplyIndexData(ha, &IndexHeader, pbIndexData);
+
+    /* Cleanup and exit */
+    if(pbIndexData != NULL)
+        STORM_FREE(pbIndexData);
+    FileStream_Close(pStream);
+    return nError;
+}
+
+/* Saves the loaded tables to the index file. */
+/* pArchiveId is the identity of the archive before the tables have been loaded, */
+/* dwLoadFlags are the MPQ_FLAG_XXX that were set while loading the tables. */
+int SaveArchiveIndex(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags, uint32_t dwLoadFlags)
+{
+    TMPQIndexHeader IndexHeader;
+    TMPQIndexHeader * pIndexHeader;
+    TMPQIndexLayout Layout;
+    TMPQIndexEntry * pIndexEntry;
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    TMPQFileEntry * pFileEntry;
+    TFileStream * pStream;
+    unsigned char * pbIndexFile;
+    unsigned char * pbIndexData;
+    uint64_t IndexSize;
+    uint64_t cbNames = 0;
+    char * szIndexName = NULL;
+    char * szTempName = NULL;
+    char * szName;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Lazy BET tables are not fully decoded in the file table */
+    if(ha->pBetTable != NULL)
+        return ERROR_NOT_SUPPORTED;
+
+    /* Calculate the size of the name section */
+    for(i = 0; i < ha->dwFileTableSize; i++)
+    {
+        if(ha->pFileTable[i].szFileName != NULL)
+            cbNames += strlen(ha->pFileTable[i].szFileName) + 1;
+    }
+    if(cbNames >= MPQ_INDEX_NO_NAME)
+        return ERROR_NOT_SUPPORTED;
+
+    /* Fill the index header */
+    pIndexHeader = &IndexHeader;
+    memset(pIndexHeader, 0, sizeof(TMPQIndexHeader));
+    pIndexHeader->dwSignature = MPQ_INDEX_SIGNATURE;
+    pIndexHeader->dwVersion = MPQ_INDEX_VERSION;
+    pIndexHeader->dwHeaderSize = sizeof(TMPQIndexHeader);
+    pIndexHeader->dwEntrySize = sizeof(TMPQIndexEntry);
+    pIndexHeader->ArchiveId = *pArchiveId;
+    pIndexHeader->dwOpenFlags = (dwFlags & MPQ_INDEX_OPEN_FLAGS);
+    pIndexHeader->dwLoadFlags = (dwLoadFlags & MPQ_INDEX_LOAD_FLAGS);
+    pIndexHeader->dwMaxFileCount = ha->dwMaxFileCount;
+    pIndexHeader->dwFileTableSize = ha->dwFileTableSize;
+    pIndexHeader->dwFileFlags1 = ha->dwFileFlags1;
+    pIndexHeader->dwFileFlags2 = ha->dwFileFlags2;
+    pIndexHeader->dwFileFlags3 = ha->dwFileFlags3;
+    pIndexHeader->dwAttrFlags = ha->dwAttrFlags;
+    pIndexHeader->dwAttrArrays |= (ha->pFileTime != NULL) ? MPQ_ATTRIBUTE_FILETIME : 0;
+    pIndexHeader->dwAttrArrays |= (ha->pFileCrc32 != NULL) ? MPQ_ATTRIBUTE_CRC32 : 0;
+    pIndexHeader->dwAttrArrays |= (ha->pFileMd5 != NULL) ? MPQ_ATTRIBUTE_MD5 : 0;
+    pIndexHeader->dwHashTableSize = (ha->pHashTable != NULL) ? ha->pHeader->dwHashTableSize : 0;
+    if(pHetTable != NULL)
+    {
+        pIndexHeader->dwHetEntryCount = pHetTable->dwEntryCount;
+        pIndexHeader->dwHetTotalCount = pHetTable->dwTotalCount;
+        pIndexHeader->dwHetNameHashBitSize = pHetTable->dwNameHashBitSize;
+        pIndexHeader->dwHetIndexSizeTotal = pHetTable->dwIndexSizeTotal;
+        pIndexHeader->dwHetIndexSizeExtra = pHetTable->dwIndexSizeExtra;
+        pIndexHeader->dwHetIndexSize = pHetTable->dwIndexSize;
+    }
+    pIndexHeader->cbNames = (uint32_t)cbNames;
+    memcpy(pIndexHeader->LoadedHeader, ha->HeaderData, sizeof(pIndexHeader->LoadedHeader));
+
+    /* Allocate space for the entire index file */
+    GetIndexLayout(pIndexHeader, &Layout);
+    IndexSize = sizeof(TMPQIndexHeader) + Layout.DataSize;
+    pIndexHeader->IndexSize = IndexSize;
+    if(IndexSize > 0xFFFFFFFF)
+        return ERROR_NOT_SUPPORTED;
+
+    pbIndexFile = STORM_ALLOC(uint8_t, (size_t)IndexSize);
+    if(pbIndexFile == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pbIndexData = pbIndexFile + sizeof(TMPQIndexHeader);
+    memset(pbIndexData, 0, (size_t)Layout.DataSize);
+
+    /* Fill the index data */
+    if(nError == ERROR_SUCCESS)
+    {
+        /* File entries and file names */
+        pIndexEntry = (TMPQIndexEntry *)(pbIndexData + Layout.EntriesOffs);
+        szName = (char *)(pbIndexData + Layout.NamesOffs);
+        pFileEntry = ha->pFileTable;
+        for(i = 0; i < ha->dwFileTableSize; i++, pIndexEntry++, pFileEntry++)
+        {
+            pIndexEntry->FileNameHash = pFileEntry->FileNameHash;
+            pIndexEntry->ByteOffset = pFileEntry->ByteOffset;
+            pIndexEntry->dwNameOffset = MPQ_INDEX_NO_NAME;
+            pIndexEntry->dwFileSize = pFileEntry->dwFileSize;
+            pIndexEntry->dwCmpSize = pFileEntry->dwCmpSize;
+            pIndexEntry->dwFlags = pFileEntry->dwFlags;
+
+            if(pFileEntry->szFileName != NULL)
+            {
+                pIndexEntry->dwNameOffset = (uint32_t)(szName - (char *)(pbIndexData + Layout.NamesOffs));
+                strcpy(szName, pFileEntry->szFileName);
+                szName += strlen(szName) + 1;
+            }
+        }
+
+        /* Hash table */
+        if(pIndexHeader->dwHashTableSize != 0)
+            memcpy(pbIndexData + Layout.HashTableOffs, ha->pHashTable, pIndexHeader->dwHashTableSize * sizeof(TMPQHash));
+
+        /* File attributes */
+        if(ha->pFileTime != NULL)
+            memcpy(pbIndexData + Layout.FileTimeOffs, ha->pFileTime, ha->dwFileTableSize * sizeof(uint64_t));
+        if(ha->pFileCrc32 != NULL)
+            memcpy(pbIndexData + Layout.Crc32Offs, ha->pFileCrc32, ha->dwFileTableSize * sizeof(uint32_t));
+        if(ha->pFileMd5 != NULL)
+            memcpy(pbIndexData + Layout.Md5Offs, ha->pFileMd5, ha->dwFileTableSize * MD5_DIGEST_SIZE);
+
+        /* HET table */
+        if(pHetTable != NULL)
+        {
+            memcpy(pbIndexData + Layout.HetOffs, pHetTable->pNameHashes, pHetTable->dwTotalCount);
+            memcpy(pbIndexData + Layout.HetOffs + pHetTable->dwTotalCount, pHetTable->pBetIndexes->Elements, (size_t)Layout.HetIndexBytes);
+        }
+
+        /* The header goes last, as it contains MD5 of the whole index */
+        CalculateIndexMd5(pIndexHeader, pbIndexData, (size_t)Layout.DataSize, pIndexHeader->IndexMd5);
+        memcpy(pbIndexFile, pIndexHeader, sizeof(TMPQIndexHeader));
+    }
+
+    /* Write the index to a temporary file and rename it, */
+    /* so nobody ever sees incomplete index file */
+    if(nError == ERROR_SUCCESS)
+    {
+        szIndexName = CreateIndexFileName(ha, "");
+        szTempName = CreateIndexFileName(ha, MPQ_INDEX_TEMP_SUFFIX);
+        if(szIndexName == NULL || szTempName == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_CreateFile(szTempName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+        if(pStream != NULL)
+        {
+            if(!FileStream_Write(pStream, NULL, pbIndexFile, (uint32_t)IndexSize))
+                nError = GetLastError();
+            FileStream_Close(pStream);
+
+            if(nError == ERROR_SUCCESS && rename(szTempName, szIndexName) != 0)
+                nError = errno;
+            if(nError != ERROR_SUCCESS)
+                remove(szTempName);
+        }
+        else
+        {
+            nError = GetLastError();
+        }
+    }
+
+    /* Cleanup and exit */
+    if(szTempName != NULL)
+        STORM_FREE(szTempName);
+    if(szIndexName != NULL)
+        STORM_FREE(szIndexName);
+    if(pbIndexFile != NULL)
+        STORM_FREE(pbIndexFile);
+    return nError;
+}
+
+/* Deletes the index file of the archive. Called whenever the MPQ tables are saved. */
+/* A file that is not an index file is left alone */
+void RemoveArchiveIndex(TMPQArchive * ha)
+{
+    TFileStream * pStream;
+    uint64_t ByteOffset = 0;
+    uint32_t dwSignature = 0;
+    char * szIndexName;
+
+    if((szIndexName = CreateIndexFileName(ha, "")) != NULL)
+    {
+        pStream = FileStream_OpenFile(szIndexName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+        if(pStream != NULL)
+        {
+            FileStream_Read(pStream, &ByteOffset, &dwSignature, sizeof(uint32_t));
+            FileStream_Close(pStream);
+
+            if(dwSignature == MPQ_INDEX_SIGNATURE)
+                remove(szIndexName);
+        }
+        STORM_FREE(szIndexName);
+    }
+}
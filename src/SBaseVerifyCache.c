@@ -0,0 +1,464 @@
+/*****************************************************************************/
+/* SBaseVerifyCache.c                               Copyright (c) Ayron 2026 */
+/*---------------------------------------------------------------------------*/
+/* Verification cache. Remembers the files and the signature that have       */
+/* passed the verification, so they aren't verified again as long as the     */
+/* archive doesn't change. File results can be kept in a file next to MPQ.   */
+/*---------------------------------------------------------------------------*/
+/*   Date    Ver   Who  Comment                                              */
+/* --------  ----  ---  -------                                              */
+/* 18.10.26  1.00  Ayr  Created                                              */
+/*****************************************************************************/
+
+#include "thunderStorm.h"
+#include "StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MPQ_VERIFY_CACHE_SIGNATURE    0x59465654    /* 'TVFY' */
+#define MPQ_VERIFY_CACHE_VERSION      2
+#define MPQ_VERIFY_CACHE_EXTENSION    ".vfy"
+#define MPQ_VERIFY_CACHE_TEMP_SUFFIX  ".tmp"
+
+/* Set in dwVerifyFlags once the file has passed, with any SFILE_VERIFY_XXX flags */
+#define MPQ_VERIFY_CACHE_PASSED       0x80000000
+
+/* Open flags that change the results of the verification */
+#define MPQ_VERIFY_CACHE_OPEN_FLAGS   (MPQ_OPEN_NO_ATTRIBUTES | MPQ_OPEN_FORCE_MPQ_V1 | MPQ_OPEN_CHECK_SECTOR_CRC | MPQ_OPEN_CHECK_RAW_MD5)
+
+/*
+ * Layout of the cache file:
+ *
+ *   TMPQVerifyCacheHeader
+ *   TMPQVerifyCacheEntry [dwFileCount]
+ *
+ * Like the index file, the cache file is in native byte order.
+ * A cache file that doesn't match the archive is ignored and
+ * overwritten when the archive is closed.
+ *
+ * The results in the cache file are trusted, the files are not verified
+ * again. The result of the signature check is never saved, as that would
+ * let anyone who can write the cache file make any archive look signed.
+ */
+
+typedef struct _TMPQVerifyCacheHeader
+{
+    uint32_t dwSignature;                       /* MPQ_VERIFY_CACHE_SIGNATURE */
+    uint32_t dwVersion;                         /* MPQ_VERIFY_CACHE_VERSION */
+    uint32_t dwHeaderSize;                      /* sizeof(TMPQVerifyCacheHeader) */
+    uint32_t dwFileCount;                       /* Number of entries after the header */
+
+    TMPQArchiveId ArchiveId;                    /* Identity of the archive */
+    uint32_t dwOpenFlags;                       /* MPQ_OPEN_XXX flags that affect the results */
+    uint32_t dwReserved;
+    unsigned char EntriesMd5[MD5_DIGEST_SIZE];  /* MD5 of the entries, so a damaged cache file is not used */
+} TMPQVerifyCacheHeader;
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static char * CreateCacheFileName(TMPQArchive * ha, const char * szSuffix)
+{
+    const char * szMpqName = FileStream_GetFileName(ha->pStream);
+    size_t nLength = strlen(szMpqName);
+    char * szCacheName;
+
+    szCacheName = STORM_ALLOC(char, nLength + strlen(MPQ_VERIFY_CACHE_EXTENSION) + strlen(szSuffix) + 1);
+    if(szCacheName != NULL)
+    {
+        memcpy(szCacheName, szMpqName, nLength);
+        strcpy(szCacheName + nLength, MPQ_VERIFY_CACHE_EXTENSION);
+        strcat(szCacheName, szSuffix);
+    }
+
+    return szCacheName;
+}
+
+/* Calculates MD5 of the public part of the RSA key set by SFileSetRSAKey. */
+/* Without a key, the MD5 is all zeros. */
+static int CalculateKeyMd5(TMPQArchive * ha, unsigned char * md5)
+{
+    hash_state md5_state;
+    unsigned char * pbKeyData;
+    unsigned long cbN;
+    unsigned long cbE;
+
+    memset(md5, 0, MD5_DIGEST_SIZE);
+    if(ha->keyRSA.N != NULL)
+    {
+        cbN = mp_unsigned_bin_size(ha->keyRSA.N);
+        cbE = mp_unsigned_bin_size(ha->keyRSA.e);
+        pbKeyData = STORM_ALLOC(uint8_t, cbN + cbE);
+        if(pbKeyData == NULL)
+            return 0;
+
+        mp_to_unsigned_bin(ha->keyRSA.N, pbKeyData);
+        mp_to_unsigned_bin(ha->keyRSA.e, pbKeyData + cbN);
+        md5_init(&md5_state);
+        md5_process(&md5_state, pbKeyData, cbN + cbE);
+        md5_done(&md5_state, md5);
+        STORM_FREE(pbKeyData);
+    }
+
+    return 1;
+}
+
+/* Bits of the verification result that belong to the given SFILE_VERIFY_XXX flags */
+static uint32_t GetVerifyResultMask(uint32_t dwFlags)
+{
+    uint32_t dwResultMask = 0;
+
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+        dwResultMask |= VERIFY_FILE_HAS_SECTOR_CRC | VERIFY_FILE_SECTOR_CRC_ERROR;
+    if(dwFlags & SFILE_VERIFY_FILE_CRC)
+        dwResultMask |= VERIFY_FILE_HAS_CHECKSUM | VERIFY_FILE_CHECKSUM_ERROR;
+    if(dwFlags & SFILE_VERIFY_FILE_MD5)
+        dwResultMask |= VERIFY_FILE_HAS_MD5 | VERIFY_FILE_MD5_ERROR;
+    if(dwFlags & SFILE_VERIFY_RAW_MD5)
+        dwResultMask |= VERIFY_FILE_HAS_RAW_MD5 | VERIFY_FILE_RAW_MD5_ERROR;
+    return dwResultMask;
+}
+
+/* Gets the verification cache, if it can be used at this moment. */
+/* Once the archive has been changed, the cache is not used until it is flushed */
+static TMPQVerifyCache * GetVerifyCache(TMPQArchive * ha)
+{
+    if(ha->pVerifyCache == NULL || (ha->dwFlags & MPQ_FLAG_CHANGED))
+        return NULL;
+    return ha->pVerifyCache;
+}
+
+/* Deletes the cache file. A file that is not a cache file is left alone */
+static void RemoveVerifyCacheFile(TMPQArchive * ha)
+{
+    TFileStream * pStream;
+    uint64_t ByteOffset = 0;
+    uint32_t dwSignature = 0;
+    char * szCacheName;
+
+    if((szCacheName = CreateCacheFileName(ha, "")) != NULL)
+    {
+        pStream = FileStream_OpenFile(szCacheName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+        if(pStream != NULL)
+        {
+            FileStream_Read(pStream, &ByteOffset, &dwSignature, sizeof(uint32_t));
+            FileStream_Close(pStream);
+
+            if(dwSignature == MPQ_VERIFY_CACHE_SIGNATURE)
+                remove(szCacheName);
+        }
+        STORM_FREE(szCacheName);
+    }
+}
+
+/* Loads the cache file, if it belongs to the archive */
+static int LoadVerifyCacheFile(TMPQArchive * ha, TMPQVerifyCache * pCache)
+{
+    TMPQVerifyCacheHeader CacheHeader;
+    TMPQVerifyCacheEntry * pEntries = NULL;
+    TFileStream * pStream;
+    hash_state md5_state;
+    unsigned char md5[MD5_DIGEST_SIZE];
+    uint64_t ByteOffset = 0;
+    uint64_t CacheSize = 0;
+    uint32_t cbEntries = pCache->dwFileCount * sizeof(TMPQVerifyCacheEntry);
+    char * szCacheName;
+    int nError = ERROR_SUCCESS;
+
+    if((szCacheName = CreateCacheFileName(ha, "")) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pStream = FileStream_OpenFile(szCacheName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+    STORM_FREE(szCacheName);
+    if(pStream == NULL)
+        return ERROR_FILE_NOT_FOUND;
+
+    /* Load and verify the cache header */
+    FileStream_GetSize(pStream, &CacheSize);
+    if(CacheSize < sizeof(TMPQVerifyCacheHeader) || !FileStream_Read(pStream, &ByteOffset, &CacheHeader, sizeof(TMPQVerifyCacheHeader)))
+        nError = ERROR_BAD_FORMAT;
+    if(nError == ERROR_SUCCESS)
+    {
+        if(CacheHeader.dwSignature != MPQ_VERIFY_CACHE_SIGNATURE || CacheHeader.dwVersion != MPQ_VERIFY_CACHE_VERSION)
+            nError = ERROR_BAD_FORMAT;
+        if(CacheHeader.dwHeaderSize != sizeof(TMPQVerifyCacheHeader))
+            nError = ERROR_BAD_FORMAT;
+        if(CacheHeader.dwFileCount != pCache->dwFileCount || CacheSize != sizeof(TMPQVerifyCacheHeader) + cbEntries)
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    /* Verify that the cache belongs to the archive */
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!IsSameArchiveId(&CacheHeader.ArchiveId, &pCache->ArchiveId) || CacheHeader.dwOpenFlags != pCache->dwOpenFlags)
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    /* Load the entries */
+    if(nError == ERROR_SUCCESS && cbEntries != 0)
+    {
+        pEntries = STORM_ALLOC(TMPQVerifyCacheEntry, pCache->dwFileCount);
+        if(pEntries != NULL)
+        {
+            ByteOffset = sizeof(TMPQVerifyCacheHeader);
+            if(!FileStream_Read(pStream, &ByteOffset, pEntries, cbEntries))
+                nError = ERROR_FILE_CORRUPT;
+        }
+        else
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    /* Only use the entries if they are intact */
+    if(nError == ERROR_SUCCESS && cbEntries != 0)
+    {
+        md5_init(&md5_state);
+        md5_process(&md5_state, (unsigned char *)pEntries, cbEntries);
+        md5_done(&md5_state, md5);
+        if(memcmp(md5, CacheHeader.EntriesMd5, MD5_DIGEST_SIZE))
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    if(nError == ERROR_SUCCESS && cbEntries != 0)
+        memcpy(pCache->pEntries, pEntries, cbEntries);
+
+    /* Cleanup and exit */
+    if(pEntries != NULL)
+        STORM_FREE(pEntries);
+    FileStream_Close(pStream);
+    return nError;
+}
+
+/* Saves the cache to the cache file */
+static int SaveVerifyCacheFile(TMPQArchive * ha, TMPQVerifyCache * pCache)
+{
+    TMPQVerifyCacheHeader CacheHeader;
+    TFileStream * pStream;
+    hash_state md5_state;
+    uint32_t cbEntries = pCache->dwFileCount * sizeof(TMPQVerifyCacheEntry);
+    char * szCacheName = NULL;
+    char * szTempName = NULL;
+    int nError = ERROR_SUCCESS;
+
+    /* Fill the cache header */
+    memset(&CacheHeader, 0, sizeof(TMPQVerifyCacheHeader));
+    CacheHeader.dwSignature = MPQ_VERIFY_CACHE_SIGNATURE;
+    CacheHeader.dwVersion = MPQ_VERIFY_CACHE_VERSION;
+    CacheHeader.dwHeaderSize = sizeof(TMPQVerifyCacheHeader);
+    CacheHeader.dwFileCount = pCache->dwFileCount;
+    CacheHeader.ArchiveId = pCache->ArchiveId;
+    CacheHeader.dwOpenFlags = pCache->dwOpenFlags;
+    md5_init(&md5_state);
+    if(cbEntries != 0)
+        md5_process(&md5_state, (unsigned char *)pCache->pEntries, cbEntries);
+    md5_done(&md5_state, CacheHeader.EntriesMd5);
+
+    /* Write the cache to a temporary file and rename it, */
+    /* so nobody ever sees incomplete cache file */
+    szCacheName = CreateCacheFileName(ha, "");
+    szTempName = CreateCacheFileName(ha, MPQ_VERIFY_CACHE_TEMP_SUFFIX);
+    if(szCacheName == NULL || szTempName == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_CreateFile(szTempName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+        if(pStream != NULL)
+        {
+            if(!FileStream_Write(pStream, NULL, &CacheHeader, sizeof(TMPQVerifyCacheHeader)))
+                nError = GetLastError();
+            if(nError == ERROR_SUCCESS && cbEntries != 0 && !FileStream_Write(pStream, NULL, pCache->pEntries, cbEntries))
+                nError = GetLastError();
+            FileStream_Close(pStream);
+
+            if(nError == ERROR_SUCCESS && rename(szTempName, szCacheName) != 0)
+                nError = errno;
+            if(nError != ERROR_SUCCESS)
+                remove(szTempName);
+        }
+        else
+        {
+            nError = GetLastError();
+        }
+    }
+
+    /* Cleanup and exit */
+    if(szTempName != NULL)
+        STORM_FREE(szTempName);
+    if(szCacheName != NULL)
+        STORM_FREE(szCacheName);
+    return nError;
+}
+
+/*-----------------------------------------------------------------------------
+ * Public functions (StormLib internals)
+ */
+
+/* Creates the verification cache of a newly open archive. Must be called */
+/* after all tables have been loaded. With MPQ_OPEN_VERIFY_CACHE_FILE, */
+/* the cache file is loaded if it belongs to the archive. pArchiveId is */
+/* the identity of the archive, or NULL if the cache file can't be used */
+int CreateVerifyCache(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags)
+{
+    TMPQVerifyCache * pCache;
+
+    pCache = STORM_ALLOC(TMPQVerifyCache, 1);
+    if(pCache == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(pCache, 0, sizeof(TMPQVerifyCache));
+
+    /* One entry for each item of the file table */
+    pCache->dwFileCount = ha->dwFileTableSize;
+    if(pCache->dwFileCount != 0)
+    {
+        pCache->pEntries = STORM_ALLOC(TMPQVerifyCacheEntry, pCache->dwFileCount);
+        if(pCache->pEntries == NULL)
+        {
+            STORM_FREE(pCache);
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        memset(pCache->pEntries, 0, pCache->dwFileCount * sizeof(TMPQVerifyCacheEntry));
+    }
+
+    /* Ignore the result of loading, the cache file is optional */
+    if((dwFlags & MPQ_OPEN_VERIFY_CACHE_FILE) && pArchiveId != NULL)
+    {
+        pCache->ArchiveId = *pArchiveId;
+        pCache->dwOpenFlags = (dwFlags & MPQ_VERIFY_CACHE_OPEN_FLAGS);
+        pCache->bSaveFile = 1;
+        LoadVerifyCacheFile(ha, pCache);
+    }
+
+    ha->pVerifyCache = pCache;
+    return ERROR_SUCCESS;
+}
+
+/* Retrieves the result of a file that has already passed */
+/* the verification with all the given SFILE_VERIFY_XXX flags */
+int QueryVerifyCacheFile(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwFlags, uint32_t * pdwVerifyResult)
+{
+    TMPQVerifyCacheEntry * pEntry;
+    TMPQVerifyCache * pCache = GetVerifyCache(ha);
+
+    dwFlags = (dwFlags & SFILE_VERIFY_ALL) | MPQ_VERIFY_CACHE_PASSED;
+    if(pCache != NULL && dwFileIndex < pCache->dwFileCount)
+    {
+        pEntry = pCache->pEntries + dwFileIndex;
+        if((pEntry->dwVerifyFlags & dwFlags) == dwFlags)
+        {
+            *pdwVerifyResult = pEntry->dwVerifyResult & GetVerifyResultMask(dwFlags);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Stores the result of a file verification. Only files that have passed are stored */
+void UpdateVerifyCacheFile(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwFlags, uint32_t dwVerifyResult)
+{
+    TMPQVerifyCacheEntry * pEntry;
+    TMPQVerifyCache * pCache = GetVerifyCache(ha);
+
+    dwFlags = (dwFlags & SFILE_VERIFY_ALL) | MPQ_VERIFY_CACHE_PASSED;
+    if(pCache != NULL && dwFileIndex < pCache->dwFileCount && (dwVerifyResult & VERIFY_FILE_ERROR_MASK) == 0)
+    {
+        pEntry = pCache->pEntries + dwFileIndex;
+        if((pEntry->dwVerifyFlags & dwFlags) != dwFlags || (pEntry->dwVerifyResult & dwVerifyResult) != dwVerifyResult)
+        {
+            pEntry->dwVerifyFlags |= dwFlags;
+            pEntry->dwVerifyResult |= dwVerifyResult;
+            pCache->bDirty = 1;
+        }
+    }
+}
+
+/* Retrieves the result of the signature check, if it has already passed with the current RSA key */
+int QueryVerifyCacheSignature(TMPQArchive * ha, uint32_t * pdwSignatureResult)
+{
+    TMPQVerifyCache * pCache = GetVerifyCache(ha);
+    unsigned char KeyMd5[MD5_DIGEST_SIZE];
+
+    if(pCache != NULL && pCache->dwSignatureResult != ERROR_NO_SIGNATURE && CalculateKeyMd5(ha, KeyMd5))
+    {
+        if(!memcmp(KeyMd5, pCache->KeyMd5, MD5_DIGEST_SIZE))
+        {
+            *pdwSignatureResult = pCache->dwSignatureResult;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Stores the result of the signature check, if it has passed. */
+/* The result is only kept in memory, it is never saved to the cache file */
+void UpdateVerifyCacheSignature(TMPQArchive * ha, uint32_t dwSignatureResult)
+{
+    TMPQVerifyCache * pCache = GetVerifyCache(ha);
+
+    if(pCache != NULL && pCache->dwSignatureResult != dwSignatureResult)
+    {
+        if(dwSignatureResult == ERROR_WEAK_SIGNATURE_OK || dwSignatureResult == ERROR_STRONG_SIGNATURE_OK || dwSignatureResult == ERROR_SECURE_SIGNATURE_OK)
+        {
+            if(CalculateKeyMd5(ha, pCache->KeyMd5))
+                pCache->dwSignatureResult = dwSignatureResult;
+        }
+    }
+}
+
+/* Forgets all results. Called whenever the archive is saved or compacted. */
+/* The cache file is deleted, like the index file */
+void InvalidateVerifyCache(TMPQArchive * ha)
+{
+    TMPQVerifyCache * pCache = ha->pVerifyCache;
+    TMPQVerifyCacheEntry * pEntries;
+
+    if(pCache != NULL)
+    {
+        /* The file table may have grown */
+        if(ha->dwFileTableSize > pCache->dwFileCount)
+        {
+            pEntries = STORM_ALLOC(TMPQVerifyCacheEntry, ha->dwFileTableSize);
+            if(pEntries != NULL)
+            {
+                if(pCache->pEntries != NULL)
+                    STORM_FREE(pCache->pEntries);
+                pCache->pEntries = pEntries;
+                pCache->dwFileCount = ha->dwFileTableSize;
+            }
+        }
+
+        if(pCache->dwFileCount != 0)
+            memset(pCache->pEntries, 0, pCache->dwFileCount * sizeof(TMPQVerifyCacheEntry));
+        pCache->dwSignatureResult = ERROR_NO_SIGNATURE;
+        pCache->bDirty = 0;
+
+        /* The identity of the archive is not known until it is open again */
+        if(pCache->bSaveFile)
+        {
+            RemoveVerifyCacheFile(ha);
+            pCache->bSaveFile = 0;
+        }
+    }
+}
+
+/* Saves the cache file, if anything has been added, and frees the cache */
+void FreeVerifyCache(TMPQArchive * ha)
+{
+    TMPQVerifyCache * pCache = ha->pVerifyCache;
+
+    if(pCache != NULL)
+    {
+        if(pCache->bSaveFile && pCache->bDirty && (ha->dwFlags & MPQ_FLAG_CHANGED) == 0)
+            SaveVerifyCacheFile(ha, pCache);
+
+        if(pCache->pEntries != NULL)
+            STORM_FREE(pCache->pEntries);
+        STORM_FREE(pCache);
+        ha->pVerifyCache = NULL;
+    }
+}
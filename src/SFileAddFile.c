@@ -93,7 +93,7 @@ static int WriteDataToMpqFile(
     uint32_t dwDataSize,
     uint32_t dwCompression)
 {
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint64_t ByteOffset;
     unsigned char * pbCompressed = NULL;             /* Compressed (target) data */
     unsigned char * pbToWrite = hf->pbFileSector;    /* Data to write to the file */
@@ -266,7 +266,7 @@ static int RecryptFileData(
     const char * szNewFileName)
 {
     uint64_t RawFilePos;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint32_t dwBytesToRecrypt = pFileEntry->dwCmpSize;
     uint32_t dwOldKey;
     uint32_t dwNewKey;
@@ -404,9 +404,10 @@ int SFileAddFile_Init(
     uint32_t dwFlags,
     TMPQFile ** phf)
 {
-    TFileEntry * pFileEntry = NULL;
+    TMPQFileEntry * pFileEntry = NULL;
     uint64_t TempPos;                  /* For various file offset calculations */
     TMPQFile * hf = NULL;               /* File structure for newly added file */
+    unsigned char md5[MD5_DIGEST_SIZE];
     uint32_t dwHashIndex = HASH_ENTRY_FREE;
     int nError = ERROR_SUCCESS;
 
@@ -510,15 +511,23 @@ int SFileAddFile_Init(
         pFileEntry->dwCmpSize = 0;
         pFileEntry->dwFlags  = dwFlags | MPQ_FILE_EXISTS;
 
-        /* Initialize the file time, CRC32 and MD5 */
+        /* Initialize the file time, CRC32 and MD5. A replaced file */
+        /* reuses the existing entry, which still has the old values */
         assert(sizeof(hf->hctx) >= sizeof(hash_state));
-        memset(pFileEntry->md5, 0, MD5_DIGEST_SIZE);
         md5_init((hash_state *)hf->hctx);
-        pFileEntry->dwCrc32 = crc32(0, Z_NULL, 0);
+        memset(md5, 0, MD5_DIGEST_SIZE);
+        nError = SetFileEntryMd5(ha, pFileEntry, md5);
+        if(nError == ERROR_SUCCESS)
+            nError = SetFileEntryCrc32(ha, pFileEntry, crc32(0, Z_NULL, 0));
 
         /* If the caller gave us a file time, use it. */
-        pFileEntry->FileTime = FileTime;
+        if(nError == ERROR_SUCCESS)
+            nError = SetFileEntryTime(ha, pFileEntry, FileTime);
+    }
 
+    /* Finish the file entry and TMPQFile structure */
+    if(nError == ERROR_SUCCESS)
+    {
         /* Mark the archive as modified */
         ha->dwFlags |= MPQ_FLAG_CHANGED;
 
@@ -540,7 +549,8 @@ int SFileAddFile_Init(
 int SFileAddFile_Write(TMPQFile * hf, const void * pvData, uint32_t dwSize, uint32_t dwCompression)
 {
     TMPQArchive * ha;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
+    unsigned char md5[MD5_DIGEST_SIZE];
     int nError = ERROR_SUCCESS;
 
     /* Don't bother if the caller gave us zero size */
@@ -631,11 +641,8 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, uint32_t dwSize, uint
     {
         if(hf->dwFilePos >= pFileEntry->dwFileSize)
         {
-            /* Finish calculating CRC32 */
-            hf->pFileEntry->dwCrc32 = hf->dwCrc32;
-
             /* Finish calculating MD5 */
-            md5_done((hash_state *)hf->hctx, hf->pFileEntry->md5);
+            md5_done((hash_state *)hf->hctx, md5);
 
             /* If we also have sector checksums, write them to the file */
             if(hf->SectorChksums != NULL)
@@ -646,7 +653,7 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, uint32_t dwSize, uint
             /* Now write patch info */
             if(hf->pPatchInfo != NULL)
             {
-                memcpy(hf->pPatchInfo->md5, hf->pFileEntry->md5, MD5_DIGEST_SIZE);
+                memcpy(hf->pPatchInfo->md5, md5, MD5_DIGEST_SIZE);
                 hf->pPatchInfo->dwDataSize  = hf->pFileEntry->dwFileSize;
                 hf->pFileEntry->dwFileSize = hf->dwPatchedFileSize;
                 nError = WritePatchInfo(hf);
@@ -666,6 +673,12 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, uint32_t dwSize, uint
                                          hf->pFileEntry->dwCmpSize,
                                          ha->pHeader->dwRawChunkSize);
             }
+
+            /* Store the CRC32 and MD5 of the file */
+            if(nError == ERROR_SUCCESS)
+                nError = SetFileEntryCrc32(ha, hf->pFileEntry, hf->dwCrc32);
+            if(nError == ERROR_SUCCESS)
+                nError = SetFileEntryMd5(ha, hf->pFileEntry, md5);
         }
     }
 
@@ -677,7 +690,7 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, uint32_t dwSize, uint
 int SFileAddFile_Finish(TMPQFile * hf)
 {
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     int nError = hf->nAddFileError;
 
     /* If all previous operations succeeded, we can update the MPQ */
@@ -697,15 +710,31 @@ int SFileAddFile_Finish(TMPQFile * hf)
         }
     }
 
-    /* Now we need to recreate the HET table, if exists */
+    /* Now we need to insert the file to the HET table, if exists. */
+    /* The HET table is rebuilt from scratch when the MPQ tables are saved */
     if(nError == ERROR_SUCCESS && ha->pHetTable != NULL)
     {
-        nError = RebuildHetTable(ha);
+        nError = InsertHetTableEntry(ha, pFileEntry);
+    }
+
+    /* If another file has the same data, share them. The data just written */
+    /* stay beyond the end of the file data and get overwritten later */
+    if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_DEDUP_DATA))
+    {
+        TMPQFileEntry * pSameEntry = FindSameFileData(ha, pFileEntry);
+
+        if(pSameEntry != NULL)
+            pFileEntry->ByteOffset = pSameEntry->ByteOffset;
+        else
+            InsertDataIndexEntry(ha, pFileEntry);
     }
 
     /* Update the block table size */
     if(nError == ERROR_SUCCESS)
     {
+        /* Move the end of the file data behind the new file */
+        UpdateFreeMpqSpace(ha, pFileEntry);
+
         /* Call the user callback, if any */
         if(ha->pfnAddFileCB != NULL)
             ha->pfnAddFileCB(ha->pvAddFileUserData, hf->dwDataSize, hf->dwDataSize, 1);
@@ -757,6 +786,8 @@ int EXPORT_SYMBOL SFileCreateFile(
     {
         if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
             nError = ERROR_ACCESS_DENIED;
+        if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+            nError = ERROR_COMPACT_INTERRUPTED;
 
         /* Don't allow to add a file under pseudo-file name */
         if(IsPseudoFileName(szArchivedName, NULL))
@@ -1086,6 +1117,8 @@ int EXPORT_SYMBOL SFileRemoveFile(void * hMpq, const char * szFileName, uint32_t
     {
         if((ha->dwFlags & MPQ_FLAG_READ_ONLY) || (ha->haPatch != NULL))
             nError = ERROR_ACCESS_DENIED;
+        if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+            nError = ERROR_COMPACT_INTERRUPTED;
     }
 
     /* If all checks have passed, we can delete the file from the MPQ */
@@ -1103,17 +1136,14 @@ int EXPORT_SYMBOL SFileRemoveFile(void * hMpq, const char * szFileName, uint32_t
     }
 
     /* If the file has been deleted, we need to invalidate */
-    /* the internal files and recreate HET table */
+    /* the internal files */
     if(nError == ERROR_SUCCESS)
     {
         /* Invalidate the entries for internal files */
         /* After we are done with MPQ changes, we need to re-create them anyway */
         InvalidateInternalFiles(ha);
 
-        /*
-         * Don't rebuild HET table now; the file's flags indicate
-         * that it's been deleted, which is enough
-         */
+        /* The file has already been removed from the HET table by DeleteFileEntry */
     }
 
     /* Resolve error and exit */
@@ -1142,6 +1172,8 @@ int EXPORT_SYMBOL SFileRenameFile(void * hMpq, const char * szFileName, const ch
     {
         if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
             nError = ERROR_ACCESS_DENIED;
+        if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+            nError = ERROR_COMPACT_INTERRUPTED;
     }
 
     /* Open the new file. If exists, we don't allow rename operation */
@@ -1158,7 +1190,7 @@ int EXPORT_SYMBOL SFileRenameFile(void * hMpq, const char * szFileName, const ch
         if(SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_BASE_FILE, (void **)&hf))
         {
             uint64_t RawDataOffs;
-            TFileEntry * pFileEntry = hf->pFileEntry;
+            TMPQFileEntry * pFileEntry = hf->pFileEntry;
 
             /* Invalidate the entries for internal files */
             InvalidateInternalFiles(ha);
@@ -1193,10 +1225,6 @@ int EXPORT_SYMBOL SFileRenameFile(void * hMpq, const char * szFileName, const ch
         }
     }
 
-    /* We also need to rebuild the HET table, if present */
-    if(nError == ERROR_SUCCESS && ha->pHetTable != NULL)
-        nError = RebuildHetTable(ha);
-
     /* Resolve error and return */
     if(nError != ERROR_SUCCESS)
         SetLastError(nError);
@@ -1228,7 +1256,7 @@ int EXPORT_SYMBOL SFileSetDataCompression(uint32_t DataCompression)
 int EXPORT_SYMBOL SFileSetFileLocale(void * hFile, uint32_t lcNewLocale)
 {
     TMPQArchive * ha;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQFile * hf = (TMPQFile *)IsValidMpqHandle(hFile);
 
     /* Invalid handle => do nothing */
@@ -1299,3 +1327,31 @@ int EXPORT_SYMBOL SFileSetAddFileCallback(void * hMpq, SFILE_ADDFILE_CALLBACK Ad
     ha->pfnAddFileCB = AddFileCB;
     return 1;
 }
+
+/*-----------------------------------------------------------------------------
+ * Enables sharing of file data
+ */
+
+/* If enabled, each file added to the archive is compared with the existing files. */
+/* If a file with the same data stored the same way is found, the new file points */
+/* to its data instead of storing another copy. SFileCompactArchive then also merges */
+/* the files with the same data. Encrypted files are never shared. */
+/* Files already in the archive are only found by their MD5 from (attributes). */
+/* If (attributes) has no MD5s, added files only share data with other files added */
+/* since the archive was opened; use SFileCompactArchive to merge the older ones. */
+int EXPORT_SYMBOL SFileSetDataDedup(void * hMpq, int bEnable)
+{
+    TMPQArchive * ha = (TMPQArchive *) hMpq;
+
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+
+    if(bEnable)
+        ha->dwFlags |= MPQ_FLAG_DEDUP_DATA;
+    else
+        ha->dwFlags &= ~MPQ_FLAG_DEDUP_DATA;
+    return 1;
+}
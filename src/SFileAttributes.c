@@ -172,6 +172,14 @@ static int LoadAttributesFile(TMPQArchive * ha, unsigned char * pbAttrFile, uint
         pbAttrPtr = (unsigned char *)(pAttrHeader + 1);
     }
 
+    /* The arrays are as large as the file table, so there must not be more entries */
+    if(dwAttributesEntries > ha->dwFileTableSize)
+        return ERROR_BAD_FORMAT;
+
+    /* Allocate arrays for the attributes that are present */
+    if(AllocateFileAttributes(ha, ha->dwAttrFlags) != ERROR_SUCCESS)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
     /* Load the CRC32 (if present) */
     if(ha->dwAttrFlags & MPQ_ATTRIBUTE_CRC32)
     {
@@ -183,8 +191,7 @@ static int LoadAttributesFile(TMPQArchive * ha, unsigned char * pbAttrFile, uint
             return ERROR_FILE_CORRUPT;
 
         BSWAP_ARRAY32_UNSIGNED(ArrayCRC32, dwAttributesEntries);
-        for(i = 0; i < dwAttributesEntries; i++)
-            ha->pFileTable[i].dwCrc32 = ArrayCRC32[i];
+        memcpy(ha->pFileCrc32, ArrayCRC32, cbArraySize);
         pbAttrPtr += cbArraySize;
     }
 
@@ -199,8 +206,7 @@ static int LoadAttributesFile(TMPQArchive * ha, unsigned char * pbAttrFile, uint
             return ERROR_FILE_CORRUPT;
 
         BSWAP_ARRAY64_UNSIGNED(ArrayFileTime, dwAttributesEntries);
-        for(i = 0; i < dwAttributesEntries; i++)
-            ha->pFileTable[i].FileTime = ArrayFileTime[i];
+        memcpy(ha->pFileTime, ArrayFileTime, cbArraySize);
         pbAttrPtr += cbArraySize;
     }
 
@@ -214,11 +220,7 @@ static int LoadAttributesFile(TMPQArchive * ha, unsigned char * pbAttrFile, uint
         if((pbAttrPtr + cbArraySize) > pbAttrFileEnd)
             return ERROR_FILE_CORRUPT;
 
-        for(i = 0; i < dwAttributesEntries; i++)
-        {
-            memcpy(ha->pFileTable[i].md5, ArrayMd5, MD5_DIGEST_SIZE);
-            ArrayMd5 += MD5_DIGEST_SIZE;
-        }
+        memcpy(ha->pFileMd5, ArrayMd5, cbArraySize);
         pbAttrPtr += cbArraySize;
     }
 
@@ -248,8 +250,8 @@ static int LoadAttributesFile(TMPQArchive * ha, unsigned char * pbAttrFile, uint
 static unsigned char * CreateAttributesFile(TMPQArchive * ha, uint32_t * pcbAttrFile)
 {
     PMPQ_ATTRIBUTES_HEADER pAttrHeader;
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->pHeader->dwBlockTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->pHeader->dwBlockTableSize;
+    TMPQFileEntry * pFileEntry;
     unsigned char * pbAttrFile;
     unsigned char * pbAttrPtr;
     size_t cbAttrFile;
@@ -286,7 +288,7 @@ static unsigned char * CreateAttributesFile(TMPQArchive * ha, uint32_t * pcbAttr
 
             /* Copy from file table */
             for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
-                *pArrayCRC32++ = BSWAP_INT32_UNSIGNED(pFileEntry->dwCrc32);
+                *pArrayCRC32++ = BSWAP_INT32_UNSIGNED(GetFileEntryCrc32(ha, pFileEntry));
 
             /* Update pointer */
             pbAttrPtr = (unsigned char *)pArrayCRC32;
@@ -299,7 +301,7 @@ static unsigned char * CreateAttributesFile(TMPQArchive * ha, uint32_t * pcbAttr
 
             /* Copy from file table */
             for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
-                *pArrayFileTime++ = BSWAP_INT64_UNSIGNED(pFileEntry->FileTime);
+                *pArrayFileTime++ = BSWAP_INT64_UNSIGNED(GetFileEntryTime(ha, pFileEntry));
 
             /* Update pointer */
             pbAttrPtr = (unsigned char *)pArrayFileTime;
@@ -313,7 +315,7 @@ static unsigned char * CreateAttributesFile(TMPQArchive * ha, uint32_t * pcbAttr
             /* Copy from file table */
             for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
             {
-                memcpy(pbArrayMD5, pFileEntry->md5, MD5_DIGEST_SIZE);
+                memcpy(pbArrayMD5, GetFileEntryMd5(ha, pFileEntry), MD5_DIGEST_SIZE);
                 pbArrayMD5 += MD5_DIGEST_SIZE;
             }
 
@@ -405,6 +407,19 @@ int SAttrLoadAttributes(TMPQArchive * ha)
     return nError;
 }
 
+/* Loads the (attributes), if it has been deferred by MPQ_OPEN_LAZY_ATTRIBUTES */
+int SAttrLoadLazy(TMPQArchive * ha)
+{
+    /* Same like SListFileLoadLazy */
+    if((ha->dwFlags & (MPQ_FLAG_ATTRIBUTES_LAZY | MPQ_FLAG_COMPACT_INTERRUPTED)) == MPQ_FLAG_ATTRIBUTES_LAZY)
+    {
+        ha->dwFlags &= ~MPQ_FLAG_ATTRIBUTES_LAZY;
+        return SAttrLoadAttributes(ha);
+    }
+
+    return ERROR_SUCCESS;
+}
+
 /* Saves the (attributes) to the MPQ */
 int SAttrFileSaveToMpq(TMPQArchive * ha)
 {
@@ -481,6 +496,7 @@ uint32_t EXPORT_SYMBOL SFileGetAttributes(void * hMpq)
         return SFILE_INVALID_ATTRIBUTES;
     }
 
+    SAttrLoadLazy(ha);
     return ha->dwAttrFlags;
 }
 
@@ -502,6 +518,13 @@ int EXPORT_SYMBOL SFileSetAttributes(void * hMpq, uint32_t dwFlags)
         return 0;
     }
 
+    /* Not allowed until an interrupted in-place compacting is finished */
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+    {
+        SetLastError(ERROR_COMPACT_INTERRUPTED);
+        return 0;
+    }
+
     /* Set the attributes */
     InvalidateInternalFiles(ha);
     ha->dwAttrFlags = (dwFlags & MPQ_ATTRIBUTE_ALL);
@@ -513,11 +536,13 @@ int EXPORT_SYMBOL SFileUpdateFileAttributes(void * hMpq, const char * szFileName
     hash_state md5_state;
     TMPQArchive * ha = (TMPQArchive *)hMpq;
     TMPQFile * hf;
+    unsigned char md5[MD5_DIGEST_SIZE];
     uint8_t Buffer[0x1000];
     void * hFile = NULL;
     size_t dwTotalBytes = 0;
     size_t dwBytesRead;
     uint32_t dwCrc32;
+    int nError;
 
     /* Verify the parameters */
     if(!IsValidMpqHandle(ha))
@@ -533,6 +558,13 @@ int EXPORT_SYMBOL SFileUpdateFileAttributes(void * hMpq, const char * szFileName
         return 0;
     }
 
+    /* Not allowed until an interrupted in-place compacting is finished */
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+    {
+        SetLastError(ERROR_COMPACT_INTERRUPTED);
+        return 0;
+    }
+
     /* Attempt to open the file */
     if(!SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_BASE_FILE, &hFile))
         return 0;
@@ -562,11 +594,16 @@ int EXPORT_SYMBOL SFileUpdateFileAttributes(void * hMpq, const char * szFileName
     }
 
     /* Update both CRC32 and MD5 */
-    hf->pFileEntry->dwCrc32 = dwCrc32;
-    md5_done(&md5_state, hf->pFileEntry->md5);
+    md5_done(&md5_state, md5);
+    nError = SetFileEntryCrc32(ha, hf->pFileEntry, dwCrc32);
+    if(nError == ERROR_SUCCESS)
+        nError = SetFileEntryMd5(ha, hf->pFileEntry, md5);
 
     /* Remember that we need to save the MPQ tables */
     InvalidateInternalFiles(ha);
     SFileCloseFile(hFile);
-    return 1;
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
 }
@@ -13,6 +13,102 @@
 
 #include "thunderStorm.h"
 #include "StormCommon.h"
+#include <pthread.h>
+
+/*****************************************************************************/
+/* Local structures                                                          */
+/*****************************************************************************/
+
+#define COMPACT_MIN_WORKLOAD    0x1000000   /* Minimum amount of archive data worth a worker thread */
+#define COMPACT_BATCH_FILES     0x1000      /* Maximum number of files prepared at once */
+#define COMPACT_BATCH_BYTES     0x10000000  /* Maximum amount of file data prepared at once */
+#define COMPACT_COPY_SIZE       0x400000    /* Amount of data copied at once by FileStream_Copy */
+#define COMPACT_HASH_BUFFER_SIZE 0x10000    /* Buffer for hashing file data when merging files with the same data */
+
+/* File to be copied to the new archive */
+typedef struct _TCompactFile
+{
+    TMPQFileEntry * pFileEntry;            /* File entry of the file */
+    TMPQFile * hf;                      /* Prepared file handle. NULL if the file has zero size */
+    uint64_t MpqFilePos;                /* Position of the file in the new archive */
+    uint64_t MpqFileEnd;                /* End of the file in the new archive */
+} TCompactFile;
+
+/* Files copied by one round of parallel workers */
+typedef struct _TCompactBatch
+{
+    pthread_mutex_t Lock;               /* Guards picking of files and the progress */
+    TCompactFile * pFiles;              /* Files of the batch */
+    uint32_t dwFiles;                   /* Number of files in the batch */
+    uint32_t dwNextFile;                /* Index of the next file to be copied */
+    uint64_t BytesProcessed;            /* Compact progress of all workers */
+} TCompactBatch;
+
+/* Streams used for copying the file data. Parallel workers */
+/* need their own streams, as each stream has its file position */
+typedef struct _TCompactWorker
+{
+    TMPQArchive * ha;                   /* The archive being compacted */
+    TCompactBatch * pBatch;             /* Current batch. NULL if compacting on a single thread */
+    TFileStream * pOldStream;           /* Stream to read the file data from */
+    TFileStream * pNewStream;           /* Stream to write the file data to */
+    int bNotifyProgress;                /* Nonzero if this worker calls the compact callback */
+    int nError;                         /* Result of the worker. The last error value is per thread, */
+                                        /* so this is how the caller learns the error of each worker */
+} TCompactWorker;
+
+/* A file whose data may be shared with other files */
+typedef struct _TCompactDataEntry
+{
+    TMPQFileEntry * pFileEntry;            /* The file entry */
+    unsigned char md5[MD5_DIGEST_SIZE]; /* MD5 of the stored data (only when merging files with the same data) */
+} TCompactDataEntry;
+
+/*
+ * In-place compacting moves the files towards the begin of the archive.
+ * Its progress is stored in a journal file next to the MPQ, so an interrupted
+ * compacting can be finished by calling SFileCompactArchiveInPlace again.
+ *
+ * Layout of the journal file:
+ *
+ *   TMPQJournalHeader
+ *   TMPQJournalEntry [dwEntries]        (all existing files, sorted by position)
+ *   uint8_t          [dwBackupSize]     (original data of the file being moved, if any)
+ *
+ * When the new position of a file overlaps its old data, the part of the old
+ * data that the move overwrites is saved to the journal before the file is moved.
+ * The journal is in native byte order.
+ *
+ * While the journal exists, the MPQ tables on disk don't match the file data,
+ * so SFileOpenArchive only allows SFileCompactArchiveInPlace to be called.
+ */
+
+#define MPQ_JOURNAL_SIGNATURE   0x4C4E4A43      /* 'CJNL' */
+#define MPQ_JOURNAL_EXTENSION   ".jnl"
+#define MPQ_JOURNAL_NO_BACKUP   0xFFFFFFFF      /* dwBackupEntry if there are no saved data */
+#define MPQ_JOURNAL_SHARED_DATA 0x00000001      /* The file shares the data with the previous file that has data */
+
+typedef struct _TMPQJournalHeader
+{
+    uint32_t dwSignature;               /* MPQ_JOURNAL_SIGNATURE */
+    uint32_t dwHeaderSize;              /* sizeof(TMPQJournalHeader) */
+    uint32_t dwEntrySize;               /* sizeof(TMPQJournalEntry) */
+    uint32_t dwFileTableSize;           /* Size of the file table of the archive */
+    uint64_t MpqPos;                    /* Position of the MPQ header in the archive */
+    uint32_t dwEntries;                 /* Number of entries in the journal */
+    uint32_t dwEntriesDone;             /* Number of entries whose files have already been moved */
+    uint32_t dwBackupEntry;             /* Entry whose data are saved in the journal, or MPQ_JOURNAL_NO_BACKUP */
+    uint32_t dwBackupSize;              /* Number of bytes saved from the begin of the file data */
+} TMPQJournalHeader;
+
+typedef struct _TMPQJournalEntry
+{
+    uint64_t OldByteOffset;             /* Position of the file before compacting, relative to the MPQ */
+    uint64_t NewByteOffset;             /* Position of the file after compacting, relative to the MPQ */
+    uint64_t DataSize;                  /* Size of the patch header and compressed data. Zero for empty files */
+    uint32_t dwFileIndex;               /* Index of the file in the file table */
+    uint32_t dwFlags;                   /* See MPQ_JOURNAL_SHARED_DATA */
+} TMPQJournalEntry;
 
 /*****************************************************************************/
 /* Local functions                                                           */
@@ -20,8 +116,8 @@
 
 static int CheckIfAllFilesKnown(TMPQArchive * ha)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     uint32_t dwBlockIndex = 0;
     int nError = ERROR_SUCCESS;
 
@@ -48,8 +144,8 @@ static int CheckIfAllFilesKnown(TMPQArchive * ha)
 
 static int CheckIfAllKeysKnown(TMPQArchive * ha, const char * szListFile, uint32_t * pFileKeys)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     uint32_t dwBlockIndex = 0;
     int nError = ERROR_SUCCESS;
 
@@ -127,26 +223,18 @@ static int CopyNonMpqData(
 {
     uint64_t DataSize = ByteCount;
     uint32_t dwToRead;
-    char DataBuffer[0x1000];
     int nError = ERROR_SUCCESS;
 
-    /* Copy the data */
+    /* Copy the data in large blocks. The progress is updated after each block */
     while(DataSize > 0)
     {
         /* Get the proper size of data */
-        dwToRead = sizeof(DataBuffer);
+        dwToRead = COMPACT_COPY_SIZE;
         if(DataSize < dwToRead)
             dwToRead = (uint32_t)DataSize;
 
-        /* Read from the source stream */
-        if(!FileStream_Read(pSrcStream, ByteOffset, DataBuffer, dwToRead))
-        {
-            nError = GetLastError();
-            break;
-        }
-
-        /* Write to the target stream */
-        if(!FileStream_Write(pTrgStream, NULL, DataBuffer, dwToRead))
+        /* Copy the block to the target stream */
+        if(!FileStream_Copy(pTrgStream, NULL, pSrcStream, ByteOffset, dwToRead))
         {
             nError = GetLastError();
             break;
@@ -167,22 +255,89 @@ static int CopyNonMpqData(
     return nError;
 }
 
+/* Updates the compact progress and notifies the application. */
+/* Parallel workers sum up their progress under a lock, and only */
+/* the worker running on the calling thread notifies the application. */
+static void UpdateCompactProgress(TCompactWorker * pWorker, uint32_t dwBytesProcessed)
+{
+    TMPQArchive * ha = pWorker->ha;
+    TCompactBatch * pBatch = pWorker->pBatch;
+    uint64_t BytesProcessed;
+
+    if(ha->pfnCompactCB != NULL)
+    {
+        if(pBatch != NULL)
+        {
+            pthread_mutex_lock(&pBatch->Lock);
+            pBatch->BytesProcessed += dwBytesProcessed;
+            BytesProcessed = pBatch->BytesProcessed;
+            pthread_mutex_unlock(&pBatch->Lock);
+
+            if(pWorker->bNotifyProgress)
+                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, BytesProcessed, ha->CompactTotalBytes);
+        }
+        else
+        {
+            ha->CompactBytesProcessed += dwBytesProcessed;
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+        }
+    }
+}
+
+/* Checks whether the file data would be copied unchanged. This is true */
+/* if the file key doesn't change and the sectors follow each other */
+static int CanCopyFileRaw(TMPQFile * hf, uint32_t dwFileKey1, uint32_t dwFileKey2)
+{
+    uint32_t dwCmpSize = hf->pFileEntry->dwCmpSize;
+
+    /* The sectors must not be re-encrypted */
+    if(dwFileKey1 != dwFileKey2)
+        return 0;
+
+    /* The sectors must fit into the compressed size, */
+    /* otherwise the last sector would be cut */
+    if(hf->SectorOffsets != NULL)
+    {
+        if(hf->SectorOffsets[hf->dwSectorCount] > dwCmpSize)
+            return 0;
+
+        /* Same for the sector checksums */
+        if(hf->SectorChksums != NULL)
+        {
+            if(hf->SectorOffsets[hf->dwSectorCount + 1] < hf->SectorOffsets[hf->dwSectorCount])
+                return 0;
+            if(hf->SectorOffsets[hf->dwSectorCount + 1] > dwCmpSize)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
 /* Copies all file sectors into another archive. */
 static int CopyMpqFileSectors(
-    TMPQArchive * ha,
+    TCompactWorker * pWorker,
     TMPQFile * hf,
-    TFileStream * pNewStream,
     uint64_t MpqFilePos)               /* MPQ file position in the new archive */
 {
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TFileStream * pNewStream = pWorker->pNewStream;
+    TFileStream * pOldStream = pWorker->pOldStream;
+    TMPQArchive * ha = pWorker->ha;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     uint64_t RawFilePos;               /* Used for calculating sector offset in the old MPQ archive */
+    uint64_t NewFilePos;               /* Where the next data are written to the new MPQ archive */
     uint32_t dwBytesToCopy = pFileEntry->dwCmpSize;
     uint32_t dwPatchSize = 0;              /* Size of patch header */
     uint32_t dwFileKey1 = 0;               /* File key used for decryption */
     uint32_t dwFileKey2 = 0;               /* File key used for encryption */
     uint32_t dwCmpSize = 0;                /* Compressed file size, including patch header */
+    int bCopyRaw = 0;                      /* If nonzero, the file data are copied as a single block */
     int nError = ERROR_SUCCESS;
 
+    /* The file data are always written to the given position, */
+    /* so that parallel workers can share the target file */
+    NewFilePos = ha->MpqPos + MpqFilePos;
+
     /* Resolve decryption keys. Note that the file key given */
     /* in the TMPQFile structure also includes the key adjustment */
     if(nError == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED))
@@ -199,15 +354,44 @@ static int CopyMpqFileSectors(
     if(nError == ERROR_SUCCESS && hf->pPatchInfo != NULL)
     {
         BSWAP_ARRAY32_UNSIGNED(hf->pPatchInfo, sizeof(uint32_t) * 3);
-        if(!FileStream_Write(pNewStream, NULL, hf->pPatchInfo, hf->pPatchInfo->dwLength))
+        if(!FileStream_Write(pNewStream, &NewFilePos, hf->pPatchInfo, hf->pPatchInfo->dwLength))
             nError = GetLastError();
 
         /* Save the size of the patch info */
         dwPatchSize = hf->pPatchInfo->dwLength;
+        NewFilePos += dwPatchSize;
+    }
+
+    /* If the file data don't change, copy the sector offset table, */
+    /* sectors, sector checksums and extra data in large blocks */
+    if(nError == ERROR_SUCCESS && CanCopyFileRaw(hf, dwFileKey1, dwFileKey2))
+    {
+        RawFilePos = CalculateRawSectorOffset(hf, 0);
+        bCopyRaw = 1;
+
+        while(dwBytesToCopy != 0)
+        {
+            uint32_t dwToCopy = STORMLIB_MIN(dwBytesToCopy, COMPACT_COPY_SIZE);
+
+            if(!FileStream_Copy(pNewStream, &NewFilePos, pOldStream, &RawFilePos, dwToCopy))
+            {
+                nError = GetLastError();
+                break;
+            }
+
+            /* Update compact progress */
+            UpdateCompactProgress(pWorker, dwToCopy);
+
+            /* Adjust byte counts */
+            RawFilePos += dwToCopy;
+            NewFilePos += dwToCopy;
+            dwBytesToCopy -= dwToCopy;
+            dwCmpSize += dwToCopy;
+        }
     }
 
     /* If we have to save sector offset table, do it. */
-    if(nError == ERROR_SUCCESS && hf->SectorOffsets != NULL)
+    if(nError == ERROR_SUCCESS && !bCopyRaw && hf->SectorOffsets != NULL)
     {
         uint32_t * SectorOffsetsCopy = STORM_ALLOC(uint32_t, hf->SectorOffsets[0] / sizeof(uint32_t));
         uint32_t dwSectorOffsLen = hf->SectorOffsets[0];
@@ -226,26 +410,23 @@ static int CopyMpqFileSectors(
                 EncryptMpqBlock(SectorOffsetsCopy, dwSectorOffsLen, dwFileKey2 - 1);
 
             BSWAP_ARRAY32_UNSIGNED(SectorOffsetsCopy, dwSectorOffsLen);
-            if(!FileStream_Write(pNewStream, NULL, SectorOffsetsCopy, dwSectorOffsLen))
+            if(!FileStream_Write(pNewStream, &NewFilePos, SectorOffsetsCopy, dwSectorOffsLen))
                 nError = GetLastError();
 
+            NewFilePos += dwSectorOffsLen;
             dwBytesToCopy -= dwSectorOffsLen;
             dwCmpSize += dwSectorOffsLen;
         }
 
         /* Update compact progress */
-        if(ha->pfnCompactCB != NULL)
-        {
-            ha->CompactBytesProcessed += dwSectorOffsLen;
-            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-        }
+        UpdateCompactProgress(pWorker, dwSectorOffsLen);
 
         STORM_FREE(SectorOffsetsCopy);
     }
 
     /* Now we have to copy all file sectors. We do it without */
     /* recompression, because recompression is not necessary in this case */
-    if(nError == ERROR_SUCCESS)
+    if(nError == ERROR_SUCCESS && !bCopyRaw)
     {
         uint32_t dwSector;
         
@@ -269,7 +450,7 @@ static int CopyMpqFileSectors(
             RawFilePos = CalculateRawSectorOffset(hf, dwRawByteOffset);
             
             /* Read the file sector */
-            if(!FileStream_Read(ha->pStream, &RawFilePos, hf->pbFileSector, dwRawDataInSector))
+            if(!FileStream_Read(pOldStream, &RawFilePos, hf->pbFileSector, dwRawDataInSector))
             {
                 nError = GetLastError();
                 break;
@@ -299,20 +480,17 @@ static int CopyMpqFileSectors(
             }
 
             /* Now write the sector back to the file */
-            if(!FileStream_Write(pNewStream, NULL, hf->pbFileSector, dwRawDataInSector))
+            if(!FileStream_Write(pNewStream, &NewFilePos, hf->pbFileSector, dwRawDataInSector))
             {
                 nError = GetLastError();
                 break;
             }
 
             /* Update compact progress */
-            if(ha->pfnCompactCB != NULL)
-            {
-                ha->CompactBytesProcessed += dwRawDataInSector;
-                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-            }
+            UpdateCompactProgress(pWorker, dwRawDataInSector);
 
             /* Adjust byte counts */
+            NewFilePos += dwRawDataInSector;
             dwBytesToCopy -= dwRawDataInSector;
             dwCmpSize += dwRawDataInSector;
         }
@@ -320,27 +498,24 @@ static int CopyMpqFileSectors(
 
     /* Copy the sector CRCs, if any */
     /* Sector CRCs are always compressed (not imploded) and unencrypted */
-    if(nError == ERROR_SUCCESS && hf->SectorOffsets != NULL && hf->SectorChksums != NULL)
+    if(nError == ERROR_SUCCESS && !bCopyRaw && hf->SectorOffsets != NULL && hf->SectorChksums != NULL)
     {
         uint32_t dwCrcLength;
 
         dwCrcLength = hf->SectorOffsets[hf->dwSectorCount + 1] - hf->SectorOffsets[hf->dwSectorCount];
         if(dwCrcLength != 0)
         {
-            if(!FileStream_Read(ha->pStream, NULL, hf->SectorChksums, dwCrcLength))
+            if(!FileStream_Read(pOldStream, NULL, hf->SectorChksums, dwCrcLength))
                 nError = GetLastError();
 
-            if(!FileStream_Write(pNewStream, NULL, hf->SectorChksums, dwCrcLength))
+            if(!FileStream_Write(pNewStream, &NewFilePos, hf->SectorChksums, dwCrcLength))
                 nError = GetLastError();
 
             /* Update compact progress */
-            if(ha->pfnCompactCB != NULL)
-            {
-                ha->CompactBytesProcessed += dwCrcLength;
-                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-            }
+            UpdateCompactProgress(pWorker, dwCrcLength);
 
             /* Size of the CRC block is also included in the compressed file size */
+            NewFilePos += dwCrcLength;
             dwBytesToCopy -= dwCrcLength;
             dwCmpSize += dwCrcLength;
         }
@@ -360,13 +535,14 @@ static int CopyMpqFileSectors(
         pbExtraData = STORM_ALLOC(uint8_t, dwBytesToCopy);
         if(pbExtraData != NULL)
         {
-            if(!FileStream_Read(ha->pStream, NULL, pbExtraData, dwBytesToCopy))
+            if(!FileStream_Read(pOldStream, NULL, pbExtraData, dwBytesToCopy))
                 nError = GetLastError();
 
-            if(!FileStream_Write(pNewStream, NULL, pbExtraData, dwBytesToCopy))
+            if(!FileStream_Write(pNewStream, &NewFilePos, pbExtraData, dwBytesToCopy))
                 nError = GetLastError();
 
             /* Include these extra data in the compressed size */
+            NewFilePos += dwBytesToCopy;
             dwCmpSize += dwBytesToCopy;
             STORM_FREE(pbExtraData);
         }
@@ -375,6 +551,8 @@ static int CopyMpqFileSectors(
     }
 
     /* Write the MD5's of the raw file data, if needed */
+    /* Note: This reads the file data back, which leaves the file */
+    /* position at the end of the data, where the MD5's go */
     if(nError == ERROR_SUCCESS && ha->pHeader->dwRawChunkSize != 0)
     {
         nError = WriteMpqDataMD5(pNewStream, 
@@ -410,20 +588,394 @@ static int CopyMpqFileSectors(
     return nError;
 }
 
-static int CopyMpqFiles(TMPQArchive * ha, uint32_t * pFileKeys, TFileStream * pNewStream)
+/* Creates the file handle and loads everything that is needed */
+/* for copying the file, except the sector buffer */
+static int PrepareMpqFile(TMPQArchive * ha, TMPQFileEntry * pFileEntry, uint32_t dwFileKey, TMPQFile ** PtrFile)
+{
+    TMPQFile * hf;
+    int nError = ERROR_SUCCESS;
+
+    /* Allocate structure for the MPQ file */
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    /* Set the file decryption key */
+    hf->dwFileKey = dwFileKey;
+
+    /* If the file is a patch file, load the patch header */
+    if(nError == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE))
+        nError = AllocatePatchInfo(hf, 1);
+
+    /* The sector size is determined when allocating the sector buffer. */
+    /* The buffer itself is allocated again right before the copy */
+    if(nError == ERROR_SUCCESS)
+    {
+        nError = AllocateSectorBuffer(hf);
+        STORM_FREE(hf->pbFileSector);
+        hf->pbFileSector = NULL;
+    }
+
+    /* Also allocate sector offset table and sector checksum table */
+    if(nError == ERROR_SUCCESS)
+        nError = AllocateSectorOffsets(hf, 1);
+
+    /* Also load sector checksums, if any */
+    if(nError == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+        nError = AllocateSectorChecksums(hf, 0);
+
+    /* Give the file handle to the caller */
+    if(nError == ERROR_SUCCESS)
+        *PtrFile = hf;
+    else
+        FreeFileHandle(&hf);
+    return nError;
+}
+
+/* Returns the number of bytes that CopyMpqFileSectors writes for the file */
+static uint64_t GetCompactedFileSize(TMPQArchive * ha, TMPQFile * hf)
+{
+    uint32_t dwRawChunkSize = ha->pHeader->dwRawChunkSize;
+    uint32_t dwCmpSize = hf->pFileEntry->dwCmpSize;
+    uint64_t FileSize = dwCmpSize;
+
+    if(hf->pPatchInfo != NULL)
+        FileSize += hf->pPatchInfo->dwLength;
+    if(dwRawChunkSize != 0 && dwCmpSize != 0)
+        FileSize += (((dwCmpSize - 1) / dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+    return FileSize;
+}
+
+/* Sorts the files by the position and the size of the data */
+static int CompareDataPositions(const void * pvEntry1, const void * pvEntry2)
+{
+    TMPQFileEntry * pFileEntry1 = ((const TCompactDataEntry *)pvEntry1)->pFileEntry;
+    TMPQFileEntry * pFileEntry2 = ((const TCompactDataEntry *)pvEntry2)->pFileEntry;
+
+    if(pFileEntry1->ByteOffset != pFileEntry2->ByteOffset)
+        return (pFileEntry1->ByteOffset < pFileEntry2->ByteOffset) ? -1 : 1;
+    if(pFileEntry1->dwCmpSize != pFileEntry2->dwCmpSize)
+        return (pFileEntry1->dwCmpSize < pFileEntry2->dwCmpSize) ? -1 : 1;
+    if(pFileEntry1->dwFileSize != pFileEntry2->dwFileSize)
+        return (pFileEntry1->dwFileSize < pFileEntry2->dwFileSize) ? -1 : 1;
+    if(pFileEntry1->dwFlags != pFileEntry2->dwFlags)
+        return (pFileEntry1->dwFlags < pFileEntry2->dwFlags) ? -1 : 1;
+    return (pFileEntry1 < pFileEntry2) ? -1 : (pFileEntry1 > pFileEntry2);
+}
+
+/* Sorts the files by the size and the MD5 of the data */
+static int CompareDataContents(const void * pvEntry1, const void * pvEntry2)
+{
+    const TCompactDataEntry * pEntry1 = (const TCompactDataEntry *)pvEntry1;
+    const TCompactDataEntry * pEntry2 = (const TCompactDataEntry *)pvEntry2;
+    int nResult;
+
+    if(pEntry1->pFileEntry->dwCmpSize != pEntry2->pFileEntry->dwCmpSize)
+        return (pEntry1->pFileEntry->dwCmpSize < pEntry2->pFileEntry->dwCmpSize) ? -1 : 1;
+    if((nResult = memcmp(pEntry1->md5, pEntry2->md5, MD5_DIGEST_SIZE)) != 0)
+        return nResult;
+    return (pEntry1->pFileEntry < pEntry2->pFileEntry) ? -1 : (pEntry1->pFileEntry > pEntry2->pFileEntry);
+}
+
+/* Calculates MD5 of the data stored in the MPQ */
+static int CalculateStoredDataMd5(TMPQArchive * ha, TMPQFileEntry * pFileEntry, unsigned char * md5)
+{
+    hash_state md5_state;
+    uint64_t RawFilePos = FileOffsetFromMpqOffset(ha, pFileEntry->ByteOffset);
+    uint32_t dwBytesLeft = pFileEntry->dwCmpSize;
+    uint32_t dwToRead;
+    uint8_t * pbBuffer;
+    int nError = ERROR_SUCCESS;
+
+    pbBuffer = STORM_ALLOC(uint8_t, COMPACT_HASH_BUFFER_SIZE);
+    if(pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    md5_init(&md5_state);
+    while(dwBytesLeft != 0)
+    {
+        dwToRead = STORMLIB_MIN(dwBytesLeft, COMPACT_HASH_BUFFER_SIZE);
+        if(!FileStream_Read(ha->pStream, &RawFilePos, pbBuffer, dwToRead))
+        {
+            nError = GetLastError();
+            break;
+        }
+
+        md5_process(&md5_state, pbBuffer, dwToRead);
+        RawFilePos += dwToRead;
+        dwBytesLeft -= dwToRead;
+    }
+    md5_done(&md5_state, md5);
+
+    STORM_FREE(pbBuffer);
+    return nError;
+}
+
+/*
+ * For each file, finds the file whose copy of the data will be used.
+ * Files that share the data in the archive keep sharing them. With
+ * MPQ_FLAG_DEDUP_DATA, files with the same data stored the same way
+ * share them as well. Only the owner of the data is copied; the other
+ * files get the new position of the owner's data.
+ */
+static int FindFileDataOwners(TMPQArchive * ha, uint32_t * pOwners)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TCompactDataEntry * pEntries;
+    TMPQFileEntry * pFileEntry;
+    uint32_t dwEntries = 0;
+    uint32_t dwOwners;
+    uint32_t dwOwnerIndex;
+    uint32_t i, j, k;
+    int nError = ERROR_SUCCESS;
+
+    /* Every file owns its data at first */
+    for(i = 0; i < ha->dwFileTableSize; i++)
+        pOwners[i] = i;
+
+    pEntries = STORM_ALLOC(TCompactDataEntry, ha->dwFileTableSize + 1);
+    if(pEntries == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    /* Collect the files that may share data */
+    for(i = 0; i < ha->dwFileTableSize; i++)
+    {
+        if(CanShareFileData(ha->pFileTable + i))
+        {
+            memset(&pEntries[dwEntries], 0, sizeof(TCompactDataEntry));
+            pEntries[dwEntries++].pFileEntry = ha->pFileTable + i;
+        }
+    }
+
+    /* Files with the same position and size already share the data. */
+    /* The first one in the file table becomes the owner. */
+    qsort(pEntries, dwEntries, sizeof(TCompactDataEntry), CompareDataPositions);
+    for(i = 0, dwOwners = 0; i < dwEntries; i = j)
+    {
+        dwOwnerIndex = (uint32_t)(pEntries[i].pFileEntry - ha->pFileTable);
+        for(j = i + 1; j < dwEntries && pEntries[j].pFileEntry->ByteOffset == pEntries[i].pFileEntry->ByteOffset && IsSameFileData(ha, pEntries[i].pFileEntry, pEntries[j].pFileEntry); j++)
+            pOwners[pEntries[j].pFileEntry - ha->pFileTable] = dwOwnerIndex;
+        pEntries[dwOwners++] = pEntries[i];
+    }
+
+    /* Also merge the owners that have the same data */
+    if(ha->dwFlags & MPQ_FLAG_DEDUP_DATA)
+    {
+        for(i = 0; i < dwOwners && nError == ERROR_SUCCESS; i++)
+            nError = CalculateStoredDataMd5(ha, pEntries[i].pFileEntry, pEntries[i].md5);
+
+        /* Files with the same MD5 are compared byte by byte with the first one */
+        qsort(pEntries, dwOwners, sizeof(TCompactDataEntry), CompareDataContents);
+        for(i = 0; i < dwOwners && nError == ERROR_SUCCESS; i = j)
+        {
+            dwOwnerIndex = (uint32_t)(pEntries[i].pFileEntry - ha->pFileTable);
+            for(j = i + 1; j < dwOwners && pEntries[j].pFileEntry->dwCmpSize == pEntries[i].pFileEntry->dwCmpSize && !memcmp(pEntries[j].md5, pEntries[i].md5, MD5_DIGEST_SIZE); j++)
+            {
+                pFileEntry = pEntries[j].pFileEntry;
+                if(IsSameFileData(ha, pEntries[i].pFileEntry, pFileEntry))
+                    pOwners[pFileEntry - ha->pFileTable] = dwOwnerIndex;
+            }
+        }
+
+        /* The files that shared data with a merged owner follow it */
+        for(k = 0; k < ha->dwFileTableSize; k++)
+            pOwners[k] = pOwners[pOwners[k]];
+    }
+
+    STORM_FREE(pEntries);
+    return nError;
+}
+
+/* Copies the files of the current batch, until there is no file left */
+static void CopyMpqFilesWorker(void * pvContext)
+{
+    TCompactWorker * pWorker = (TCompactWorker *)pvContext;
+    TCompactBatch * pBatch = pWorker->pBatch;
+    TCompactFile * pFile;
+    uint64_t NewFilePos;
+
+    for(;;)
+    {
+        /* Pick the next file. On error, the other workers stop as well */
+        pthread_mutex_lock(&pBatch->Lock);
+        if(pWorker->nError != ERROR_SUCCESS)
+            pBatch->dwNextFile = pBatch->dwFiles;
+        pFile = (pBatch->dwNextFile < pBatch->dwFiles) ? &pBatch->pFiles[pBatch->dwNextFile++] : NULL;
+        pthread_mutex_unlock(&pBatch->Lock);
+
+        /* Stop if there's nothing left to do */
+        if(pFile == NULL)
+            break;
+
+        /* Copy the file to its precalculated position */
+        if(pFile->hf != NULL)
+        {
+            pWorker->nError = AllocateSectorBuffer(pFile->hf);
+            if(pWorker->nError == ERROR_SUCCESS)
+                pWorker->nError = CopyMpqFileSectors(pWorker, pFile->hf, pFile->MpqFilePos);
+
+            /* The file must end exactly where the next one begins */
+            if(pWorker->nError == ERROR_SUCCESS)
+            {
+                FileStream_GetPos(pWorker->pNewStream, &NewFilePos);
+                if(NewFilePos != pWorker->ha->MpqPos + pFile->MpqFileEnd)
+                    pWorker->nError = ERROR_FILE_CORRUPT;
+            }
+
+            /* Free buffers. This also sets "hf" to NULL. */
+            FreeFileHandle(&pFile->hf);
+        }
+    }
+}
+
+/* Copies the files using multiple workers. The files are processed in batches. */
+/* For each batch, the file positions in the new archive are calculated first, */
+/* then the workers copy the files in parallel, each using its own file streams. */
+static int CopyMpqFilesParallel(TMPQArchive * ha, uint32_t * pFileKeys, uint32_t * pOwners, TFileStream * pNewStream, uint32_t dwWorkers)
+{
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry = ha->pFileTable;
+    TCompactWorker * pWorkers;
+    TCompactBatch Batch;
+    TCompactFile * pFile;
+    uint64_t MpqFilePos;
+    uint64_t cbBatch;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Allocate the workers and the batch */
+    memset(&Batch, 0, sizeof(TCompactBatch));
+    pWorkers = STORM_ALLOC(TCompactWorker, dwWorkers);
+    Batch.pFiles = STORM_ALLOC(TCompactFile, COMPACT_BATCH_FILES);
+    if(pWorkers == NULL || Batch.pFiles == NULL)
+    {
+        if(pWorkers != NULL)
+            STORM_FREE(pWorkers);
+        if(Batch.pFiles != NULL)
+            STORM_FREE(Batch.pFiles);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    pthread_mutex_init(&Batch.Lock, NULL);
+    Batch.BytesProcessed = ha->CompactBytesProcessed;
+
+    /* The first worker runs on this thread and uses the archive streams. */
+    /* The other ones have to open their own streams, as the file position */
+    /* is kept in the stream */
+    memset(pWorkers, 0, sizeof(TCompactWorker) * dwWorkers);
+    for(i = 0; i < dwWorkers; i++)
+    {
+        pWorkers[i].ha = ha;
+        pWorkers[i].pBatch = &Batch;
+        pWorkers[i].pOldStream = ha->pStream;
+        pWorkers[i].pNewStream = pNewStream;
+        pWorkers[i].bNotifyProgress = (i == 0);
+
+        if(i > 0 && nError == ERROR_SUCCESS)
+        {
+            pWorkers[i].pOldStream = FileStream_OpenFile(FileStream_GetFileName(ha->pStream), STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+            pWorkers[i].pNewStream = FileStream_OpenFile(FileStream_GetFileName(pNewStream), STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+            if(pWorkers[i].pOldStream == NULL || pWorkers[i].pNewStream == NULL)
+                nError = GetLastError();
+        }
+    }
+
+    /* The files begin right after the MPQ header */
+    FileStream_GetPos(pNewStream, &MpqFilePos);
+    MpqFilePos = MpqFilePos - ha->MpqPos;
+
+    while(nError == ERROR_SUCCESS && pFileEntry < pFileTableEnd)
+    {
+        /* Prepare the next batch of files and calculate their positions */
+        Batch.dwFiles = Batch.dwNextFile = 0;
+        for(cbBatch = 0; pFileEntry < pFileTableEnd && Batch.dwFiles < COMPACT_BATCH_FILES && cbBatch < COMPACT_BATCH_BYTES; pFileEntry++)
+        {
+            if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && pOwners[pFileEntry - ha->pFileTable] == (uint32_t)(pFileEntry - ha->pFileTable))
+            {
+                pFile = &Batch.pFiles[Batch.dwFiles++];
+                pFile->pFileEntry = pFileEntry;
+                pFile->MpqFilePos = pFile->MpqFileEnd = MpqFilePos;
+                pFile->hf = NULL;
+
+                /* Only files with nonzero size are copied */
+                if(pFileEntry->dwFileSize != 0)
+                {
+                    nError = PrepareMpqFile(ha, pFileEntry, pFileKeys[pFileEntry - ha->pFileTable], &pFile->hf);
+                    if(nError != ERROR_SUCCESS)
+                        break;
+
+                    pFile->MpqFileEnd = MpqFilePos + GetCompactedFileSize(ha, pFile->hf);
+                    cbBatch += pFileEntry->dwCmpSize;
+                }
+
+                MpqFilePos = pFile->MpqFileEnd;
+            }
+        }
+
+        /* Copy the files */
+        if(nError == ERROR_SUCCESS)
+        {
+            RunParallelWorkers(CopyMpqFilesWorker, pWorkers, sizeof(TCompactWorker), dwWorkers);
+            for(i = 0; i < dwWorkers; i++)
+            {
+                if(pWorkers[i].nError != ERROR_SUCCESS)
+                    nError = pWorkers[i].nError;
+            }
+
+            /* Other workers may have finished after the last notification */
+            if(nError == ERROR_SUCCESS && ha->pfnCompactCB != NULL)
+                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, Batch.BytesProcessed, ha->CompactTotalBytes);
+        }
+
+        /* Note: DO NOT update the compressed size in the file entry, no matter how bad it is. */
+        for(i = 0; i < Batch.dwFiles; i++)
+        {
+            pFile = &Batch.pFiles[i];
+            if(nError == ERROR_SUCCESS)
+                pFile->pFileEntry->ByteOffset = pFile->MpqFilePos;
+            if(pFile->hf != NULL)
+                FreeFileHandle(&pFile->hf);
+        }
+    }
+
+    /* Take over the progress of the workers */
+    if(ha->pfnCompactCB != NULL)
+        ha->CompactBytesProcessed = Batch.BytesProcessed;
+
+    /* Cleanup and exit */
+    for(i = 1; i < dwWorkers; i++)
+    {
+        if(pWorkers[i].pOldStream != NULL)
+            FileStream_Close(pWorkers[i].pOldStream);
+        if(pWorkers[i].pNewStream != NULL)
+            FileStream_Close(pWorkers[i].pNewStream);
+    }
+    pthread_mutex_destroy(&Batch.Lock);
+    STORM_FREE(Batch.pFiles);
+    STORM_FREE(pWorkers);
+    return nError;
+}
+
+static int CopyMpqFilesSerial(TMPQArchive * ha, uint32_t * pFileKeys, uint32_t * pOwners, TFileStream * pNewStream)
+{
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
+    TCompactWorker Worker;
     TMPQFile * hf = NULL;
     uint64_t MpqFilePos;
     int nError = ERROR_SUCCESS;
 
+    /* Copy the data using the archive streams */
+    memset(&Worker, 0, sizeof(TCompactWorker));
+    Worker.ha = ha;
+    Worker.pOldStream = ha->pStream;
+    Worker.pNewStream = pNewStream;
+
     /* Walk through all files and write them to the destination MPQ archive */
     for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
     {
         /* Copy all the file sectors */
-        /* Only do that when the file has nonzero size */
-        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS))
+        /* Only do that when the file has nonzero size and owns its data */
+        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && pOwners[pFileEntry - ha->pFileTable] == (uint32_t)(pFileEntry - ha->pFileTable))
         {
             /* Query the position where the destination file will be */
             FileStream_GetPos(pNewStream, &MpqFilePos);
@@ -432,42 +984,18 @@ static int CopyMpqFiles(TMPQArchive * ha, uint32_t * pFileKeys, TFileStream * pN
             /* Perform file copy ONLY if the file has nonzero size */
             if(pFileEntry->dwFileSize != 0)
             {
-                /* Allocate structure for the MPQ file */
-                hf = CreateFileHandle(ha, pFileEntry);
-                if(hf == NULL)
-                    return ERROR_NOT_ENOUGH_MEMORY;
-
-                /* Set the file decryption key */
-                hf->dwFileKey = pFileKeys[pFileEntry - ha->pFileTable];
-
-                /* If the file is a patch file, load the patch header */
-                if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
-                {
-                    nError = AllocatePatchInfo(hf, 1);
-                    if(nError != ERROR_SUCCESS)
-                        break;
-                }
-
-                /* Allocate buffers for file sector and sector offset table */
-                nError = AllocateSectorBuffer(hf);
+                /* Load the patch header and the sector tables */
+                nError = PrepareMpqFile(ha, pFileEntry, pFileKeys[pFileEntry - ha->pFileTable], &hf);
                 if(nError != ERROR_SUCCESS)
                     break;
 
-                /* Also allocate sector offset table and sector checksum table */
-                nError = AllocateSectorOffsets(hf, 1);
+                /* Allocate buffer for file sector */
+                nError = AllocateSectorBuffer(hf);
                 if(nError != ERROR_SUCCESS)
                     break;
 
-                /* Also load sector checksums, if any */
-                if(pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC)
-                {
-                    nError = AllocateSectorChecksums(hf, 0);
-                    if(nError != ERROR_SUCCESS)
-                        break;
-                }
-
                 /* Copy all file sectors */
-                nError = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
+                nError = CopyMpqFileSectors(&Worker, hf, MpqFilePos);
                 if(nError != ERROR_SUCCESS)
                     break;
 
@@ -486,6 +1014,410 @@ static int CopyMpqFiles(TMPQArchive * ha, uint32_t * pFileKeys, TFileStream * pN
     return nError;
 }
 
+static int CopyMpqFiles(TMPQArchive * ha, uint32_t * pFileKeys, TFileStream * pNewStream)
+{
+    uint32_t * pOwners;
+    uint32_t dwWorkers;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Find out which files share their data */
+    pOwners = STORM_ALLOC(uint32_t, ha->dwFileTableSize + 1);
+    if(pOwners == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    nError = FindFileDataOwners(ha, pOwners);
+
+    /* Large archives are compacted by multiple workers */
+    if(nError == ERROR_SUCCESS)
+    {
+        dwWorkers = GetParallelWorkerCount(ha->CompactTotalBytes, COMPACT_MIN_WORKLOAD);
+        if(dwWorkers > 1)
+            nError = CopyMpqFilesParallel(ha, pFileKeys, pOwners, pNewStream, dwWorkers);
+        else
+            nError = CopyMpqFilesSerial(ha, pFileKeys, pOwners, pNewStream);
+    }
+
+    /* Files sharing the data get the new position of the data */
+    if(nError == ERROR_SUCCESS)
+    {
+        for(i = 0; i < ha->dwFileTableSize; i++)
+        {
+            if(pOwners[i] != i)
+                ha->pFileTable[i].ByteOffset = ha->pFileTable[pOwners[i]].ByteOffset;
+        }
+    }
+
+    STORM_FREE(pOwners);
+    return nError;
+}
+
+/*-----------------------------------------------------------------------------
+ * In-place compacting
+ */
+
+static char * CreateJournalFileName(TMPQArchive * ha)
+{
+    const char * szMpqName = FileStream_GetFileName(ha->pStream);
+    size_t nLength = strlen(szMpqName);
+    char * szJournalName;
+
+    szJournalName = STORM_ALLOC(char, nLength + strlen(MPQ_JOURNAL_EXTENSION) + 1);
+    if(szJournalName != NULL)
+    {
+        memcpy(szJournalName, szMpqName, nLength);
+        strcpy(szJournalName + nLength, MPQ_JOURNAL_EXTENSION);
+    }
+
+    return szJournalName;
+}
+
+/* Checks whether an in-place compacting of the archive has been interrupted */
+int IsCompactInterrupted(TMPQArchive * ha)
+{
+    TMPQJournalHeader JournalHeader;
+    TFileStream * pJournal;
+    uint64_t ByteOffset = 0;
+    char * szJournalName;
+    int bInterrupted = 0;
+
+    szJournalName = CreateJournalFileName(ha);
+    if(szJournalName != NULL)
+    {
+        pJournal = FileStream_OpenFile(szJournalName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+        if(pJournal != NULL)
+        {
+            if(FileStream_Read(pJournal, &ByteOffset, &JournalHeader, sizeof(TMPQJournalHeader)))
+                bInterrupted = (JournalHeader.dwSignature == MPQ_JOURNAL_SIGNATURE && JournalHeader.MpqPos == ha->MpqPos);
+            FileStream_Close(pJournal);
+        }
+        STORM_FREE(szJournalName);
+    }
+
+    return bInterrupted;
+}
+
+static int WriteJournalHeader(TFileStream * pJournal, TMPQJournalHeader * pJournalHeader)
+{
+    uint64_t ByteOffset = 0;
+
+    if(!FileStream_Write(pJournal, &ByteOffset, pJournalHeader, sizeof(TMPQJournalHeader)))
+        return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+static int CompareJournalEntries(const void * pvEntry1, const void * pvEntry2)
+{
+    const TMPQJournalEntry * pEntry1 = (const TMPQJournalEntry *)pvEntry1;
+    const TMPQJournalEntry * pEntry2 = (const TMPQJournalEntry *)pvEntry2;
+
+    if(pEntry1->OldByteOffset != pEntry2->OldByteOffset)
+        return (pEntry1->OldByteOffset < pEntry2->OldByteOffset) ? -1 : 1;
+    if(pEntry1->dwFileIndex != pEntry2->dwFileIndex)
+        return (pEntry1->dwFileIndex < pEntry2->dwFileIndex) ? -1 : 1;
+    return 0;
+}
+
+/* Returns the position of the first MPQ table, relative to the MPQ */
+static uint64_t GetFirstTablePos(TMPQHeader * pHeader)
+{
+    uint64_t FirstTablePos = (uint64_t)-1;
+
+    if(pHeader->HashTableSize64 != 0)
+        FirstTablePos = STORMLIB_MIN(FirstTablePos, MAKE_OFFSET64(pHeader->wHashTablePosHi, pHeader->dwHashTablePos));
+    if(pHeader->BlockTableSize64 != 0)
+        FirstTablePos = STORMLIB_MIN(FirstTablePos, MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos));
+    if(pHeader->HiBlockTableSize64 != 0)
+        FirstTablePos = STORMLIB_MIN(FirstTablePos, pHeader->HiBlockTablePos64);
+    if(pHeader->HetTableSize64 != 0)
+        FirstTablePos = STORMLIB_MIN(FirstTablePos, pHeader->HetTablePos64);
+    if(pHeader->BetTableSize64 != 0)
+        FirstTablePos = STORMLIB_MIN(FirstTablePos, pHeader->BetTablePos64);
+    return FirstTablePos;
+}
+
+/* Calculates the new position of each file. The files keep their order, */
+/* so each file moves towards the begin of the archive, or stays in place. */
+static int PlanInPlaceCompact(TMPQArchive * ha, TMPQJournalEntry ** PtrEntries, uint32_t * PtrEntryCount)
+{
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
+    TMPQJournalEntry * pEntries;
+    TMPQJournalEntry * pDataEntry = NULL;
+    TMPQJournalEntry * pEntry;
+    TMPQFile * hf;
+    uint64_t FirstTablePos = GetFirstTablePos(ha->pHeader);
+    uint64_t MpqFilePos = ha->pHeader->dwHeaderSize;
+    uint64_t FileSize;
+    uint32_t dwEntries = 0;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Allocate one entry for each existing file */
+    pEntries = STORM_ALLOC(TMPQJournalEntry, ha->dwFileTableSize + 1);
+    if(pEntries == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            pEntry = &pEntries[dwEntries++];
+            memset(pEntry, 0, sizeof(TMPQJournalEntry));
+            pEntry->OldByteOffset = pEntry->NewByteOffset = pFileEntry->ByteOffset;
+            pEntry->dwFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
+        }
+    }
+
+    /* Sort the files by their position in the archive */
+    qsort(pEntries, dwEntries, sizeof(TMPQJournalEntry), CompareJournalEntries);
+
+    /* Calculate the new positions */
+    for(i = 0; i < dwEntries; i++)
+    {
+        pEntry = &pEntries[i];
+        pFileEntry = ha->pFileTable + pEntry->dwFileIndex;
+
+        /* Files with zero size have no data */
+        if(pFileEntry->dwFileSize == 0)
+        {
+            pEntry->NewByteOffset = MpqFilePos;
+            continue;
+        }
+
+        /* Files that share the data with the previous file move together with it */
+        if(pDataEntry != NULL && pDataEntry->OldByteOffset == pEntry->OldByteOffset && IsSameFileData(ha, ha->pFileTable + pDataEntry->dwFileIndex, pFileEntry))
+        {
+            pEntry->NewByteOffset = pDataEntry->NewByteOffset;
+            pEntry->DataSize = pDataEntry->DataSize;
+            pEntry->dwFlags = MPQ_JOURNAL_SHARED_DATA;
+            continue;
+        }
+
+        /* Load the patch header, if any, to get the size of the file data */
+        hf = CreateFileHandle(ha, pFileEntry);
+        if(hf == NULL)
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+
+        if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
+            nError = AllocatePatchInfo(hf, 1);
+        if(nError == ERROR_SUCCESS)
+        {
+            pEntry->DataSize = pFileEntry->dwCmpSize + ((hf->pPatchInfo != NULL) ? hf->pPatchInfo->dwLength : 0);
+            FileSize = GetCompactedFileSize(ha, hf);
+        }
+        FreeFileHandle(&hf);
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        /* Files overlapping other files in another way, or files placed */
+        /* after the MPQ tables can't be moved in place */
+        if(MpqFilePos > pEntry->OldByteOffset || pEntry->OldByteOffset + FileSize > FirstTablePos)
+        {
+            nError = ERROR_NOT_SUPPORTED;
+            break;
+        }
+
+        pEntry->NewByteOffset = MpqFilePos;
+        MpqFilePos += FileSize;
+        pDataEntry = pEntry;
+    }
+
+    /* Give the entries to the caller */
+    if(nError == ERROR_SUCCESS)
+    {
+        *PtrEntries = pEntries;
+        *PtrEntryCount = dwEntries;
+    }
+    else
+        STORM_FREE(pEntries);
+    return nError;
+}
+
+/* Loads the journal of an interrupted compacting and brings the file table */
+/* to the state after the last file moved. If a file was being moved and its */
+/* original data are in the journal, they are written back to the archive. */
+static int LoadJournal(TMPQArchive * ha, TFileStream * pJournal, TMPQJournalHeader * pJournalHeader, TMPQJournalEntry ** PtrEntries)
+{
+    TMPQJournalEntry * pEntries = NULL;
+    TMPQJournalEntry * pEntry;
+    TMPQFileEntry * pFileEntry;
+    uint64_t ByteOffset = 0;
+    uint64_t RawFilePos;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Load and verify the journal header */
+    if(!FileStream_Read(pJournal, &ByteOffset, pJournalHeader, sizeof(TMPQJournalHeader)))
+        nError = ERROR_FILE_CORRUPT;
+    if(nError == ERROR_SUCCESS)
+    {
+        if(pJournalHeader->dwSignature != MPQ_JOURNAL_SIGNATURE ||
+           pJournalHeader->dwHeaderSize != sizeof(TMPQJournalHeader) ||
+           pJournalHeader->dwEntrySize != sizeof(TMPQJournalEntry) ||
+           pJournalHeader->dwFileTableSize != ha->dwFileTableSize ||
+           pJournalHeader->MpqPos != ha->MpqPos ||
+           pJournalHeader->dwEntries > ha->dwFileTableSize ||
+           pJournalHeader->dwEntriesDone > pJournalHeader->dwEntries)
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    /* Load the journal entries */
+    if(nError == ERROR_SUCCESS)
+    {
+        pEntries = STORM_ALLOC(TMPQJournalEntry, pJournalHeader->dwEntries + 1);
+        if(pEntries == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        ByteOffset = sizeof(TMPQJournalHeader);
+        if(!FileStream_Read(pJournal, &ByteOffset, pEntries, pJournalHeader->dwEntries * sizeof(TMPQJournalEntry)))
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    /* The file table must still be the one the journal was created for. */
+    /* If all files were moved, the new tables may have been saved already. */
+    for(i = 0; nError == ERROR_SUCCESS && i < pJournalHeader->dwEntries; i++)
+    {
+        pEntry = &pEntries[i];
+        if(pEntry->dwFileIndex >= ha->dwFileTableSize)
+        {
+            nError = ERROR_FILE_CORRUPT;
+            break;
+        }
+
+        pFileEntry = ha->pFileTable + pEntry->dwFileIndex;
+        if(pFileEntry->ByteOffset != pEntry->OldByteOffset)
+        {
+            if(pJournalHeader->dwEntriesDone != pJournalHeader->dwEntries || pFileEntry->ByteOffset != pEntry->NewByteOffset)
+                nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    /* Files that have already been moved are at their new positions */
+    if(nError == ERROR_SUCCESS)
+    {
+        for(i = 0; i < pJournalHeader->dwEntriesDone; i++)
+        {
+            pEntry = &pEntries[i];
+            ha->pFileTable[pEntry->dwFileIndex].ByteOffset = pEntry->NewByteOffset;
+        }
+    }
+
+    /* Restore the data of the file that was being moved */
+    if(nError == ERROR_SUCCESS && pJournalHeader->dwBackupEntry != MPQ_JOURNAL_NO_BACKUP)
+    {
+        pEntry = &pEntries[pJournalHeader->dwBackupEntry];
+        if(pJournalHeader->dwBackupEntry == pJournalHeader->dwEntriesDone && pJournalHeader->dwEntriesDone < pJournalHeader->dwEntries &&
+           pJournalHeader->dwBackupSize != 0 && pJournalHeader->dwBackupSize <= pEntry->DataSize)
+        {
+            ByteOffset = sizeof(TMPQJournalHeader) + pJournalHeader->dwEntries * sizeof(TMPQJournalEntry);
+            RawFilePos = FileOffsetFromMpqOffset(ha, pEntry->OldByteOffset);
+            if(!FileStream_Copy(ha->pStream, &RawFilePos, pJournal, &ByteOffset, pJournalHeader->dwBackupSize))
+                nError = GetLastError();
+        }
+        else
+        {
+            nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    /* Give the entries to the caller */
+    if(nError == ERROR_SUCCESS)
+        *PtrEntries = pEntries;
+    else if(pEntries != NULL)
+        STORM_FREE(pEntries);
+    return nError;
+}
+
+/* Moves the files that haven't been moved yet to their new positions */
+static int MoveFilesInPlace(TMPQArchive * ha, uint32_t * pFileKeys, TFileStream * pJournal, TMPQJournalHeader * pJournalHeader, TMPQJournalEntry * pEntries)
+{
+    TMPQJournalEntry * pEntry;
+    TCompactWorker Worker;
+    TMPQFileEntry * pFileEntry;
+    TMPQFile * hf = NULL;
+    uint64_t BackupPos = sizeof(TMPQJournalHeader) + pJournalHeader->dwEntries * sizeof(TMPQJournalEntry);
+    uint64_t ByteOffset;
+    uint64_t RawFilePos;
+    uint64_t NewDataEnd;
+    int nError = ERROR_SUCCESS;
+
+    /* The file data are read through a separate stream, */
+    /* so that reading and writing don't move each other's position */
+    memset(&Worker, 0, sizeof(TCompactWorker));
+    Worker.ha = ha;
+    Worker.pNewStream = ha->pStream;
+    Worker.pOldStream = FileStream_OpenFile(FileStream_GetFileName(ha->pStream), STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE | STREAM_FLAG_READ_ONLY);
+    if(Worker.pOldStream == NULL)
+        return GetLastError();
+
+    while(pJournalHeader->dwEntriesDone < pJournalHeader->dwEntries)
+    {
+        pEntry = &pEntries[pJournalHeader->dwEntriesDone];
+        pFileEntry = ha->pFileTable + pEntry->dwFileIndex;
+
+        /* Move the file data, if the file has any and its position changes. */
+        /* Files sharing the data have already been moved with the previous file. */
+        if(pEntry->DataSize != 0 && pEntry->NewByteOffset != pEntry->OldByteOffset && (pEntry->dwFlags & MPQ_JOURNAL_SHARED_DATA) == 0)
+        {
+            nError = PrepareMpqFile(ha, pFileEntry, pFileKeys[pEntry->dwFileIndex], &hf);
+            if(nError == ERROR_SUCCESS)
+                nError = AllocateSectorBuffer(hf);
+
+            /* If the new file position overlaps the old data, save the part */
+            /* of the old data that gets overwritten to the journal first */
+            NewDataEnd = (nError == ERROR_SUCCESS) ? pEntry->NewByteOffset + GetCompactedFileSize(ha, hf) : 0;
+            if(nError == ERROR_SUCCESS && NewDataEnd > pEntry->OldByteOffset)
+            {
+                pJournalHeader->dwBackupSize = (uint32_t)STORMLIB_MIN(NewDataEnd - pEntry->OldByteOffset, pEntry->DataSize);
+                ByteOffset = BackupPos;
+                RawFilePos = hf->RawFilePos;
+                if(!FileStream_Copy(pJournal, &ByteOffset, Worker.pOldStream, &RawFilePos, pJournalHeader->dwBackupSize))
+                    nError = GetLastError();
+
+                if(nError == ERROR_SUCCESS)
+                {
+                    pJournalHeader->dwBackupEntry = pJournalHeader->dwEntriesDone;
+                    nError = WriteJournalHeader(pJournal, pJournalHeader);
+                }
+            }
+
+            /* Copy the file to its new position */
+            if(nError == ERROR_SUCCESS)
+                nError = CopyMpqFileSectors(&Worker, hf, pEntry->NewByteOffset);
+            if(hf != NULL)
+                FreeFileHandle(&hf);
+            if(nError != ERROR_SUCCESS)
+                break;
+
+            /* Commit the move to the journal */
+            pFileEntry->ByteOffset = pEntry->NewByteOffset;
+            pJournalHeader->dwBackupEntry = MPQ_JOURNAL_NO_BACKUP;
+            pJournalHeader->dwBackupSize = 0;
+            pJournalHeader->dwEntriesDone++;
+            nError = WriteJournalHeader(pJournal, pJournalHeader);
+            if(nError != ERROR_SUCCESS)
+                break;
+        }
+        else
+        {
+            /* Files that stay in place or share the data are done immediately */
+            if((pEntry->dwFlags & MPQ_JOURNAL_SHARED_DATA) == 0)
+                UpdateCompactProgress(&Worker, (uint32_t)pEntry->DataSize);
+            pFileEntry->ByteOffset = pEntry->NewByteOffset;
+            pJournalHeader->dwEntriesDone++;
+        }
+    }
+
+    FileStream_Close(Worker.pOldStream);
+    return nError;
+}
+
 
 /*****************************************************************************/
 /* Public functions                                                          */
@@ -526,6 +1458,8 @@ int EXPORT_SYMBOL SFileCompactArchive(void * hMpq, const char * szListFile, int
         nError = ERROR_INVALID_HANDLE;
     if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
         nError = ERROR_ACCESS_DENIED;
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+        nError = ERROR_COMPACT_INTERRUPTED;
 
     /* If the MPQ is changed at this moment, we have to flush the archive */
     if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_CHANGED))
@@ -533,6 +1467,12 @@ int EXPORT_SYMBOL SFileCompactArchive(void * hMpq, const char * szListFile, int
         SFileFlushArchive(hMpq);
     }
 
+    /* The file names are needed to calculate the file keys */
+    if(nError == ERROR_SUCCESS)
+    {
+        SListFileLoadLazy(ha);
+    }
+
     /* Create the table with file keys */
     if(nError == ERROR_SUCCESS)
     {
@@ -612,7 +1552,12 @@ int EXPORT_SYMBOL SFileCompactArchive(void * hMpq, const char * szListFile, int
 
     /* Now copy all files */
     if(nError == ERROR_SUCCESS)
+    {
         nError = CopyMpqFiles(ha, pFileKeys, pTempStream);
+        ha->FreeSpacePos = 0;
+        FreeChunkBitmap(ha);
+        InvalidateVerifyCache(ha);
+    }
 
     /* If succeeded, switch the streams */
     if(nError == ERROR_SUCCESS)
@@ -642,6 +1587,158 @@ int EXPORT_SYMBOL SFileCompactArchive(void * hMpq, const char * szListFile, int
     return (nError == ERROR_SUCCESS);
 }
 
+int EXPORT_SYMBOL SFileCompactArchiveInPlace(void * hMpq, const char * szListFile)
+{
+    TMPQJournalHeader JournalHeader;
+    TMPQJournalEntry * pEntries = NULL;
+    TFileStream * pJournal = NULL;
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    uint32_t * pFileKeys = NULL;
+    uint32_t dwEntries = 0;
+    char * szJournalName = NULL;
+    int nError = ERROR_SUCCESS;
+
+    /* Test the valid parameters */
+    if(!IsValidMpqHandle(hMpq))
+        nError = ERROR_INVALID_HANDLE;
+    if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_READ_ONLY))
+        nError = ERROR_ACCESS_DENIED;
+
+    /* Malformed archives may have overlapping files or tables */
+    if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_MALFORMED))
+        nError = ERROR_NOT_SUPPORTED;
+
+    /* If there is a journal from an interrupted compacting, load it */
+    if(nError == ERROR_SUCCESS)
+    {
+        if((szJournalName = CreateJournalFileName(ha)) == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        pJournal = FileStream_OpenFile(szJournalName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+        if(pJournal != NULL)
+            nError = LoadJournal(ha, pJournal, &JournalHeader, &pEntries);
+
+        /* The file table matches the file data again, so the deferred */
+        /* (listfile) and (attributes) can be loaded from their new positions */
+        if(nError == ERROR_SUCCESS)
+            ha->dwFlags &= ~MPQ_FLAG_COMPACT_INTERRUPTED;
+    }
+
+    /* If the MPQ is changed at this moment, we have to flush the archive. */
+    /* This is not done when resuming, because the file table is not saved yet */
+    if(nError == ERROR_SUCCESS && pJournal == NULL && (ha->dwFlags & MPQ_FLAG_CHANGED))
+    {
+        SFileFlushArchive(hMpq);
+    }
+
+    /* The file names are needed to calculate the file keys */
+    if(nError == ERROR_SUCCESS)
+    {
+        SListFileLoadLazy(ha);
+    }
+
+    /* Create the table with file keys */
+    if(nError == ERROR_SUCCESS)
+    {
+        if((pFileKeys = STORM_ALLOC(uint32_t, ha->dwFileTableSize)) != NULL)
+            memset(pFileKeys, 0, sizeof(uint32_t) * ha->dwFileTableSize);
+        else
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* Check if we are able to decrypt all files. If not, the archive cannot be compacted. */
+    if(nError == ERROR_SUCCESS)
+    {
+        /* Initialize the progress variables for compact callback */
+        FileStream_GetSize(ha->pStream, &(ha->CompactTotalBytes));
+        ha->CompactBytesProcessed = ha->pHeader->dwHeaderSize;
+        nError = CheckIfAllKeysKnown(ha, szListFile, pFileKeys);
+    }
+
+    /* Calculate the new file positions and create the journal */
+    if(nError == ERROR_SUCCESS && pJournal == NULL)
+    {
+        nError = PlanInPlaceCompact(ha, &pEntries, &dwEntries);
+        if(nError == ERROR_SUCCESS)
+        {
+            memset(&JournalHeader, 0, sizeof(TMPQJournalHeader));
+            JournalHeader.dwSignature = MPQ_JOURNAL_SIGNATURE;
+            JournalHeader.dwHeaderSize = sizeof(TMPQJournalHeader);
+            JournalHeader.dwEntrySize = sizeof(TMPQJournalEntry);
+            JournalHeader.dwFileTableSize = ha->dwFileTableSize;
+            JournalHeader.MpqPos = ha->MpqPos;
+            JournalHeader.dwEntries = dwEntries;
+            JournalHeader.dwBackupEntry = MPQ_JOURNAL_NO_BACKUP;
+
+            pJournal = FileStream_CreateFile(szJournalName, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+            if(pJournal == NULL)
+                nError = GetLastError();
+        }
+
+        if(nError == ERROR_SUCCESS)
+        {
+            if(!FileStream_Write(pJournal, NULL, &JournalHeader, sizeof(TMPQJournalHeader)) ||
+               !FileStream_Write(pJournal, NULL, pEntries, dwEntries * sizeof(TMPQJournalEntry)))
+                nError = GetLastError();
+        }
+    }
+
+    /* Move the files */
+    if(nError == ERROR_SUCCESS)
+    {
+        nError = MoveFilesInPlace(ha, pFileKeys, pJournal, &JournalHeader, pEntries);
+        FreeChunkBitmap(ha);
+        InvalidateVerifyCache(ha);
+    }
+
+    /* Save the tables after the last file. This also cuts the archive. */
+    if(nError == ERROR_SUCCESS)
+    {
+        ha->dwFlags |= MPQ_FLAG_CHANGED;
+        ha->FreeSpacePos = 0;
+        if(!SFileFlushArchive(hMpq))
+            nError = GetLastError();
+    }
+
+    /* The compacting is complete, so the journal is no longer needed */
+    if(nError == ERROR_SUCCESS)
+    {
+        FileStream_Close(pJournal);
+        pJournal = NULL;
+        remove(szJournalName);
+    }
+
+    /* Final user notification */
+    if(nError == ERROR_SUCCESS && ha->pfnCompactCB != NULL)
+    {
+        ha->CompactBytesProcessed += (ha->pHeader->dwHashTableSize * sizeof(TMPQHash));
+        ha->CompactBytesProcessed += (ha->dwFileTableSize * sizeof(TMPQBlock));
+        ha->pfnCompactCB(ha->pvCompactUserData, CCB_CLOSING_ARCHIVE, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+    }
+
+    /* Cleanup and return. If anything failed, the journal stays */
+    /* so that the next call can finish the compacting. Until then, */
+    /* the archive must not be read or changed */
+    if(pJournal != NULL)
+    {
+        if(nError != ERROR_SUCCESS)
+            ha->dwFlags |= MPQ_FLAG_COMPACT_INTERRUPTED;
+        FileStream_Close(pJournal);
+    }
+    if(pEntries != NULL)
+        STORM_FREE(pEntries);
+    if(pFileKeys != NULL)
+        STORM_FREE(pFileKeys);
+    if(szJournalName != NULL)
+        STORM_FREE(szJournalName);
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
 /*-----------------------------------------------------------------------------
  * Changing hash table size
  */
@@ -664,6 +1761,8 @@ int EXPORT_SYMBOL SFileSetMaxFileCount(void * hMpq, uint32_t dwMaxFileCount)
         nError = ERROR_INVALID_HANDLE;
     if(ha->dwFlags & MPQ_FLAG_READ_ONLY)
         nError = ERROR_ACCESS_DENIED;
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+        nError = ERROR_COMPACT_INTERRUPTED;
     if(dwMaxFileCount < ha->dwFileTableSize)
         nError = ERROR_DISK_FULL;
 
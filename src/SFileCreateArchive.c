@@ -127,7 +127,9 @@ int EXPORT_SYMBOL SFileCreateArchive2(const char * szMpqName, PSFILE_CREATE_MPQ
        (pCreateInfo->pvUserData != NULL || pCreateInfo->cbUserData != 0)               ||
        (pCreateInfo->dwAttrFlags & ~MPQ_ATTRIBUTE_ALL)                                 ||
        (pCreateInfo->dwSectorSize & (pCreateInfo->dwSectorSize - 1))                   ||
-       (pCreateInfo->dwRawChunkSize & (pCreateInfo->dwRawChunkSize - 1)))
+       (pCreateInfo->dwRawChunkSize & (pCreateInfo->dwRawChunkSize - 1))               ||
+       (pCreateInfo->dwRawChunkSize != 0 && pCreateInfo->dwRawChunkSize < MPQ_RAW_CHUNK_SIZE_MIN) ||
+       (pCreateInfo->dwRawChunkSize > MPQ_RAW_CHUNK_SIZE_MAX))
     {
         SetLastError(ERROR_INVALID_PARAMETER);
         return 0;
@@ -12,10 +12,40 @@
 #include "thunderStorm.h"
 #include "StormCommon.h"
 
+/* Size of the buffer for extracting file data */
+#define EXTRACT_BUFFER_SIZE 0x100000
+
+/* Returns nonzero if the file data are stored in the MPQ as they are, */
+/* so they can be copied to the local file without reading them through */
+/* SFileReadFile */
+static int CanExtractFileRaw(TMPQFile * hf)
+{
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
+
+    /* Local files, patched files and MPK files are read a special way */
+    if(hf->pStream != NULL || hf->hfPatch != NULL || hf->ha->dwSubType == MPQ_SUBTYPE_MPK)
+        return 0;
+
+    /* With MPQ_OPEN_CHECK_RAW_MD5, the data must be read through SFileReadFile, */
+    /* which checks the MD5 of each raw chunk */
+    if(hf->ha->dwFlags & MPQ_FLAG_CHECK_RAW_MD5)
+        return 0;
+
+    /* The data must be neither compressed, encrypted nor a patch */
+    if(pFileEntry->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE))
+        return 0;
+    return (pFileEntry->dwCmpSize == pFileEntry->dwFileSize);
+}
+
 int EXPORT_SYMBOL SFileExtractFile(void * hMpq, const char * szToExtract, const char * szExtracted, uint32_t dwSearchScope)
 {
     TFileStream * pLocalFile = NULL;
+    TMPQFile * hf = NULL;
+    uint8_t * pbBuffer = NULL;
+    uint64_t RawFilePos;
+    uint32_t dwBufferSize = EXTRACT_BUFFER_SIZE;
     void * hMpqFile = NULL;
+    int bCopyRaw = 0;
     int nError = ERROR_SUCCESS;
 
     /* Open the MPQ file */
@@ -23,6 +53,7 @@ int EXPORT_SYMBOL SFileExtractFile(void * hMpq, const char * szToExtract, const
     {
         if(!SFileOpenFileEx(hMpq, szToExtract, dwSearchScope, &hMpqFile))
             nError = GetLastError();
+        hf = (TMPQFile *)hMpqFile;
     }
 
     /* Create the local file */
@@ -33,15 +64,36 @@ int EXPORT_SYMBOL SFileExtractFile(void * hMpq, const char * szToExtract, const
             nError = GetLastError();
     }
 
+    /* Files stored as plain data are copied directly from the archive */
+    if(nError == ERROR_SUCCESS && CanExtractFileRaw(hf))
+    {
+        RawFilePos = CalculateRawSectorOffset(hf, 0);
+        if(!FileStream_Copy(pLocalFile, NULL, hf->ha->pStream, &RawFilePos, hf->pFileEntry->dwFileSize))
+            nError = GetLastError();
+        bCopyRaw = 1;
+    }
+
+    /* Other files are decoded into a large buffer. When the buffer size */
+    /* is a multiple of the sector size, the sectors are decoded directly */
+    /* into it and no sector is decoded twice */
+    if(nError == ERROR_SUCCESS && bCopyRaw == 0)
+    {
+        if(hf->ha != NULL && hf->ha->dwSectorSize != 0 && hf->ha->dwSectorSize < EXTRACT_BUFFER_SIZE)
+            dwBufferSize = (EXTRACT_BUFFER_SIZE / hf->ha->dwSectorSize) * hf->ha->dwSectorSize;
+
+        pbBuffer = STORM_ALLOC(uint8_t, dwBufferSize);
+        if(pbBuffer == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
     /* Copy the file's content */
-    while(nError == ERROR_SUCCESS)
+    while(nError == ERROR_SUCCESS && bCopyRaw == 0)
     {
-        char  szBuffer[0x1000];
         size_t dwTransferred = 0;
 
         /* dwTransferred is only set to nonzero if something has been read. */
         /* nError can be ERROR_SUCCESS or ERROR_HANDLE_EOF */
-        if(!SFileReadFile(hMpqFile, szBuffer, sizeof(szBuffer), &dwTransferred))
+        if(!SFileReadFile(hMpqFile, pbBuffer, dwBufferSize, &dwTransferred))
             nError = GetLastError();
         if(nError == ERROR_HANDLE_EOF)
             nError = ERROR_SUCCESS;
@@ -49,11 +101,13 @@ int EXPORT_SYMBOL SFileExtractFile(void * hMpq, const char * szToExtract, const
             break;
 
         /* If something has been actually read, write it */
-        if(!FileStream_Write(pLocalFile, NULL, szBuffer, dwTransferred))
+        if(!FileStream_Write(pLocalFile, NULL, pbBuffer, dwTransferred))
             nError = GetLastError();
     }
 
     /* Close the files */
+    if(pbBuffer != NULL)
+        STORM_FREE(pbBuffer);
     if(hMpqFile != NULL)
         SFileCloseFile(hMpqFile);
     if(pLocalFile != NULL)
@@ -29,13 +29,24 @@ typedef int (*MPQSEARCH)(TMPQSearch *, SFILE_FIND_DATA *); */
 typedef struct 
 {
     TMPQArchive * ha;                   /* Handle to MPQ, where the search runs */
-    TFileEntry ** pSearchTable;         /* Table for files that have been already found */
+    TMPQFileEntry ** pSearchTable;         /* Table for files that have been already found */
+    uint32_t * pFileIndexes;            /* File indexes matching the mask prefix, sorted (NULL = search all entries) */
+    uint32_t  dwFileIndexes;               /* Number of items in pFileIndexes */
     uint32_t  dwSearchTableItems;          /* Number of items in the search table */
-    uint32_t  dwNextIndex;                 /* Next file index to be checked */
+    uint32_t  dwNextIndex;                 /* Next file index to be checked (or next item in pFileIndexes) */
     uint32_t  dwFlagMask;                  /* For checking flag mask */
-    char   szSearchMask[1];             /* Search mask (variable length) */
+    TMPQWildCard * pWildCard;           /* Compiled search mask */
 } TMPQSearch;
 
+/* Used by enumerating the file table entries */
+typedef struct
+{
+    TMPQArchive * ha;                   /* Handle to MPQ, where the search runs */
+    uint32_t * pHashIndexes;            /* Hash table index for each file entry (HASH_ENTRY_FREE if none) */
+    uint32_t  dwHashIndexes;            /* Number of items in pHashIndexes */
+    uint32_t  dwNextIndex;              /* Next file index to be checked */
+} TMPQEntrySearch;
+
 /*-----------------------------------------------------------------------------
  * Local functions
  */
@@ -137,6 +148,380 @@ int CheckWildCard(const char * szString, const char * szWildCard)
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Compiled wildcard
+ *
+ * The search mask is compiled once per search. Literal characters are
+ * upper-cased by AsciiToUpperTable, and each group of '*' (with the '?'
+ * that follow it) becomes a single '*', as CheckWildCard skips them alike.
+ * CheckWildCard takes the first occurrence of the literal run after '*'
+ * and never backtracks, so each such run is searched by a KMP automaton,
+ * which finds the same occurrence in one pass over the name. The literal
+ * prefix, the suffix and the minimal length reject most names early.
+ */
+
+/* Builds the KMP failure function for a literal run of the compiled mask */
+static void BuildWildCardFailure(const char * szRun, uint32_t * pFailure, size_t nRunLength)
+{
+    size_t nBorder = 0;
+    size_t i;
+
+    pFailure[0] = 0;
+    for(i = 1; i < nRunLength; i++)
+    {
+        while(nBorder > 0 && szRun[i] != szRun[nBorder])
+            nBorder = pFailure[nBorder - 1];
+        if(szRun[i] == szRun[nBorder])
+            nBorder++;
+        pFailure[i] = (uint32_t)nBorder;
+    }
+}
+
+/* Finds the first occurrence of a literal run in the name. */
+/* Returns pointer after the occurrence or NULL if not found */
+static const uint8_t * FindWildCardRun(const char * szRun, const uint32_t * pFailure, size_t nRunLength, const uint8_t * pbString)
+{
+    size_t nMatched = 0;
+    uint8_t ch;
+
+    while(*pbString != 0)
+    {
+        ch = AsciiToUpperTable[*pbString++];
+        while(nMatched > 0 && (uint8_t)szRun[nMatched] != ch)
+            nMatched = pFailure[nMatched - 1];
+        if((uint8_t)szRun[nMatched] == ch)
+            nMatched++;
+        if(nMatched == nRunLength)
+            return pbString;
+    }
+
+    return NULL;
+}
+
+TMPQWildCard * CompileWildCard(const char * szWildCard)
+{
+    TMPQWildCard * pWildCard;
+    size_t nMaxLength = 0;
+    size_t nLength = 0;
+    size_t nRunLength;
+    size_t i;
+    char * szMask;
+
+    /* Allocate the compiled mask. Note that NULL mask never matches, same like in CheckWildCard */
+    if(szWildCard != NULL)
+        nMaxLength = strlen(szWildCard);
+    pWildCard = (TMPQWildCard *)STORM_ALLOC(uint8_t, sizeof(TMPQWildCard) + (nMaxLength + 1) * sizeof(uint32_t) + nMaxLength + 1);
+    if(pWildCard == NULL)
+        return NULL;
+
+    memset(pWildCard, 0, sizeof(TMPQWildCard));
+    pWildCard->pTable = (uint32_t *)(pWildCard + 1);
+    pWildCard->szMask = szMask = (char *)(pWildCard->pTable + nMaxLength + 1);
+
+    /* Copy the mask, upper-case it and collapse the groups of stars */
+    while(szWildCard != NULL && *szWildCard != 0)
+    {
+        if(*szWildCard == '*')
+        {
+            while(*szWildCard == '*' || *szWildCard == '?')
+                szWildCard++;
+            szMask[nLength++] = '*';
+            continue;
+        }
+
+        szMask[nLength++] = (*szWildCard == '?') ? '?' : (char)AsciiToUpperTable[(uint8_t)*szWildCard];
+        szWildCard++;
+    }
+    szMask[nLength] = 0;
+    pWildCard->nLength = nLength;
+
+    /* Get the literal prefix and the number of literal characters */
+    while(szMask[pWildCard->nPrefixLength] != 0 && szMask[pWildCard->nPrefixLength] != '?' && szMask[pWildCard->nPrefixLength] != '*')
+        pWildCard->nPrefixLength++;
+    for(i = 0; i < nLength; i++)
+    {
+        if(szMask[i] != '?' && szMask[i] != '*')
+            pWildCard->nMinLength++;
+    }
+
+    /* If the mask doesn't end with star, the name must end */
+    /* with the part of the mask that follows the last star */
+    for(i = nLength; i > 0 && szMask[i - 1] != '*'; i--);
+    if(i > 0)
+    {
+        pWildCard->nSuffixOffset = i;
+        pWildCard->nSuffixLength = nLength - i;
+    }
+
+    /* CheckWildCard lets '?' skip past the end of the name. That only gives */
+    /* a match if the rest of the mask is made of '?' and at least one '*' */
+    pWildCard->nPastEndOffset = (size_t)-1;
+    for(i = nLength; i > 0 && (szMask[i - 1] == '?' || szMask[i - 1] == '*'); i--);
+    if(strchr(szMask + i, '*') != NULL)
+        pWildCard->nPastEndOffset = i;
+
+    /* For each star, store the length of the literal run that follows, */
+    /* followed by the KMP failure function of that run */
+    for(i = 0; i < nLength; i++)
+    {
+        if(szMask[i] == '*')
+        {
+            nRunLength = strcspn(szMask + i + 1, "?*");
+            pWildCard->pTable[i] = (uint32_t)nRunLength;
+            if(nRunLength != 0)
+                BuildWildCardFailure(szMask + i + 1, pWildCard->pTable + i + 1, nRunLength);
+        }
+    }
+
+    return pWildCard;
+}
+
+/* Gives the same result as CheckWildCard(szString, szWildCard) */
+int MatchWildCard(TMPQWildCard * pWildCard, const char * szString)
+{
+    const uint8_t * pbString = (const uint8_t *)szString;
+    const char * szMask = pWildCard->szMask;
+    size_t nStringLength;
+    size_t nRunLength;
+    size_t i;
+
+    /* Empty mask never matches, single star always matches */
+    if(pWildCard->nLength == 0)
+        return 0;
+    if(pWildCard->nLength == 1 && szMask[0] == '*')
+        return 1;
+
+    /* Check the literal prefix */
+    for(i = 0; i < pWildCard->nPrefixLength; i++)
+    {
+        if(AsciiToUpperTable[pbString[i]] != (uint8_t)szMask[i])
+            return 0;
+    }
+
+    /* Check the minimal length and the suffix */
+    if(pWildCard->nSuffixLength != 0 || pWildCard->nMinLength > pWildCard->nPrefixLength)
+    {
+        nStringLength = i + strlen(szString + i);
+        if(nStringLength < pWildCard->nMinLength || nStringLength < i + pWildCard->nSuffixLength)
+            return 0;
+        for(i = 0; i < pWildCard->nSuffixLength; i++)
+        {
+            if(szMask[pWildCard->nSuffixOffset + i] != '?' && (uint8_t)szMask[pWildCard->nSuffixOffset + i] != AsciiToUpperTable[pbString[nStringLength - pWildCard->nSuffixLength + i]])
+                return 0;
+        }
+    }
+
+    /* Run the mask past the prefix */
+    pbString += pWildCard->nPrefixLength;
+    i = pWildCard->nPrefixLength;
+    for(;;)
+    {
+        switch(szMask[i])
+        {
+            case 0:
+                return (*pbString == 0);
+
+            case '?':
+                if(*pbString == 0)
+                    return (i >= pWildCard->nPastEndOffset);
+                pbString++;
+                i++;
+                break;
+
+            case '*':
+                nRunLength = pWildCard->pTable[i++];
+                if(nRunLength == 0)
+                    return 1;
+                pbString = FindWildCardRun(szMask + i, pWildCard->pTable + i, nRunLength, pbString);
+                if(pbString == NULL)
+                    return 0;
+                i += nRunLength;
+                break;
+
+            default:
+                if(AsciiToUpperTable[*pbString] != (uint8_t)szMask[i])
+                    return 0;
+                pbString++;
+                i++;
+                break;
+        }
+    }
+}
+
+void FreeWildCard(TMPQWildCard * pWildCard)
+{
+    if(pWildCard != NULL)
+        STORM_FREE(pWildCard);
+}
+
+/*-----------------------------------------------------------------------------
+ * Sorted name index
+ *
+ * Masks that begin with a literal prefix (like "World\\Maps\\*") only
+ * need to check the names that begin with that prefix. Those are found
+ * by a binary search in the name index, which is built on the first such
+ * search and dropped when file names change. The names are compared
+ * the same way CheckWildCard compares them.
+ */
+
+static int CompareNames(const char * szName1, const char * szName2, size_t nMaxLength)
+{
+    const uint8_t * pbName1 = (const uint8_t *)szName1;
+    const uint8_t * pbName2 = (const uint8_t *)szName2;
+    size_t i;
+
+    for(i = 0; i < nMaxLength; i++)
+    {
+        if(AsciiToUpperTable[pbName1[i]] != AsciiToUpperTable[pbName2[i]])
+            return (AsciiToUpperTable[pbName1[i]] < AsciiToUpperTable[pbName2[i]]) ? -1 : 1;
+        if(pbName1[i] == 0)
+            break;
+    }
+
+    return 0;
+}
+
+static int CompareNameIndexEntries(const void * p1, const void * p2)
+{
+    const TMPQNameIndexEntry * pEntry1 = (const TMPQNameIndexEntry *)p1;
+    const TMPQNameIndexEntry * pEntry2 = (const TMPQNameIndexEntry *)p2;
+    int nResult;
+
+    nResult = CompareNames(pEntry1->szFileName, pEntry2->szFileName, (size_t)-1);
+    if(nResult == 0)
+        nResult = (pEntry1->dwFileIndex < pEntry2->dwFileIndex) ? -1 : 1;
+    return nResult;
+}
+
+static int CompareFileIndexes(const void * p1, const void * p2)
+{
+    uint32_t dwFileIndex1 = *(const uint32_t *)p1;
+    uint32_t dwFileIndex2 = *(const uint32_t *)p2;
+
+    return (dwFileIndex1 < dwFileIndex2) ? -1 : (dwFileIndex1 > dwFileIndex2);
+}
+
+static TMPQNameIndex * BuildNameIndex(TMPQArchive * ha)
+{
+    TMPQNameIndex * pNameIndex;
+    TMPQFileEntry * pFileEntry;
+    uint32_t dwEntries = 0;
+    uint32_t i;
+
+    /* Count the named entries */
+    for(i = 0; i < ha->dwFileTableSize; i++)
+    {
+        if(ha->pFileTable[i].szFileName != NULL)
+            dwEntries++;
+    }
+
+    /* Allocate the index */
+    pNameIndex = (TMPQNameIndex *)STORM_ALLOC(uint8_t, sizeof(TMPQNameIndex) + dwEntries * sizeof(TMPQNameIndexEntry));
+    if(pNameIndex != NULL)
+    {
+        /* Fill the entries and sort them by name */
+        pNameIndex->dwEntries = 0;
+        for(i = 0; i < ha->dwFileTableSize; i++)
+        {
+            pFileEntry = ha->pFileTable + i;
+            if(pFileEntry->szFileName != NULL)
+            {
+                pNameIndex->Entries[pNameIndex->dwEntries].szFileName = pFileEntry->szFileName;
+                pNameIndex->Entries[pNameIndex->dwEntries].dwFileIndex = i;
+                pNameIndex->dwEntries++;
+            }
+        }
+
+        qsort(pNameIndex->Entries, pNameIndex->dwEntries, sizeof(TMPQNameIndexEntry), CompareNameIndexEntries);
+    }
+
+    return pNameIndex;
+}
+
+/* Returns the length of the literal prefix of the mask, */
+/* or 0 if the mask can't be resolved by the name index */
+static size_t GetIndexedPrefixLength(TMPQArchive * ha, const char * szMask)
+{
+    const char * szPseudoName = "FILE00000000.";
+    size_t nLength = 0;
+    size_t i;
+
+    /* Patched archives merge names of multiple MPQs */
+    if(ha->haPatch != NULL)
+        return 0;
+
+    /* Find the first wildcard character */
+    while(szMask[nLength] != 0 && szMask[nLength] != '*' && szMask[nLength] != '?')
+        nLength++;
+
+    /* Files without name are found under a pseudo-name "File########.ext". */
+    /* If the prefix can match such name, all file entries must be checked */
+    for(i = 0; i < nLength && i < 13; i++)
+    {
+        if(i >= 4 && i < 12)
+        {
+            if(szMask[i] < '0' || szMask[i] > '9')
+                break;
+        }
+        else
+        {
+            if(AsciiToUpperTable[(uint8_t)szMask[i]] != (uint8_t)szPseudoName[i])
+                break;
+        }
+    }
+
+    return (i < nLength && i < 13) ? nLength : 0;
+}
+
+/* Finds the indexes of all named file entries that begin with the prefix */
+static int FindFilesByPrefix(TMPQSearch * hs, const char * szPrefix, size_t nLength)
+{
+    TMPQArchive * ha = hs->ha;
+    TMPQNameIndex * pNameIndex;
+    uint32_t dwFirst = 0;
+    uint32_t dwLast;
+    uint32_t dwMiddle;
+    uint32_t i;
+
+    /* Build the name index, if not done yet */
+    if(ha->pNameIndex == NULL)
+    {
+        ha->pNameIndex = BuildNameIndex(ha);
+        if(ha->pNameIndex == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    pNameIndex = ha->pNameIndex;
+
+    /* Find the first entry that is not less than the prefix */
+    dwLast = pNameIndex->dwEntries;
+    while(dwFirst < dwLast)
+    {
+        dwMiddle = dwFirst + (dwLast - dwFirst) / 2;
+        if(CompareNames(pNameIndex->Entries[dwMiddle].szFileName, szPrefix, nLength) < 0)
+            dwFirst = dwMiddle + 1;
+        else
+            dwLast = dwMiddle;
+    }
+
+    /* Find the end of the range of names that begin with the prefix */
+    for(dwLast = dwFirst; dwLast < pNameIndex->dwEntries; dwLast++)
+    {
+        if(CompareNames(pNameIndex->Entries[dwLast].szFileName, szPrefix, nLength) != 0)
+            break;
+    }
+
+    /* Copy the file indexes to the search. They are sorted, */
+    /* so that the files are found in the same order like without the index */
+    hs->pFileIndexes = STORM_ALLOC(uint32_t, (dwLast - dwFirst) + 1);
+    if(hs->pFileIndexes == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for(i = dwFirst; i < dwLast; i++)
+        hs->pFileIndexes[hs->dwFileIndexes++] = pNameIndex->Entries[i].dwFileIndex;
+    qsort(hs->pFileIndexes, hs->dwFileIndexes, sizeof(uint32_t), CompareFileIndexes);
+    return ERROR_SUCCESS;
+}
+
 static uint32_t GetSearchTableItems(TMPQArchive * ha)
 {
     uint32_t dwMergeItems = 0;
@@ -158,9 +543,9 @@ static uint32_t GetSearchTableItems(TMPQArchive * ha)
 static int FileWasFoundBefore(
     TMPQArchive * ha,
     TMPQSearch * hs,
-    TFileEntry * pFileEntry)
+    TMPQFileEntry * pFileEntry)
 {
-    TFileEntry * pEntry;
+    TMPQFileEntry * pEntry;
     char * szRealFileName = pFileEntry->szFileName;
     uint32_t dwStartIndex;
     uint32_t dwNameHash;
@@ -216,10 +601,10 @@ static int FileWasFoundBefore(
     return 0;
 }
 
-static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
+static TMPQFileEntry * FindPatchEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry, TMPQArchive ** pha)
 {
-    TFileEntry * pPatchEntry = NULL;
-    TFileEntry * pTempEntry;
+    TMPQFileEntry * pPatchEntry = NULL;
+    TMPQFileEntry * pTempEntry;
     char szFileName[MAX_PATH];
 
     /* Go while there are patches */
@@ -237,7 +622,10 @@ static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
         /* Try to find the file there */
         pTempEntry = GetFileEntryExact(ha, szFileName, 0, NULL);
         if(pTempEntry != NULL)
+        {
             pPatchEntry = pTempEntry;
+            *pha = ha;
+        }
     }
 
     /* Return the found patch entry */
@@ -248,12 +636,14 @@ static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
 static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
 {
     TMPQArchive * ha = hs->ha;
-    TFileEntry * pFileTableEnd;
-    TFileEntry * pPatchEntry;
-    TFileEntry * pFileEntry;
+    TMPQArchive * haPatch;
+    TMPQFileEntry * pPatchEntry;
+    TMPQFileEntry * pFileEntry;
     const char * szFileName;
-    void * hFile;
+    TMPQFile * hf;
     char szNameBuff[MAX_PATH];
+    uint64_t FileTime;
+    uint32_t dwSearchCount;
     uint32_t dwBlockIndex;
     size_t nPrefixLength;
 
@@ -261,18 +651,23 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
     while(ha != NULL)
     {
         /* Now parse the file entry table in order to get all files. */
-        pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-        pFileEntry = ha->pFileTable + hs->dwNextIndex;
+        /* If the mask has a literal prefix, only parse the entries that match it */
+        dwSearchCount = (hs->pFileIndexes != NULL) ? hs->dwFileIndexes : ha->dwFileTableSize;
 
         /* Get the length of the patch prefix (0 if none) */
         nPrefixLength = (ha->pPatchPrefix != NULL) ? ha->pPatchPrefix->nLength : 0;
 
         /* Parse the file table */
-        while(pFileEntry < pFileTableEnd)
+        while(hs->dwNextIndex < dwSearchCount)
         {
-            /* Increment the next index for subsequent search */
+            /* Get the file entry and increment the next index for subsequent search */
+            dwBlockIndex = (hs->pFileIndexes != NULL) ? hs->pFileIndexes[hs->dwNextIndex] : hs->dwNextIndex;
+            pFileEntry = ha->pFileTable + dwBlockIndex;
             hs->dwNextIndex++;
 
+            /* Decode the file entry from the BET table, if not done yet */
+            DecodeFileEntry(ha, dwBlockIndex);
+
             /* Is it a file but not a patch file? */
             if((pFileEntry->dwFlags & hs->dwFlagMask) == MPQ_FILE_EXISTS)
             {
@@ -283,24 +678,21 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
 /*                      DebugBreak(); */
 
                     /* Find a patch to this file */
-                    pPatchEntry = FindPatchEntry(ha, pFileEntry);
+                    haPatch = ha;
+                    pPatchEntry = FindPatchEntry(ha, pFileEntry, &haPatch);
                     if(pPatchEntry == NULL)
                         pPatchEntry = pFileEntry;
 
-                    /* Prepare the block index */
-                    dwBlockIndex = (uint32_t)(pFileEntry - ha->pFileTable);
-
                     /* Get the file name. If it's not known, we will create pseudo-name */
                     szFileName = pFileEntry->szFileName;
                     if(szFileName == NULL)
                     {
-                        /* Open the file by its pseudo-name. */
-                        sprintf(szNameBuff, "File%08u.xxx", (unsigned int)dwBlockIndex);
-                        if(SFileOpenFileEx((void *)hs->ha, szNameBuff, SFILE_OPEN_BASE_FILE, &hFile))
+                        /* Open the file by its index. The hash entry is not needed for the pseudo-name */
+                        if(OpenFileEntry(ha, dwBlockIndex, HASH_ENTRY_FREE, &hf) == ERROR_SUCCESS)
                         {
-                            SFileGetFileName(hFile, szNameBuff);
+                            SFileGetFileName((void *)hf, szNameBuff);
                             szFileName = szNameBuff;
-                            SFileCloseFile(hFile);
+                            SFileCloseFile((void *)hf);
                         }
                     }
 
@@ -308,7 +700,7 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
                     if(szFileName != NULL)
                     {
                         /* Check the file name against the wildcard */
-                        if(CheckWildCard(szFileName + nPrefixLength, hs->szSearchMask))
+                        if(MatchWildCard(hs->pWildCard, szFileName + nPrefixLength))
                         {
                             /* Fill the found entry. hash entry and block index are taken from the base MPQ */
                             lpFindFileData->dwBlockIndex = dwBlockIndex;
@@ -318,8 +710,9 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
                             lpFindFileData->lcLocale     = 0; /* pPatchEntry->lcLocale; */
 
                             /* Fill the filetime */
-                            lpFindFileData->dwFileTimeHi = (uint32_t)(pPatchEntry->FileTime >> 32);
-                            lpFindFileData->dwFileTimeLo = (uint32_t)(pPatchEntry->FileTime);
+                            FileTime = GetFileEntryTime(haPatch, pPatchEntry);
+                            lpFindFileData->dwFileTimeHi = (uint32_t)(FileTime >> 32);
+                            lpFindFileData->dwFileTimeLo = (uint32_t)(FileTime);
 
                             /* Fill the file name and plain file name */
                             strcpy(lpFindFileData->cFileName, szFileName + nPrefixLength);
@@ -329,8 +722,6 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
                     }
                 }
             }
-
-            pFileEntry++;
         }
 
         /* If there is no more patches in the chain, stop it. */
@@ -348,12 +739,108 @@ static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
     return ERROR_NO_MORE_FILES;
 }
 
+/* Builds the hash table index of each file entry in one pass over the hash table */
+static uint32_t * BuildHashIndexes(TMPQArchive * ha)
+{
+    TMPQHash * pHashTableEnd;
+    TMPQHash * pHash;
+    uint32_t * pHashIndexes;
+    uint32_t i;
+
+    pHashIndexes = STORM_ALLOC(uint32_t, ha->dwFileTableSize + 1);
+    if(pHashIndexes != NULL)
+    {
+        for(i = 0; i < ha->dwFileTableSize; i++)
+            pHashIndexes[i] = HASH_ENTRY_FREE;
+
+        if(ha->pHashTable != NULL)
+        {
+            pHashTableEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
+            for(pHash = ha->pHashTable; pHash < pHashTableEnd; pHash++)
+            {
+                if(pHash->dwBlockIndex < ha->dwFileTableSize)
+                {
+                    /* If multiple hash entries point to the file entry, */
+                    /* mark it as duplicate, same like FindHashIndex does */
+                    i = pHash->dwBlockIndex;
+                    pHashIndexes[i] = (pHashIndexes[i] == HASH_ENTRY_FREE) ? (uint32_t)(pHash - ha->pHashTable) : HASH_ENTRY_DELETED;
+                }
+            }
+
+            for(i = 0; i < ha->dwFileTableSize; i++)
+            {
+                if(pHashIndexes[i] == HASH_ENTRY_DELETED)
+                    pHashIndexes[i] = HASH_ENTRY_FREE;
+            }
+        }
+    }
+
+    return pHashIndexes;
+}
+
+/* Performs one file table entry search */
+static int DoEntrySearch(TMPQEntrySearch * hs, SFILE_ENTRY_DATA * lpEntryData)
+{
+    TMPQArchive * ha = hs->ha;
+    TMPQFileEntry * pFileEntry;
+    TMPQHash * pHash = NULL;
+    uint32_t dwSearchCount;
+    uint32_t dwHashIndex;
+    uint32_t dwFileIndex;
+
+    /* The file table may have been changed since the search started */
+    dwSearchCount = STORMLIB_MIN(hs->dwHashIndexes, ha->dwFileTableSize);
+
+    while(hs->dwNextIndex < dwSearchCount)
+    {
+        /* Get the file entry and increment the next index for subsequent search */
+        dwFileIndex = hs->dwNextIndex++;
+        DecodeFileEntry(ha, dwFileIndex);
+        pFileEntry = ha->pFileTable + dwFileIndex;
+
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            /* Only use the hash index if it still points to the file */
+            dwHashIndex = hs->pHashIndexes[dwFileIndex];
+            if(dwHashIndex != HASH_ENTRY_FREE)
+            {
+                if(ha->pHashTable != NULL && dwHashIndex < ha->pHeader->dwHashTableSize && ha->pHashTable[dwHashIndex].dwBlockIndex == dwFileIndex)
+                    pHash = ha->pHashTable + dwHashIndex;
+                else
+                    dwHashIndex = HASH_ENTRY_FREE;
+            }
+
+            /* Fill the entry data */
+            lpEntryData->ByteOffset   = pFileEntry->ByteOffset;
+            lpEntryData->FileTime     = GetFileEntryTime(ha, pFileEntry);
+            lpEntryData->FileNameHash = pFileEntry->FileNameHash;
+            lpEntryData->szFileName   = pFileEntry->szFileName;
+            lpEntryData->dwFileIndex  = dwFileIndex;
+            lpEntryData->dwHashIndex  = dwHashIndex;
+            lpEntryData->dwNameHash1  = (pHash != NULL) ? pHash->dwName1 : 0;
+            lpEntryData->dwNameHash2  = (pHash != NULL) ? pHash->dwName2 : 0;
+            lpEntryData->lcLocale     = (pHash != NULL) ? pHash->lcLocale : 0;
+            lpEntryData->dwFileSize   = pFileEntry->dwFileSize;
+            lpEntryData->dwCompSize   = pFileEntry->dwCmpSize;
+            lpEntryData->dwFileFlags  = pFileEntry->dwFlags;
+            return ERROR_SUCCESS;
+        }
+    }
+
+    /* No more files found, return error */
+    return ERROR_NO_MORE_FILES;
+}
+
 static void FreeMPQSearch(TMPQSearch ** hs)
 {
     if(hs != NULL)
     {
         if((*hs)->pSearchTable != NULL)
             STORM_FREE((*hs)->pSearchTable);
+        if((*hs)->pFileIndexes != NULL)
+            STORM_FREE((*hs)->pFileIndexes);
+        if((*hs)->pWildCard != NULL)
+            FreeWildCard((*hs)->pWildCard);
         STORM_FREE(*hs);
         *hs = NULL;
     }
@@ -367,6 +854,7 @@ void EXPORT_SYMBOL * SFileFindFirstFile(void * hMpq, const char * szMask, SFILE_
 {
     TMPQArchive * ha = (TMPQArchive *)hMpq;
     TMPQSearch * hs = NULL;
+    size_t nPrefixLength;
     size_t nSize  = 0;
     int nError = ERROR_SUCCESS;
 
@@ -382,10 +870,14 @@ void EXPORT_SYMBOL * SFileFindFirstFile(void * hMpq, const char * szMask, SFILE_
     if(nError == ERROR_SUCCESS && szListFile != NULL && *szListFile != 0)
         nError = SFileAddListFile((void *)ha, szListFile);
 
+    /* Enumeration needs the file names. Ignore the result, (listfile) is optional */
+    if(nError == ERROR_SUCCESS)
+        SListFileLoadLazy(ha);
+
     /* Allocate the structure for MPQ search */
     if(nError == ERROR_SUCCESS)
     {
-        nSize = sizeof(TMPQSearch) + strlen(szMask) + 1;
+        nSize = sizeof(TMPQSearch);
         if((hs = (TMPQSearch *)STORM_ALLOC(char, nSize)) == NULL)
             nError = ERROR_NOT_ENOUGH_MEMORY;
     }
@@ -394,24 +886,36 @@ void EXPORT_SYMBOL * SFileFindFirstFile(void * hMpq, const char * szMask, SFILE_
     if(nError == ERROR_SUCCESS)
     {
         memset(hs, 0, sizeof(TMPQSearch));
-        strcpy(hs->szSearchMask, szMask);
         hs->dwFlagMask = MPQ_FILE_EXISTS;
         hs->ha = ha;
 
+        /* Compile the search mask */
+        hs->pWildCard = CompileWildCard(szMask);
+        if(hs->pWildCard == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+
         /* If the archive is patched archive, we have to create a merge table */
         /* to prevent files being repeated */
-        if(ha->haPatch != NULL)
+        if(nError == ERROR_SUCCESS && ha->haPatch != NULL)
         {
             hs->dwSearchTableItems = GetSearchTableItems(ha);
-            hs->pSearchTable = STORM_ALLOC(TFileEntry *, hs->dwSearchTableItems);
+            hs->pSearchTable = STORM_ALLOC(TMPQFileEntry *, hs->dwSearchTableItems);
             hs->dwFlagMask = MPQ_FILE_EXISTS | MPQ_FILE_PATCH_FILE;
             if(hs->pSearchTable != NULL)
-                memset(hs->pSearchTable, 0, hs->dwSearchTableItems * sizeof(TFileEntry *));
+                memset(hs->pSearchTable, 0, hs->dwSearchTableItems * sizeof(TMPQFileEntry *));
             else
                 nError = ERROR_NOT_ENOUGH_MEMORY;
         }
     }
 
+    /* If the mask begins with a literal prefix, use the name index */
+    if(nError == ERROR_SUCCESS)
+    {
+        nPrefixLength = GetIndexedPrefixLength(ha, szMask);
+        if(nPrefixLength != 0)
+            nError = FindFilesByPrefix(hs, szMask, nPrefixLength);
+    }
+
     /* Perform first item searching */
     if(nError == ERROR_SUCCESS)
     {
@@ -462,3 +966,100 @@ int EXPORT_SYMBOL SFileFindClose(void * hFind)
     FreeMPQSearch(&hs);
     return 1;
 }
+
+/*-----------------------------------------------------------------------------
+ * Enumerating file table entries
+ *
+ * Gives the metadata of every file entry, without generating pseudo-names
+ * for files without name. The files can then be opened by SFileOpenFileByIndex.
+ */
+
+void EXPORT_SYMBOL * SFileFindFirstEntry(void * hMpq, SFILE_ENTRY_DATA * lpEntryData)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TMPQEntrySearch * hs = NULL;
+    int nError = ERROR_SUCCESS;
+
+    /* Check for the valid parameters */
+    if(!IsValidMpqHandle(hMpq))
+        nError = ERROR_INVALID_HANDLE;
+    if(lpEntryData == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+
+    /* Give the file names, if known. Ignore the result, (listfile) is optional */
+    if(nError == ERROR_SUCCESS)
+        SListFileLoadLazy(ha);
+
+    /* Allocate the structure for entry search */
+    if(nError == ERROR_SUCCESS)
+    {
+        if((hs = STORM_ALLOC(TMPQEntrySearch, 1)) != NULL)
+        {
+            memset(hs, 0, sizeof(TMPQEntrySearch));
+            hs->ha = ha;
+
+            /* Get the hash index of all file entries at once */
+            hs->pHashIndexes = BuildHashIndexes(ha);
+            hs->dwHashIndexes = ha->dwFileTableSize;
+            if(hs->pHashIndexes == NULL)
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+        else
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    /* Perform first item searching */
+    if(nError == ERROR_SUCCESS)
+    {
+        nError = DoEntrySearch(hs, lpEntryData);
+    }
+
+    /* Cleanup */
+    if(nError != ERROR_SUCCESS)
+    {
+        SFileFindEntryClose(hs);
+        SetLastError(nError);
+        hs = NULL;
+    }
+
+    /* Return the result value */
+    return (void *)hs;
+}
+
+int EXPORT_SYMBOL SFileFindNextEntry(void * hFind, SFILE_ENTRY_DATA * lpEntryData)
+{
+    TMPQEntrySearch * hs = (TMPQEntrySearch *)hFind;
+    int nError = ERROR_SUCCESS;
+
+    /* Check the parameters */
+    if(hs == NULL || !IsValidMpqHandle(hs->ha))
+        nError = ERROR_INVALID_HANDLE;
+    if(lpEntryData == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+
+    if(nError == ERROR_SUCCESS)
+        nError = DoEntrySearch(hs, lpEntryData);
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
+int EXPORT_SYMBOL SFileFindEntryClose(void * hFind)
+{
+    TMPQEntrySearch * hs = (TMPQEntrySearch *)hFind;
+
+    /* Check the parameters */
+    if(hs == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+
+    if(hs->pHashIndexes != NULL)
+        STORM_FREE(hs->pHashIndexes);
+    STORM_FREE(hs);
+    return 1;
+}
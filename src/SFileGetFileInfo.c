@@ -29,10 +29,19 @@
  * Local functions
  */
 
-static void ConvertFileEntryToSelfRelative(TFileEntry * pFileEntry, TFileEntry * pSrcFileEntry)
+static void ConvertFileEntryToSelfRelative(TFileEntry * pFileEntry, TMPQArchive * ha, TMPQFileEntry * pSrcFileEntry)
 {
-    /* Copy the file entry itself */
-    memcpy(pFileEntry, pSrcFileEntry, sizeof(TFileEntry));
+    /* Copy the file entry itself. CRC32, file time and MD5 */
+    /* are not in the file table, so they must be looked up */
+    memset(pFileEntry, 0, sizeof(TFileEntry));
+    pFileEntry->FileNameHash = pSrcFileEntry->FileNameHash;
+    pFileEntry->ByteOffset = pSrcFileEntry->ByteOffset;
+    pFileEntry->FileTime = GetFileEntryTime(ha, pSrcFileEntry);
+    pFileEntry->dwFileSize = pSrcFileEntry->dwFileSize;
+    pFileEntry->dwCmpSize = pSrcFileEntry->dwCmpSize;
+    pFileEntry->dwFlags = pSrcFileEntry->dwFlags;
+    pFileEntry->dwCrc32 = GetFileEntryCrc32(ha, pSrcFileEntry);
+    memcpy(pFileEntry->md5, GetFileEntryMd5(ha, pSrcFileEntry), MD5_DIGEST_SIZE);
 
     /* If source is NULL, leave it NULL */
     if(pSrcFileEntry->szFileName != NULL)
@@ -46,13 +55,16 @@ static void ConvertFileEntryToSelfRelative(TFileEntry * pFileEntry, TFileEntry *
 
 static uint32_t GetMpqFileCount(TMPQArchive * ha)
 {
-    TFileEntry * pFileTableEnd;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd;
+    TMPQFileEntry * pFileEntry;
     uint32_t dwFileCount = 0;
 
     /* Go through all open MPQs, including patches */
     while(ha != NULL)
     {
+        /* We need flags of all file entries */
+        DecodeAllFileEntries(ha);
+
         /* Only count files that are not patch files */
         pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
         for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
@@ -143,7 +155,7 @@ int EXPORT_SYMBOL SFileGetFileInfo(
 {
     MPQ_SIGNATURE_INFO SignatureInfo;
     TMPQArchive * ha = NULL;
-    TFileEntry * pFileEntry = NULL;
+    TMPQFileEntry * pFileEntry = NULL;
     uint64_t Int64Value = 0;
     uint64_t ByteOffset = 0;
     TMPQFile * hf = NULL;
@@ -621,6 +633,7 @@ int EXPORT_SYMBOL SFileGetFileInfo(
             hf = IsValidFileHandle(hMpqOrFile);
             if(hf != NULL && hf->pFileEntry != NULL)
             {
+                SListFileLoadLazy(hf->ha);
                 pvSrcFileInfo = pFileEntry = hf->pFileEntry;
                 cbSrcFileInfo = sizeof(TFileEntry);
                 if(pFileEntry->szFileName != NULL)
@@ -715,9 +728,10 @@ int EXPORT_SYMBOL SFileGetFileInfo(
 
         case SFileInfoFileTime:
             hf = IsValidFileHandle(hMpqOrFile);
-            if(hf != NULL && hf->pFileEntry != NULL)
+            if(hf != NULL && hf->ha != NULL && hf->pFileEntry != NULL)
             {
-                pvSrcFileInfo = &hf->pFileEntry->FileTime;
+                Int64Value = GetFileEntryTime(hf->ha, hf->pFileEntry);
+                pvSrcFileInfo = &Int64Value;
                 cbSrcFileInfo = sizeof(uint64_t);
                 nInfoType = SFILE_INFO_TYPE_DIRECT_POINTER;
             }
@@ -776,6 +790,27 @@ int EXPORT_SYMBOL SFileGetFileInfo(
             }
             break;
 
+        case SFileInfoCRC32:
+            hf = IsValidFileHandle(hMpqOrFile);
+            if(hf != NULL && hf->ha != NULL && hf->pFileEntry != NULL)
+            {
+                dwInt32Value = GetFileEntryCrc32(hf->ha, hf->pFileEntry);
+                pvSrcFileInfo = &dwInt32Value;
+                cbSrcFileInfo = sizeof(uint32_t);
+                nInfoType = SFILE_INFO_TYPE_DIRECT_POINTER;
+            }
+            break;
+
+        case SFileInfoMD5:
+            hf = IsValidFileHandle(hMpqOrFile);
+            if(hf != NULL && hf->ha != NULL && hf->pFileEntry != NULL)
+            {
+                pvSrcFileInfo = (void *)GetFileEntryMd5(hf->ha, hf->pFileEntry);
+                cbSrcFileInfo = MD5_DIGEST_SIZE;
+                nInfoType = SFILE_INFO_TYPE_DIRECT_POINTER;
+            }
+            break;
+
         default:    /* Invalid info class */
             SetLastError(ERROR_INVALID_PARAMETER);
             return 0;
@@ -815,7 +850,7 @@ int EXPORT_SYMBOL SFileGetFileInfo(
 
                     case SFILE_INFO_TYPE_FILE_ENTRY:
                         assert(pFileEntry != NULL);
-                        ConvertFileEntryToSelfRelative((TFileEntry *)pvFileInfo, pFileEntry);
+                        ConvertFileEntryToSelfRelative((TFileEntry *)pvFileInfo, hf->ha, pFileEntry);
                         break;
                 }
             }
@@ -905,7 +940,7 @@ static struct TFileHeader2Ext data2ext[] =
     {0, 0, 0, 0, NULL}                                          /* Terminator  */
 };
 
-static int CreatePseudoFileName(void * hFile, TFileEntry * pFileEntry, char * szFileName)
+static int CreatePseudoFileName(void * hFile, TMPQFileEntry * pFileEntry, char * szFileName)
 {
     TMPQFile * hf = (TMPQFile *)hFile;  /* MPQ File handle */
     uint32_t FirstBytes[2] = {0, 0};       /* The first 4 bytes of the file */
@@ -958,13 +993,17 @@ int EXPORT_SYMBOL SFileGetFileName(void * hFile, char * szFileName)
     /* Check valid parameters */
     if(IsValidFileHandle(hFile))
     {
-        TFileEntry * pFileEntry = hf->pFileEntry;
+        TMPQFileEntry * pFileEntry = hf->pFileEntry;
 
         /* For MPQ files, retrieve the file name from the file entry */
         if(hf->pStream == NULL)
         {
             if(pFileEntry != NULL)
             {
+                /* The name might be in the (listfile) that hasn't been loaded yet */
+                if(pFileEntry->szFileName == NULL)
+                    SListFileLoadLazy(hf->ha);
+
                 /* If the file name is not there yet, create a pseudo name */
                 if(pFileEntry->szFileName == NULL)
                     nError = CreatePseudoFileName(hFile, pFileEntry, szFileName);
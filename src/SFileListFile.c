@@ -18,12 +18,12 @@
  */
 
 #define CACHE_BUFFER_SIZE  0x1000       /* Size of the cache buffer */
-#define MAX_LISTFILE_SIZE  0x04000000   /* Maximum accepted listfile size is about 68 MB */
+#define LISTFILE_CHUNK_SIZE 0x100000    /* Minimum amount of listfile data worth a worker thread */
 
 struct TListFileCache
 {
     void *  hFile;                      /* Stormlib file handle */
-    char  * szMask;                     /* Self-relative pointer to file mask */
+    TMPQWildCard * pWildCard;           /* Compiled file mask */
     uint32_t   dwFileSize;                 /* Total size of the cached file */
     uint32_t   dwFilePos;                  /* Position of the cache in the file */
     uint8_t  * pBegin;                     /* The begin of the listfile cache */
@@ -31,7 +31,27 @@ struct TListFileCache
     uint8_t  * pEnd;                       /* The last character in the file cache */
 
     uint8_t Buffer[CACHE_BUFFER_SIZE];
-/*  char MaskBuff[1]    */                /* Followed by the name mask (if any) */
+};
+
+/* One name found in the listfile */
+struct TListFileName
+{
+    TMPQNameHash NameHash;              /* All hashes of the name */
+    const char * szName;                /* Position of the name in the listfile data (not zero-terminated) */
+    size_t cchName;                     /* Length of the name */
+};
+
+/* Part of the listfile that is processed by one worker */
+struct TListFileChunk
+{
+    TMPQArchive * ha;                   /* Archive for which the names are hashed */
+    const uint8_t * pbBegin;            /* Begin of the chunk. Always the begin of a line */
+    const uint8_t * pbEnd;              /* End of the chunk */
+    struct TListFileName * pNames;      /* Names found in the chunk */
+    size_t nNames;                      /* Number of names found in the chunk */
+    size_t nMaxNames;                   /* Number of items allocated in pNames */
+    int bTerminated;                    /* The chunk contains a line that ends the listfile */
+    int nError;                         /* Result of the worker */
 };
 
 /*-----------------------------------------------------------------------------
@@ -54,14 +74,16 @@ static int FreeListFileCache(struct TListFileCache * pCache)
 {
     /* Valid parameter check */
     if(pCache != NULL)
+    {
+        FreeWildCard(pCache->pWildCard);
         STORM_FREE(pCache);
+    }
     return 1;
 }
 
 static struct TListFileCache * CreateListFileCache(void * hListFile, const char * szMask)
 {
     struct TListFileCache * pCache = NULL;
-    size_t nMaskLength = 0;
     size_t dwBytesRead = 0;
     size_t dwFileSize;
 
@@ -70,26 +92,19 @@ static struct TListFileCache * CreateListFileCache(void * hListFile, const char
     if(dwFileSize == 0)
         return NULL;
 
-    /* Append buffer for name mask, if any */
-    if(szMask != NULL)
-        nMaskLength = strlen(szMask) + 1;
-
     /* Allocate cache for one file block */
-    pCache = (struct TListFileCache *)STORM_ALLOC(uint8_t, sizeof(struct TListFileCache) + nMaskLength);
+    pCache = (struct TListFileCache *)STORM_ALLOC(uint8_t, sizeof(struct TListFileCache));
     if(pCache != NULL)
     {
         /* Clear the entire structure */
-        memset(pCache, 0, sizeof(struct TListFileCache) + nMaskLength);
+        memset(pCache, 0, sizeof(struct TListFileCache));
 
-        /* Shall we copy the mask? */
-        if(szMask != NULL)
-        {
-            pCache->szMask = (char *)(pCache + 1);
-            memcpy(pCache->szMask, szMask, nMaskLength);
-        }
+        /* Compile the mask */
+        pCache->pWildCard = CompileWildCard(szMask);
 
         /* Load the file cache from the file */
-        SFileReadFile(hListFile, pCache->Buffer, CACHE_BUFFER_SIZE, &dwBytesRead);
+        if(pCache->pWildCard != NULL)
+            SFileReadFile(hListFile, pCache->Buffer, CACHE_BUFFER_SIZE, &dwBytesRead);
         if(dwBytesRead != 0)
         {
             /* Allocate pointers */
@@ -217,6 +232,47 @@ static size_t ReadListFileLine(struct TListFileCache * pCache, char * szLine, in
     return (szLine - szLineBegin);
 }
 
+/* Same like ReadListFileLine, but works on listfile data loaded in memory. */
+/* The name is not copied, only its position and length are given back. */
+/* Returns the length of the line, zero means there are no more names. */
+static size_t ParseListFileLine(const uint8_t ** ppbPos, const uint8_t * pbEnd, const char ** pszName, size_t * pcchName)
+{
+    const uint8_t * pbExtraString = NULL;
+    const uint8_t * pbLineEnd;
+    const uint8_t * pbName;
+    const uint8_t * pbPos = *ppbPos;
+    const uint8_t * pbZero;
+    size_t cchLine;
+
+    /* Skip newlines, spaces, tabs and another non-printable stuff */
+    while(pbPos < pbEnd && pbPos[0] <= 0x20)
+        pbPos++;
+
+    /* The name is never longer than what ReadListFileLine would copy */
+    pbName = pbPos;
+    pbLineEnd = ((size_t)(pbEnd - pbPos) > (MAX_PATH - 1)) ? (pbPos + MAX_PATH - 1) : pbEnd;
+
+    /* Find the end of the line and the last '~' in it */
+    while(pbPos < pbLineEnd && pbPos[0] != 0x0D && pbPos[0] != 0x0A)
+    {
+        if(pbPos[0] == '~')
+            pbExtraString = pbPos;
+        pbPos++;
+    }
+
+    /* Cut the information about patch, if any */
+    cchLine = (size_t)(pbPos - pbName);
+    if(pbExtraString != NULL && (pbExtraString + 1) < pbPos && pbExtraString[1] == 'P')
+        cchLine = (size_t)(pbExtraString - pbName);
+
+    /* The name itself ends at the first zero character */
+    pbZero = (const uint8_t *)memchr(pbName, 0, cchLine);
+    *pcchName = (pbZero != NULL) ? (size_t)(pbZero - pbName) : cchLine;
+    *pszName = (const char *)pbName;
+    *ppbPos = pbPos;
+    return cchLine;
+}
+
 static int CompareFileNodes(const void * p1, const void * p2) 
 {
     char * szFileName1 = *(char **)p1;
@@ -227,8 +283,8 @@ static int CompareFileNodes(const void * p1, const void * p2)
 
 static unsigned char * CreateListFile(TMPQArchive * ha, uint32_t * pcbListFile)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQFileEntry * pFileEntry;
     char ** SortTable = NULL;
     char * szListFile = NULL;
     char * szListLine;
@@ -319,20 +375,21 @@ static unsigned char * CreateListFile(TMPQArchive * ha, uint32_t * pcbListFile)
 /* Adds a name into the list of all names. For each locale in the MPQ, */
 /* one entry will be created */
 /* If the file name is already there, does nothing. */
-static int SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFileName)
+/* Same like SListFileCreateNodeForAllLocales, but with already calculated name hashes */
+static int SListFileCreateNodeForAllLocales2(TMPQArchive * ha, const char * szFileName, TMPQNameHash * pNameHash)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQHash * pFirstHash;
     TMPQHash * pHash;
 
     /* If we have HET table, use that one */
     if(ha->pHetTable != NULL)
     {
-        pFileEntry = GetFileEntryLocale(ha, szFileName, 0);
+        pFileEntry = GetFileEntryByHash(ha, pNameHash, 0, NULL);
         if(pFileEntry != NULL)
         {
             /* Allocate file name for the file entry */
-            AllocateFileName(ha, pFileEntry, szFileName);
+            AllocateFileName2(ha, pFileEntry, szFileName, pNameHash);
         }
 
         return ERROR_SUCCESS;
@@ -342,11 +399,11 @@ static int SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFil
     if(ha->pHashTable != NULL)
     {
         /* Go while we found something */
-        pFirstHash = pHash = GetFirstHashEntry(ha, szFileName);
+        pFirstHash = pHash = GetFirstHashEntry2(ha, pNameHash);
         while(pHash != NULL)
         {
             /* Allocate file name for the file entry */
-            AllocateFileName(ha, ha->pFileTable + pHash->dwBlockIndex, szFileName);
+            AllocateFileName2(ha, ha->pFileTable + pHash->dwBlockIndex, szFileName, pNameHash);
 
             /* Now find the next language version of the file */
             pHash = GetNextHashEntry(ha, pFirstHash, pHash);
@@ -358,6 +415,14 @@ static int SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFil
     return ERROR_CAN_NOT_COMPLETE;
 }
 
+static int SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFileName)
+{
+    TMPQNameHash NameHash;
+
+    HashFileName(ha, szFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &NameHash);
+    return SListFileCreateNodeForAllLocales2(ha, szFileName, &NameHash);
+}
+
 /* Saves the whole listfile to the MPQ */
 int SListFileSaveToMpq(TMPQArchive * ha)
 {
@@ -420,7 +485,128 @@ int SListFileSaveToMpq(TMPQArchive * ha)
     return nError;
 }
 
-static int SFileAddArbitraryListFile(
+/* Worker that finds the names in one listfile chunk and calculates their hashes */
+static void HashListFileChunk(void * pvContext)
+{
+    struct TListFileChunk * pChunk = (struct TListFileChunk *)pvContext;
+    struct TListFileName * pNewNames;
+    struct TListFileName * pName;
+    const uint8_t * pbPos = pChunk->pbBegin;
+    const char * szName = NULL;
+    size_t nMaxNames;
+    size_t cchName;
+    char szFileName[MAX_PATH];
+
+    while(ParseListFileLine(&pbPos, pChunk->pbEnd, &szName, &cchName) > 0)
+    {
+        /* Make sure that there is space for the name */
+        if(pChunk->nNames >= pChunk->nMaxNames)
+        {
+            nMaxNames = (pChunk->nMaxNames != 0) ? (pChunk->nMaxNames * 2) : 0x1000;
+            pNewNames = STORM_REALLOC(struct TListFileName, pChunk->pNames, nMaxNames);
+            if(pNewNames == NULL)
+            {
+                pChunk->nError = ERROR_NOT_ENOUGH_MEMORY;
+                return;
+            }
+
+            pChunk->pNames = pNewNames;
+            pChunk->nMaxNames = nMaxNames;
+        }
+
+        /* Calculate all hashes of the name */
+        memcpy(szFileName, szName, cchName);
+        szFileName[cchName] = 0;
+
+        pName = pChunk->pNames + pChunk->nNames++;
+        HashFileName(pChunk->ha, szFileName, MPQ_NAME_HASH_STORM | MPQ_NAME_HASH_HET, &pName->NameHash);
+        pName->szName = szName;
+        pName->cchName = cchName;
+    }
+
+    /* An empty name before the end of the chunk ends the whole listfile */
+    pChunk->bTerminated = ((const uint8_t *)szName < pChunk->pbEnd);
+}
+
+/* Adds the names from listfile data loaded in memory. The data is split */
+/* to chunks, each chunk is parsed and hashed by a separate worker. */
+/* The names are then applied to the file table in the listfile order. */
+static int SFileAddListFileData(
+    TMPQArchive * ha,
+    const uint8_t * pbListFile,
+    size_t cbListFile)
+{
+    struct TListFileChunk * pChunks;
+    struct TListFileName * pName;
+    const uint8_t * pbListFileEnd = pbListFile + cbListFile;
+    const uint8_t * pbChunkBegin = pbListFile;
+    const uint8_t * pbChunkEnd;
+    uint32_t dwWorkers;
+    uint32_t i;
+    size_t j;
+    char szFileName[MAX_PATH];
+    int nError = ERROR_SUCCESS;
+
+    /* Without hash table and HET table, the names can't be matched */
+    if(ha->pHashTable == NULL && ha->pHetTable == NULL)
+        return ERROR_SUCCESS;
+
+    /* Allocate one chunk per worker */
+    dwWorkers = GetParallelWorkerCount(cbListFile, LISTFILE_CHUNK_SIZE);
+    pChunks = STORM_ALLOC(struct TListFileChunk, dwWorkers);
+    if(pChunks == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(pChunks, 0, sizeof(struct TListFileChunk) * dwWorkers);
+
+    /* Split the listfile to chunks. Each chunk must begin at the begin of a line */
+    for(i = 0; i < dwWorkers; i++)
+    {
+        pbChunkEnd = (i < dwWorkers - 1) ? (pbListFile + (cbListFile / dwWorkers) * (i + 1)) : pbListFileEnd;
+        if(pbChunkEnd < pbChunkBegin)
+            pbChunkEnd = pbChunkBegin;
+        while(pbChunkEnd < pbListFileEnd && pbChunkEnd[-1] != 0x0D && pbChunkEnd[-1] != 0x0A)
+            pbChunkEnd++;
+
+        pChunks[i].ha = ha;
+        pChunks[i].pbBegin = pbChunkBegin;
+        pChunks[i].pbEnd = pbChunkEnd;
+        pbChunkBegin = pbChunkEnd;
+    }
+
+    /* Parse and hash the chunks */
+    RunParallelWorkers(HashListFileChunk, pChunks, sizeof(struct TListFileChunk), dwWorkers);
+
+    /* Apply the names to the file table. Add the node for every locale in the archive */
+    for(i = 0; i < dwWorkers && nError == ERROR_SUCCESS; i++)
+    {
+        nError = pChunks[i].nError;
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        for(j = 0; j < pChunks[i].nNames; j++)
+        {
+            pName = pChunks[i].pNames + j;
+            memcpy(szFileName, pName->szName, pName->cchName);
+            szFileName[pName->cchName] = 0;
+            SListFileCreateNodeForAllLocales2(ha, szFileName, &pName->NameHash);
+        }
+
+        if(pChunks[i].bTerminated)
+            break;
+    }
+
+    /* Free the chunks */
+    for(i = 0; i < dwWorkers; i++)
+    {
+        if(pChunks[i].pNames != NULL)
+            STORM_FREE(pChunks[i].pNames);
+    }
+    STORM_FREE(pChunks);
+    return nError;
+}
+
+/* Adds the names from listfile, reading it line by line */
+static int SFileAddListFileCache(
     TMPQArchive * ha,
     void * hListFile)
 {
@@ -443,13 +629,66 @@ static int SFileAddArbitraryListFile(
     return (pCache != NULL) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
 }
 
+static int SFileAddArbitraryListFile(
+    TMPQArchive * ha,
+    void * hListFile)
+{
+    uint8_t * pbListFile;
+    uint32_t dwFileSizeHi = 0;
+    size_t dwBytesRead = 0;
+    size_t dwFileSize;
+    int nError = ERROR_CAN_NOT_COMPLETE;
+
+    /* Load the whole listfile and process it at once */
+    dwFileSize = SFileGetFileSize(hListFile, &dwFileSizeHi);
+    if(dwFileSize != 0 && dwFileSize != SFILE_INVALID_SIZE && dwFileSizeHi == 0)
+    {
+        pbListFile = STORM_ALLOC(uint8_t, dwFileSize);
+        if(pbListFile != NULL)
+        {
+            if(SFileReadFile(hListFile, pbListFile, dwFileSize, &dwBytesRead) && dwBytesRead == dwFileSize)
+                nError = SFileAddListFileData(ha, pbListFile, dwBytesRead);
+            STORM_FREE(pbListFile);
+        }
+    }
+
+    /* If the listfile can't be loaded at once (not enough memory, */
+    /* or the listfile is not complete in a partial MPQ), */
+    /* read it line by line, up to the first missing block */
+    if(nError != ERROR_SUCCESS)
+    {
+        SFileSetFilePointer(hListFile, 0, NULL, SEEK_SET);
+        nError = SFileAddListFileCache(ha, hListFile);
+    }
+
+    return nError;
+}
+
 static int SFileAddExternalListFile(
     TMPQArchive * ha,
     void * hMpq,
     const char * szListFile)
 {
+    TFileStream * pStream;
+    const void * pvListFile;
+    uint64_t cbListFile = 0;
     void * hListFile;
-    int nError = ERROR_SUCCESS;
+    int nError = ERROR_CAN_NOT_COMPLETE;
+
+    /* Map the external listfile to memory and process it in place. */
+    /* There is no limit for the size of the listfile. */
+    pStream = FileStream_OpenFile(szListFile, STREAM_PROVIDER_FLAT | BASE_PROVIDER_MAP | STREAM_FLAG_READ_ONLY);
+    if(pStream != NULL)
+    {
+        pvListFile = FileStream_GetMappedView(pStream, &cbListFile);
+        if(pvListFile != NULL && cbListFile == (size_t)cbListFile)
+            nError = SFileAddListFileData(ha, (const uint8_t *)pvListFile, (size_t)cbListFile);
+        FileStream_Close(pStream);
+    }
+
+    /* If the listfile can't be mapped, read it as any other listfile */
+    if(nError == ERROR_SUCCESS)
+        return ERROR_SUCCESS;
 
     /* Open the external list file */
     if(!SFileOpenFileEx(hMpq, szListFile, SFILE_OPEN_LOCAL_FILE, &hListFile))
@@ -525,9 +764,14 @@ int EXPORT_SYMBOL SFileAddListFile(void * hMpq, const char * szListFile)
     while(ha != NULL)
     {
         if(szListFile != NULL)
+        {
             nError = SFileAddExternalListFile(ha, hMpq, szListFile);
+        }
         else
+        {
+            ha->dwFlags &= ~MPQ_FLAG_LISTFILE_LAZY;
             nError = SFileAddInternalListFile(ha, hMpq);
+        }
 
         /* Also, add three special files to the listfile: */
         /* (listfile) itself, (attributes) and (signature) */
@@ -542,6 +786,28 @@ int EXPORT_SYMBOL SFileAddListFile(void * hMpq, const char * szListFile)
     return nError;
 }
 
+/* Loads the internal listfile, if it has been deferred by MPQ_OPEN_LAZY_LISTFILE */
+int SListFileLoadLazy(TMPQArchive * ha)
+{
+    int nError = ERROR_SUCCESS;
+
+    /* After an interrupted in-place compacting, the (listfile) */
+    /* may not be at its position until the compacting is finished */
+    if((ha->dwFlags & (MPQ_FLAG_LISTFILE_LAZY | MPQ_FLAG_COMPACT_INTERRUPTED)) == MPQ_FLAG_LISTFILE_LAZY)
+    {
+        /* Clear the flag first, the listfile is only loaded once */
+        ha->dwFlags &= ~MPQ_FLAG_LISTFILE_LAZY;
+        nError = SFileAddInternalListFile(ha, (void *)ha);
+
+        /* Same like SFileAddListFile */
+        SListFileCreateNodeForAllLocales(ha, LISTFILE_NAME);
+        SListFileCreateNodeForAllLocales(ha, SIGNATURE_NAME);
+        SListFileCreateNodeForAllLocales(ha, ATTRIBUTES_NAME);
+    }
+
+    return nError;
+}
+
 /*-----------------------------------------------------------------------------
  * Enumerating files in listfile
  */
@@ -588,7 +854,7 @@ void EXPORT_SYMBOL * SListFileFindFirstFile(void * hMpq, const char * szListFile
                 }
 
                 /* If some mask entered, check it */
-                if(CheckWildCard(lpFindFileData->cFileName, pCache->szMask))
+                if(MatchWildCard(pCache->pWildCard, lpFindFileData->cFileName))
                     break;                
             }
         }
@@ -636,7 +902,7 @@ int EXPORT_SYMBOL SListFileFindNextFile(void * hFind, SFILE_FIND_DATA * lpFindFi
             }
 
             /* If some mask entered, check it */
-            if(CheckWildCard(lpFindFileData->cFileName, pCache->szMask))
+            if(MatchWildCard(pCache->pWildCard, lpFindFileData->cFileName))
             {
                 nError = ERROR_SUCCESS;
                 break;
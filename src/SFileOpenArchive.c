@@ -157,10 +157,16 @@ int EXPORT_SYMBOL SFileOpenArchive(
     TMPQUserData * pUserData;
     TFileStream * pStream = NULL;       /* Open file stream */
     TMPQArchive * ha = NULL;            /* Archive handle */
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     uint64_t FileSize = 0;             /* Size of the file */
     unsigned char * pbHeaderBuffer = NULL;       /* Buffer for searching MPQ header */
+    uint32_t dwFlagsBeforeLoad = 0;             /* Archive flags before loading the tables, for the index file */
+    uint32_t dwReadOnly = 0;
+    TMPQArchiveId ArchiveId;                    /* Identity of the archive file, for the index file and the verification cache file */
+    int bHasArchiveId = 0;
     int bIsWarcraft3Map = 0;
+    int bIndexLoaded = 0;
+    int bSaveIndex = 0;
     int nError = ERROR_SUCCESS;   
 
     /* Verify the parameters */
@@ -233,8 +239,14 @@ int EXPORT_SYMBOL SFileOpenArchive(
         /* Also remember if we shall check sector CRCs when reading file */
         ha->dwFlags |= (dwFlags & MPQ_OPEN_CHECK_SECTOR_CRC) ? MPQ_FLAG_CHECK_SECTOR_CRC : 0;
 
+        /* Also remember if we shall check MD5 of the raw data chunks */
+        ha->dwFlags |= (dwFlags & MPQ_OPEN_CHECK_RAW_MD5) ? MPQ_FLAG_CHECK_RAW_MD5 : 0;
+
         /* Also remember if this MPQ is a patch */
         ha->dwFlags |= (dwFlags & MPQ_OPEN_PATCH) ? MPQ_FLAG_PATCH : 0;
+
+        /* Also remember if the BET table shall be decoded on demand */
+        ha->dwFlags |= (dwFlags & MPQ_OPEN_LAZY_BET) ? MPQ_FLAG_LAZY_BET : 0;
        
         /* Limit the header searching to about 130 MB of data */
         if(EndOfSearch > 0x08000000)
@@ -372,8 +384,8 @@ int EXPORT_SYMBOL SFileOpenArchive(
             ha->pUserData = NULL;
         }
 
-        /* Both MPQ_OPEN_NO_LISTFILE or MPQ_OPEN_NO_ATTRIBUTES trigger read only mode */
-        if(dwFlags & (MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES))
+        /* MPQ_OPEN_NO_LISTFILE, MPQ_OPEN_NO_ATTRIBUTES or MPQ_OPEN_LAZY_BET trigger read only mode */
+        if(dwFlags & (MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES | MPQ_OPEN_LAZY_BET))
             ha->dwFlags |= MPQ_FLAG_READ_ONLY;
 
         /* Remember whether whis is a map for Warcraft III */
@@ -387,42 +399,86 @@ int EXPORT_SYMBOL SFileOpenArchive(
         nError = VerifyMpqTablePositions(ha, FileSize);
     }
 
+    /* An interrupted in-place compacting has already moved some of the file data, */
+    /* so the tables don't match the data. Until SFileCompactArchiveInPlace finishes */
+    /* the compacting, the files can neither be read nor changed */
+    if(nError == ERROR_SUCCESS && IsCompactInterrupted(ha))
+    {
+        ha->dwFlags |= MPQ_FLAG_COMPACT_INTERRUPTED;
+    }
+
+    /* The index file and the verification cache file need the identity of the archive, */
+    /* taken before the tables are loaded. Archives on web servers use neither of them */
+    if(nError == ERROR_SUCCESS && (dwFlags & (MPQ_OPEN_USE_INDEX | MPQ_OPEN_VERIFY_CACHE_FILE)))
+    {
+        uint32_t dwStreamFlags = 0;
+
+        FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+        if((dwStreamFlags & BASE_PROVIDER_MASK) != BASE_PROVIDER_HTTP)
+            bHasArchiveId = (CalculateArchiveId(ha, &ArchiveId) == ERROR_SUCCESS);
+    }
+
+    /* If there is an up-to-date index file, load all tables from it. */
+    /* Lazy BET tables don't use the index file */
+    if(nError == ERROR_SUCCESS && bHasArchiveId && (dwFlags & MPQ_OPEN_USE_INDEX) && (dwFlags & MPQ_OPEN_LAZY_BET) == 0 && (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED) == 0)
+    {
+        bIndexLoaded = (LoadArchiveIndex(ha, &ArchiveId, dwFlags) == ERROR_SUCCESS);
+        if(bIndexLoaded == 0)
+        {
+            /* Remember the state before loading the tables. */
+            /* The read-only flag is cleared so we can see if loading sets it */
+            dwReadOnly = (ha->dwFlags & MPQ_FLAG_READ_ONLY);
+            ha->dwFlags &= ~MPQ_FLAG_READ_ONLY;
+            dwFlagsBeforeLoad = ha->dwFlags;
+            bSaveIndex = 1;
+        }
+    }
+
     /* Read the hash table. Ignore the result, as hash table is no longer required */
     /* Read HET table. Ignore the result, as HET table is no longer required */
-    if(nError == ERROR_SUCCESS)
+    if(nError == ERROR_SUCCESS && bIndexLoaded == 0)
     {
         nError = LoadAnyHashTable(ha);
     }
 
     /* Now, build the file table. It will be built by combining */
     /* the block table, BET table, hi-block table, (attributes) and (listfile). */
-    if(nError == ERROR_SUCCESS)
+    if(nError == ERROR_SUCCESS && bIndexLoaded == 0)
     {
         nError = BuildFileTable(ha);
     }
 
     /* Load the internal listfile and include it to the file table */
-    if(nError == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_NO_LISTFILE) == 0)
+    if(nError == ERROR_SUCCESS && bIndexLoaded == 0 && (dwFlags & MPQ_OPEN_NO_LISTFILE) == 0)
     {
         /* Quick check for (listfile) */
         pFileEntry = GetFileEntryLocale(ha, LISTFILE_NAME, LANG_NEUTRAL);
         if(pFileEntry != NULL)
         {
             /* Ignore result of the operation. (listfile) is optional. */
-            SFileAddListFile((void *)ha, NULL);
+            /* The index file needs the names, so it never defers the listfile. */
+            /* After an interrupted compacting, it is loaded once the compacting is finished */
+            if(((dwFlags & MPQ_OPEN_LAZY_LISTFILE) && bSaveIndex == 0) || (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+                ha->dwFlags |= MPQ_FLAG_LISTFILE_LAZY;
+            else
+                SFileAddListFile((void *)ha, NULL);
             ha->dwFileFlags1 = pFileEntry->dwFlags;
         }
     }
 
     /* Load the "(attributes)" file and merge it to the file table */
-    if(nError == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_NO_ATTRIBUTES) == 0)
+    if(nError == ERROR_SUCCESS && bIndexLoaded == 0 && (dwFlags & MPQ_OPEN_NO_ATTRIBUTES) == 0)
     {
         /* Quick check for (attributes) */
         pFileEntry = GetFileEntryLocale(ha, ATTRIBUTES_NAME, LANG_NEUTRAL);
         if(pFileEntry != NULL)
         {
             /* Ignore result of the operation. (attributes) is optional. */
-            SAttrLoadAttributes(ha);
+            /* Patch archives need the patch bits from (attributes) at once */
+            if(((dwFlags & MPQ_OPEN_LAZY_ATTRIBUTES) && bSaveIndex == 0 && (ha->dwFlags & MPQ_FLAG_PATCH) == 0) || (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+                ha->dwFlags |= MPQ_FLAG_ATTRIBUTES_LAZY;
+            else
+                SAttrLoadAttributes(ha);
             ha->dwFileFlags2 = pFileEntry->dwFlags;
         }
     }
@@ -439,10 +495,23 @@ int EXPORT_SYMBOL SFileOpenArchive(
             ha->dwFileFlags3 = pFileEntry->dwFlags;
         }
 
+        /* Create the index file for the next open. Ignore the result, the index file is optional */
+        if(bSaveIndex)
+        {
+            SaveArchiveIndex(ha, &ArchiveId, dwFlags, ha->dwFlags & ~dwFlagsBeforeLoad);
+            ha->dwFlags |= dwReadOnly;
+        }
+
         /* Finally, set the MPQ_FLAG_READ_ONLY if the MPQ was found malformed */
         ha->dwFlags |= (ha->dwFlags & MPQ_FLAG_MALFORMED) ? MPQ_FLAG_READ_ONLY : 0;
     }
 
+    /* Create the verification cache, if wanted */
+    if(nError == ERROR_SUCCESS && (dwFlags & (MPQ_OPEN_VERIFY_CACHE | MPQ_OPEN_VERIFY_CACHE_FILE)))
+    {
+        nError = CreateVerifyCache(ha, bHasArchiveId ? &ArchiveId : NULL, dwFlags);
+    }
+
     /* Cleanup and exit */
     if(nError != ERROR_SUCCESS)
     {
@@ -550,6 +619,11 @@ int EXPORT_SYMBOL SFileFlushArchive(void * hMpq)
     /* Only if the MPQ was changed */
     if(ha->dwFlags & MPQ_FLAG_CHANGED)
     {
+        /* The index file, if any, no longer matches the archive, */
+        /* and neither do the verification results */
+        RemoveArchiveIndex(ha);
+        InvalidateVerifyCache(ha);
+
         /* Indicate that we are saving MPQ internal structures */
         ha->dwFlags |= MPQ_FLAG_SAVING_TABLES;
 
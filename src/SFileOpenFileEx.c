@@ -99,11 +99,54 @@ static int OpenLocalFile(const char * szFileName, void ** PtrFile)
     return 0;
 }
 
+/* Opens the file entry at the given index. The hash index is not looked up, */
+/* the caller has to give it (HASH_ENTRY_FREE if the file has no hash entry) */
+int OpenFileEntry(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwHashIndex, TMPQFile ** PtrFile)
+{
+    TMPQFileEntry * pFileEntry;
+    TMPQFile * hf;
+
+    /* Check whether the file really exists in the MPQ */
+    if(dwFileIndex >= ha->dwFileTableSize)
+        return ERROR_FILE_NOT_FOUND;
+    DecodeFileEntry(ha, dwFileIndex);
+    pFileEntry = ha->pFileTable + dwFileIndex;
+    if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
+        return ERROR_FILE_NOT_FOUND;
+    if(pFileEntry->dwFlags & ~MPQ_FILE_VALID_FLAGS)
+        return ERROR_NOT_SUPPORTED;
+
+    /* Allocate file handle */
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    if(dwHashIndex != HASH_ENTRY_FREE)
+        hf->pHashEntry = ha->pHashTable + dwHashIndex;
+    hf->dwHashIndex = dwHashIndex;
+
+    /* If the MPQ has sector CRC enabled, enable if for the file */
+    if(ha->dwFlags & MPQ_FLAG_CHECK_SECTOR_CRC)
+        hf->bCheckSectorCRCs = 1;
+
+    /* If the real file name is known, the file key doesn't have to be detected */
+    if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && pFileEntry->szFileName != NULL && !IsPseudoFileName(pFileEntry->szFileName, NULL))
+    {
+        hf->dwFileKey = DecryptFileKey(pFileEntry->szFileName,
+                                       pFileEntry->ByteOffset,
+                                       pFileEntry->dwFileSize,
+                                       pFileEntry->dwFlags);
+    }
+
+    *PtrFile = hf;
+    return ERROR_SUCCESS;
+}
+
 int OpenPatchedFile(void * hMpq, const char * szFileName, void ** PtrFile)
 {
     TMPQArchive * haBase = NULL;
     TMPQArchive * ha = (TMPQArchive *)hMpq;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQFile * hfPatch;                     /* Pointer to patch file */
     TMPQFile * hfBase = NULL;               /* Pointer to base open file */
     TMPQFile * hf = NULL;
@@ -233,7 +276,7 @@ int EXPORT_SYMBOL SFileEnumLocales(
 int EXPORT_SYMBOL SFileOpenFileEx(void * hMpq, const char * szFileName, uint32_t dwSearchScope, void ** PtrFile)
 {
     TMPQArchive * ha = IsValidMpqHandle(hMpq);
-    TFileEntry  * pFileEntry = NULL;
+    TMPQFileEntry * pFileEntry = NULL;
     TMPQFile    * hf = NULL;
     uint32_t dwHashIndex = HASH_ENTRY_FREE;
     uint32_t dwFileIndex = 0;
@@ -252,6 +295,10 @@ int EXPORT_SYMBOL SFileOpenFileEx(void * hMpq, const char * szFileName, uint32_t
     if(dwSearchScope != SFILE_OPEN_CHECK_EXISTS && PtrFile == NULL)
         nError = ERROR_INVALID_PARAMETER;
 
+    /* The file data can't be read until an interrupted in-place compacting is finished */
+    if(nError == ERROR_SUCCESS && dwSearchScope != SFILE_OPEN_LOCAL_FILE && dwSearchScope != SFILE_OPEN_CHECK_EXISTS && (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+        nError = ERROR_COMPACT_INTERRUPTED;
+
     /* Prepare the file opening */
     if(nError == ERROR_SUCCESS)
     {
@@ -265,8 +312,12 @@ int EXPORT_SYMBOL SFileOpenFileEx(void * hMpq, const char * szFileName, uint32_t
                 if((bOpenByIndex = IsPseudoFileName(szFileName, &dwFileIndex)))
                 {
                     /* Get the file entry for the file */
-                    if(dwFileIndex > ha->dwFileTableSize)
+                    if(dwFileIndex >= ha->dwFileTableSize)
                         break;
+                    DecodeFileEntry(ha, dwFileIndex);
+
+                    /* The file name from (listfile) is needed to decrypt the file */
+                    SListFileLoadLazy(ha);
                     pFileEntry = ha->pFileTable + dwFileIndex;
                 }
                 else
@@ -365,6 +416,61 @@ int EXPORT_SYMBOL SFileOpenFileEx(void * hMpq, const char * szFileName, uint32_t
     return (nError == ERROR_SUCCESS);
 }
 
+/*-----------------------------------------------------------------------------
+ * SFileOpenFileByIndex
+ *
+ *   hMpq          - Handle of opened MPQ archive
+ *   dwFileIndex   - Index of the file in the file table
+ *   dwHashIndex   - Index of the file in the hash table (from SFileFindNextEntry),
+ *                   or HASH_ENTRY_FREE if not known
+ *   PtrFile       - Pointer to store opened file handle
+ *
+ * Opens the file in this MPQ, without patches. Unlike opening by pseudo-name,
+ * the hash table is only searched if the given hash index doesn't belong to the file.
+ */
+
+int EXPORT_SYMBOL SFileOpenFileByIndex(void * hMpq, uint32_t dwFileIndex, uint32_t dwHashIndex, void ** PtrFile)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TMPQFile * hf = NULL;
+    int nError = ERROR_SUCCESS;
+
+    /* Check the parameters */
+    if(ha == NULL)
+        nError = ERROR_INVALID_HANDLE;
+    if(PtrFile == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+    if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+        nError = ERROR_COMPACT_INTERRUPTED;
+
+    if(nError == ERROR_SUCCESS)
+    {
+        /* Verify the hash index. If it doesn't belong to the file, look it up */
+        if(ha->pHashTable != NULL)
+        {
+            if(dwHashIndex >= ha->pHeader->dwHashTableSize || ha->pHashTable[dwHashIndex].dwBlockIndex != dwFileIndex)
+                dwHashIndex = (dwFileIndex < ha->dwFileTableSize) ? FindHashIndex(ha, dwFileIndex) : HASH_ENTRY_FREE;
+        }
+        else
+        {
+            dwHashIndex = HASH_ENTRY_FREE;
+        }
+
+        /* The file name from (listfile) is needed to decrypt the file */
+        SListFileLoadLazy(ha);
+        nError = OpenFileEntry(ha, dwFileIndex, dwHashIndex, &hf);
+    }
+
+    /* Give the file entry */
+    if(PtrFile != NULL)
+        PtrFile[0] = hf;
+
+    /* Return error code */
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
 /*-----------------------------------------------------------------------------
  * SFileHasFile
  *
@@ -93,7 +93,7 @@ static LOCALIZED_MPQ_INFO LocaleMpqs_WoW[] =
  * Local functions
  */
 
-static inline int IsPatchMetadataFile(TFileEntry * pFileEntry)
+static inline int IsPatchMetadataFile(TMPQFileEntry * pFileEntry)
 {
     /* The file must ave a namet */
     if(pFileEntry->szFileName != NULL && (pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE) == 0)
@@ -443,7 +443,7 @@ static int CreatePatchPrefix(TMPQArchive * ha, const char * szFileName, size_t n
 static int IsMatchingPatchFile(
     TMPQArchive * ha,
     const char * szFileName,
-    unsigned char * pbFileMd5)
+    const unsigned char * pbFileMd5)
 {
     MPQ_PATCH_HEADER PatchHeader = {0};
     void * hFile = NULL;
@@ -471,7 +471,7 @@ static int IsMatchingPatchFile(
 
 static const char * FindArchiveLanguage(TMPQArchive * ha, PLOCALIZED_MPQ_INFO pMpqInfo)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     const char * szLanguage = LanguageList;
     char szFileName[0x40];
 
@@ -505,9 +505,9 @@ static const char * FindArchiveLanguage(TMPQArchive * ha, PLOCALIZED_MPQ_INFO pM
     return NULL;
 }
 
-static TFileEntry * FindBaseLstFile(TMPQArchive * ha)
+static TMPQFileEntry * FindBaseLstFile(TMPQArchive * ha)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     const char * szLanguage;
     char szFileName[0x40];
 
@@ -574,7 +574,7 @@ static int FindPatchPrefix_WoW_13164_13623(TMPQArchive * haBase, TMPQArchive * h
 static int FindPatchPrefix_SC2(TMPQArchive * haBase, TMPQArchive * haPatch)
 {
     TMPQNamePrefix * pPatchPrefix;
-    TFileEntry * pBaseEntry;
+    TMPQFileEntry * pBaseEntry;
     char * szLstFileName;
     char * szPlainName;
     size_t cchWorkBuffer = 0x400;
@@ -584,8 +584,8 @@ static int FindPatchPrefix_SC2(TMPQArchive * haBase, TMPQArchive * haPatch)
     /* and verify by MD5-before-patch */
     if(haBase->haPatch == NULL)
     {
-        TFileEntry * pFileTableEnd = haPatch->pFileTable + haPatch->dwFileTableSize;
-        TFileEntry * pFileEntry;
+        TMPQFileEntry * pFileTableEnd = haPatch->pFileTable + haPatch->dwFileTableSize;
+        TMPQFileEntry * pFileEntry;
 
         /* Allocate working buffer for merging LST file */
         szLstFileName = STORM_ALLOC(char, cchWorkBuffer);
@@ -597,6 +597,7 @@ static int FindPatchPrefix_SC2(TMPQArchive * haBase, TMPQArchive * haPatch)
                 return 0;
 
             /* Parse the entire file table */
+            DecodeAllFileEntries(haPatch);
             for(pFileEntry = haPatch->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
             {
                 /* Look for "patch_metadata" file */
@@ -608,7 +609,7 @@ static int FindPatchPrefix_SC2(TMPQArchive * haBase, TMPQArchive * haPatch)
                     strcpy(szPlainName, pBaseEntry->szFileName);
 
                     /* Check for matching MD5 file */
-                    if(IsMatchingPatchFile(haPatch, szLstFileName, pBaseEntry->md5))
+                    if(IsMatchingPatchFile(haPatch, szLstFileName, GetFileEntryMd5(haBase, pBaseEntry)))
                     {
                         bResult = CreatePatchPrefix(haPatch, szLstFileName, (size_t)(szPlainName - szLstFileName));
                         break;
@@ -703,7 +704,7 @@ int Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf)
     memset(pPatcher, 0, sizeof(TMPQPatcher));
 
     /* Copy the MD5 of the current file */
-    memcpy(pPatcher->this_md5, hf->pFileEntry->md5, MD5_DIGEST_SIZE);
+    memcpy(pPatcher->this_md5, GetFileEntryMd5(hf->ha, hf->pFileEntry), MD5_DIGEST_SIZE);
 
     /* Find out the biggest data size needed during the patching process */
     while(hf != NULL)
@@ -894,6 +895,16 @@ int EXPORT_SYMBOL SFileOpenPatchArchive(
     {
         if(!(ha->dwFlags & MPQ_FLAG_READ_ONLY))
             nError = ERROR_ACCESS_DENIED;
+        if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+            nError = ERROR_COMPACT_INTERRUPTED;
+    }
+
+    /* The patch prefix is searched by the file names of the base archive. */
+    /* Load deferred (listfile) and (attributes) before the patch chain is created */
+    if(nError == ERROR_SUCCESS)
+    {
+        SListFileLoadLazy(ha);
+        SAttrLoadLazy(ha);
     }
 
     /* Open the archive like it is normal archive */
@@ -26,7 +26,7 @@ static int ReadMpqSectors(TMPQFile * hf, unsigned char * pbBuffer, uint32_t dwBy
 {
     uint64_t RawFilePos;
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     unsigned char * pbRawSector = NULL;
     unsigned char * pbOutSector = pbBuffer;
     unsigned char * pbInSector = pbBuffer;
@@ -99,9 +99,12 @@ static int ReadMpqSectors(TMPQFile * hf, unsigned char * pbBuffer, uint32_t dwBy
     if(FileStream_Read(ha->pStream, &RawFilePos, pbInSector, dwRawBytesToRead))
     {
         uint32_t i;
+
+        /* Check MD5 of the raw data chunks, if required */
+        nError = VerifyRawDataChunks(hf, RawFilePos, dwRawBytesToRead);
         
         /* Now we have to decrypt and decompress all file sectors that have been loaded */
-        for(i = 0; i < dwSectorsToRead; i++)
+        for(i = 0; nError == ERROR_SUCCESS && i < dwSectorsToRead; i++)
         {
             uint32_t dwRawBytesInThisSector = ha->dwSectorSize;
             uint32_t dwBytesInThisSector = ha->dwSectorSize;
@@ -231,7 +234,7 @@ static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, uint32_t dwFile
 {
     uint64_t RawFilePos = hf->RawFilePos;
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     unsigned char * pbCompressed = NULL;
     unsigned char * pbRawData = NULL;
     int nError = ERROR_SUCCESS;
@@ -269,6 +272,14 @@ static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, uint32_t dwFile
             return GetLastError();
         }
 
+        /* Check MD5 of the raw data chunks, if required */
+        nError = VerifyRawDataChunks(hf, RawFilePos, pFileEntry->dwCmpSize);
+        if(nError != ERROR_SUCCESS)
+        {
+            STORM_FREE(pbCompressed);
+            return nError;
+        }
+
         /* If the file is encrypted, we have to decrypt the data first */
         if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
         {
@@ -360,7 +371,7 @@ static int ReadMpkFileSingleUnit(TMPQFile * hf, void * pvBuffer, uint32_t dwFile
 {
     uint64_t RawFilePos = hf->RawFilePos + 0x0C;   /* For some reason, MPK files start at position (hf->RawFilePos + 0x0C) */
     TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
     unsigned char * pbCompressed = NULL;
     unsigned char * pbRawData = hf->pbFileSector;
     int nError = ERROR_SUCCESS;
@@ -667,37 +678,23 @@ static int ReadMpqFileLocalFile(TMPQFile * hf, void * pvBuffer, uint32_t dwFileP
  * SFileReadFile
  */
 
-int EXPORT_SYMBOL SFileReadFile(void * hFile, void * pvBuffer, size_t dwToRead, size_t * pdwRead)
+/* Reads data from the current file position and moves the position. */
+/* Unlike SFileReadFile, this returns the error code instead of setting it. */
+/* The streams report their errors through the last error value, which is */
+/* kept per thread, so multiple threads can read at once (each on its own file). */
+int ReadMpqFile(TMPQFile * hf, void * pvBuffer, uint32_t dwToRead, uint32_t * pdwBytesRead)
 {
-    TMPQFile * hf = (TMPQFile *)hFile;
     uint32_t dwBytesRead = 0;                      /* Number of bytes read */
     int nError = ERROR_SUCCESS;
 
-    /* Always zero the result */
-    if(pdwRead != NULL)
-        *pdwRead = 0;
-
-    /* Check valid parameters */
-    if(!IsValidFileHandle(hFile))
-    {
-        SetLastError(ERROR_INVALID_HANDLE);
-        return 0;
-    }
-
-    if(pvBuffer == NULL)
-    {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return 0;
-    }
-
     /* If we didn't load the patch info yet, do it now */
     if(hf->pFileEntry != NULL && (hf->pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE) && hf->pPatchInfo == NULL)
     {
         nError = AllocatePatchInfo(hf, 1);
         if(nError != ERROR_SUCCESS)
         {
-            SetLastError(nError);
-            return 0;
+            *pdwBytesRead = 0;
+            return nError;
         }
     }
 
@@ -734,15 +731,45 @@ int EXPORT_SYMBOL SFileReadFile(void * hFile, void * pvBuffer, size_t dwToRead,
     /* Increment the file position */
     hf->dwFilePos += dwBytesRead;
 
-    /* Give the caller the number of bytes read */
-    if(pdwRead != NULL)
-        *pdwRead = dwBytesRead;
-
     /* If the read operation succeeded, but not full number of bytes was read, */
-    /* set the last error to ERROR_HANDLE_EOF */
+    /* the caller gets ERROR_HANDLE_EOF */
     if(nError == ERROR_SUCCESS && (dwBytesRead < dwToRead))
         nError = ERROR_HANDLE_EOF;
 
+    *pdwBytesRead = dwBytesRead;
+    return nError;
+}
+
+int EXPORT_SYMBOL SFileReadFile(void * hFile, void * pvBuffer, size_t dwToRead, size_t * pdwRead)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+    uint32_t dwBytesRead = 0;                      /* Number of bytes read */
+    int nError = ERROR_SUCCESS;
+
+    /* Always zero the result */
+    if(pdwRead != NULL)
+        *pdwRead = 0;
+
+    /* Check valid parameters */
+    if(!IsValidFileHandle(hFile))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+
+    if(pvBuffer == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    /* Read the data and move the file position */
+    nError = ReadMpqFile(hf, pvBuffer, (uint32_t)dwToRead, &dwBytesRead);
+
+    /* Give the caller the number of bytes read */
+    if(pdwRead != NULL)
+        *pdwRead = dwBytesRead;
+
     /* If something failed, set the last error value */
     if(nError != ERROR_SUCCESS)
         SetLastError(nError);
@@ -14,6 +14,7 @@
 /* 02.05.15  1.00  Ayr  Ported to plain c                                    */
 /*****************************************************************************/
 
+#include <pthread.h>
 #include "thunderStorm.h"
 #include "StormCommon.h"
 
@@ -21,7 +22,66 @@
  * Local defines
  */
 
-#define MPQ_DIGEST_UNIT_SIZE      0x10000
+#define MPQ_DIGEST_UNIT_SIZE      0x10000       /* Minimum read size when calculating the MPQ digests */
+#define MPQ_DIGEST_READ_SIZE      0x100000      /* Default read size when calculating the MPQ digests */
+#define MPQ_DIGEST_MAX_READ_SIZE  0x10000000    /* Maximum read size, see SFileSetDigestReadSize */
+#define VERIFY_BUFFER_SIZE        0x100000      /* Amount of file data read at once when verifying */
+#define VERIFY_MIN_WORKLOAD       0x1000000     /* Minimum amount of file data worth a verification worker */
+
+/* Digests of the MPQ data, calculated by CalculateMpqDigests */
+#define MPQ_DIGEST_MD5            0x0001        /* MD5 with the (signature) file zeroed (weak signature) */
+#define MPQ_DIGEST_SHA1           0x0002        /* SHA1 with the (signature) file zeroed (secure signature) */
+#define MPQ_DIGEST_SHA1_TAILS     0x0004        /* SHA1 with each of the known tails (strong signature) */
+
+typedef struct _TMpqDigests
+{
+    unsigned char Md5[MD5_DIGEST_SIZE];
+    unsigned char Sha1[SHA1_DIGEST_SIZE];
+    unsigned char Sha1Tail0[SHA1_DIGEST_SIZE];  /* No tail */
+    unsigned char Sha1Tail1[SHA1_DIGEST_SIZE];  /* Plain name of the archive as tail */
+    unsigned char Sha1Tail2[SHA1_DIGEST_SIZE];  /* "ARCHIVE" as tail */
+} TMpqDigests;
+
+/* Double buffer for reading the MPQ data while the previous unit is being hashed */
+typedef struct _TDigestReader
+{
+    pthread_mutex_t Lock;               /* Guards cbLoaded, bFailed and bCancel */
+    pthread_cond_t Cond;                /* Signaled when a buffer is loaded or given back */
+    TFileStream * pStream;              /* Stream of the archive */
+    unsigned char * pbBuffer[2];        /* The two buffers */
+    uint32_t cbLoaded[2];               /* Bytes loaded in each buffer, zero if empty */
+    uint64_t ReadOffset;                /* File offset of the next unit to be read */
+    uint64_t EndOffset;                 /* File offset where the reading ends */
+    uint32_t dwReadSize;                /* Size of one unit */
+    int bFailed;                        /* Set by the reader if a read failed */
+    int nError;                         /* Error code of the failed read. The last error value is per thread */
+    int bCancel;                        /* Set by the caller to stop the reader */
+} TDigestReader;
+
+/* State shared by all workers of SFileVerifyAllFiles */
+typedef struct _TVerifyBatch
+{
+    pthread_mutex_t Lock;               /* Guards picking of files and the progress */
+    TMPQArchive * ha;                   /* The archive being verified */
+    uint32_t * pdwResults;              /* Verification result for each file entry */
+    uint32_t dwFlags;                   /* What to verify (SFILE_VERIFY_XXX) */
+    uint32_t dwNextFile;                /* Index of the next file entry to be verified */
+    uint64_t BytesProcessed;            /* Amount of file data verified so far */
+    uint64_t TotalBytes;                /* Amount of file data to be verified */
+    SFILE_VERIFY_CALLBACK pfnVerifyCB;  /* Progress callback, called under the lock */
+    void * pvUserData;                  /* User data for the progress callback */
+} TVerifyBatch;
+
+/* Archive and buffer used by one worker. The workers read through copies */
+/* of the archive structure, each with its own stream, as each stream has */
+/* its file position */
+typedef struct _TVerifyWorker
+{
+    TVerifyBatch * pBatch;              /* Shared state of the workers */
+    TMPQArchive * ha;                   /* Archive to read the files from */
+    unsigned char * pbBuffer;           /* Buffer for the file data */
+    uint32_t cbBuffer;                  /* Size of the buffer, multiple of the sector size */
+} TVerifyWorker;
 
 /*-----------------------------------------------------------------------------
  * Known Blizzard public keys
@@ -201,244 +261,259 @@ static void CalculateArchiveRange(
     FileStream_GetSize(ha->pStream, &pSI->EndOfFile);
 }
 
-static int CalculateMpqHashMd5(
-    TMPQArchive * ha,
-    PMPQ_SIGNATURE_INFO pSI,
-    unsigned char * pMd5Digest)
+static void AddTailToSha1(
+    hash_state * psha1_state,
+    const char * szTail)
 {
-    hash_state md5_state;
-    uint64_t BeginBuffer;
-    uint64_t EndBuffer;
-    unsigned char * pbDigestBuffer = NULL;
+    unsigned char * pbTail = (unsigned char *)szTail;
+    unsigned char szUpperCase[0x200];
+    unsigned long nLength = 0;
 
-    /* Allocate buffer for creating the MPQ digest. */
-    pbDigestBuffer = STORM_ALLOC(uint8_t, MPQ_DIGEST_UNIT_SIZE);
-    if(pbDigestBuffer == NULL)
-        return 0;
+    /* Convert the tail to uppercase */
+    /* Note that we don't need to terminate the string with zero */
+    while(*pbTail != 0)
+    {
+        szUpperCase[nLength++] = AsciiToUpperTable[*pbTail++];
+    }
 
-    /* Initialize the MD5 hash state */
-    md5_init(&md5_state);
+    /* Append the tail to the SHA1 */
+    sha1_process(psha1_state, szUpperCase, nLength);
+}
 
-    /* Set the byte offset of begin of the data */
-    BeginBuffer = pSI->BeginMpqData;
+/* Reads the next unit of the MPQ data into the given buffer. */
+/* Returns the number of bytes read, zero on error */
+static uint32_t ReadDigestUnit(TDigestReader * pReader, uint32_t dwBuffer)
+{
+    uint32_t dwToRead = pReader->dwReadSize;
 
-    /* Create the digest */
-    for(;;)
-    {
-        uint64_t BytesRemaining;
-        unsigned char * pbSigBegin = NULL;
-        unsigned char * pbSigEnd = NULL;
-        uint32_t dwToRead = MPQ_DIGEST_UNIT_SIZE;
-
-        /* Check the number of bytes remaining */
-        BytesRemaining = pSI->EndMpqData - BeginBuffer;
-        if(BytesRemaining < MPQ_DIGEST_UNIT_SIZE)
-            dwToRead = (uint32_t)BytesRemaining;
-        if(dwToRead == 0)
-            break;
+    /* Check the number of bytes remaining */
+    if((pReader->EndOffset - pReader->ReadOffset) < dwToRead)
+        dwToRead = (uint32_t)(pReader->EndOffset - pReader->ReadOffset);
 
-        /* Read the next chunk */
-        if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
-        {
-            STORM_FREE(pbDigestBuffer);
-            return 0;
-        }
+    /* Read the next unit */
+    if(!FileStream_Read(pReader->pStream, &pReader->ReadOffset, pReader->pbBuffer[dwBuffer], dwToRead))
+        return 0;
 
-        /* Move the current byte offset */
-        EndBuffer = BeginBuffer + dwToRead;
+    pReader->ReadOffset += dwToRead;
+    return dwToRead;
+}
 
-        /* Check if the signature is within the loaded digest */
-        if(BeginBuffer <= pSI->BeginExclude && pSI->BeginExclude < EndBuffer)
-            pbSigBegin = pbDigestBuffer + (size_t)(pSI->BeginExclude - BeginBuffer);
-        if(BeginBuffer <= pSI->EndExclude && pSI->EndExclude < EndBuffer)
-            pbSigEnd = pbDigestBuffer + (size_t)(pSI->EndExclude - BeginBuffer);
+/* Reader thread. Fills the buffers in turn, while the caller hashes the other one */
+static void * DigestReaderThread(void * pvReader)
+{
+    TDigestReader * pReader = (TDigestReader *)pvReader;
+    uint32_t dwBytesRead;
+    uint32_t dwBuffer = 0;
+    int bResult = 1;
 
-        /* Zero the part that belongs to the signature */
-        if(pbSigBegin != NULL || pbSigEnd != NULL)
+    while(bResult && pReader->ReadOffset < pReader->EndOffset)
+    {
+        /* Wait until the buffer has been hashed */
+        pthread_mutex_lock(&pReader->Lock);
+        while(pReader->cbLoaded[dwBuffer] != 0 && !pReader->bCancel)
+            pthread_cond_wait(&pReader->Cond, &pReader->Lock);
+        bResult = !pReader->bCancel;
+        pthread_mutex_unlock(&pReader->Lock);
+
+        /* Read the next unit outside the lock */
+        if(bResult)
         {
-            if(pbSigBegin == NULL)
-                pbSigBegin = pbDigestBuffer;
-            if(pbSigEnd == NULL)
-                pbSigEnd = pbDigestBuffer + dwToRead;
-
-            memset(pbSigBegin, 0, (pbSigEnd - pbSigBegin));
+            dwBytesRead = ReadDigestUnit(pReader, dwBuffer);
+            bResult = (dwBytesRead != 0);
+
+            pthread_mutex_lock(&pReader->Lock);
+            pReader->cbLoaded[dwBuffer] = dwBytesRead;
+            pReader->bFailed = !bResult;
+            pReader->nError = bResult ? ERROR_SUCCESS : GetLastError();
+            pthread_cond_signal(&pReader->Cond);
+            pthread_mutex_unlock(&pReader->Lock);
+            dwBuffer ^= 1;
         }
-
-        /* Pass the buffer to the hashing function */
-        md5_process(&md5_state, pbDigestBuffer, dwToRead);
-
-        /* Move pointers */
-        BeginBuffer += dwToRead;
     }
 
-    /* Finalize the MD5 hash */
-    md5_done(&md5_state, pMd5Digest);
-    STORM_FREE(pbDigestBuffer);
-    return 1;
+    return NULL;
 }
 
-static int CalculateMpqHashSha1(
+/* Calculates the requested digests (MPQ_DIGEST_XXX) of the MPQ data in one pass. */
+/* The data are read in units of the archive's digest read size. On flat local files, */
+/* the next unit is read by a separate thread while the current one is being hashed. */
+static int CalculateMpqDigests(
     TMPQArchive * ha,
     PMPQ_SIGNATURE_INFO pSI,
-    unsigned char * pSha1Digest)
+    uint32_t dwDigests,
+    TMpqDigests * pDigests)
 {
+    TDigestReader Reader;
+    hash_state md5_state;
     hash_state sha1_state;
+    hash_state sha1_raw_state;
+    hash_state sha1_state_temp;
+    pthread_t ReaderThread;
     uint64_t BeginBuffer;
     uint64_t EndBuffer;
-    unsigned char * pbDigestBuffer = NULL;
-
-    /* Allocate buffer for creating the MPQ digest. */
-    pbDigestBuffer = STORM_ALLOC(uint8_t, MPQ_DIGEST_UNIT_SIZE);
-    if(pbDigestBuffer == NULL)
+    uint32_t dwStreamFlags = 0;
+    uint32_t dwBuffer = 0;
+    uint32_t dwToHash;
+    char szPlainName[MAX_PATH];
+    int bThreaded = 0;
+    int bResult = 1;
+
+    /* Prepare the reader */
+    memset(&Reader, 0, sizeof(TDigestReader));
+    Reader.pStream = ha->pStream;
+    Reader.ReadOffset = pSI->BeginMpqData;
+    Reader.EndOffset = pSI->EndMpqData;
+    Reader.dwReadSize = (ha->dwDigestReadSize != 0) ? ha->dwDigestReadSize : MPQ_DIGEST_READ_SIZE;
+
+    /* Don't allocate more than needed for small archives */
+    if((Reader.EndOffset - Reader.ReadOffset) < Reader.dwReadSize)
+        Reader.dwReadSize = (uint32_t)STORMLIB_MAX(Reader.EndOffset - Reader.ReadOffset, MPQ_DIGEST_UNIT_SIZE);
+
+    /* Allocate the buffers for the MPQ data */
+    Reader.pbBuffer[0] = STORM_ALLOC(uint8_t, Reader.dwReadSize);
+    Reader.pbBuffer[1] = STORM_ALLOC(uint8_t, Reader.dwReadSize);
+    if(Reader.pbBuffer[0] == NULL || Reader.pbBuffer[1] == NULL)
+    {
+        if(Reader.pbBuffer[1] != NULL)
+            STORM_FREE(Reader.pbBuffer[1]);
+        if(Reader.pbBuffer[0] != NULL)
+            STORM_FREE(Reader.pbBuffer[0]);
         return 0;
+    }
 
-    /* Initialize the SHA1 hash state */
+    /* Initialize the hash states */
+    md5_init(&md5_state);
     sha1_init(&sha1_state);
+    sha1_init(&sha1_raw_state);
+
+    /* Only use the reader thread if there is more than one unit to read. */
+    /* Streams of other providers may call the download callback, so they */
+    /* are read by the calling thread */
+    FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+    if((Reader.EndOffset - Reader.ReadOffset) > Reader.dwReadSize &&
+       (dwStreamFlags & STREAM_PROVIDER_MASK) == STREAM_PROVIDER_FLAT &&
+       (dwStreamFlags & BASE_PROVIDER_MASK) != BASE_PROVIDER_HTTP)
+    {
+        if(pthread_mutex_init(&Reader.Lock, NULL) == 0)
+        {
+            if(pthread_cond_init(&Reader.Cond, NULL) == 0)
+            {
+                bThreaded = (pthread_create(&ReaderThread, NULL, DigestReaderThread, &Reader) == 0);
+                if(!bThreaded)
+                    pthread_cond_destroy(&Reader.Cond);
+            }
+            if(!bThreaded)
+                pthread_mutex_destroy(&Reader.Lock);
+        }
+    }
 
-    /* Set the byte offset of begin of the data */
-    BeginBuffer = pSI->BeginMpqData;
-
-    /* Create the digest */
-    for(;;)
+    /* Create the digests */
+    for(BeginBuffer = pSI->BeginMpqData; BeginBuffer < pSI->EndMpqData; BeginBuffer = EndBuffer)
     {
-        uint64_t BytesRemaining;
-        unsigned char * pbSigBegin = NULL;
-        unsigned char * pbSigEnd = NULL;
-        uint32_t dwToRead = MPQ_DIGEST_UNIT_SIZE;
-
-        /* Check the number of bytes remaining */
-        BytesRemaining = pSI->EndMpqData - BeginBuffer;
-        if(BytesRemaining < MPQ_DIGEST_UNIT_SIZE)
-            dwToRead = (uint32_t)BytesRemaining;
-        if(dwToRead == 0)
-            break;
+        unsigned char * pbDigestBuffer = Reader.pbBuffer[dwBuffer];
+        unsigned char * pbSigBegin;
+        unsigned char * pbSigEnd;
 
-        /* Read the next chunk */
-        if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
+        /* Get the next unit, either from the reader thread or directly */
+        if(bThreaded)
         {
-            STORM_FREE(pbDigestBuffer);
-            return 0;
+            pthread_mutex_lock(&Reader.Lock);
+            while(Reader.cbLoaded[dwBuffer] == 0 && !Reader.bFailed)
+                pthread_cond_wait(&Reader.Cond, &Reader.Lock);
+            bResult = (Reader.cbLoaded[dwBuffer] != 0);
+            pthread_mutex_unlock(&Reader.Lock);
+        }
+        else
+        {
+            Reader.cbLoaded[dwBuffer] = ReadDigestUnit(&Reader, dwBuffer);
+            bResult = (Reader.cbLoaded[dwBuffer] != 0);
         }
 
+        if(!bResult)
+            break;
+
         /* Move the current byte offset */
-        EndBuffer = BeginBuffer + dwToRead;
+        dwToHash = Reader.cbLoaded[dwBuffer];
+        EndBuffer = BeginBuffer + dwToHash;
 
-        /* Check if the signature is within the loaded digest */
-        if(BeginBuffer <= pSI->BeginExclude && pSI->BeginExclude < EndBuffer)
-            pbSigBegin = pbDigestBuffer + (size_t)(pSI->BeginExclude - BeginBuffer);
-        if(BeginBuffer <= pSI->EndExclude && pSI->EndExclude < EndBuffer)
-            pbSigEnd = pbDigestBuffer + (size_t)(pSI->EndExclude - BeginBuffer);
+        /* The strong signature covers the data as they are */
+        if(dwDigests & MPQ_DIGEST_SHA1_TAILS)
+            sha1_process(&sha1_raw_state, pbDigestBuffer, dwToHash);
 
         /* Zero the part that belongs to the signature */
-        if(pbSigBegin != NULL || pbSigEnd != NULL)
+        if(pSI->BeginExclude < EndBuffer && BeginBuffer < pSI->EndExclude)
         {
-            if(pbSigBegin == NULL)
-                pbSigBegin = pbDigestBuffer;
-            if(pbSigEnd == NULL)
-                pbSigEnd = pbDigestBuffer + dwToRead;
-
+            pbSigBegin = pbDigestBuffer + (size_t)(STORMLIB_MAX(pSI->BeginExclude, BeginBuffer) - BeginBuffer);
+            pbSigEnd = pbDigestBuffer + (size_t)(STORMLIB_MIN(pSI->EndExclude, EndBuffer) - BeginBuffer);
             memset(pbSigBegin, 0, (pbSigEnd - pbSigBegin));
         }
 
-        /* Pass the buffer to the hashing function */
-        sha1_process(&sha1_state, pbDigestBuffer, dwToRead);
+        /* Pass the buffer to the hashing functions */
+        if(dwDigests & MPQ_DIGEST_MD5)
+            md5_process(&md5_state, pbDigestBuffer, dwToHash);
+        if(dwDigests & MPQ_DIGEST_SHA1)
+            sha1_process(&sha1_state, pbDigestBuffer, dwToHash);
 
-        /* Move pointers */
-        BeginBuffer += dwToRead;
+        /* Give the buffer back to the reader */
+        if(bThreaded)
+        {
+            pthread_mutex_lock(&Reader.Lock);
+            Reader.cbLoaded[dwBuffer] = 0;
+            pthread_cond_signal(&Reader.Cond);
+            pthread_mutex_unlock(&Reader.Lock);
+        }
+        else
+        {
+            Reader.cbLoaded[dwBuffer] = 0;
+        }
+        dwBuffer ^= 1;
     }
 
-    /* Finalize the SHA1 hash */
-    sha1_done(&sha1_state, pSha1Digest);
-    STORM_FREE(pbDigestBuffer);
-    return 1;
-}
-
-static void AddTailToSha1(
-    hash_state * psha1_state,
-    const char * szTail)
-{
-    unsigned char * pbTail = (unsigned char *)szTail;
-    unsigned char szUpperCase[0x200];
-    unsigned long nLength = 0;
-
-    /* Convert the tail to uppercase */
-    /* Note that we don't need to terminate the string with zero */
-    while(*pbTail != 0)
+    /* Stop the reader thread */
+    if(bThreaded)
     {
-        szUpperCase[nLength++] = AsciiToUpperTable[*pbTail++];
+        pthread_mutex_lock(&Reader.Lock);
+        Reader.bCancel = 1;
+        pthread_cond_signal(&Reader.Cond);
+        pthread_mutex_unlock(&Reader.Lock);
+
+        pthread_join(ReaderThread, NULL);
+        pthread_cond_destroy(&Reader.Cond);
+        pthread_mutex_destroy(&Reader.Lock);
+
+        /* Pass the error of the reader to the caller's thread */
+        if(Reader.bFailed)
+            SetLastError(Reader.nError);
     }
 
-    /* Append the tail to the SHA1 */
-    sha1_process(psha1_state, szUpperCase, nLength);
-}
-
-static int CalculateMpqHashSha1WithTail(
-    TMPQArchive * ha,
-    PMPQ_SIGNATURE_INFO pSI,
-    unsigned char * sha1_tail0,
-    unsigned char * sha1_tail1,
-    unsigned char * sha1_tail2)
-{
-    uint64_t BeginBuffer;
-    hash_state sha1_state_temp;
-    hash_state sha1_state;
-    unsigned char * pbDigestBuffer = NULL;
-    char szPlainName[MAX_PATH];
-
-    /* Allocate buffer for creating the MPQ digest. */
-    pbDigestBuffer = STORM_ALLOC(uint8_t, MPQ_DIGEST_UNIT_SIZE);
-    if(pbDigestBuffer == NULL)
-        return 0;
-
-    /* Initialize SHA1 state structure */
-    sha1_init(&sha1_state);
-
-    /* Calculate begin of data to be hashed */
-    BeginBuffer = pSI->BeginMpqData;
-
-    /* Create the digest */
-    for(;;)
+    /* Finalize the digests */
+    if(bResult)
     {
-        uint64_t BytesRemaining;
-        uint32_t dwToRead = MPQ_DIGEST_UNIT_SIZE;
-
-        /* Check the number of bytes remaining */
-        BytesRemaining = pSI->EndMpqData - BeginBuffer;
-        if(BytesRemaining < MPQ_DIGEST_UNIT_SIZE)
-            dwToRead = (uint32_t)BytesRemaining;
-        if(dwToRead == 0)
-            break;
+        if(dwDigests & MPQ_DIGEST_MD5)
+            md5_done(&md5_state, pDigests->Md5);
+        if(dwDigests & MPQ_DIGEST_SHA1)
+            sha1_done(&sha1_state, pDigests->Sha1);
 
-        /* Read the next chunk */
-        if(!FileStream_Read(ha->pStream, &BeginBuffer, pbDigestBuffer, dwToRead))
+        /* Add all three known tails and generate three hashes */
+        if(dwDigests & MPQ_DIGEST_SHA1_TAILS)
         {
-            STORM_FREE(pbDigestBuffer);
-            return 0;
-        }
+            memcpy(&sha1_state_temp, &sha1_raw_state, sizeof(hash_state));
+            sha1_done(&sha1_state_temp, pDigests->Sha1Tail0);
 
-        /* Pass the buffer to the hashing function */
-        sha1_process(&sha1_state, pbDigestBuffer, dwToRead);
+            memcpy(&sha1_state_temp, &sha1_raw_state, sizeof(hash_state));
+            GetPlainAnsiFileName(FileStream_GetFileName(ha->pStream), szPlainName);
+            AddTailToSha1(&sha1_state_temp, szPlainName);
+            sha1_done(&sha1_state_temp, pDigests->Sha1Tail1);
 
-        /* Move pointers */
-        BeginBuffer += dwToRead;
+            memcpy(&sha1_state_temp, &sha1_raw_state, sizeof(hash_state));
+            AddTailToSha1(&sha1_state_temp, "ARCHIVE");
+            sha1_done(&sha1_state_temp, pDigests->Sha1Tail2);
+        }
     }
 
-    /* Add all three known tails and generate three hashes */
-    memcpy(&sha1_state_temp, &sha1_state, sizeof(hash_state));
-    sha1_done(&sha1_state_temp, sha1_tail0);
-
-    memcpy(&sha1_state_temp, &sha1_state, sizeof(hash_state));
-    GetPlainAnsiFileName(FileStream_GetFileName(ha->pStream), szPlainName);
-    AddTailToSha1(&sha1_state_temp, szPlainName);
-    sha1_done(&sha1_state_temp, sha1_tail1);
-
-    memcpy(&sha1_state_temp, &sha1_state, sizeof(hash_state));
-    AddTailToSha1(&sha1_state_temp, "ARCHIVE");
-    sha1_done(&sha1_state_temp, sha1_tail2);
-
-    /* Finalize the SHA1 hash */
-    STORM_FREE(pbDigestBuffer);
-    return 1;
+    STORM_FREE(Reader.pbBuffer[1]);
+    STORM_FREE(Reader.pbBuffer[0]);
+    return bResult;
 }
 
 static int VerifyRawMpqData(
@@ -450,7 +525,8 @@ static int VerifyRawMpqData(
     unsigned char * pbDataChunk;
     unsigned char * pbMD5Array1;                 /* Calculated MD5 array */
     unsigned char * pbMD5Array2;                 /* MD5 array loaded from the MPQ */
-    uint32_t dwBytesInChunk;
+    uint32_t dwBytesToRead;
+    uint32_t dwChunksPerRead;
     uint32_t dwChunkCount;
     uint32_t dwChunkSize = ha->pHeader->dwRawChunkSize;
     uint32_t dwMD5Size;
@@ -465,8 +541,12 @@ static int VerifyRawMpqData(
     dwChunkCount = ((dwDataSize - 1) / dwChunkSize) + 1;
     dwMD5Size = dwChunkCount * MD5_DIGEST_SIZE;
 
-    /* Allocate space for data chunk and for the MD5 array */
-    pbDataChunk = STORM_ALLOC(uint8_t, dwChunkSize);
+    /* Read as many chunks at once as fit into the verify buffer */
+    dwChunksPerRead = STORMLIB_MAX(VERIFY_BUFFER_SIZE / dwChunkSize, 1);
+    dwChunksPerRead = STORMLIB_MIN(dwChunksPerRead, dwChunkCount);
+
+    /* Allocate space for data chunks and for the MD5 array */
+    pbDataChunk = STORM_ALLOC(uint8_t, dwChunksPerRead * dwChunkSize);
     if(pbDataChunk == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
@@ -479,28 +559,25 @@ static int VerifyRawMpqData(
     /* Calculate MD5 of each data chunk */
     if(nError == ERROR_SUCCESS)
     {
-        uint32_t i;
         unsigned char * pbMD5 = pbMD5Array1;
 
-        for(i = 0; i < dwChunkCount; i++)
+        while(dwDataSize > 0)
         {
-            /* Get the number of bytes in the chunk */
-            dwBytesInChunk = STORMLIB_MIN(dwChunkSize, dwDataSize);
-
-            /* Read the data chunk */
-            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataChunk, dwBytesInChunk))
+            /* Read the data of multiple chunks */
+            dwBytesToRead = STORMLIB_MIN(dwChunksPerRead * dwChunkSize, dwDataSize);
+            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataChunk, dwBytesToRead))
             {
                 nError = ERROR_FILE_CORRUPT;
                 break;
             }
 
-            /* Calculate MD5 */
-            CalculateDataBlockHash(pbDataChunk, dwBytesInChunk, pbMD5);
-
             /* Move pointers and offsets */
-            DataOffset += dwBytesInChunk;
-            dwDataSize -= dwBytesInChunk;
-            pbMD5 += MD5_DIGEST_SIZE;
+            DataOffset += dwBytesToRead;
+            dwDataSize -= dwBytesToRead;
+
+            /* Calculate MD5 of each chunk */
+            MD5_HashChunks(pbDataChunk, dwBytesToRead, dwChunkSize, pbMD5);
+            pbMD5 += ((dwBytesToRead - 1) / dwChunkSize + 1) * MD5_DIGEST_SIZE;
         }
     }
 
@@ -509,7 +586,7 @@ static int VerifyRawMpqData(
     {
         /* Read the array of MD5 */
         if(!FileStream_Read(ha->pStream, &DataOffset, pbMD5Array2, dwMD5Size))
-            nError = GetLastError();
+            nError = ERROR_FILE_CORRUPT;
     }
 
     /* Compare the array of MD5 */
@@ -535,7 +612,7 @@ static uint32_t VerifyWeakSignature(
     PMPQ_SIGNATURE_INFO pSI)
 {
     uint8_t RevSignature[MPQ_WEAK_SIGNATURE_SIZE];
-    uint8_t Md5Digest[MD5_DIGEST_SIZE];
+    TMpqDigests Digests;
     rsa_key * key;
     rsa_key blizzKey;
     int hash_idx = find_hash("md5");
@@ -546,7 +623,7 @@ static uint32_t VerifyWeakSignature(
         return ERROR_WEAK_SIGNATURE_OK;
 
     /* Calculate hash of the entire archive, skipping the (signature) file */
-    if(!CalculateMpqHashMd5(ha, pSI, Md5Digest))
+    if(!CalculateMpqDigests(ha, pSI, MPQ_DIGEST_MD5, &Digests))
         return ERROR_VERIFY_FAILED;
 
     key = &(ha->keyRSA);
@@ -563,7 +640,7 @@ static uint32_t VerifyWeakSignature(
     /* Verify the signature */
     memcpy(RevSignature, &pSI->Signature[8], MPQ_WEAK_SIGNATURE_SIZE);
     memrev(RevSignature, MPQ_WEAK_SIGNATURE_SIZE);
-    rsa_verify_hash_ex(RevSignature, MPQ_WEAK_SIGNATURE_SIZE, Md5Digest, sizeof(Md5Digest), LTC_LTC_PKCS_1_V1_5, hash_idx, 0, &result, key);
+    rsa_verify_hash_ex(RevSignature, MPQ_WEAK_SIGNATURE_SIZE, Digests.Md5, MD5_DIGEST_SIZE, LTC_LTC_PKCS_1_V1_5, hash_idx, 0, &result, key);
     if(key == &blizzKey)
         rsa_free(key);
 
@@ -576,7 +653,7 @@ static uint32_t VerifySecureSignature(
     PMPQ_SIGNATURE_INFO pSI)
 {
     uint8_t RevSignature[MPQ_SECURE_SIGNATURE_SIZE];
-    uint8_t Sha1Digest[SHA1_DIGEST_SIZE];
+    TMpqDigests Digests;
     rsa_key * key = &(ha->keyRSA);
     int hash_idx = find_hash("sha1");
     int result = 0;
@@ -590,13 +667,13 @@ static uint32_t VerifySecureSignature(
         return ENOKEY;
 
     /* Calculate hash of the entire archive, skipping the (signature) file */
-    if(!CalculateMpqHashSha1(ha, pSI, Sha1Digest))
+    if(!CalculateMpqDigests(ha, pSI, MPQ_DIGEST_SHA1, &Digests))
         return ERROR_VERIFY_FAILED;
 
     /* Verify the signature */
     memcpy(RevSignature, &pSI->Signature[8], pSI->cbSignatureSize);
     memrev(RevSignature, pSI->cbSignatureSize);
-    rsa_verify_hash_ex(RevSignature, pSI->cbSignatureSize, Sha1Digest, sizeof(Sha1Digest), LTC_LTC_PKCS_1_V1_5, hash_idx, 0, &result, key);
+    rsa_verify_hash_ex(RevSignature, pSI->cbSignatureSize, Digests.Sha1, SHA1_DIGEST_SIZE, LTC_LTC_PKCS_1_V1_5, hash_idx, 0, &result, key);
 
     /* Return the result */
     return result ? ERROR_SECURE_SIGNATURE_OK : ERROR_SECURE_SIGNATURE_ERROR;
@@ -631,15 +708,13 @@ static uint32_t VerifyStrongSignature(
     PMPQ_SIGNATURE_INFO pSI)
 {
     unsigned char reversed_signature[MPQ_STRONG_SIGNATURE_SIZE];
-    unsigned char Sha1Digest_tail0[SHA1_DIGEST_SIZE];
-    unsigned char Sha1Digest_tail1[SHA1_DIGEST_SIZE];
-    unsigned char Sha1Digest_tail2[SHA1_DIGEST_SIZE];
+    TMpqDigests Digests;
     unsigned char padded_digest[MPQ_STRONG_SIGNATURE_SIZE];
     uint32_t dwResult;
     size_t digest_offset;
 
     /* Calculate SHA1 hash of the archive */
-    if(!CalculateMpqHashSha1WithTail(ha, pSI, Sha1Digest_tail0, Sha1Digest_tail1, Sha1Digest_tail2))
+    if(!CalculateMpqDigests(ha, pSI, MPQ_DIGEST_SHA1_TAILS, &Digests))
         return ERROR_VERIFY_FAILED;
 
     /* Prepare the signature for decryption */
@@ -652,35 +727,35 @@ static uint32_t VerifyStrongSignature(
     padded_digest[0] = 0x0b;
 
     /* Try Blizzard Strong public key with no SHA1 tail */
-    memcpy(padded_digest + digest_offset, Sha1Digest_tail0, SHA1_DIGEST_SIZE);
+    memcpy(padded_digest + digest_offset, Digests.Sha1Tail0, SHA1_DIGEST_SIZE);
     memrev(padded_digest + digest_offset, SHA1_DIGEST_SIZE);
     dwResult = VerifyStrongSignatureWithKey(reversed_signature, padded_digest, szBlizzardStrongPublicKey);
     if(dwResult == ERROR_STRONG_SIGNATURE_OK)
         return dwResult;
 
     /* Try War 3 map public key with plain file name as SHA1 tail */
-    memcpy(padded_digest + digest_offset, Sha1Digest_tail1, SHA1_DIGEST_SIZE);
+    memcpy(padded_digest + digest_offset, Digests.Sha1Tail1, SHA1_DIGEST_SIZE);
     memrev(padded_digest + digest_offset, SHA1_DIGEST_SIZE);
     dwResult = VerifyStrongSignatureWithKey(reversed_signature, padded_digest, szWarcraft3MapPublicKey);
     if(dwResult == ERROR_STRONG_SIGNATURE_OK)
         return dwResult;
 
     /* Try WoW-TBC public key with "ARCHIVE" as SHA1 tail */
-    memcpy(padded_digest + digest_offset, Sha1Digest_tail2, SHA1_DIGEST_SIZE);
+    memcpy(padded_digest + digest_offset, Digests.Sha1Tail2, SHA1_DIGEST_SIZE);
     memrev(padded_digest + digest_offset, SHA1_DIGEST_SIZE);
     dwResult = VerifyStrongSignatureWithKey(reversed_signature, padded_digest, szWowPatchPublicKey);
     if(dwResult == ERROR_STRONG_SIGNATURE_OK)
         return dwResult;
 
     /* Try Survey public key with no SHA1 tail */
-    memcpy(padded_digest + digest_offset, Sha1Digest_tail0, SHA1_DIGEST_SIZE);
+    memcpy(padded_digest + digest_offset, Digests.Sha1Tail0, SHA1_DIGEST_SIZE);
     memrev(padded_digest + digest_offset, SHA1_DIGEST_SIZE);
     dwResult = VerifyStrongSignatureWithKey(reversed_signature, padded_digest, szWowSurveyPublicKey);
     if(dwResult == ERROR_STRONG_SIGNATURE_OK)
         return dwResult;
 
     /* Try Starcraft II public key with no SHA1 tail */
-    memcpy(padded_digest + digest_offset, Sha1Digest_tail0, SHA1_DIGEST_SIZE);
+    memcpy(padded_digest + digest_offset, Digests.Sha1Tail0, SHA1_DIGEST_SIZE);
     memrev(padded_digest + digest_offset, SHA1_DIGEST_SIZE);
     dwResult = VerifyStrongSignatureWithKey(reversed_signature, padded_digest, szStarcraft2MapPublicKey);
     if(dwResult == ERROR_STRONG_SIGNATURE_OK)
@@ -689,6 +764,122 @@ static uint32_t VerifyStrongSignature(
     return ERROR_STRONG_SIGNATURE_ERROR;
 }
 
+/* Reads the entire file through the given buffer and checks the sector CRCs, */
+/* CRC32 and MD5 of the file. Both CRC32 and MD5 are calculated from the same data. */
+static uint32_t VerifyFileData(
+    TMPQFile * hf,
+    uint32_t dwTotalBytes,
+    uint32_t dwFlags,
+    unsigned char * pbBuffer,
+    uint32_t cbBuffer,
+    uint32_t * pdwCrc32,
+    unsigned char * md5)
+{
+    hash_state md5_state;
+    const unsigned char * pFileMd5;
+    TMPQFileEntry * pFileEntry = hf->pFileEntry;
+    uint32_t dwVerifyResult = 0;
+    uint32_t dwBytesRead;
+    uint32_t dwCrc32;
+    int nError;
+
+    /* Initialize the CRC32 and MD5 contexts */
+    md5_init(&md5_state);
+    dwCrc32 = crc32(0, Z_NULL, 0);
+
+    /* Also turn on sector checksum verification */
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+        hf->bCheckSectorCRCs = 1;
+
+    /* Go through entire file and update both CRC32 and MD5 */
+    for(;;)
+    {
+        /* Read data from file */
+        nError = ReadMpqFile(hf, pbBuffer, cbBuffer, &dwBytesRead);
+        if(nError == ERROR_CHECKSUM_ERROR)
+            dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
+
+        /* Update CRC32 value */
+        if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            dwCrc32 = crc32(dwCrc32, pbBuffer, dwBytesRead);
+
+        /* Update MD5 value */
+        if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            md5_process(&md5_state, pbBuffer, dwBytesRead);
+
+        /* Decrement the total size */
+        dwTotalBytes -= dwBytesRead;
+
+        /* Stop at the end of the file or on error */
+        if(nError != ERROR_SUCCESS || dwBytesRead == 0)
+            break;
+    }
+
+    /* If the file has sector checksums, indicate it in the flags */
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+    {
+        if((pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
+            dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
+    }
+
+    /* Check if the entire file has been read */
+    /* No point in checking CRC32 and MD5 if not */
+    /* Skip checksum checks if the file has patches */
+    if(dwTotalBytes == 0)
+    {
+        /* Check CRC32 and MD5 only if there is no patches */
+        if(hf->hfPatch == NULL)
+        {
+            /* Check if the CRC32 matches. */
+            if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            {
+                /* Only check the CRC32 if it is valid */
+                if(GetFileEntryCrc32(hf->ha, pFileEntry) != 0)
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
+                    if(dwCrc32 != GetFileEntryCrc32(hf->ha, pFileEntry))
+                        dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
+                }
+            }
+
+            /* Check if MD5 matches */
+            if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            {
+                /* Patch files have their MD5 saved in the patch info */
+                pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : GetFileEntryMd5(hf->ha, pFileEntry);
+                md5_done(&md5_state, md5);
+
+                /* Only check the MD5 if it is valid */
+                if(IsValidMD5(pFileMd5))
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+                    if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
+                        dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
+                }
+            }
+        }
+        else
+        {
+            /* Patched files are MD5-checked automatically */
+            dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+        }
+    }
+    else
+    {
+        dwVerifyResult |= VERIFY_READ_ERROR;
+    }
+
+    *pdwCrc32 = dwCrc32;
+    return dwVerifyResult;
+}
+
+/* Gets the size of the buffer for reading file data. It is a multiple of the sector size, */
+/* so that whole sectors are decompressed directly into the buffer */
+static uint32_t GetVerifyBufferSize(TMPQArchive * ha)
+{
+    return ((VERIFY_BUFFER_SIZE + ha->dwSectorSize - 1) / ha->dwSectorSize) * ha->dwSectorSize;
+}
+
 static uint32_t VerifyFile(
     void * hMpq,
     const char * szFileName,
@@ -696,15 +887,13 @@ static uint32_t VerifyFile(
     char * pMD5,
     uint32_t dwFlags)
 {
-    hash_state md5_state;
-    unsigned char * pFileMd5;
     unsigned char md5[MD5_DIGEST_SIZE];
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQFile * hf;
-    uint8_t Buffer[0x1000];
+    unsigned char * pbBuffer;
     void * hFile = NULL;
     uint32_t dwVerifyResult = 0;
-    uint32_t dwTotalBytes = 0;
+    uint32_t cbBuffer;
     uint32_t dwCrc32 = 0;
 
     /*
@@ -715,6 +904,13 @@ static uint32_t VerifyFile(
     /* Make sure the md5 is initialized */
     memset(md5, 0, sizeof(md5));
 
+    /* The file data don't match the tables until an interrupted in-place compacting is finished */
+    if(IsValidMpqHandle(hMpq) && (((TMPQArchive *)hMpq)->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+    {
+        SetLastError(ERROR_COMPACT_INTERRUPTED);
+        return VERIFY_OPEN_ERROR;
+    }
+
     /* If we have to verify raw data MD5, do it before file open */
     if(dwFlags & SFILE_VERIFY_RAW_MD5)
     {
@@ -747,93 +943,14 @@ static uint32_t VerifyFile(
     /* Attempt to open the file */
     if(SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_FROM_MPQ, &hFile))
     {
-        /* Get the file size */
+        /* Read the file through a buffer of whole sectors */
         hf = (TMPQFile *)hFile;
-        pFileEntry = hf->pFileEntry;
-        dwTotalBytes = SFileGetFileSize(hFile, NULL);
-
-        /* Initialize the CRC32 and MD5 contexts */
-        md5_init(&md5_state);
-        dwCrc32 = crc32(0, Z_NULL, 0);
-
-        /* Also turn on sector checksum verification */
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
-            hf->bCheckSectorCRCs = 1;
-
-        /* Go through entire file and update both CRC32 and MD5 */
-        for(;;)
-        {
-            size_t dwBytesRead = 0;
-
-            /* Read data from file */
-            SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead);
-            if(dwBytesRead == 0)
-            {
-                if(GetLastError() == ERROR_CHECKSUM_ERROR)
-                    dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
-                break;
-            }
-
-            /* Update CRC32 value */
-            if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                dwCrc32 = crc32(dwCrc32, Buffer, dwBytesRead);
-            
-            /* Update MD5 value */
-            if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                md5_process(&md5_state, Buffer, dwBytesRead);
-
-            /* Decrement the total size */
-            dwTotalBytes -= dwBytesRead;
-        }
-
-        /* If the file has sector checksums, indicate it in the flags */
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
-        {
-            if((hf->pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
-                dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
-        }
-
-        /* Check if the entire file has been read */
-        /* No point in checking CRC32 and MD5 if not */
-        /* Skip checksum checks if the file has patches */
-        if(dwTotalBytes == 0)
+        cbBuffer = GetVerifyBufferSize(hf->ha);
+        pbBuffer = STORM_ALLOC(uint8_t, cbBuffer);
+        if(pbBuffer != NULL)
         {
-            /* Check CRC32 and MD5 only if there is no patches */
-            if(hf->hfPatch == NULL)
-            {
-                /* Check if the CRC32 matches. */
-                if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                {
-                    /* Only check the CRC32 if it is valid */
-                    if(pFileEntry->dwCrc32 != 0)
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
-                        if(dwCrc32 != pFileEntry->dwCrc32)
-                            dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
-                    }
-                }
-
-                /* Check if MD5 matches */
-                if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                {
-                    /* Patch files have their MD5 saved in the patch info */
-                    pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : pFileEntry->md5;
-                    md5_done(&md5_state, md5);
-
-                    /* Only check the MD5 if it is valid */
-                    if(IsValidMD5(pFileMd5))
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_MD5;
-                        if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
-                            dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
-                    }
-                }
-            }
-            else
-            {
-                /* Patched files are MD5-checked automatically */
-                dwVerifyResult |= VERIFY_FILE_HAS_MD5;
-            }
+            dwVerifyResult |= VerifyFileData(hf, (uint32_t)SFileGetFileSize(hFile, NULL), dwFlags, pbBuffer, cbBuffer, &dwCrc32, md5);
+            STORM_FREE(pbBuffer);
         }
         else
         {
@@ -857,12 +974,94 @@ static uint32_t VerifyFile(
     return dwVerifyResult;
 }
 
+/* Verifies one file of the archive, given by its index in the file table. */
+/* The file is verified without patches. */
+static uint32_t VerifyFileByIndex(TVerifyWorker * pWorker, uint32_t dwFileIndex)
+{
+    unsigned char md5[MD5_DIGEST_SIZE];
+    TMPQArchive * ha = pWorker->ha;
+    TMPQFileEntry * pFileEntry = ha->pFileTable + dwFileIndex;
+    TMPQFile * hf = NULL;
+    uint32_t dwFlags = pWorker->pBatch->dwFlags;
+    uint32_t dwVerifyResult = 0;
+    uint32_t dwCrc32;
+
+    /* If the file's raw MD5 doesn't match, don't bother with more checks */
+    if((dwFlags & SFILE_VERIFY_RAW_MD5) && ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwVerifyResult |= VERIFY_FILE_HAS_RAW_MD5;
+        if(VerifyRawMpqData(ha, pFileEntry->ByteOffset, pFileEntry->dwCmpSize) != ERROR_SUCCESS)
+            return dwVerifyResult | VERIFY_FILE_RAW_MD5_ERROR;
+    }
+
+    /* Open the file and verify its data */
+    if(OpenFileEntry(ha, dwFileIndex, HASH_ENTRY_FREE, &hf) == ERROR_SUCCESS)
+    {
+        dwVerifyResult |= VerifyFileData(hf, pFileEntry->dwFileSize, dwFlags, pWorker->pbBuffer, pWorker->cbBuffer, &dwCrc32, md5);
+        FreeFileHandle(&hf);
+    }
+    else
+    {
+        dwVerifyResult |= VERIFY_OPEN_ERROR;
+    }
+
+    return dwVerifyResult;
+}
+
+/* Checks whether a file entry is verified by the workers. Files whose result */
+/* has been taken from the verification cache are skipped */
+static int IsFileToVerify(TVerifyBatch * pBatch, uint32_t dwFileIndex)
+{
+    uint32_t dwVerifyResult;
+
+    if((pBatch->ha->pFileTable[dwFileIndex].dwFlags & MPQ_FILE_EXISTS) == 0)
+        return 0;
+    return !QueryVerifyCacheFile(pBatch->ha, dwFileIndex, pBatch->dwFlags, &dwVerifyResult);
+}
+
+/* Verifies the files of the archive, until there is no file left */
+static void VerifyAllFilesWorker(void * pvContext)
+{
+    TVerifyWorker * pWorker = (TVerifyWorker *)pvContext;
+    TVerifyBatch * pBatch = pWorker->pBatch;
+    TMPQArchive * ha = pBatch->ha;
+    uint32_t dwVerifyResult = 0;
+    uint32_t dwFileIndex = HASH_ENTRY_FREE;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pBatch->Lock);
+
+        /* Store the result of the previous file and notify the application */
+        if(dwFileIndex != HASH_ENTRY_FREE)
+        {
+            pBatch->pdwResults[dwFileIndex] = dwVerifyResult;
+            pBatch->BytesProcessed += ha->pFileTable[dwFileIndex].dwCmpSize;
+            if(pBatch->pfnVerifyCB != NULL)
+                pBatch->pfnVerifyCB(pBatch->pvUserData, dwFileIndex, dwVerifyResult, pBatch->BytesProcessed, pBatch->TotalBytes);
+        }
+
+        /* Pick the next existing file that isn't in the verification cache */
+        while(pBatch->dwNextFile < ha->dwFileTableSize && !IsFileToVerify(pBatch, pBatch->dwNextFile))
+            pBatch->dwNextFile++;
+        dwFileIndex = (pBatch->dwNextFile < ha->dwFileTableSize) ? pBatch->dwNextFile++ : HASH_ENTRY_FREE;
+
+        pthread_mutex_unlock(&pBatch->Lock);
+
+        /* Stop if there's nothing left to do */
+        if(dwFileIndex == HASH_ENTRY_FREE)
+            break;
+
+        dwVerifyResult = VerifyFileByIndex(pWorker, dwFileIndex);
+    }
+}
+
 /* Used in SFileGetFileInfo */
 int QueryMpqSignatureInfo(
     TMPQArchive * ha,
     PMPQ_SIGNATURE_INFO pSI)
 {
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     uint64_t ExtraBytes;
     uint32_t dwFileSize;
 
@@ -983,7 +1182,8 @@ int SSignFileFinish(TMPQArchive * ha)
     MPQ_SIGNATURE_INFO si;
     unsigned long signature_len;
     uint8_t Signature[MPQ_SECURE_SIGNATURE_SIZE];
-    uint8_t Digest[SHA1_DIGEST_SIZE];
+    TMpqDigests Digests;
+    uint8_t * pbDigest;
     unsigned long DigestLength;
     rsa_key * key;
     rsa_key blizzKey;
@@ -1007,18 +1207,20 @@ int SSignFileFinish(TMPQArchive * ha)
     {
         hash_idx = find_hash("md5");
         DigestLength = MD5_DIGEST_SIZE;
+        pbDigest = Digests.Md5;
         
         /* Calculate MD5 of the entire archive */
-        if(!CalculateMpqHashMd5(ha, &si, Digest))
+        if(!CalculateMpqDigests(ha, &si, MPQ_DIGEST_MD5, &Digests))
             return ERROR_VERIFY_FAILED;
     }
     else
     {
         hash_idx = find_hash("sha1");
         DigestLength = SHA1_DIGEST_SIZE;
+        pbDigest = Digests.Sha1;
         
         /* Calculate SHA1 of the entire archive */
-        if(!CalculateMpqHashSha1(ha, &si, Digest))
+        if(!CalculateMpqDigests(ha, &si, MPQ_DIGEST_SHA1, &Digests))
             return ERROR_VERIFY_FAILED;
     }
 
@@ -1040,7 +1242,7 @@ int SSignFileFinish(TMPQArchive * ha)
 
     /* Sign the hash */
     memset(Signature, 0, sizeof(Signature));
-    rsa_sign_hash_ex(Digest, DigestLength, Signature + 8, &signature_len, LTC_LTC_PKCS_1_V1_5, 0, 0, hash_idx, 0, key);
+    rsa_sign_hash_ex(pbDigest, DigestLength, Signature + 8, &signature_len, LTC_LTC_PKCS_1_V1_5, 0, 0, hash_idx, 0, key);
 	memrev(Signature + 8, signature_len);
 
     if(key == &blizzKey)
@@ -1086,18 +1288,192 @@ int EXPORT_SYMBOL SFileGetFileChecksums(void * hMpq, const char * szFileName, ui
 
 uint32_t EXPORT_SYMBOL SFileVerifyFile(void * hMpq, const char * szFileName, uint32_t dwFlags)
 {
-    return VerifyFile(hMpq,
-                      szFileName,
-                      NULL,
-                      NULL,
-                      dwFlags);
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TMPQFileEntry * pFileEntry;
+    uint32_t dwVerifyResult;
+    uint32_t dwFileIndex = HASH_ENTRY_FREE;
+
+    /* Files that have already passed are taken from the verification cache. */
+    /* Not for patched archives, as the file data may come from the patches */
+    if(ha != NULL && ha->pVerifyCache != NULL && ha->haPatch == NULL)
+    {
+        pFileEntry = GetFileEntryLocale(ha, szFileName, lcFileLocale);
+        if(pFileEntry != NULL)
+        {
+            dwFileIndex = (uint32_t)(pFileEntry - ha->pFileTable);
+            if(QueryVerifyCacheFile(ha, dwFileIndex, dwFlags, &dwVerifyResult))
+                return dwVerifyResult;
+        }
+    }
+
+    dwVerifyResult = VerifyFile(hMpq,
+                                szFileName,
+                                NULL,
+                                NULL,
+                                dwFlags);
+
+    if(dwFileIndex != HASH_ENTRY_FREE)
+        UpdateVerifyCacheFile(ha, dwFileIndex, dwFlags, dwVerifyResult);
+    return dwVerifyResult;
+}
+
+/* Verifies all files in the archive. Large archives are verified by multiple */
+/* workers, each of them reading the files through its own stream. */
+/* The callback is called after each file, never by two workers at once. */
+int EXPORT_SYMBOL SFileVerifyAllFiles(void * hMpq, uint32_t dwFlags, uint32_t * pdwResults, uint32_t dwMaxResults, SFILE_VERIFY_CALLBACK pfnVerifyCB, void * pvUserData)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TVerifyWorker * pWorkers = NULL;
+    TVerifyBatch Batch;
+    TMPQFileEntry * pFileTableEnd;
+    TMPQFileEntry * pFileEntry;
+    uint32_t dwStreamFlags = 0;
+    uint32_t dwWorkers = 1;
+    uint32_t i;
+    int nError = ERROR_SUCCESS;
+
+    /* Check the parameters */
+    if(ha == NULL)
+        nError = ERROR_INVALID_HANDLE;
+    if(nError == ERROR_SUCCESS && pdwResults == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+    if(nError == ERROR_SUCCESS && dwMaxResults < ha->dwFileTableSize)
+        nError = ERROR_INSUFFICIENT_BUFFER;
+    if(nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED))
+        nError = ERROR_COMPACT_INTERRUPTED;
+
+    /* Load everything that would otherwise be loaded on demand */
+    /* while reading the files, so that the workers only read the tables */
+    if(nError == ERROR_SUCCESS)
+    {
+        SListFileLoadLazy(ha);
+        SAttrLoadLazy(ha);
+        DecodeAllFileEntries(ha);
+
+        memset(&Batch, 0, sizeof(TVerifyBatch));
+        Batch.ha = ha;
+        Batch.pdwResults = pdwResults;
+        Batch.dwFlags = dwFlags;
+        Batch.pfnVerifyCB = pfnVerifyCB;
+        Batch.pvUserData = pvUserData;
+
+        /* Files that don't exist have zero result */
+        memset(pdwResults, 0, sizeof(uint32_t) * ha->dwFileTableSize);
+        pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+        for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+        {
+            if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+                Batch.TotalBytes += pFileEntry->dwCmpSize;
+        }
+
+        /* Files that have already passed are taken from the verification cache */
+        if(ha->pVerifyCache != NULL)
+        {
+            for(i = 0; i < ha->dwFileTableSize; i++)
+            {
+                if((ha->pFileTable[i].dwFlags & MPQ_FILE_EXISTS) && QueryVerifyCacheFile(ha, i, dwFlags, &pdwResults[i]))
+                {
+                    Batch.BytesProcessed += ha->pFileTable[i].dwCmpSize;
+                    if(pfnVerifyCB != NULL)
+                        pfnVerifyCB(pvUserData, i, pdwResults[i], Batch.BytesProcessed, Batch.TotalBytes);
+                }
+            }
+        }
+
+        /* Only plain files can be opened once more for the other workers */
+        FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+        if((dwStreamFlags & STREAM_PROVIDER_MASK) == STREAM_PROVIDER_FLAT && (dwStreamFlags & BASE_PROVIDER_MASK) != BASE_PROVIDER_HTTP)
+            dwWorkers = GetParallelWorkerCount(Batch.TotalBytes - Batch.BytesProcessed, VERIFY_MIN_WORKLOAD);
+
+        pWorkers = STORM_ALLOC(TVerifyWorker, dwWorkers);
+        if(pWorkers == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* Each worker reads through its own copy of the archive structure. The first */
+    /* worker runs on this thread and uses the archive stream, the other ones open */
+    /* the archive file once more. Raw chunk MD5s are only checked when the caller */
+    /* asks for SFILE_VERIFY_RAW_MD5, as the copies can't share the chunk bitmap. */
+    if(nError == ERROR_SUCCESS)
+    {
+        pthread_mutex_init(&Batch.Lock, NULL);
+        memset(pWorkers, 0, sizeof(TVerifyWorker) * dwWorkers);
+        for(i = 0; i < dwWorkers; i++)
+        {
+            pWorkers[i].pBatch = &Batch;
+            pWorkers[i].ha = STORM_ALLOC(TMPQArchive, 1);
+            if(pWorkers[i].ha == NULL)
+            {
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+
+            /* The copy shares all tables with the archive */
+            memcpy(pWorkers[i].ha, ha, sizeof(TMPQArchive));
+            pWorkers[i].ha->dwFlags &= ~MPQ_FLAG_CHECK_RAW_MD5;
+            if(i > 0)
+            {
+                pWorkers[i].ha->pStream = FileStream_OpenFile(FileStream_GetFileName(ha->pStream), (dwStreamFlags & STREAM_PROVIDERS_MASK) | STREAM_FLAG_READ_ONLY);
+                if(pWorkers[i].ha->pStream == NULL)
+                {
+                    nError = GetLastError();
+                    break;
+                }
+            }
+
+            pWorkers[i].cbBuffer = GetVerifyBufferSize(ha);
+            pWorkers[i].pbBuffer = STORM_ALLOC(uint8_t, pWorkers[i].cbBuffer);
+            if(pWorkers[i].pbBuffer == NULL)
+            {
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+        }
+
+        /* Verify the files */
+        if(nError == ERROR_SUCCESS)
+            RunParallelWorkers(VerifyAllFilesWorker, pWorkers, sizeof(TVerifyWorker), dwWorkers);
+
+        /* Cleanup the workers */
+        for(i = 0; i < dwWorkers; i++)
+        {
+            if(pWorkers[i].ha != NULL)
+            {
+                if(pWorkers[i].ha->pStream != NULL && pWorkers[i].ha->pStream != ha->pStream)
+                    FileStream_Close(pWorkers[i].ha->pStream);
+                STORM_FREE(pWorkers[i].ha);
+            }
+            if(pWorkers[i].pbBuffer != NULL)
+                STORM_FREE(pWorkers[i].pbBuffer);
+        }
+        pthread_mutex_destroy(&Batch.Lock);
+    }
+
+    if(pWorkers != NULL)
+        STORM_FREE(pWorkers);
+
+    /* Remember the files that have passed. If any of the files failed the verification, report that */
+    if(nError == ERROR_SUCCESS)
+    {
+        for(i = 0; i < ha->dwFileTableSize; i++)
+        {
+            if(ha->pFileTable[i].dwFlags & MPQ_FILE_EXISTS)
+                UpdateVerifyCacheFile(ha, i, dwFlags, pdwResults[i]);
+            if(pdwResults[i] & VERIFY_FILE_ERROR_MASK)
+                nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
 }
 
 /* Verifies raw data of the archive Only works for MPQs version 4 or newer */
 int EXPORT_SYMBOL SFileVerifyRawData(void * hMpq, uint32_t dwWhatToVerify, const char * szFileName)
 {
     TMPQArchive * ha = (TMPQArchive *)hMpq;
-    TFileEntry * pFileEntry;
+    TMPQFileEntry * pFileEntry;
     TMPQHeader * pHeader;
 
     /* Verify input parameters */
@@ -1105,6 +1481,10 @@ int EXPORT_SYMBOL SFileVerifyRawData(void * hMpq, uint32_t dwWhatToVerify, const
         return ERROR_INVALID_PARAMETER;
     pHeader = ha->pHeader;
 
+    /* The file data don't match the tables until an interrupted in-place compacting is finished */
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+        return ERROR_COMPACT_INTERRUPTED;
+
     /* If the archive doesn't have raw data MD5, report it as OK */
     if(pHeader->dwRawChunkSize == 0)
         return ERROR_SUCCESS;
@@ -1171,6 +1551,7 @@ uint32_t EXPORT_SYMBOL SFileVerifyArchive(void * hMpq)
 {
     MPQ_SIGNATURE_INFO si;
     TMPQArchive * ha = (TMPQArchive *)hMpq;
+    uint32_t dwResult = ERROR_NO_SIGNATURE;
 
     /* Verify input parameters */
     if(!IsValidMpqHandle(hMpq))
@@ -1179,10 +1560,24 @@ uint32_t EXPORT_SYMBOL SFileVerifyArchive(void * hMpq)
         return ERROR_VERIFY_FAILED;
     }
 
+    /* The archive data don't match the tables until an interrupted in-place compacting is finished */
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+    {
+        SetLastError(ERROR_COMPACT_INTERRUPTED);
+        return ERROR_VERIFY_FAILED;
+    }
+
     /* If the archive was modified, we need to flush it */
     if(ha->dwFlags & MPQ_FLAG_CHANGED)
         SFileFlushArchive(hMpq);
 
+    /* A signature that has already passed is taken from the verification cache */
+    if(QueryVerifyCacheSignature(ha, &dwResult))
+    {
+        SetLastError(ERROR_SUCCESS);
+        return dwResult;
+    }
+
     /* Get the MPQ signature and signature type */
     memset(&si, 0, sizeof(MPQ_SIGNATURE_INFO));
     if(!QueryMpqSignatureInfo(ha, &si))
@@ -1199,17 +1594,19 @@ uint32_t EXPORT_SYMBOL SFileVerifyArchive(void * hMpq)
 
     /* Verify the secure signature, if present */
     if(si.SignatureTypes & SIGNATURE_TYPE_SECURE)
-        return VerifySecureSignature(ha, &si);
+        dwResult = VerifySecureSignature(ha, &si);
 
     /* Verify the strong signature, if present */
-    if(si.SignatureTypes & SIGNATURE_TYPE_STRONG)
-        return VerifyStrongSignature(ha, &si);
+    else if(si.SignatureTypes & SIGNATURE_TYPE_STRONG)
+        dwResult = VerifyStrongSignature(ha, &si);
 
     /* Verify the weak signature, if present */
-    if(si.SignatureTypes & SIGNATURE_TYPE_WEAK)
-        return VerifyWeakSignature(ha, &si);
+    else if(si.SignatureTypes & SIGNATURE_TYPE_WEAK)
+        dwResult = VerifyWeakSignature(ha, &si);
 
-    return ERROR_NO_SIGNATURE;
+    /* Remember the signature if it has passed */
+    UpdateVerifyCacheSignature(ha, dwResult);
+    return dwResult;
 }
 
 /* Signs the archive */
@@ -1279,6 +1676,13 @@ int EXPORT_SYMBOL SFileSignArchive(void * hMpq, uint32_t dwSignatureType)
         return 0;
     }
 
+    /* Not until an interrupted in-place compacting is finished */
+    if(ha->dwFlags & MPQ_FLAG_COMPACT_INTERRUPTED)
+    {
+        SetLastError(ERROR_COMPACT_INTERRUPTED);
+        return 0;
+    }
+
     /* If the signature is not there yet */
     if(ha->dwFileFlags3 == 0)
     {
@@ -1292,6 +1696,31 @@ int EXPORT_SYMBOL SFileSignArchive(void * hMpq, uint32_t dwSignatureType)
     return 1;
 }
 
+/* Sets the size of the units in which the archive is read when calculating */
+/* the signature digests. Larger units mean fewer, larger reads */
+int EXPORT_SYMBOL SFileSetDigestReadSize(void * hMpq, uint32_t dwReadSize)
+{
+    TMPQArchive * ha;
+
+    /* Verify the archive handle */
+    ha = IsValidMpqHandle(hMpq);
+    if(ha == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+
+    /* Zero restores the default size */
+    if(dwReadSize != 0 && (dwReadSize < MPQ_DIGEST_UNIT_SIZE || dwReadSize > MPQ_DIGEST_MAX_READ_SIZE))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    ha->dwDigestReadSize = dwReadSize;
+    return 1;
+}
+
 /* Sets the signing key */
 int EXPORT_SYMBOL SFileSetRSAKey(void * hMpq, unsigned char * key, size_t keyLength)
 {
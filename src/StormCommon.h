@@ -65,6 +65,9 @@
 /* For HashStringJenkins */
 #include "jenkins/lookup.h"
 
+/* Multi-buffer MD5 for the raw data chunks */
+#include "md5mb/md5mb.h"
+
 /* Anubis cipher */
 #include "anubis/anubis.h"
 
@@ -77,6 +80,10 @@
 
 #define ID_MPQ_FILE            0x46494c45     /* Used internally for checking TMPQFile ('FILE') */
 
+/* Range of raw chunk sizes accepted from the MPQ header v4 */
+#define MPQ_RAW_CHUNK_SIZE_MIN 0x00000200
+#define MPQ_RAW_CHUNK_SIZE_MAX 0x00800000
+
 /* Prevent problems with CRT "min" and "max" functions, */
 /* as they are not defined on all platforms */
 #define STORMLIB_MIN(a, b) ((a < b) ? a : b)
@@ -86,6 +93,85 @@
 /* Macro for building 64-bit file offset from two 32-bit */
 #define MAKE_OFFSET64(hi, lo)      (((uint64_t)hi << 32) | (uint64_t)lo)
 
+/* Entry of the archive's file table. Only the fields needed for lookup */
+/* and reading are here; CRC32, file time and MD5 from the (attributes) */
+/* are kept in separate arrays of the archive, which only exist when needed. */
+/* SFileGetFileInfo(SFileInfoFileEntry) converts it to the public TFileEntry */
+typedef struct _TMPQFileEntry
+{
+    uint64_t FileNameHash;                      /* Jenkins hash of the file name. Only used when the MPQ has BET table. */
+    uint64_t ByteOffset;                        /* Position of the file content in the MPQ, relative to the MPQ header */
+    char * szFileName;                          /* File name. NULL if not known. */
+    uint32_t dwFileSize;                        /* Decompressed size of the file */
+    uint32_t dwCmpSize;                         /* Compressed size of the file (i.e., size of the file data in the MPQ) */
+    uint32_t dwFlags;                           /* File flags (from block table) */
+} TMPQFileEntry;
+
+/* Block of the file name arena. File names are appended to the block */
+/* and never move, so TMPQFileEntry::szFileName can point directly into it */
+typedef struct _TMPQNameBlock
+{
+    struct _TMPQNameBlock * pNext;              /* Next (older) block */
+    size_t cbBlockSize;                         /* Size of the name buffer, in bytes */
+    size_t cbUsed;                              /* Number of bytes already used */
+    char szNames[1];                            /* Name buffer (variable length) */
+} TMPQNameBlock;
+
+/* Sorted name index of the file table. Built on demand by SFileFindFirstFile */
+typedef struct _TMPQNameIndexEntry
+{
+    const char * szFileName;                    /* File name, stored in the name arena */
+    uint32_t dwFileIndex;                       /* Index of the file entry */
+} TMPQNameIndexEntry;
+
+typedef struct _TMPQNameIndex
+{
+    uint32_t dwEntries;                         /* Number of entries in the index */
+    TMPQNameIndexEntry Entries[1];              /* Entries, sorted by name (variable length) */
+} TMPQNameIndex;
+
+typedef struct _TMPQDataIndex
+{
+    uint32_t dwHashTableSize;                   /* Number of slots, always a power of two */
+    uint32_t dwEntries;                         /* Number of occupied slots */
+    uint32_t FileIndexes[1];                    /* Index of the file entry plus one, zero for free slot (variable length) */
+} TMPQDataIndex;
+
+typedef struct _TMPQChunkBitmap
+{
+    uint32_t dwFileCount;                       /* Number of file entries covered by the bitmap */
+    uint32_t * FirstChunk;                      /* Index of the first raw chunk of each file entry (dwFileCount + 1 items) */
+    uint8_t * Verified;                         /* One bit for each raw chunk whose MD5 has already been verified */
+} TMPQChunkBitmap;
+
+/* Identity of the archive file, shared by the index file and the verification cache file. */
+/* Calculated when the archive is open, before any MPQ table is loaded */
+typedef struct _TMPQArchiveId
+{
+    uint64_t ArchiveSize;                       /* Size of the archive file */
+    uint64_t ArchiveTime;                       /* Modification time of the archive file */
+    uint64_t MpqPos;                            /* Position of the MPQ header in the archive */
+    unsigned char TablesMd5[MD5_DIGEST_SIZE];   /* MD5 of the MPQ header and of the MPQ tables, as stored in the archive */
+} TMPQArchiveId;
+
+typedef struct _TMPQVerifyCacheEntry
+{
+    uint32_t dwVerifyFlags;                     /* SFILE_VERIFY_XXX the file has passed with (0 if not passed yet) */
+    uint32_t dwVerifyResult;                    /* VERIFY_FILE_HAS_XXX found by these checks */
+} TMPQVerifyCacheEntry;
+
+typedef struct _TMPQVerifyCache
+{
+    TMPQArchiveId ArchiveId;                    /* Identity of the archive as it was open (only if bSaveFile is set) */
+    uint32_t dwOpenFlags;
+    uint32_t dwSignatureResult;                 /* Signature check that has passed (ERROR_NO_SIGNATURE if none). Never saved to the cache file */
+    unsigned char KeyMd5[MD5_DIGEST_SIZE];      /* MD5 of the RSA key the signature has passed with (zeros for no key) */
+    uint32_t dwFileCount;                       /* Number of items in pEntries */
+    TMPQVerifyCacheEntry * pEntries;            /* Verification state of each file table entry */
+    int bSaveFile;                              /* Save the cache to "<archive>.vfy" when the archive is closed */
+    int bDirty;                                 /* Something has been added since the cache was loaded */
+} TMPQVerifyCache;
+
 /* Archive handle structure */
 typedef struct _TMPQArchive
 {
@@ -103,22 +189,35 @@ typedef struct _TMPQArchive
     TMPQHeader   * pHeader;                     /* MPQ file header */
     TMPQHash     * pHashTable;                  /* Hash table */
     TMPQHetTable * pHetTable;                   /* HET table */
-    TFileEntry   * pFileTable;                  /* File table */
+    TMPQBetTable * pBetTable;                   /* BET table, only kept if MPQ_FLAG_LAZY_BET is set */
+    uint8_t      * pbBetDecoded;                /* Bit array of BET entries already decoded to the file table */
+    TMPQFileEntry * pFileTable;                 /* File table */
+    uint32_t     * pFileCrc32;                  /* CRC32 of each file table entry (NULL if none) */
+    uint64_t     * pFileTime;                   /* File time of each file table entry (NULL if none) */
+    unsigned char * pFileMd5;                   /* MD5 of each file table entry (NULL if none) */
+    TMPQNameBlock * pNameBlocks;                /* Storage for the file names in the file table (newest block first) */
+    TMPQNameIndex * pNameIndex;                 /* Named file entries sorted by name, for prefix searches (NULL if not built yet) */
+    TMPQDataIndex * pDataIndex;                 /* File entries by MD5 of their data, for deduplication (NULL if not built yet) */
+    TMPQChunkBitmap * pChunkBitmap;             /* Raw chunks already verified (MPQ_FLAG_CHECK_RAW_MD5, NULL if not built yet) */
+    TMPQVerifyCache * pVerifyCache;             /* Files and signature that passed the verification (NULL if not enabled) */
     HASH_STRING    pfnHashString;               /* Hashing function that will convert the file name into hash */
     
     TMPQUserData   UserData;                    /* MPQ user data. Valid only when ID_MPQ_USERDATA has been found */
     uint32_t          HeaderData[MPQ_HEADER_WORDS];  /* Storage for MPQ header */
+    uint64_t      FreeSpacePos;                /* Cached end of the file data, excluding internal files (0 if not known) */
 
     uint32_t          dwHETBlockSize;
     uint32_t          dwBETBlockSize;
     uint32_t          dwMaxFileCount;              /* Maximum number of files in the MPQ. Also total size of the file table. */
     uint32_t          dwFileTableSize;             /* Current size of the file table, e.g. index of the entry past the last occupied one */
+    uint32_t          dwFreeFileIndex;             /* All file table entries below this index are in use */
     uint32_t          dwReservedFiles;             /* Number of entries reserved for internal MPQ files (listfile, attributes) */
     uint32_t          dwSectorSize;                /* Default size of one file sector */
     uint32_t          dwFileFlags1;                /* Flags for (listfile) */
     uint32_t          dwFileFlags2;                /* Flags for (attributes) */
     uint32_t          dwFileFlags3;                /* Flags for (signature) */
     uint32_t          dwAttrFlags;                 /* Flags for the (attributes) file, see MPQ_ATTRIBUTE_XXX */
+    uint32_t          dwDigestReadSize;            /* Read size for the MPQ digests (0 = default), see SFileSetDigestReadSize */
     uint32_t          dwFlags;                     /* See MPQ_FLAG_XXXXX */
     uint32_t          dwSubType;                   /* See MPQ_SUBTYPE_XXX */
 
@@ -140,7 +239,7 @@ typedef struct _TMPQFile
     TFileStream  * pStream;                     /* File stream. Only used on local files */
     TMPQArchive  * ha;                          /* Archive handle */
     TMPQHash     * pHashEntry;                  /* Pointer to hash table entry, if the file was open using hash table */
-    TFileEntry   * pFileEntry;                  /* File entry for the file */
+    TMPQFileEntry * pFileEntry;                 /* File entry for the file */
     uint64_t      RawFilePos;                   /* Offset in MPQ archive (relative to file begin) */
     uint64_t      MpqFilePos;                   /* Offset in MPQ archive (relative to MPQ header) */
     uint32_t          dwHashIndex;              /* Hash table index (0xFFFFFFFF if not used) */
@@ -244,6 +343,19 @@ uint32_t HashStringCS(const char * szFileName, uint32_t dwHashType);
 uint32_t HashStringSlash(const char * szFileName, uint32_t dwHashType);
 uint32_t HashStringLower(const char * szFileName, uint32_t dwHashType);
 
+/* Flags for HashFileName */
+#define MPQ_NAME_HASH_STORM     0x01            /* Calculate dwHashIndex, dwName1 and dwName2 */
+#define MPQ_NAME_HASH_HET       0x02            /* Calculate FileNameHash (ignored if the archive has no HET table) */
+
+/* All hashes of a file name, calculated by a single pass over the name */
+typedef struct _TMPQNameHash
+{
+    uint32_t dwHashIndex;                       /* Hash of type MPQ_HASH_TABLE_INDEX */
+    uint32_t dwName1;                           /* Hash of type MPQ_HASH_NAME_A */
+    uint32_t dwName2;                           /* Hash of type MPQ_HASH_NAME_B */
+    uint64_t FileNameHash;                      /* Jenkins hash, masked by the HET table masks */
+} TMPQNameHash;
+
 void  InitializeMpqCryptography();
 
 uint32_t GetHashTableSizeForFileCount(uint32_t dwFileCount);
@@ -265,7 +377,7 @@ uint32_t DetectFileKeyBySectorSize(uint32_t * EncryptedData, uint32_t dwSectorSi
 uint32_t DetectFileKeyByContent(void * pvEncryptedData, uint32_t dwSectorSize, uint32_t dwFileSize);
 uint32_t DecryptFileKey(const char * szFileName, uint64_t MpqPos, uint32_t dwFileSize, uint32_t dwFlags);
 
-int IsValidMD5(unsigned char * pbMd5);
+int IsValidMD5(const unsigned char * pbMd5);
 int IsValidSignature(unsigned char * pbSignature, size_t cbSignatureSize);
 int VerifyDataBlockHash(void * pvDataBlock, uint32_t cbDataBlock, unsigned char * expected_md5);
 void CalculateDataBlockHash(void * pvDataBlock, uint32_t cbDataBlock, unsigned char * md5_hash);
@@ -285,20 +397,26 @@ uint64_t FileOffsetFromMpqOffset(TMPQArchive * ha, uint64_t MpqOffset);
 uint64_t CalculateRawSectorOffset(TMPQFile * hf, uint32_t dwSectorOffset);
 
 int ConvertMpqHeaderToFormat4(TMPQArchive * ha, uint64_t MpqOffset, uint64_t FileSize, uint32_t dwFlags);
+int CalculateArchiveId(TMPQArchive * ha, TMPQArchiveId * pArchiveId);
+int IsSameArchiveId(TMPQArchiveId * pArchiveId1, TMPQArchiveId * pArchiveId2);
 
 TMPQHash * FindFreeHashEntry(TMPQArchive * ha, uint32_t dwStartIndex, uint32_t dwName1, uint32_t dwName2, uint32_t lcLocale);
+void HashFileName(TMPQArchive * ha, const char * szFileName, uint32_t dwHashFlags, TMPQNameHash * pNameHash);
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName);
+TMPQHash * GetFirstHashEntry2(TMPQArchive * ha, TMPQNameHash * pNameHash);
 TMPQHash * GetNextHashEntry(TMPQArchive * ha, TMPQHash * pFirstHash, TMPQHash * pPrevHash);
-TMPQHash * AllocateHashEntry(TMPQArchive * ha, TFileEntry * pFileEntry, uint32_t lcLocale);
+TMPQHash * AllocateHashEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry, TMPQNameHash * pNameHash, uint32_t lcLocale);
 
 TMPQExtHeader * LoadExtTable(TMPQArchive * ha, uint64_t ByteOffset, size_t Size, uint32_t dwSignature, uint32_t dwKey);
 TMPQHetTable * LoadHetTable(TMPQArchive * ha);
 TMPQBetTable * LoadBetTable(TMPQArchive * ha);
+TMPQExtHeader * TranslateBetTable2(TMPQArchive * ha, uint64_t * pcbBetTable);
 
 TMPQBlock * LoadBlockTable(TMPQArchive * ha);
 TMPQBlock * TranslateBlockTable(TMPQArchive * ha, uint64_t * pcbTableSize, int * pbNeedHiBlockTable);
 
 uint64_t FindFreeMpqSpace(TMPQArchive * ha);
+void UpdateFreeMpqSpace(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
 
 /* Functions that load the HET and BET tables */
 int  CreateHashTable(TMPQArchive * ha, uint32_t dwHashTableSize);
@@ -308,6 +426,8 @@ int  DefragmentFileTable(TMPQArchive * ha);
 
 int  CreateFileTable(TMPQArchive * ha, uint32_t dwFileTableSize);
 int  RebuildHetTable(TMPQArchive * ha);
+int  InsertHetTableEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+void DeleteHetTableEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
 int  RebuildFileTable(TMPQArchive * ha, uint32_t dwNewHashTableSize);
 int  SaveMPQTables(TMPQArchive * ha);
 
@@ -318,15 +438,40 @@ TMPQBetTable * CreateBetTable(uint32_t dwMaxFileCount);
 void FreeBetTable(TMPQBetTable * pBetTable);
 
 /* Functions for finding files in the file table */
-TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
-TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale);
-TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
+TMPQFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
+TMPQFileEntry * GetFileEntryByHash(TMPQArchive * ha, TMPQNameHash * pNameHash, uint32_t lcLocale, uint32_t * PtrHashIndex);
+TMPQFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale);
+TMPQFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
+
+/* Decoding file entries from the BET table on demand (MPQ_FLAG_LAZY_BET) */
+void DecodeFileEntry(TMPQArchive * ha, uint32_t dwFileIndex);
+void DecodeAllFileEntries(TMPQArchive * ha);
 
 /* Allocates file name in the file entry */
-void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * szFileName);
+void AllocateFileName(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const char * szFileName);
+void AllocateFileName2(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const char * szFileName, TMPQNameHash * pNameHash);
+void FreeFileNames(TMPQArchive * ha);
+void FreeNameIndex(TMPQArchive * ha);
+
+/* Deduplication of file data (MPQ_FLAG_DEDUP_DATA) */
+int  CanShareFileData(TMPQFileEntry * pFileEntry);
+int  IsSameFileData(TMPQArchive * ha, TMPQFileEntry * pFileEntry1, TMPQFileEntry * pFileEntry2);
+TMPQFileEntry * FindSameFileData(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+void InsertDataIndexEntry(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+void FreeDataIndex(TMPQArchive * ha);
+
+/* CRC32, file time and MD5 of the file entries */
+int  AllocateFileAttributes(TMPQArchive * ha, uint32_t dwAttrFlags);
+void FreeFileAttributes(TMPQArchive * ha);
+uint32_t GetFileEntryCrc32(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+uint64_t GetFileEntryTime(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+const unsigned char * GetFileEntryMd5(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+int  SetFileEntryCrc32(TMPQArchive * ha, TMPQFileEntry * pFileEntry, uint32_t dwCrc32);
+int  SetFileEntryTime(TMPQArchive * ha, TMPQFileEntry * pFileEntry, uint64_t FileTime);
+int  SetFileEntryMd5(TMPQArchive * ha, TMPQFileEntry * pFileEntry, const unsigned char * md5);
 
 /* Allocates new file entry in the MPQ tables. Reuses existing, if possible */
-TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
+TMPQFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, uint32_t lcLocale, uint32_t * PtrHashIndex);
 int  RenameFileEntry(TMPQArchive * ha, TMPQFile * hf, const char * szNewFileName);
 int  DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf);
 
@@ -354,7 +499,9 @@ int SCompDecompressMpk(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer
  * Common functions - MPQ File
  */
 
-TMPQFile * CreateFileHandle(TMPQArchive * ha, TFileEntry * pFileEntry);
+TMPQFile * CreateFileHandle(TMPQArchive * ha, TMPQFileEntry * pFileEntry);
+int OpenFileEntry(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwHashIndex, TMPQFile ** PtrFile);
+int ReadMpqFile(TMPQFile * hf, void * pvBuffer, uint32_t dwToRead, uint32_t * pdwBytesRead);
 void * LoadMpqTable(TMPQArchive * ha, uint64_t ByteOffset, uint32_t dwCompressedSize, uint32_t dwTableSize, uint32_t dwKey, int * pbTableIsCut);
 int  AllocateSectorBuffer(TMPQFile * hf);
 int  AllocatePatchInfo(TMPQFile * hf, int bLoadFromFile);
@@ -365,6 +512,8 @@ int  WriteSectorOffsets(TMPQFile * hf);
 int  WriteSectorChecksums(TMPQFile * hf);
 int  WriteMemDataMD5(TFileStream * pStream, uint64_t RawDataOffs, void * pvRawData, uint32_t dwRawDataSize, uint32_t dwChunkSize, uint32_t * pcbTotalSize);
 int  WriteMpqDataMD5(TFileStream * pStream, uint64_t RawDataOffs, uint32_t dwRawDataSize, uint32_t dwChunkSize);
+int  VerifyRawDataChunks(TMPQFile * hf, uint64_t RawFilePos, uint32_t dwRawDataSize);
+void FreeChunkBitmap(TMPQArchive * ha);
 void FreeFileHandle(TMPQFile ** hf);
 void FreeArchiveHandle(TMPQArchive ** ha);
 
@@ -394,6 +543,24 @@ void Patch_Finalize(TMPQPatcher * pPatcher);
  */
 
 int CheckWildCard(const char * szString, const char * szWildCard);
+
+/* Search mask compiled for repeated matching */
+typedef struct _TMPQWildCard
+{
+    char * szMask;                              /* Upper-cased mask, groups of stars collapsed to one */
+    uint32_t * pTable;                          /* For each star, length of the following literal run and its KMP table */
+    size_t nLength;                             /* Length of the compiled mask */
+    size_t nPrefixLength;                       /* Length of the literal prefix */
+    size_t nSuffixOffset;                       /* Offset of the part after the last star */
+    size_t nSuffixLength;                       /* Length of the part after the last star (0 if the mask ends with star) */
+    size_t nMinLength;                          /* Number of literal characters in the mask */
+    size_t nPastEndOffset;                      /* Offset from which '?' may skip past the end of the name */
+} TMPQWildCard;
+
+TMPQWildCard * CompileWildCard(const char * szWildCard);
+int MatchWildCard(TMPQWildCard * pWildCard, const char * szString);
+void FreeWildCard(TMPQWildCard * pWildCard);
+
 int IsInternalMpqFileName(const char * szFileName);
 
 const char * GetPlainFileName(const char * szFileName);
@@ -402,6 +569,11 @@ const char * GetPlainFileName(const char * szFileName);
 void CopyFileName(char * szTarget, const char * szSource, size_t cchLength);
 void CopyFileName(char * szTarget, const char * szSource, size_t cchLength);
 
+/* Running work on multiple threads */
+typedef void (*PARALLEL_WORKER)(void * pvContext);
+uint32_t GetParallelWorkerCount(uint64_t cbWorkload, uint32_t cbMinWorkload);
+void RunParallelWorkers(PARALLEL_WORKER pfnWorker, void * pvContexts, size_t cbContext, uint32_t dwWorkers);
+
 /*-----------------------------------------------------------------------------
  * Internal support for MPQ modifications
  */
@@ -427,11 +599,35 @@ int SFileAddFile_Finish(
     TMPQFile * hf
     );
 
+/* Checks for the journal of SFileCompactArchiveInPlace */
+int  IsCompactInterrupted(TMPQArchive * ha);
+
+/*-----------------------------------------------------------------------------
+ * Index file support
+ */
+
+int  LoadArchiveIndex(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags);
+int  SaveArchiveIndex(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags, uint32_t dwLoadFlags);
+void RemoveArchiveIndex(TMPQArchive * ha);
+
+/*-----------------------------------------------------------------------------
+ * Verification cache support
+ */
+
+int  CreateVerifyCache(TMPQArchive * ha, TMPQArchiveId * pArchiveId, uint32_t dwFlags);
+int  QueryVerifyCacheFile(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwFlags, uint32_t * pdwVerifyResult);
+void UpdateVerifyCacheFile(TMPQArchive * ha, uint32_t dwFileIndex, uint32_t dwFlags, uint32_t dwVerifyResult);
+int  QueryVerifyCacheSignature(TMPQArchive * ha, uint32_t * pdwSignatureResult);
+void UpdateVerifyCacheSignature(TMPQArchive * ha, uint32_t dwSignatureResult);
+void InvalidateVerifyCache(TMPQArchive * ha);
+void FreeVerifyCache(TMPQArchive * ha);
+
 /*-----------------------------------------------------------------------------
  * Attributes support
  */
 
 int  SAttrLoadAttributes(TMPQArchive * ha);
+int  SAttrLoadLazy(TMPQArchive * ha);
 int  SAttrFileSaveToMpq(TMPQArchive * ha);
 
 /*-----------------------------------------------------------------------------
@@ -439,6 +635,7 @@ int  SAttrFileSaveToMpq(TMPQArchive * ha);
  */
 
 int  SListFileSaveToMpq(TMPQArchive * ha);
+int  SListFileLoadLazy(TMPQArchive * ha);
 
 /*-----------------------------------------------------------------------------
  * Weak signature support
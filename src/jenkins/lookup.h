@@ -16,6 +16,7 @@ extern "C"
 
 uint32_t hashlittle(const void *key, size_t length, uint32_t initval);
 void hashlittle2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
+void hashlittle2_table(const void *key, size_t length, const uint8_t *table, uint32_t *pc, uint32_t *pb);
 
 #ifdef __cplusplus
 }
@@ -636,6 +636,69 @@ void hashlittle2(
 }
 
 
+/*
+ * hashlittle2_table: same as hashlittle2() on a copy of the key where
+ * each byte is replaced by table[byte].  The key is read one byte at a
+ * time, so no copy of the converted key is needed.
+ */
+void hashlittle2_table( 
+  const void    *key,    /* the key to hash */
+  size_t         length, /* length of the key */
+  const uint8_t *table,  /* conversion table of 256 bytes */
+  uint32_t      *pc,     /* IN: primary initval, OUT: primary hash */
+  uint32_t      *pb)     /* IN: secondary initval, OUT: secondary hash */
+{
+  uint32_t a,b,c;                                          /* internal state */
+  const uint8_t *k = (const uint8_t *)key;
+
+  /* Set up the internal state */
+  a = b = c = 0xdeadbeef + ((uint32_t)length) + *pc;
+  c += *pb;
+
+  /*--------------- all but the last block: affect some 32 bits of (a,b,c) */
+  while (length > 12)
+  {
+    a += table[k[0]];
+    a += ((uint32_t)table[k[1]])<<8;
+    a += ((uint32_t)table[k[2]])<<16;
+    a += ((uint32_t)table[k[3]])<<24;
+    b += table[k[4]];
+    b += ((uint32_t)table[k[5]])<<8;
+    b += ((uint32_t)table[k[6]])<<16;
+    b += ((uint32_t)table[k[7]])<<24;
+    c += table[k[8]];
+    c += ((uint32_t)table[k[9]])<<8;
+    c += ((uint32_t)table[k[10]])<<16;
+    c += ((uint32_t)table[k[11]])<<24;
+    mix(a,b,c);
+    length -= 12;
+    k += 12;
+  }
+
+  /*-------------------------------- last block: affect all 32 bits of (c) */
+  switch(length)                   /* all the case statements fall through */
+  {
+  case 12: c+=((uint32_t)table[k[11]])<<24;
+  case 11: c+=((uint32_t)table[k[10]])<<16;
+  case 10: c+=((uint32_t)table[k[9]])<<8;
+  case 9 : c+=table[k[8]];
+  case 8 : b+=((uint32_t)table[k[7]])<<24;
+  case 7 : b+=((uint32_t)table[k[6]])<<16;
+  case 6 : b+=((uint32_t)table[k[5]])<<8;
+  case 5 : b+=table[k[4]];
+  case 4 : a+=((uint32_t)table[k[3]])<<24;
+  case 3 : a+=((uint32_t)table[k[2]])<<16;
+  case 2 : a+=((uint32_t)table[k[1]])<<8;
+  case 1 : a+=table[k[0]];
+           break;
+  case 0 : *pc=c; *pb=b; return;  /* zero length strings require no mixing */
+  }
+
+  final(a,b,c);
+  *pc=c; *pb=b;
+}
+
+
 
 /*
  * hashbig():
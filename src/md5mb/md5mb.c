@@ -0,0 +1,439 @@
+/*****************************************************************************/
+/* md5mb.c                                                                   */
+/*---------------------------------------------------------------------------*/
+/* Multi-buffer MD5. Independent buffers are hashed at once, each in its     */
+/* own 32-bit lane of a SIMD register: 4 lanes with SSE2, 8 lanes with AVX2. */
+/* The instruction set is picked at runtime. Other CPUs use the plain C      */
+/* version, one buffer at a time.                                            */
+/*****************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "md5mb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD5MB_X86
+#include <immintrin.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MD5MB_MAX_LANES     8           /* Number of lanes of the widest engine */
+#define MD5MB_BLOCK_SIZE    64          /* Size of one MD5 block */
+
+#define LOAD32L(p)          ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define STORE32L(p, x)      { (p)[0] = (unsigned char)(x); (p)[1] = (unsigned char)((x) >> 8); \
+                              (p)[2] = (unsigned char)((x) >> 16); (p)[3] = (unsigned char)((x) >> 24); }
+
+/* Processes one block in all lanes. State holds the A, B, C and D words of each lane */
+typedef void (*MD5_BLOCK_FUNC)(uint32_t State[4][MD5MB_MAX_LANES], const unsigned char * Blocks[MD5MB_MAX_LANES]);
+
+/*
+ * The MD5 steps, written with the VXXX vector operations that each engine
+ * defines before it expands MD5_ROUNDS.
+ */
+
+#define MD5_F(b, c, d)      VXOR(d, VAND(b, VXOR(c, d)))
+#define MD5_G(b, c, d)      VXOR(c, VAND(d, VXOR(b, c)))
+#define MD5_H(b, c, d)      VXOR(VXOR(b, c), d)
+#define MD5_I(b, c, d)      VXOR(c, VOR(b, VNOT(d)))
+
+#define MD5_STEP(f, a, b, c, d, x, s, t) \
+    a = VADD(VADD(a, f(b, c, d)), VADD(x, VSET1(t))); \
+    a = VADD(VROTL(a, s), b);
+
+#define MD5_ROUNDS(a, b, c, d, W) \
+    MD5_STEP(MD5_F, a, b, c, d, W[ 0],  7, 0xd76aa478) \
+    MD5_STEP(MD5_F, d, a, b, c, W[ 1], 12, 0xe8c7b756) \
+    MD5_STEP(MD5_F, c, d, a, b, W[ 2], 17, 0x242070db) \
+    MD5_STEP(MD5_F, b, c, d, a, W[ 3], 22, 0xc1bdceee) \
+    MD5_STEP(MD5_F, a, b, c, d, W[ 4],  7, 0xf57c0faf) \
+    MD5_STEP(MD5_F, d, a, b, c, W[ 5], 12, 0x4787c62a) \
+    MD5_STEP(MD5_F, c, d, a, b, W[ 6], 17, 0xa8304613) \
+    MD5_STEP(MD5_F, b, c, d, a, W[ 7], 22, 0xfd469501) \
+    MD5_STEP(MD5_F, a, b, c, d, W[ 8],  7, 0x698098d8) \
+    MD5_STEP(MD5_F, d, a, b, c, W[ 9], 12, 0x8b44f7af) \
+    MD5_STEP(MD5_F, c, d, a, b, W[10], 17, 0xffff5bb1) \
+    MD5_STEP(MD5_F, b, c, d, a, W[11], 22, 0x895cd7be) \
+    MD5_STEP(MD5_F, a, b, c, d, W[12],  7, 0x6b901122) \
+    MD5_STEP(MD5_F, d, a, b, c, W[13], 12, 0xfd987193) \
+    MD5_STEP(MD5_F, c, d, a, b, W[14], 17, 0xa679438e) \
+    MD5_STEP(MD5_F, b, c, d, a, W[15], 22, 0x49b40821) \
+    MD5_STEP(MD5_G, a, b, c, d, W[ 1],  5, 0xf61e2562) \
+    MD5_STEP(MD5_G, d, a, b, c, W[ 6],  9, 0xc040b340) \
+    MD5_STEP(MD5_G, c, d, a, b, W[11], 14, 0x265e5a51) \
+    MD5_STEP(MD5_G, b, c, d, a, W[ 0], 20, 0xe9b6c7aa) \
+    MD5_STEP(MD5_G, a, b, c, d, W[ 5],  5, 0xd62f105d) \
+    MD5_STEP(MD5_G, d, a, b, c, W[10],  9, 0x02441453) \
+    MD5_STEP(MD5_G, c, d, a, b, W[15], 14, 0xd8a1e681) \
+    MD5_STEP(MD5_G, b, c, d, a, W[ 4], 20, 0xe7d3fbc8) \
+    MD5_STEP(MD5_G, a, b, c, d, W[ 9],  5, 0x21e1cde6) \
+    MD5_STEP(MD5_G, d, a, b, c, W[14],  9, 0xc33707d6) \
+    MD5_STEP(MD5_G, c, d, a, b, W[ 3], 14, 0xf4d50d87) \
+    MD5_STEP(MD5_G, b, c, d, a, W[ 8], 20, 0x455a14ed) \
+    MD5_STEP(MD5_G, a, b, c, d, W[13],  5, 0xa9e3e905) \
+    MD5_STEP(MD5_G, d, a, b, c, W[ 2],  9, 0xfcefa3f8) \
+    MD5_STEP(MD5_G, c, d, a, b, W[ 7], 14, 0x676f02d9) \
+    MD5_STEP(MD5_G, b, c, d, a, W[12], 20, 0x8d2a4c8a) \
+    MD5_STEP(MD5_H, a, b, c, d, W[ 5],  4, 0xfffa3942) \
+    MD5_STEP(MD5_H, d, a, b, c, W[ 8], 11, 0x8771f681) \
+    MD5_STEP(MD5_H, c, d, a, b, W[11], 16, 0x6d9d6122) \
+    MD5_STEP(MD5_H, b, c, d, a, W[14], 23, 0xfde5380c) \
+    MD5_STEP(MD5_H, a, b, c, d, W[ 1],  4, 0xa4beea44) \
+    MD5_STEP(MD5_H, d, a, b, c, W[ 4], 11, 0x4bdecfa9) \
+    MD5_STEP(MD5_H, c, d, a, b, W[ 7], 16, 0xf6bb4b60) \
+    MD5_STEP(MD5_H, b, c, d, a, W[10], 23, 0xbebfbc70) \
+    MD5_STEP(MD5_H, a, b, c, d, W[13],  4, 0x289b7ec6) \
+    MD5_STEP(MD5_H, d, a, b, c, W[ 0], 11, 0xeaa127fa) \
+    MD5_STEP(MD5_H, c, d, a, b, W[ 3], 16, 0xd4ef3085) \
+    MD5_STEP(MD5_H, b, c, d, a, W[ 6], 23, 0x04881d05) \
+    MD5_STEP(MD5_H, a, b, c, d, W[ 9],  4, 0xd9d4d039) \
+    MD5_STEP(MD5_H, d, a, b, c, W[12], 11, 0xe6db99e5) \
+    MD5_STEP(MD5_H, c, d, a, b, W[15], 16, 0x1fa27cf8) \
+    MD5_STEP(MD5_H, b, c, d, a, W[ 2], 23, 0xc4ac5665) \
+    MD5_STEP(MD5_I, a, b, c, d, W[ 0],  6, 0xf4292244) \
+    MD5_STEP(MD5_I, d, a, b, c, W[ 7], 10, 0x432aff97) \
+    MD5_STEP(MD5_I, c, d, a, b, W[14], 15, 0xab9423a7) \
+    MD5_STEP(MD5_I, b, c, d, a, W[ 5], 21, 0xfc93a039) \
+    MD5_STEP(MD5_I, a, b, c, d, W[12],  6, 0x655b59c3) \
+    MD5_STEP(MD5_I, d, a, b, c, W[ 3], 10, 0x8f0ccc92) \
+    MD5_STEP(MD5_I, c, d, a, b, W[10], 15, 0xffeff47d) \
+    MD5_STEP(MD5_I, b, c, d, a, W[ 1], 21, 0x85845dd1) \
+    MD5_STEP(MD5_I, a, b, c, d, W[ 8],  6, 0x6fa87e4f) \
+    MD5_STEP(MD5_I, d, a, b, c, W[15], 10, 0xfe2ce6e0) \
+    MD5_STEP(MD5_I, c, d, a, b, W[ 6], 15, 0xa3014314) \
+    MD5_STEP(MD5_I, b, c, d, a, W[13], 21, 0x4e0811a1) \
+    MD5_STEP(MD5_I, a, b, c, d, W[ 4],  6, 0xf7537e82) \
+    MD5_STEP(MD5_I, d, a, b, c, W[11], 10, 0xbd3af235) \
+    MD5_STEP(MD5_I, c, d, a, b, W[ 2], 15, 0x2ad7d2bb) \
+    MD5_STEP(MD5_I, b, c, d, a, W[ 9], 21, 0xeb86d391)
+
+/*-----------------------------------------------------------------------------
+ * Plain C engine, one lane
+ */
+
+#define VADD(x, y)          ((x) + (y))
+#define VAND(x, y)          ((x) & (y))
+#define VOR(x, y)           ((x) | (y))
+#define VXOR(x, y)          ((x) ^ (y))
+#define VNOT(x)             (~(x))
+#define VROTL(x, s)         (((x) << (s)) | ((x) >> (32 - (s))))
+#define VSET1(t)            ((uint32_t)(t))
+
+static void MD5_Block_C(uint32_t State[4][MD5MB_MAX_LANES], const unsigned char * Blocks[MD5MB_MAX_LANES])
+{
+    const unsigned char * pbBlock = Blocks[0];
+    uint32_t W[16];
+    uint32_t a = State[0][0];
+    uint32_t b = State[1][0];
+    uint32_t c = State[2][0];
+    uint32_t d = State[3][0];
+    int i;
+
+    for(i = 0; i < 16; i++)
+        W[i] = LOAD32L(pbBlock + i * 4);
+
+    MD5_ROUNDS(a, b, c, d, W)
+
+    State[0][0] += a;
+    State[1][0] += b;
+    State[2][0] += c;
+    State[3][0] += d;
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VNOT
+#undef VROTL
+#undef VSET1
+
+#ifdef MD5MB_X86
+
+/*-----------------------------------------------------------------------------
+ * SSE2 engine, four lanes
+ */
+
+#define VADD(x, y)          _mm_add_epi32(x, y)
+#define VAND(x, y)          _mm_and_si128(x, y)
+#define VOR(x, y)           _mm_or_si128(x, y)
+#define VXOR(x, y)          _mm_xor_si128(x, y)
+#define VNOT(x)             _mm_xor_si128(x, _mm_set1_epi32(-1))
+#define VROTL(x, s)         _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+#define VSET1(t)            _mm_set1_epi32((int)(t))
+
+__attribute__((target("sse2")))
+static void MD5_Block_SSE2(uint32_t State[4][MD5MB_MAX_LANES], const unsigned char * Blocks[MD5MB_MAX_LANES])
+{
+    __m128i W[16];
+    __m128i r0, r1, r2, r3;
+    __m128i t0, t1, t2, t3;
+    __m128i a, b, c, d;
+    int i;
+
+    /* Load the block of each lane and transpose them, */
+    /* so that W[i] holds the i-th word of all lanes */
+    for(i = 0; i < 16; i += 4)
+    {
+        r0 = _mm_loadu_si128((const __m128i *)(Blocks[0] + i * 4));
+        r1 = _mm_loadu_si128((const __m128i *)(Blocks[1] + i * 4));
+        r2 = _mm_loadu_si128((const __m128i *)(Blocks[2] + i * 4));
+        r3 = _mm_loadu_si128((const __m128i *)(Blocks[3] + i * 4));
+
+        t0 = _mm_unpacklo_epi32(r0, r1);
+        t1 = _mm_unpacklo_epi32(r2, r3);
+        t2 = _mm_unpackhi_epi32(r0, r1);
+        t3 = _mm_unpackhi_epi32(r2, r3);
+
+        W[i + 0] = _mm_unpacklo_epi64(t0, t1);
+        W[i + 1] = _mm_unpackhi_epi64(t0, t1);
+        W[i + 2] = _mm_unpacklo_epi64(t2, t3);
+        W[i + 3] = _mm_unpackhi_epi64(t2, t3);
+    }
+
+    a = _mm_loadu_si128((const __m128i *)State[0]);
+    b = _mm_loadu_si128((const __m128i *)State[1]);
+    c = _mm_loadu_si128((const __m128i *)State[2]);
+    d = _mm_loadu_si128((const __m128i *)State[3]);
+
+    MD5_ROUNDS(a, b, c, d, W)
+
+    _mm_storeu_si128((__m128i *)State[0], _mm_add_epi32(a, _mm_loadu_si128((const __m128i *)State[0])));
+    _mm_storeu_si128((__m128i *)State[1], _mm_add_epi32(b, _mm_loadu_si128((const __m128i *)State[1])));
+    _mm_storeu_si128((__m128i *)State[2], _mm_add_epi32(c, _mm_loadu_si128((const __m128i *)State[2])));
+    _mm_storeu_si128((__m128i *)State[3], _mm_add_epi32(d, _mm_loadu_si128((const __m128i *)State[3])));
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VNOT
+#undef VROTL
+#undef VSET1
+
+/*-----------------------------------------------------------------------------
+ * AVX2 engine, eight lanes
+ */
+
+#define VADD(x, y)          _mm256_add_epi32(x, y)
+#define VAND(x, y)          _mm256_and_si256(x, y)
+#define VOR(x, y)           _mm256_or_si256(x, y)
+#define VXOR(x, y)          _mm256_xor_si256(x, y)
+#define VNOT(x)             _mm256_xor_si256(x, _mm256_set1_epi32(-1))
+#define VROTL(x, s)         _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#define VSET1(t)            _mm256_set1_epi32((int)(t))
+
+__attribute__((target("avx2")))
+static void MD5_Block_AVX2(uint32_t State[4][MD5MB_MAX_LANES], const unsigned char * Blocks[MD5MB_MAX_LANES])
+{
+    __m256i W[16];
+    __m256i r[8];
+    __m256i t[8];
+    __m256i u[8];
+    __m256i a, b, c, d;
+    int i, j;
+
+    /* Load the block of each lane and transpose them, */
+    /* so that W[i] holds the i-th word of all lanes */
+    for(i = 0; i < 16; i += 8)
+    {
+        for(j = 0; j < 8; j++)
+            r[j] = _mm256_loadu_si256((const __m256i *)(Blocks[j] + i * 4));
+
+        for(j = 0; j < 8; j += 2)
+        {
+            t[j + 0] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+            t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+        }
+
+        for(j = 0; j < 8; j += 4)
+        {
+            u[j + 0] = _mm256_unpacklo_epi64(t[j + 0], t[j + 2]);
+            u[j + 1] = _mm256_unpackhi_epi64(t[j + 0], t[j + 2]);
+            u[j + 2] = _mm256_unpacklo_epi64(t[j + 1], t[j + 3]);
+            u[j + 3] = _mm256_unpackhi_epi64(t[j + 1], t[j + 3]);
+        }
+
+        for(j = 0; j < 4; j++)
+        {
+            W[i + j + 0] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x20);
+            W[i + j + 4] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x31);
+        }
+    }
+
+    a = _mm256_loadu_si256((const __m256i *)State[0]);
+    b = _mm256_loadu_si256((const __m256i *)State[1]);
+    c = _mm256_loadu_si256((const __m256i *)State[2]);
+    d = _mm256_loadu_si256((const __m256i *)State[3]);
+
+    MD5_ROUNDS(a, b, c, d, W)
+
+    _mm256_storeu_si256((__m256i *)State[0], _mm256_add_epi32(a, _mm256_loadu_si256((const __m256i *)State[0])));
+    _mm256_storeu_si256((__m256i *)State[1], _mm256_add_epi32(b, _mm256_loadu_si256((const __m256i *)State[1])));
+    _mm256_storeu_si256((__m256i *)State[2], _mm256_add_epi32(c, _mm256_loadu_si256((const __m256i *)State[2])));
+    _mm256_storeu_si256((__m256i *)State[3], _mm256_add_epi32(d, _mm256_loadu_si256((const __m256i *)State[3])));
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VNOT
+#undef VROTL
+#undef VSET1
+
+#endif /* MD5MB_X86 */
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+/* Hashes up to nLanes buffers at once, using the given engine. Each lane runs */
+/* through its full blocks, then through the padded tail. Lanes that are done */
+/* (or unused) keep hashing their padding until the longest buffer is done */
+static void MD5_HashLanes(
+    MD5_BLOCK_FUNC pfnBlock,
+    unsigned int nLanes,
+    const unsigned char ** ppbData,
+    const size_t * pcbData,
+    unsigned int nBuffers,
+    unsigned char * pbDigests)
+{
+    const unsigned char * Blocks[MD5MB_MAX_LANES];
+    unsigned char Padding[MD5MB_MAX_LANES][MD5MB_BLOCK_SIZE * 2];
+    uint32_t State[4][MD5MB_MAX_LANES];
+    uint64_t BitLength;
+    size_t FullBlocks[MD5MB_MAX_LANES];
+    size_t TotalBlocks[MD5MB_MAX_LANES];
+    size_t MaxBlocks = 0;
+    size_t cbTail;
+    size_t i;
+    unsigned int j, k;
+
+    /* Prepare the padded tail and the initial state of each lane */
+    memset(Padding, 0, sizeof(Padding));
+    for(j = 0; j < nLanes; j++)
+    {
+        FullBlocks[j] = TotalBlocks[j] = 0;
+        if(j < nBuffers)
+        {
+            FullBlocks[j] = pcbData[j] / MD5MB_BLOCK_SIZE;
+            cbTail = pcbData[j] % MD5MB_BLOCK_SIZE;
+            TotalBlocks[j] = FullBlocks[j] + ((cbTail < MD5MB_BLOCK_SIZE - 8) ? 1 : 2);
+
+            /* The tail, the 0x80 byte and the length in bits at the end */
+            memcpy(Padding[j], ppbData[j] + FullBlocks[j] * MD5MB_BLOCK_SIZE, cbTail);
+            Padding[j][cbTail] = 0x80;
+            BitLength = (uint64_t)pcbData[j] * 8;
+            for(k = 0; k < 8; k++)
+                Padding[j][(TotalBlocks[j] - FullBlocks[j]) * MD5MB_BLOCK_SIZE - 8 + k] = (unsigned char)(BitLength >> (k * 8));
+
+            if(TotalBlocks[j] > MaxBlocks)
+                MaxBlocks = TotalBlocks[j];
+        }
+
+        State[0][j] = 0x67452301;
+        State[1][j] = 0xefcdab89;
+        State[2][j] = 0x98badcfe;
+        State[3][j] = 0x10325476;
+    }
+
+    for(i = 0; i < MaxBlocks; i++)
+    {
+        /* Get the next block of each lane */
+        for(j = 0; j < nLanes; j++)
+        {
+            if(i < FullBlocks[j])
+                Blocks[j] = ppbData[j] + i * MD5MB_BLOCK_SIZE;
+            else if(i < TotalBlocks[j])
+                Blocks[j] = Padding[j] + (i - FullBlocks[j]) * MD5MB_BLOCK_SIZE;
+            else
+                Blocks[j] = Padding[j];
+        }
+
+        pfnBlock(State, Blocks);
+
+        /* Store the digests of the lanes that are done */
+        for(j = 0; j < nBuffers; j++)
+        {
+            if(TotalBlocks[j] == i + 1)
+            {
+                for(k = 0; k < 4; k++)
+                    STORE32L(pbDigests + j * 16 + k * 4, State[k][j]);
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Public functions
+ */
+
+int MD5_HashChunksEngine(int nEngine, const void * pvData, size_t cbData, size_t cbChunk, unsigned char * pbDigests)
+{
+    const unsigned char * pbData = (const unsigned char *)pvData;
+    const unsigned char * ChunkData[MD5MB_MAX_LANES];
+    size_t ChunkSize[MD5MB_MAX_LANES];
+    MD5_BLOCK_FUNC pfnBlock = MD5_Block_C;
+    unsigned int nLanes = 1;
+    unsigned int nChunks;
+
+    /* Zero chunk size would never get through the data */
+    if(cbChunk == 0)
+        return 0;
+
+#ifdef MD5MB_X86
+    /* Pick the wanted engine, or the widest engine the CPU supports */
+    if((nEngine == MD5MB_ENGINE_AUTO || nEngine == MD5MB_ENGINE_AVX2) && __builtin_cpu_supports("avx2"))
+    {
+        pfnBlock = MD5_Block_AVX2;
+        nLanes = 8;
+    }
+    else if((nEngine == MD5MB_ENGINE_AUTO || nEngine == MD5MB_ENGINE_SSE2) && __builtin_cpu_supports("sse2"))
+    {
+        pfnBlock = MD5_Block_SSE2;
+        nLanes = 4;
+    }
+#endif
+
+    /* The wanted engine is not available */
+    if((nEngine == MD5MB_ENGINE_AVX2 && nLanes != 8) || (nEngine == MD5MB_ENGINE_SSE2 && nLanes != 4))
+        return 0;
+    if(nEngine == MD5MB_ENGINE_C)
+    {
+        pfnBlock = MD5_Block_C;
+        nLanes = 1;
+    }
+
+    while(cbData > 0)
+    {
+        /* Take as many chunks as there are lanes */
+        for(nChunks = 0; nChunks < nLanes && cbData > 0; nChunks++)
+        {
+            ChunkData[nChunks] = pbData;
+            ChunkSize[nChunks] = (cbData < cbChunk) ? cbData : cbChunk;
+            pbData += ChunkSize[nChunks];
+            cbData -= ChunkSize[nChunks];
+        }
+
+        /* A single chunk is faster to hash without the other lanes */
+        if(nChunks == 1)
+            MD5_HashLanes(MD5_Block_C, 1, ChunkData, ChunkSize, nChunks, pbDigests);
+        else
+            MD5_HashLanes(pfnBlock, nLanes, ChunkData, ChunkSize, nChunks, pbDigests);
+        pbDigests += nChunks * 16;
+    }
+
+    return 1;
+}
+
+void MD5_HashChunks(const void * pvData, size_t cbData, size_t cbChunk, unsigned char * pbDigests)
+{
+    MD5_HashChunksEngine(MD5MB_ENGINE_AUTO, pvData, cbData, cbChunk, pbDigests);
+}
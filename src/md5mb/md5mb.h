@@ -0,0 +1,28 @@
+/*****************************************************************************/
+/* md5mb.h                                                                   */
+/*---------------------------------------------------------------------------*/
+/* Multi-buffer MD5, used for the MD5s of raw data chunks                    */
+/*****************************************************************************/
+
+#ifndef _MD5MB_H
+#define _MD5MB_H
+
+#include <stddef.h>
+
+/* Engines for MD5_HashChunksEngine */
+#define MD5MB_ENGINE_AUTO   0           /* The widest engine the CPU supports */
+#define MD5MB_ENGINE_C      1           /* Plain C, one chunk at a time */
+#define MD5MB_ENGINE_SSE2   2           /* Four chunks at a time */
+#define MD5MB_ENGINE_AVX2   3           /* Eight chunks at a time */
+
+/* Calculates the MD5 of each cbChunk-sized chunk of the data and stores them */
+/* one after another into pbDigests (16 bytes each). The last chunk may be shorter. */
+/* Several chunks are hashed at once when the CPU has SSE2 or AVX2. */
+/* Nothing is hashed if cbChunk is zero */
+void MD5_HashChunks(const void * pvData, size_t cbData, size_t cbChunk, unsigned char * pbDigests);
+
+/* Like MD5_HashChunks, with the given MD5MB_ENGINE_XXX. Used by the tests. */
+/* Returns 0 if the CPU doesn't support the engine or cbChunk is zero */
+int MD5_HashChunksEngine(int nEngine, const void * pvData, size_t cbData, size_t cbChunk, unsigned char * pbDigests);
+
+#endif /* _MD5MB_H */
@@ -51,6 +51,7 @@
 #define ERROR_MARKED_FOR_DELETE          10005  /* The file was marked as "deleted" in the MPQ */
 #define ERROR_FILE_INCOMPLETE            10006  /* The required file part is missing */
 #define ERROR_UNKNOWN_FILE_NAMES         10007  /* A name of at least one file is unknown */
+#define ERROR_COMPACT_INTERRUPTED        10008  /* SFileCompactArchiveInPlace was interrupted and must be called again to finish */
 
 /* Values for SFileCreateArchive */
 #define HASH_TABLE_SIZE_MIN         0x00000004  /* Verified: If there is 1 file, hash table size is 4 */
@@ -92,6 +93,12 @@
 #define MPQ_FLAG_ATTRIBUTES_NEW     0x00001000  /* Set when (attributes) invalidated by InvalidateInternalFiles */
 #define MPQ_FLAG_SIGNATURE_NONE     0x00002000  /* Set when no (signature) was found in InvalidateInternalFiles */
 #define MPQ_FLAG_SIGNATURE_NEW      0x00004000  /* Set when (signature) invalidated by InvalidateInternalFiles */
+#define MPQ_FLAG_LAZY_BET           0x00008000  /* If set, BET table entries are decoded when they are needed */
+#define MPQ_FLAG_LISTFILE_LAZY      0x00010000  /* The (listfile) has not been loaded yet. It is loaded when the file names are needed */
+#define MPQ_FLAG_ATTRIBUTES_LAZY    0x00020000  /* The (attributes) has not been loaded yet. It is loaded when CRC32, MD5 or file time is needed */
+#define MPQ_FLAG_DEDUP_DATA         0x00040000  /* Added files share the data with files of the same content. See SFileSetDataDedup */
+#define MPQ_FLAG_CHECK_RAW_MD5      0x00080000  /* Checking MD5 of raw data chunks when reading files */
+#define MPQ_FLAG_COMPACT_INTERRUPTED 0x00100000 /* The file data don't match the MPQ tables until SFileCompactArchiveInPlace is finished */
 #define MPQ_FLAG_FILENAME_UNIX      0x80000000  /* If set, filename isn't changed for hash functions */
 
 /* Values for TMPQArchive::dwSubType */
@@ -204,6 +211,13 @@
 #define MPQ_OPEN_FORCE_MPQ_V1       0x00080000  /* Always open the archive as MPQ v 1.00, ignore the "wFormatVersion" variable in the header */
 #define MPQ_OPEN_CHECK_SECTOR_CRC   0x00100000  /* On files with MPQ_FILE_SECTOR_CRC, the CRC will be checked when reading file */
 #define MPQ_OPEN_PATCH              0x00200000  /* This archive is a patch MPQ. Used internally. */
+#define MPQ_OPEN_LAZY_BET           0x00400000  /* Don't decode the BET table at once, decode each file entry when it is needed. Read only. */
+#define MPQ_OPEN_USE_INDEX          0x00800000  /* Load the tables from the index file "<archive>.idx" if it is up to date, otherwise create it */
+#define MPQ_OPEN_LAZY_LISTFILE      0x01000000  /* Don't load the internal listfile until the file names are needed (enumeration, SFileGetFileName) */
+#define MPQ_OPEN_LAZY_ATTRIBUTES    0x02000000  /* Don't load the (attributes) until CRC32, MD5 or file time is needed. Ignored for patch archives */
+#define MPQ_OPEN_CHECK_RAW_MD5      0x04000000  /* On MPQs with raw chunk MD5s (v4), the MD5 of each chunk will be checked when reading file data */
+#define MPQ_OPEN_VERIFY_CACHE       0x08000000  /* Remember files and signature that passed SFileVerifyFile, SFileVerifyAllFiles or SFileVerifyArchive, and don't verify them again */
+#define MPQ_OPEN_VERIFY_CACHE_FILE  0x10000000  /* Like MPQ_OPEN_VERIFY_CACHE, and keep the file results in "<archive>.vfy" for the next open. The saved results are trusted without verifying the files again, so don't use it if others can write the .vfy file. Signature results are never saved */
 #define MPQ_OPEN_READ_ONLY          STREAM_FLAG_READ_ONLY
 #define MPQ_OPEN_UNIX               MPQ_FLAG_FILENAME_UNIX
 
@@ -377,6 +391,8 @@ typedef enum _SFileInfoClass
     SFileInfoFlags,                         /* File flags from (uint32_t) */
     SFileInfoEncryptionKey,                 /* File encryption key */
     SFileInfoEncryptionKeyRaw,              /* Unfixed value of the file key */
+    SFileInfoCRC32,                         /* CRC32 of the file from the (attributes) (uint32_t) */
+    SFileInfoMD5,                           /* MD5 of the file from the (attributes) (unsigned char [MD5_DIGEST_SIZE]) */
 } SFileInfoClass;
 
 /*-----------------------------------------------------------------------------
@@ -393,6 +409,7 @@ typedef enum _SFileInfoClass
 typedef void (* SFILE_DOWNLOAD_CALLBACK)(void * pvUserData, uint64_t ByteOffset, uint32_t dwTotalBytes);
 typedef void (* SFILE_ADDFILE_CALLBACK)(void * pvUserData, uint32_t dwBytesWritten, uint32_t dwTotalBytes, int bFinalCall);
 typedef void (* SFILE_COMPACT_CALLBACK)(void * pvUserData, uint32_t dwWorkType, uint64_t BytesProcessed, uint64_t TotalBytes);
+typedef void (* SFILE_VERIFY_CALLBACK)(void * pvUserData, uint32_t dwFileIndex, uint32_t dwVerifyResult, uint64_t BytesProcessed, uint64_t TotalBytes);
 
 typedef struct TFileStream TFileStream;
 
@@ -690,6 +707,7 @@ typedef struct _TMPQHetTable
     uint32_t      dwIndexSizeTotal;                /* Total size of one entry in pBetIndexes (in bits) */
     uint32_t      dwIndexSizeExtra;                /* Extra bits in the entry in pBetIndexes */
     uint32_t      dwIndexSize;                     /* Effective size of one entry in pBetIndexes (in bits) */
+    uint32_t      dwUsedCount;                     /* Number of entries in pNameHashes that are not HET_ENTRY_FREE */
 } TMPQHetTable;
 
 /* Structure for parsed BET table */
@@ -752,6 +770,24 @@ typedef struct _SFILE_FIND_DATA
 
 } SFILE_FIND_DATA, *PSFILE_FIND_DATA;
 
+/* Structure for SFileFindFirstEntry and SFileFindNextEntry */
+typedef struct _SFILE_ENTRY_DATA
+{
+    uint64_t  ByteOffset;                          /* File position in the archive, relative to the MPQ header */
+    uint64_t  FileTime;                            /* File time (0 if not present) */
+    uint64_t  FileNameHash;                        /* 64-bit file name hash for the HET/BET tables */
+    const char * szFileName;                       /* File name, NULL if not known */
+    uint32_t  dwFileIndex;                         /* Index of the file in the file table */
+    uint32_t  dwHashIndex;                         /* Index of the file in the hash table (HASH_ENTRY_FREE if none) */
+    uint32_t  dwNameHash1;                         /* The first name hash in the hash table (0 if no hash entry) */
+    uint32_t  dwNameHash2;                         /* The second name hash in the hash table (0 if no hash entry) */
+    uint32_t  lcLocale;                            /* File locale (0 if no hash entry) */
+    uint32_t  dwFileSize;                          /* File size in bytes */
+    uint32_t  dwCompSize;                          /* Compressed file size */
+    uint32_t  dwFileFlags;                         /* MPQ file flags */
+
+} SFILE_ENTRY_DATA, *PSFILE_ENTRY_DATA;
+
 typedef struct _SFILE_CREATE_MPQ
 {
     uint32_t cbSize;                               /* Size of this structure, in bytes */
@@ -797,11 +833,13 @@ int FileStream_SetCallback(TFileStream * pStream, SFILE_DOWNLOAD_CALLBACK pfnCal
 int FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, uint32_t cbBitmap, uint32_t * pcbLengthNeeded);
 int FileStream_Read(TFileStream * pStream, uint64_t * pByteOffset, void * pvBuffer, uint32_t dwBytesToRead);
 int FileStream_Write(TFileStream * pStream, uint64_t * pByteOffset, const void * pvBuffer, uint32_t dwBytesToWrite);
+int FileStream_Copy(TFileStream * pTrgStream, uint64_t * pTrgOffset, TFileStream * pSrcStream, uint64_t * pSrcOffset, uint64_t ByteCount);
 int FileStream_SetSize(TFileStream * pStream, uint64_t NewFileSize);
 int FileStream_GetSize(TFileStream * pStream, uint64_t * pFileSize);
 int FileStream_GetPos(TFileStream * pStream, uint64_t * pByteOffset);
 int FileStream_GetTime(TFileStream * pStream, uint64_t * pFT);
 int FileStream_GetFlags(TFileStream * pStream, uint32_t * pdwStreamFlags);
+const void * FileStream_GetMappedView(TFileStream * pStream, uint64_t * pFileSize);
 int FileStream_Replace(TFileStream * pStream, TFileStream * pNewStream);
 void FileStream_Close(TFileStream * pStream);
 
@@ -849,6 +887,7 @@ int    SFileAddListFile(void * hMpq, const char * szListFile);
 /* Archive compacting */
 int   SFileSetCompactCallback(void * hMpq, SFILE_COMPACT_CALLBACK CompactCB, void * pvUserData);
 int   SFileCompactArchive(void * hMpq, const char * szListFile, int bReserved);
+int   SFileCompactArchiveInPlace(void * hMpq, const char * szListFile);
 
 /* Changing the maximum file count */
 uint32_t  SFileGetMaxFileCount(void * hMpq);
@@ -873,6 +912,7 @@ int   SFileIsPatchedArchive(void * hMpq);
 /* Reading from MPQ file */
 int   SFileHasFile(void * hMpq, const char * szFileName);
 int   SFileOpenFileEx(void * hMpq, const char * szFileName, uint32_t dwSearchScope, void * * phFile);
+int   SFileOpenFileByIndex(void * hMpq, uint32_t dwFileIndex, uint32_t dwHashIndex, void * * phFile);
 size_t  SFileGetFileSize(void * hFile, uint32_t * pdwFileSizeHigh);
 size_t  SFileSetFilePointer(void * hFile, off_t lFilePos, int * plFilePosHigh, uint32_t dwMoveMethod);
 int   SFileReadFile(void * hFile, void * lpBuffer, size_t dwToRead, size_t * pdwRead);
@@ -897,6 +937,10 @@ int   SFileGetFileChecksums(void * hMpq, const char * szFileName, uint32_t * pdw
 /* For dwFlags, use one or more of MPQ_ATTRIBUTE_MD5 */
 uint32_t  SFileVerifyFile(void * hMpq, const char * szFileName, uint32_t dwFlags);
 
+/* Verifies all files in the archive, using multiple threads on large archives. */
+/* pdwResults receives the result for each file table entry (see SFileMpqFileTableSize) */
+int   SFileVerifyAllFiles(void * hMpq, uint32_t dwFlags, uint32_t * pdwResults, uint32_t dwMaxResults, SFILE_VERIFY_CALLBACK pfnVerifyCB, void * pvUserData);
+
 /* Verifies raw data of the archive. Only works for MPQs version 4 or newer */
 int    SFileVerifyRawData(void * hMpq, uint32_t dwWhatToVerify, const char * szFileName);
 
@@ -905,6 +949,9 @@ int   SFileSetRSAKey(void * hMpq, unsigned char * key, size_t keyLength);
 int   SFileSignArchive(void * hMpq, uint32_t dwSignatureType);
 uint32_t  SFileVerifyArchive(void * hMpq);
 
+/* Sets how much of the archive is read at once when it's signed or verified (0 = default) */
+int   SFileSetDigestReadSize(void * hMpq, uint32_t dwReadSize);
+
 /*-----------------------------------------------------------------------------
  * Functions for file searching
  */
@@ -913,6 +960,11 @@ void * SFileFindFirstFile(void * hMpq, const char * szMask, SFILE_FIND_DATA * lp
 int   SFileFindNextFile(void * hFind, SFILE_FIND_DATA * lpFindFileData);
 int   SFileFindClose(void * hFind);
 
+/* Enumerates all file table entries, including files without known name */
+void * SFileFindFirstEntry(void * hMpq, SFILE_ENTRY_DATA * lpEntryData);
+int   SFileFindNextEntry(void * hFind, SFILE_ENTRY_DATA * lpEntryData);
+int   SFileFindEntryClose(void * hFind);
+
 void * SListFileFindFirstFile(void * hMpq, const char * szListFile, const char * szMask, SFILE_FIND_DATA * lpFindFileData);
 int   SListFileFindNextFile(void * hFind, SFILE_FIND_DATA * lpFindFileData);
 int   SListFileFindClose(void * hFind);
@@ -937,6 +989,7 @@ int   SFileSetFileLocale(void * hFile, uint32_t lcNewLocale);
 int   SFileSetDataCompression(uint32_t DataCompression);
 
 int   SFileSetAddFileCallback(void * hMpq, SFILE_ADDFILE_CALLBACK AddFileCB, void * pvUserData);
+int   SFileSetDataDedup(void * hMpq, int bEnable);
 
 
 /*-----------------------------------------------------------------------------
@@ -0,0 +1,219 @@
+/*****************************************************************************/
+/* bitarray_test.c                                                           */
+/*---------------------------------------------------------------------------*/
+/* Compares GetBits and SetBits with the byte-wise code they replaced, for   */
+/* random positions, lengths and array sizes. Run by "make test".           */
+/*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../src/thunderStorm.h"
+#include "../src/StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MAX_ARRAY_BYTES     80                  /* Arrays from 1 to this many bytes */
+#define RANDOM_TESTS        2000000             /* Number of random GetBits/SetBits pairs */
+
+static const int ResultSizes[] = {1, 2, 4, 8};
+
+static unsigned int nTests = 0;
+static unsigned int nFailed = 0;
+static uint32_t dwSeed = 0x12345678;
+
+/*-----------------------------------------------------------------------------
+ * Byte-wise GetBits and SetBits, as they were before the 64-bit fast paths.
+ * Little endian only. The values given to SetBits must fit into nBitLength.
+ */
+
+static uint16_t RefSetBitsMask[] = {0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
+
+static void RefGetBits(TBitArray * pArray, unsigned int nBitPosition, unsigned int nBitLength, void * pvBuffer)
+{
+    unsigned char * pbBuffer = (unsigned char *)pvBuffer;
+    unsigned int nBytePosition0 = (nBitPosition / 8);
+    unsigned int nBytePosition1 = nBytePosition0 + 1;
+    unsigned int nByteLength = (nBitLength / 8);
+    unsigned int nBitOffset = (nBitPosition & 0x07);
+    unsigned char BitBuffer;
+
+    /* Copy whole bytes, if any */
+    while(nByteLength > 0)
+    {
+        if(nBitOffset != 0)
+            BitBuffer = (unsigned char)((pArray->Elements[nBytePosition0] >> nBitOffset) | (pArray->Elements[nBytePosition1] << (0x08 - nBitOffset)));
+        else
+            BitBuffer = pArray->Elements[nBytePosition0];
+
+        *pbBuffer++ = BitBuffer;
+        nBytePosition1++;
+        nBytePosition0++;
+        nByteLength--;
+    }
+
+    /* Get the rest of the bits */
+    nBitLength = (nBitLength & 0x07);
+    if(nBitLength != 0)
+    {
+        *pbBuffer = (unsigned char)(pArray->Elements[nBytePosition0] >> nBitOffset);
+
+        if(nBitLength > (8 - nBitOffset))
+            *pbBuffer = (unsigned char)((pArray->Elements[nBytePosition1] << (8 - nBitOffset)) | (pArray->Elements[nBytePosition0] >> nBitOffset));
+
+        *pbBuffer &= (0x01 << nBitLength) - 1;
+    }
+}
+
+static void RefSetBits(TBitArray * pArray, unsigned int nBitPosition, unsigned int nBitLength, void * pvBuffer)
+{
+    unsigned char * pbBuffer = (unsigned char *)pvBuffer;
+    unsigned int nBytePosition = (nBitPosition / 8);
+    unsigned int nBitOffset = (nBitPosition & 0x07);
+    unsigned short BitBuffer = 0;
+    unsigned short AndMask = 0;
+    unsigned short OneByte = 0;
+
+    /* Copy whole bytes, if any */
+    while(nBitLength > 8)
+    {
+        OneByte = *pbBuffer++;
+        BitBuffer = (BitBuffer >> 0x08) | (OneByte << nBitOffset);
+        AndMask = (AndMask >> 0x08) | (0x00FF << nBitOffset);
+        pArray->Elements[nBytePosition] = (uint8_t)((pArray->Elements[nBytePosition] & ~AndMask) | BitBuffer);
+        nBytePosition++;
+        nBitLength -= 0x08;
+    }
+
+    if(nBitLength != 0)
+    {
+        OneByte = *pbBuffer;
+        BitBuffer = (BitBuffer >> 0x08) | (OneByte << nBitOffset);
+        AndMask = (AndMask >> 0x08) | (RefSetBitsMask[nBitLength] << nBitOffset);
+        pArray->Elements[nBytePosition] = (uint8_t)((pArray->Elements[nBytePosition] & ~AndMask) | BitBuffer);
+
+        if(AndMask & 0xFF00)
+        {
+            nBytePosition++;
+            BitBuffer >>= 0x08;
+            AndMask >>= 0x08;
+            pArray->Elements[nBytePosition] = (uint8_t)((pArray->Elements[nBytePosition] & ~AndMask) | BitBuffer);
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static uint32_t Random(uint32_t dwRange)
+{
+    dwSeed = dwSeed * 1103515245 + 12345;
+    return (dwSeed >> 8) % dwRange;
+}
+
+/* Places a bit array so that its last byte is right before the guard page. */
+/* Any access beyond the array makes the test crash */
+static TBitArray * PlaceBitArray(unsigned char * pbPageEnd, uint32_t dwBytes)
+{
+    TBitArray * pArray = (TBitArray *)(pbPageEnd - dwBytes - offsetof(TBitArray, Elements));
+    uint32_t i;
+
+    pArray->NumberOfBytes = dwBytes;
+    pArray->NumberOfBits = dwBytes * 8;
+    for(i = 0; i < dwBytes; i++)
+        pArray->Elements[i] = (uint8_t)Random(0x100);
+    return pArray;
+}
+
+static void TestBits(TBitArray * pArray, TBitArray * pRefArray, unsigned int nBitPosition, unsigned int nBitLength, int nResultByteSize)
+{
+    unsigned char Value[8];
+    unsigned char RefValue[8];
+    unsigned int i;
+
+    nTests++;
+
+    /* GetBits must give the same value, with the rest of the buffer zeroed */
+    memset(Value, 0, sizeof(Value));
+    memset(RefValue, 0, sizeof(RefValue));
+    GetBits(pArray, nBitPosition, nBitLength, Value, nResultByteSize);
+    RefGetBits(pRefArray, nBitPosition, nBitLength, RefValue);
+    if(memcmp(Value, RefValue, sizeof(Value)))
+    {
+        if(nFailed++ < 20)
+            printf("  GetBits of %u bytes, position %u, length %u, size %d differs\n", pArray->NumberOfBytes, nBitPosition, nBitLength, nResultByteSize);
+        return;
+    }
+
+    /* SetBits must change the same bits */
+    for(i = 0; i < sizeof(Value); i++)
+        Value[i] = (i * 8 < nBitLength) ? (uint8_t)Random(0x100) : 0;
+    if(nBitLength & 0x07)
+        Value[nBitLength / 8] &= (1 << (nBitLength & 0x07)) - 1;
+    SetBits(pArray, nBitPosition, nBitLength, Value, nResultByteSize);
+    RefSetBits(pRefArray, nBitPosition, nBitLength, Value);
+    if(memcmp(pArray->Elements, pRefArray->Elements, pArray->NumberOfBytes))
+    {
+        if(nFailed++ < 20)
+            printf("  SetBits of %u bytes, position %u, length %u, size %d differs\n", pArray->NumberOfBytes, nBitPosition, nBitLength, nResultByteSize);
+        memcpy(pArray->Elements, pRefArray->Elements, pArray->NumberOfBytes);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Main
+ */
+
+int main(void)
+{
+    TBitArray * pRefArray;
+    TBitArray * pArray;
+    unsigned char * pbPages;
+    unsigned int nBitPosition;
+    unsigned int nBitLength;
+    unsigned int nMaxLength;
+    unsigned int n;
+    long nPageSize = sysconf(_SC_PAGESIZE);
+    uint32_t dwBytes;
+    int nResultByteSize;
+
+    /* Two arrays, each followed by an inaccessible page */
+    pbPages = (unsigned char *)mmap(NULL, nPageSize * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pbPages == MAP_FAILED || mprotect(pbPages + nPageSize, nPageSize, PROT_NONE) != 0 || mprotect(pbPages + nPageSize * 3, nPageSize, PROT_NONE) != 0)
+    {
+        printf("Cannot allocate the guard pages\n");
+        return 1;
+    }
+
+    for(n = 0; n < RANDOM_TESTS; n++)
+    {
+        /* A new pair of equal arrays from time to time */
+        if((n % 1000) == 0)
+        {
+            dwBytes = 1 + Random(MAX_ARRAY_BYTES);
+            pArray = PlaceBitArray(pbPages + nPageSize, dwBytes);
+            pRefArray = PlaceBitArray(pbPages + nPageSize * 3, dwBytes);
+            memcpy(pRefArray->Elements, pArray->Elements, dwBytes);
+        }
+
+        /* The value must fit into the result buffer and into the array. */
+        /* Every fourth position is within the last 8 bytes of the array */
+        nResultByteSize = ResultSizes[Random(sizeof(ResultSizes) / sizeof(ResultSizes[0]))];
+        nBitPosition = (n & 3) ? Random(pArray->NumberOfBits) : pArray->NumberOfBits - 1 - Random(STORMLIB_MIN(64, pArray->NumberOfBits));
+        nMaxLength = STORMLIB_MIN((unsigned int)nResultByteSize * 8, pArray->NumberOfBits - nBitPosition);
+        nBitLength = Random(nMaxLength + 1);
+
+        TestBits(pArray, pRefArray, nBitPosition, nBitLength, nResultByteSize);
+    }
+
+    printf("bitarray: %u tests, %u failed\n", nTests, nFailed);
+    munmap(pbPages, nPageSize * 4);
+    return (nFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*****************************************************************************/
+/* hetbet_bench.c                                                            */
+/*---------------------------------------------------------------------------*/
+/* Measures the decoding and encoding of HET/BET tables on a synthetic       */
+/* archive with 500k files. Run by "make bench".                            */
+/*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/thunderStorm.h"
+#include "../src/StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define BENCH_FILES         500000              /* Number of files in the archive */
+#define BENCH_ROUNDS        5                   /* The best round is reported */
+#define BENCH_ARCHIVE       "hetbet_bench.mpq"
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static double GetTimeMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void GetBenchFileName(char * szFileName, unsigned int nIndex)
+{
+    sprintf(szFileName, "Data\\Dir%03u\\File%06u.dat", nIndex % 500, nIndex);
+}
+
+/* Creates a version 3 archive with HET and BET tables. The files have */
+/* different sizes, so that the BET table has wide file size fields */
+static int CreateBenchArchive(void)
+{
+    unsigned char Data[0x100];
+    char szFileName[MAX_PATH];
+    void * hMpq;
+    void * hFile;
+    unsigned int i;
+    uint32_t dwSize;
+
+    remove(BENCH_ARCHIVE);
+    if(!SFileCreateArchive(BENCH_ARCHIVE, MPQ_CREATE_ARCHIVE_V3, BENCH_FILES, &hMpq))
+        return 0;
+
+    memset(Data, 'x', sizeof(Data));
+    for(i = 0; i < BENCH_FILES; i++)
+    {
+        GetBenchFileName(szFileName, i);
+        dwSize = i % sizeof(Data);
+        if(!SFileCreateFile(hMpq, szFileName, 0, dwSize, 0, 0, &hFile))
+            break;
+        SFileWriteFile(hFile, Data, dwSize, 0);
+        SFileFinishFile(hFile);
+    }
+
+    SFileCloseArchive(hMpq);
+    return (i == BENCH_FILES);
+}
+
+/*-----------------------------------------------------------------------------
+ * Main
+ */
+
+int main(void)
+{
+    TMPQExtHeader * pBetTable;
+    TMPQArchive * ha;
+    uint64_t cbBetTable;
+    double BestOpen = 1e9;
+    double BestSave = 1e9;
+    double BestFind = 1e9;
+    double StartTime;
+    double Time;
+    char szFileName[MAX_PATH];
+    void * hMpq;
+    unsigned int nFound;
+    unsigned int nRound;
+    unsigned int i;
+
+    printf("hetbet: creating archive with %u files ...\n", BENCH_FILES);
+    if(!CreateBenchArchive())
+    {
+        printf("hetbet: cannot create %s\n", BENCH_ARCHIVE);
+        return 1;
+    }
+
+    for(nRound = 0; nRound < BENCH_ROUNDS; nRound++)
+    {
+        /* Opening decodes the whole BET table (BuildFileTable_HetBet) */
+        StartTime = GetTimeMs();
+        if(!SFileOpenArchive(BENCH_ARCHIVE, 0, MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES | MPQ_OPEN_READ_ONLY, &hMpq))
+        {
+            printf("hetbet: cannot open %s\n", BENCH_ARCHIVE);
+            return 1;
+        }
+        Time = GetTimeMs() - StartTime;
+        BestOpen = STORMLIB_MIN(BestOpen, Time);
+        ha = (TMPQArchive *)hMpq;
+
+        /* Encoding of the BET table, as done when saving the tables */
+        StartTime = GetTimeMs();
+        pBetTable = TranslateBetTable2(ha, &cbBetTable);
+        Time = GetTimeMs() - StartTime;
+        BestSave = STORMLIB_MIN(BestSave, Time);
+        if(pBetTable != NULL)
+            STORM_FREE(pBetTable);
+
+        /* Lookup of each file through the HET table */
+        StartTime = GetTimeMs();
+        for(i = nFound = 0; i < BENCH_FILES; i++)
+        {
+            GetBenchFileName(szFileName, i);
+            nFound += SFileHasFile(hMpq, szFileName) ? 1 : 0;
+        }
+        Time = GetTimeMs() - StartTime;
+        BestFind = STORMLIB_MIN(BestFind, Time);
+
+        SFileCloseArchive(hMpq);
+        if(nFound != BENCH_FILES)
+        {
+            printf("hetbet: only %u files of %u found\n", nFound, BENCH_FILES);
+            return 1;
+        }
+    }
+
+    printf("hetbet: open (BuildFileTable_HetBet)  %8.1f ms\n", BestOpen);
+    printf("hetbet: TranslateBetTable2            %8.1f ms\n", BestSave);
+    printf("hetbet: SFileHasFile for all files    %8.1f ms\n", BestFind);
+    remove(BENCH_ARCHIVE);
+    return 0;
+}
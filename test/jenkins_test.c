@@ -0,0 +1,97 @@
+/*****************************************************************************/
+/* jenkins_test.c                                                            */
+/*---------------------------------------------------------------------------*/
+/* Compares hashlittle2_table with hashlittle2 on the converted key, as the  */
+/* HET table hashes of long names depend on it. Run by "make test".         */
+/*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/thunderStorm.h"
+#include "../src/StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MAX_KEY_LENGTH      0x1000              /* Longer than the local buffer of HashFileName */
+#define RANDOM_KEYS         200000              /* Number of random keys */
+
+static uint32_t dwSeed = 0x12345678;
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static uint32_t Random(uint32_t dwRange)
+{
+    dwSeed = dwSeed * 1103515245 + 12345;
+    return (dwSeed >> 8) % dwRange;
+}
+
+/*-----------------------------------------------------------------------------
+ * Main
+ */
+
+int main(void)
+{
+    unsigned char * pbConverted;
+    unsigned char * pbKey;
+    unsigned char Table[0x100];
+    unsigned int nTests = 0;
+    unsigned int nFailed = 0;
+    unsigned int n;
+    uint32_t dwHash1, dwHash2;
+    uint32_t dwRefHash1, dwRefHash2;
+    size_t nLength;
+    size_t i;
+
+    /* One byte more, so that the keys also start at odd addresses */
+    pbKey = (unsigned char *)malloc(MAX_KEY_LENGTH + 1);
+    pbConverted = (unsigned char *)malloc(MAX_KEY_LENGTH + 1);
+    if(pbKey == NULL || pbConverted == NULL)
+    {
+        printf("Not enough memory\n");
+        return 1;
+    }
+
+    for(n = 0; n < RANDOM_KEYS; n++)
+    {
+        /* The tables used by HashFileName, then random ones */
+        for(i = 0; i < sizeof(Table); i++)
+        {
+            switch(n % 3)
+            {
+                case 0:  Table[i] = AsciiToLowerTable[i]; break;
+                case 1:  Table[i] = (unsigned char)i; break;
+                default: Table[i] = (unsigned char)Random(0x100); break;
+            }
+        }
+
+        /* Mostly short keys, some of them up to MAX_KEY_LENGTH */
+        nLength = (n & 7) ? Random(0x120) : Random(MAX_KEY_LENGTH + 1);
+        for(i = 0; i < nLength; i++)
+        {
+            pbKey[i + (n & 1)] = (unsigned char)Random(0x100);
+            pbConverted[i + (n & 1)] = Table[pbKey[i + (n & 1)]];
+        }
+
+        dwHash1 = dwRefHash1 = 1;
+        dwHash2 = dwRefHash2 = 2;
+        hashlittle2_table(pbKey + (n & 1), nLength, Table, &dwHash2, &dwHash1);
+        hashlittle2(pbConverted + (n & 1), nLength, &dwRefHash2, &dwRefHash1);
+        if(dwHash1 != dwRefHash1 || dwHash2 != dwRefHash2)
+        {
+            if(nFailed++ < 20)
+                printf("  key of %u bytes: hash differs\n", (unsigned int)nLength);
+        }
+        nTests++;
+    }
+
+    printf("jenkins: %u tests, %u failed\n", nTests, nFailed);
+    free(pbConverted);
+    free(pbKey);
+    return (nFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+/*****************************************************************************/
+/* md5mb_test.c                                                              */
+/*---------------------------------------------------------------------------*/
+/* Compares the chunk MD5s of MD5_HashChunks with CalculateDataBlockHash,    */
+/* for each engine the CPU supports. Run by "make test".                    */
+/*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/thunderStorm.h"
+#include "../src/StormCommon.h"
+#include "../src/md5mb/md5mb.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MAX_DATA_SIZE       (0x4000 * 9 + 123)  /* Larger than any short test, with a partial last chunk */
+#define MAX_CHUNKS          (MAX_DATA_SIZE + 1) /* Chunk size 1 gives one chunk per byte */
+
+/* Chunk sizes around the 56-byte padding limit and the 64-byte block size */
+static const size_t ChunkSizes[] = {1, 3, 55, 56, 57, 63, 64, 65, 100, 119, 120, 121, 128, 300, 0x4000};
+
+static const struct
+{
+    int nEngine;
+    const char * szName;
+} Engines[] =
+{
+    {MD5MB_ENGINE_AUTO, "auto"},
+    {MD5MB_ENGINE_C,    "C"},
+    {MD5MB_ENGINE_SSE2, "SSE2"},
+    {MD5MB_ENGINE_AVX2, "AVX2"}
+};
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+/* Hashes the data with the engine and compares each chunk MD5 with the expected one */
+static int TestHashChunks(int nEngine, unsigned char * pbData, size_t cbData, size_t cbChunk, unsigned char * pbDigests)
+{
+    unsigned char md5[MD5_DIGEST_SIZE];
+    size_t nChunks = (cbData + cbChunk - 1) / cbChunk;
+    size_t cbToHash;
+    size_t i;
+
+    /* The byte after the last digest must stay untouched */
+    memset(pbDigests, 0xCC, (nChunks + 1) * MD5_DIGEST_SIZE);
+    MD5_HashChunksEngine(nEngine, pbData, cbData, cbChunk, pbDigests);
+
+    for(i = 0; i < nChunks; i++)
+    {
+        cbToHash = (cbData - i * cbChunk < cbChunk) ? (cbData - i * cbChunk) : cbChunk;
+        CalculateDataBlockHash(pbData + i * cbChunk, (uint32_t)cbToHash, md5);
+        if(memcmp(md5, pbDigests + i * MD5_DIGEST_SIZE, MD5_DIGEST_SIZE))
+        {
+            printf("  data size %u, chunk size %u: MD5 of chunk %u differs\n", (unsigned int)cbData, (unsigned int)cbChunk, (unsigned int)i);
+            return 0;
+        }
+    }
+
+    if(pbDigests[nChunks * MD5_DIGEST_SIZE] != 0xCC)
+    {
+        printf("  data size %u, chunk size %u: written beyond the last digest\n", (unsigned int)cbData, (unsigned int)cbChunk);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * Main
+ */
+
+int main(void)
+{
+    unsigned char * pbDigests;
+    unsigned char * pbData;
+    unsigned char Dummy[MD5_DIGEST_SIZE];
+    unsigned int nTests = 0;
+    unsigned int nFailed = 0;
+    uint32_t dwSeed = 0x12345678;
+    size_t cbData;
+    size_t i, j;
+
+    pbData = (unsigned char *)malloc(MAX_DATA_SIZE);
+    pbDigests = (unsigned char *)malloc(MAX_CHUNKS * MD5_DIGEST_SIZE);
+    if(pbData == NULL || pbDigests == NULL)
+    {
+        printf("Not enough memory\n");
+        return 1;
+    }
+
+    /* Pseudo-random data, so that the lanes hash different bytes */
+    for(i = 0; i < MAX_DATA_SIZE; i++)
+    {
+        dwSeed = dwSeed * 1103515245 + 12345;
+        pbData[i] = (unsigned char)(dwSeed >> 16);
+    }
+
+    for(i = 0; i < sizeof(Engines) / sizeof(Engines[0]); i++)
+    {
+        unsigned int nFailedBefore = nFailed;
+
+        /* Zero chunk size must not hang, and the engine must be supported */
+        memset(Dummy, 0xCC, sizeof(Dummy));
+        if(MD5_HashChunksEngine(Engines[i].nEngine, pbData, 100, 0, Dummy) != 0 || Dummy[0] != 0xCC)
+        {
+            printf("  zero chunk size is not rejected\n");
+            nFailed++;
+        }
+        if(!MD5_HashChunksEngine(Engines[i].nEngine, pbData, 0, 64, Dummy))
+        {
+            printf("md5mb: engine %-4s not supported by the CPU, skipped\n", Engines[i].szName);
+            continue;
+        }
+
+        /* All data sizes from 0 to 300 bytes. The last chunk is often partial, */
+        /* so the lanes of the last round have different lengths */
+        for(j = 0; j < sizeof(ChunkSizes) / sizeof(ChunkSizes[0]); j++)
+        {
+            for(cbData = 0; cbData <= 300; cbData++)
+            {
+                nFailed += TestHashChunks(Engines[i].nEngine, pbData, cbData, ChunkSizes[j], pbDigests) ? 0 : 1;
+                nTests++;
+            }
+        }
+
+        /* Chunk sizes used by real archives */
+        nFailed += TestHashChunks(Engines[i].nEngine, pbData, MAX_DATA_SIZE, 0x4000, pbDigests) ? 0 : 1;
+        nFailed += TestHashChunks(Engines[i].nEngine, pbData, MAX_DATA_SIZE, 0x200, pbDigests) ? 0 : 1;
+        nTests += 2;
+
+        printf("md5mb: engine %-4s %s\n", Engines[i].szName, (nFailed == nFailedBefore) ? "OK" : "FAILED");
+    }
+
+    printf("md5mb: %u tests, %u failed\n", nTests, nFailed);
+    free(pbDigests);
+    free(pbData);
+    return (nFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/*****************************************************************************/
+/* wildcard_test.c                                                           */
+/*---------------------------------------------------------------------------*/
+/* Compares MatchWildCard with CheckWildCard, for all short masks and names  */
+/* and for random long ones. Run by "make test".                            */
+/*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../src/thunderStorm.h"
+#include "../src/StormCommon.h"
+
+/*-----------------------------------------------------------------------------
+ * Local defines
+ */
+
+#define MAX_SHORT_MASK      5                   /* All masks up to this length ... */
+#define MAX_SHORT_NAME      6                   /* ... against all names up to this length */
+#define MAX_LONG_NAME       200                 /* Longest random name */
+#define RANDOM_PAIRS        1000000             /* Number of random mask/name pairs */
+
+static const char MaskChars[] = "*?\\aB";       /* Characters of the short masks */
+static const char NameChars[] = "aAbB\\";       /* Characters of the names */
+
+/* CheckWildCard lets '?' step past the end of the name and then reads */
+/* beyond it. Each name is placed right before an inaccessible page, */
+/* so such a read faults and the pair is skipped as undefined */
+static sigjmp_buf FaultJump;
+static char * pbNameEnd;
+
+static unsigned int nTests = 0;
+static unsigned int nSkipped = 0;
+static unsigned int nFailed = 0;
+static uint32_t dwSeed = 0x12345678;
+
+/*-----------------------------------------------------------------------------
+ * Local functions
+ */
+
+static void FaultHandler(int nSignal)
+{
+    siglongjmp(FaultJump, 1);
+}
+
+static uint32_t Random(uint32_t dwRange)
+{
+    dwSeed = dwSeed * 1103515245 + 12345;
+    return (dwSeed >> 8) % dwRange;
+}
+
+/* Compares both functions for one pair. Returns 0 if they differ */
+static int TestWildCard(TMPQWildCard * pWildCard, const char * szWildCard, const char * szName)
+{
+    size_t nLength = strlen(szName);
+    char * szString = pbNameEnd - nLength - 1;
+    volatile int nExpected;
+    volatile int nResult;
+
+    memcpy(szString, szName, nLength + 1);
+    nTests++;
+
+    /* Undefined result of CheckWildCard */
+    if(sigsetjmp(FaultJump, 0))
+    {
+        nSkipped++;
+        return 1;
+    }
+    nExpected = CheckWildCard(szString, szWildCard);
+
+    /* MatchWildCard must never read beyond the name */
+    if(sigsetjmp(FaultJump, 0))
+        nResult = -1;
+    else
+        nResult = MatchWildCard(pWildCard, szString);
+
+    if(nResult != nExpected)
+    {
+        if(nFailed++ < 20)
+            printf("  mask \"%s\", name \"%s\": %d instead of %d\n", (szWildCard != NULL) ? szWildCard : "(NULL)", szName, nResult, nExpected);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Builds the n-th string made of the given characters. */
+/* Strings of the same length follow each other */
+static void MakeString(char * szString, const char * szChars, size_t nChars, size_t nLength, unsigned int nIndex)
+{
+    size_t i;
+
+    for(i = 0; i < nLength; i++)
+    {
+        szString[i] = szChars[nIndex % nChars];
+        nIndex /= nChars;
+    }
+    szString[nLength] = 0;
+}
+
+/* All masks up to MAX_SHORT_MASK against all names up to MAX_SHORT_NAME */
+static void TestShortPairs(void)
+{
+    TMPQWildCard * pWildCard;
+    char szWildCard[MAX_SHORT_MASK + 1];
+    char szName[MAX_SHORT_NAME + 1];
+    unsigned int nMasks = 1;
+    unsigned int nNames;
+    unsigned int i, j;
+    size_t nMaskLength;
+    size_t nNameLength;
+
+    for(nMaskLength = 0; nMaskLength <= MAX_SHORT_MASK; nMaskLength++, nMasks *= (sizeof(MaskChars) - 1))
+    {
+        for(i = 0; i < nMasks; i++)
+        {
+            MakeString(szWildCard, MaskChars, sizeof(MaskChars) - 1, nMaskLength, i);
+            pWildCard = CompileWildCard(szWildCard);
+
+            nNames = 1;
+            for(nNameLength = 0; nNameLength <= MAX_SHORT_NAME; nNameLength++, nNames *= (sizeof(NameChars) - 1))
+            {
+                for(j = 0; j < nNames; j++)
+                {
+                    MakeString(szName, NameChars, sizeof(NameChars) - 1, nNameLength, j);
+                    TestWildCard(pWildCard, szWildCard, szName);
+                }
+            }
+
+            FreeWildCard(pWildCard);
+        }
+    }
+}
+
+/* Random long names, with masks either random or made from the name, */
+/* so that a good part of them match */
+static void TestRandomPairs(void)
+{
+    TMPQWildCard * pWildCard;
+    char szWildCard[MAX_LONG_NAME + 1];
+    char szName[MAX_LONG_NAME + 1];
+    size_t nMaskLength;
+    size_t nNameLength;
+    size_t i;
+    unsigned int n;
+
+    for(n = 0; n < RANDOM_PAIRS; n++)
+    {
+        nNameLength = Random(MAX_LONG_NAME + 1);
+        for(i = 0; i < nNameLength; i++)
+            szName[i] = NameChars[Random(sizeof(NameChars) - 1)];
+        szName[nNameLength] = 0;
+
+        nMaskLength = 0;
+        if(n & 1)
+        {
+            /* Random mask */
+            for(i = Random(40); i > 0; i--)
+                szWildCard[nMaskLength++] = MaskChars[Random(sizeof(MaskChars) - 1)];
+        }
+        else
+        {
+            /* Parts of the name replaced by '*' or '?', the rest in swapped case */
+            for(i = 0; i < nNameLength; i++)
+            {
+                switch(Random(8))
+                {
+                    case 0:
+                        szWildCard[nMaskLength++] = '*';
+                        i += Random(8);
+                        break;
+
+                    case 1:
+                        szWildCard[nMaskLength++] = '?';
+                        break;
+
+                    case 2:
+                        szWildCard[nMaskLength++] = isalpha((unsigned char)szName[i]) ? (szName[i] ^ 0x20) : szName[i];
+                        break;
+
+                    default:
+                        szWildCard[nMaskLength++] = szName[i];
+                        break;
+                }
+            }
+        }
+        szWildCard[nMaskLength] = 0;
+
+        pWildCard = CompileWildCard(szWildCard);
+        TestWildCard(pWildCard, szWildCard, szName);
+        FreeWildCard(pWildCard);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Main
+ */
+
+int main(void)
+{
+    TMPQWildCard * pWildCard;
+    struct sigaction sa;
+    long nPageSize = sysconf(_SC_PAGESIZE);
+    char * pbPages;
+
+    /* The second page is inaccessible */
+    pbPages = (char *)mmap(NULL, nPageSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pbPages == MAP_FAILED || mprotect(pbPages + nPageSize, nPageSize, PROT_NONE) != 0)
+    {
+        printf("Cannot allocate the guard page\n");
+        return 1;
+    }
+    pbNameEnd = pbPages + nPageSize;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = FaultHandler;
+    sa.sa_flags = SA_NODEFER;           /* The handler jumps out, so the signal must not stay blocked */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+
+    /* NULL mask never matches */
+    pWildCard = CompileWildCard(NULL);
+    TestWildCard(pWildCard, NULL, "a");
+    FreeWildCard(pWildCard);
+
+    TestShortPairs();
+    TestRandomPairs();
+
+    printf("wildcard: %u tests, %u skipped, %u failed\n", nTests, nSkipped, nFailed);
+    munmap(pbPages, nPageSize * 2);
+    return (nFailed == 0) ? 0 : 1;
+}